@@ -0,0 +1,46 @@
+#pragma once
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Allocation counting for the benchmarks
+// operator new is replaced by a counting version, so every benchmark can
+// report allocs/op next to its time per operation.
+
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+// Allocations since before, per benchmark iteration
+void ReportAllocations(benchmark::State& state, uint64_t before) {
+    state.counters["allocs/op"] = benchmark::Counter(
+        (double)(allocations.load(std::memory_order_relaxed) - before), benchmark::Counter::kAvgIterations);
+}
@@ -0,0 +1,71 @@
+#include "allocs.cpp"
+#include <map>
+#include <utility>
+#include "../src/dispatch.cpp"
+
+// Fan-out cost of one chat message, the part of the SEND_MSG branch after
+// the message is numbered: snapshot the channel members, encode the message
+// once per wire format and hand it to every recipient. Takes the number of
+// recipients and the FEATURE_* bits they logged in with. Deliveries go to a
+// sink that only counts them, so no socket or queue cost is included; the
+// console log line and the history append are left out too.
+
+static uint64_t deliveries = 0;
+
+void CountDelivery(const Recipient&, SharedFrame* frame) {
+    deliveries++;
+    benchmark::DoNotOptimize(frame->data);
+}
+
+// A channel of members users that all logged in with features, created once
+// per combination. Users and channels are never reused between combinations.
+uint32_t BenchChannel(uint32_t members, uint32_t features) {
+    static std::map<std::pair<uint32_t, uint32_t>, uint32_t> channels;
+    static uint32_t nextUser = 1;  // user 0 sends
+    auto known = channels.find(std::make_pair(members, features));
+    if (known != channels.end()) {
+        return known->second;
+    }
+    uint32_t channelId = (uint32_t)channels.size() + 1;
+    for (uint32_t i = 0; i < members; i++) {
+        uint32_t userId = nextUser++;
+        RegistryAddUser(userId, INVALID_SOCKET, 0, features, L"member");
+        RegistryJoin(userId, channelId);
+    }
+    channels[std::make_pair(members, features)] = channelId;
+    return channelId;
+}
+
+static void BM_FanOut(benchmark::State& state) {
+    uint32_t members = (uint32_t)state.range(0);
+    uint32_t features = (uint32_t)state.range(1);
+    DeliverFrame = CountDelivery;
+    RegistryAddUser(0, INVALID_SOCKET, 0, FEATURE_UTF8, L"alice");
+    uint32_t channelId = BenchChannel(members, features);
+
+    Nickname nickname = {};
+    RegistryNickname(0, nickname);
+    std::wstring message = L"the quick brown fox jumps over the lazy dog";
+    std::string text(message.begin(), message.end());
+    // compact recipients are introduced by the first message, not measured
+    Introductions introductions;
+    std::vector<Recipient> recipients;
+    RegistryRecipients(channelId, 0, recipients);
+    FanOutMessage(introductions, recipients, 0, channelId, 1, nickname, message, text);
+
+    uint64_t seq = 2;
+    uint64_t delivered = deliveries;
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        recipients.clear();
+        RegistryRecipients(channelId, 0, recipients);
+        FanOutMessage(introductions, recipients, 0, channelId, seq++, nickname, message, text);
+    }
+    ReportAllocations(state, before);
+    state.counters["deliveries/s"] = benchmark::Counter((double)(deliveries - delivered), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_FanOut)
+    ->ArgNames({"members", "features"})
+    ->ArgsProduct({{1, 10, 100, 1000, 10000, 100000}, {0, FEATURE_UTF8, FEATURE_UTF8 | FEATURE_COMPACT}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,619 @@
+#include "../src/platform.cpp"
+#include "../src/protocol.cpp"
+#include "../src/decoder.cpp"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <cinttypes>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// OrzChat load generator
+// Opens --connections protocol-correct clients over a few --threads, each
+// with its own epoll loop. Clients are grouped into channels of
+// --channel-size members, and every client sends --rate messages per second
+// of --message-chars characters to its channel. Each message starts with its
+// send time, so receivers measure end-to-end delivery latency. After
+// --warmup-s, messages are counted for --duration-s. Sending then stops,
+// and the run drains for --drain-ms so late deliveries still count. The
+// results are printed as one JSON object, so runs can be compared.
+//
+// Clients log in with LOGIN and get wide NEW_MSG frames. With --utf8 they
+// log in with LOGIN_UTF8 and ask for FEATURE_UTF8, FEATURE_COMPACT and
+// FEATURE_BATCH, like the console client does.
+
+const int BENCH_MAX_EVENTS = 1024;
+const uint32_t STAMP_CHARS = 16;  // hex send time at the start of each message
+// Latency histogram, 2^HIST_SUB_BITS buckets per power of two (< 1% error)
+const uint32_t HIST_SUB_BITS = 7;
+const uint32_t HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+typedef struct {
+    const char* host;
+    uint16_t port;
+    uint32_t connections;
+    uint32_t threads;
+    uint32_t channelSize;
+    double rate;  // messages per second per connection
+    uint32_t messageChars;
+    uint32_t warmupS;
+    uint32_t durationS;
+    uint32_t drainMs;
+    BOOL utf8;
+    const char* outPath;  // stdout if null
+} BenchConfig;
+
+static BenchConfig benchConfig = {"127.0.0.1", 12345, 1000, 4, 10, 1.0, 64, 2, 10, 1000, FALSE, nullptr};
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} LatencyHistogram;
+
+typedef struct {
+    SOCKET sock;
+    uint32_t userId;
+    uint32_t channelId;
+    uint32_t peers;  // other members of the channel, who get each message
+    FrameDecoder in;
+    std::string out;  // bytes the socket has not taken yet
+} BenchConnection;
+
+typedef struct {
+    uint32_t id;
+    uint32_t first;  // index of the first connection of this worker
+    std::vector<BenchConnection> connections;
+    LatencyHistogram latency;
+    uint64_t sent;
+    uint64_t expected;  // deliveries the messages sent should cause
+    uint64_t delivered;
+    uint64_t bytesReceived;  // while measuring
+    uint64_t sendStalls;  // sends skipped because the socket was still full
+    uint64_t closed;  // connections the server closed during the run
+    BOOL failed;
+} BenchWorker;
+
+static std::atomic<uint32_t> workersReady{0};
+static std::atomic<uint64_t> startNs{0};  // set once every worker is logged in
+
+uint64_t NowNs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Whether a time falls into the measured part of the run
+BOOL Measuring(uint64_t time) {
+    uint64_t measureStart = startNs + benchConfig.warmupS * 1000000000ull;
+    return time >= measureStart && time < measureStart + benchConfig.durationS * 1000000000ull;
+}
+
+uint32_t HistogramBucket(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS)) {
+        return (uint32_t)value;
+    }
+    uint32_t shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (uint32_t)((value >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Smallest value that falls into the bucket
+uint64_t HistogramBucketValue(uint32_t bucket) {
+    if (bucket < (1u << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t shift = (bucket >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(1u << HIST_SUB_BITS) + (bucket & ((1u << HIST_SUB_BITS) - 1))) << shift;
+}
+
+void HistogramRecord(LatencyHistogram& histogram, uint64_t value) {
+    histogram.buckets[HistogramBucket(value)]++;
+    histogram.min = histogram.count == 0 ? value : std::min(histogram.min, value);
+    histogram.max = std::max(histogram.max, value);
+    histogram.count++;
+    histogram.sum += value;
+}
+
+void HistogramMerge(LatencyHistogram& into, const LatencyHistogram& from) {
+    if (from.count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+        into.buckets[i] += from.buckets[i];
+    }
+    into.min = into.count == 0 ? from.min : std::min(into.min, from.min);
+    into.max = std::max(into.max, from.max);
+    into.count += from.count;
+    into.sum += from.sum;
+}
+
+uint64_t HistogramPercentile(const LatencyHistogram& histogram, double percentile) {
+    if (histogram.count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (histogram.count - 1)) + 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += histogram.buckets[i];
+        if (seen >= rank) {
+            return std::min(std::max(HistogramBucketValue(i), histogram.min), histogram.max);
+        }
+    }
+    return histogram.max;
+}
+
+// Connect without Nagle's delay, small messages go out at once
+SOCKET BenchConnect(sockaddr_in& servAddr) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (connect(sock, (SOCKADDR*)&servAddr, sizeof(servAddr)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Blocking send of a whole frame, during setup only
+BOOL SendAll(SOCKET sock, const char* data, uint32_t size) {
+    while (size > 0) {
+        int sent = send(sock, data, size, 0);
+        if (sent <= 0) {
+            return FALSE;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return TRUE;
+}
+
+// Blocking read until a frame of the given type arrives, during setup only.
+// Anything else that comes first is skipped.
+BOOL AwaitFrame(BenchConnection& conn, uint8_t type, FrameView& view) {
+    while (TRUE) {
+        DecodeStatus status = DecoderNext(conn.in, view);
+        if (status == DECODE_FRAME) {
+            if (view.type == type) {
+                return TRUE;
+            }
+            continue;
+        }
+        if (status == DECODE_ERROR) {
+            return FALSE;
+        }
+        size_t space;
+        char* dst = DecoderWritable(conn.in, space);
+        int recvLen = recv(conn.sock, dst, (int)space, 0);
+        if (recvLen <= 0) {
+            return FALSE;
+        }
+        DecoderCommit(conn.in, recvLen);
+    }
+}
+
+// Log in, join the channel and switch the socket to non-blocking
+BOOL SetupConnection(BenchConnection& conn, uint32_t index, sockaddr_in& servAddr) {
+    conn.sock = BenchConnect(servAddr);
+    if (conn.sock == INVALID_SOCKET) {
+        return FALSE;
+    }
+    DecoderInit(conn.in, MAX_PAYLOAD_LENGTH, DECODER_REJECT);
+
+    char buffer[256];
+    uint32_t totalSize;
+    if (benchConfig.utf8) {
+        char nickname[32];
+        uint8_t nicknameBytes = (uint8_t)snprintf(nickname, sizeof(nickname), "bench%u", index);
+        totalSize = PackLoginUtf8Into(buffer, sizeof(buffer), FEATURE_UTF8 | FEATURE_COMPACT | FEATURE_BATCH, nickname,
+                                      nicknameBytes);
+    } else {
+        wchar_t nickname[32];
+        swprintf(nickname, 32, L"bench%u", index);
+        totalSize = PackLoginInto(buffer, sizeof(buffer), nickname);
+    }
+    FrameView view;
+    if (!SendAll(conn.sock, buffer, totalSize) || !AwaitFrame(conn, LOGIN_SUCCESS, view)) {
+        return FALSE;
+    }
+    conn.userId = reinterpret_cast<LoginSuccessPayload*>(view.payload)->user_id;
+    if (LoginSuccessFeatures(view.frame, view.size) & FEATURE_COMPACT) {
+        DecoderAllowCompact(conn.in);
+    }
+
+    totalSize = PackJoinChannelInto(buffer, sizeof(buffer), conn.userId, conn.channelId);
+    if (!SendAll(conn.sock, buffer, totalSize) || !AwaitFrame(conn, JOIN_CHANNEL_SUCCESS, view)) {
+        return FALSE;
+    }
+    int flags = fcntl(conn.sock, F_GETFL, 0);
+    return flags != -1 && fcntl(conn.sock, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Write what the socket takes of the connection's pending output
+void FlushConnection(BenchConnection& conn) {
+    while (!conn.out.empty()) {
+        ssize_t sent = send(conn.sock, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return;
+        }
+        conn.out.erase(0, sent);
+    }
+}
+
+// Build the next message of a connection, the send time in hex and padding
+void SendBenchMessage(BenchWorker& worker, BenchConnection& conn, uint64_t now) {
+    if (!conn.out.empty()) {
+        worker.sendStalls++;
+        return;
+    }
+    char stamp[STAMP_CHARS + 1];
+    snprintf(stamp, sizeof(stamp), "%016" PRIx64, now);
+    uint32_t chars = std::max(benchConfig.messageChars, STAMP_CHARS);
+    std::vector<char> frame;
+    uint32_t totalSize;
+    if (benchConfig.utf8) {
+        std::string text(stamp);
+        text.resize(chars, 'x');
+        frame.resize(SendMsgUtf8Size((uint32_t)text.size()));
+        totalSize = PackSendMsgUtf8Into(frame.data(), (uint32_t)frame.size(), conn.userId, conn.channelId, text.data(),
+                                        (uint32_t)text.size());
+    } else {
+        std::wstring text(stamp, stamp + STAMP_CHARS);
+        text.resize(chars, L'x');
+        frame.resize(SendMsgSize(text.c_str()));
+        totalSize = PackSendMsgInto(frame.data(), (uint32_t)frame.size(), conn.userId, conn.channelId, text.c_str());
+    }
+    conn.out.assign(frame.data(), totalSize);
+    FlushConnection(conn);
+    if (Measuring(now)) {
+        worker.sent++;
+        worker.expected += conn.peers;
+    }
+}
+
+// Send time stamped at the start of a message text, 0 if it has none
+uint64_t ParseStamp(const char* text, uint32_t chars, uint32_t charSize) {
+    if (chars < STAMP_CHARS) {
+        return 0;
+    }
+    uint64_t stamp = 0;
+    for (uint32_t i = 0; i < STAMP_CHARS; i++) {
+        uint32_t c = 0;
+        memcpy(&c, text + i * charSize, charSize);
+        uint32_t digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 16;
+        if (digit == 16) {
+            return 0;
+        }
+        stamp = (stamp << 4) | digit;
+    }
+    return stamp;
+}
+
+// Count one delivered chat message, in any of its encodings
+void RecordMessage(BenchWorker& worker, uint8_t type, const char* payload, uint32_t length, uint64_t now) {
+    if (length < MinPayloadLength(type)) {
+        return;
+    }
+    uint64_t stamp = 0;
+    if (type == NEW_MSG) {
+        uint32_t chars = std::min<uint32_t>(reinterpret_cast<const NewMsgPayload*>(payload)->msg_length,
+                                            (length - sizeof(NewMsgPayload)) / sizeof(wchar_t));
+        stamp = ParseStamp(payload + sizeof(NewMsgPayload), chars, sizeof(wchar_t));
+    } else if (type == NEW_MSG_UTF8) {
+        const NewMsgUtf8Payload* msg = reinterpret_cast<const NewMsgUtf8Payload*>(payload);
+        uint32_t offset = sizeof(NewMsgUtf8Payload) + msg->nickname_length;
+        if (offset <= length) {
+            stamp = ParseStamp(payload + offset, std::min(msg->msg_length, length - offset), 1);
+        }
+    } else if (type == NEW_MSG_COMPACT) {
+        uint32_t ids[2];
+        const char* text;
+        uint32_t textBytes;
+        uint64_t seq;
+        int seqBytes;
+        if (ParseCompactIds(payload, length, ids, 2, text, textBytes) && (seqBytes = GetVarint64(text, textBytes, seq)) > 0) {
+            stamp = ParseStamp(text + seqBytes, textBytes - seqBytes, 1);
+        }
+    } else {
+        return;
+    }
+    // only messages sent while measuring count
+    if (!Measuring(stamp)) {
+        return;
+    }
+    worker.delivered++;
+    HistogramRecord(worker.latency, (now - stamp) / 1000);
+}
+
+// Read everything the socket has and count the messages in it
+BOOL ReadConnection(BenchWorker& worker, BenchConnection& conn) {
+    size_t received = 0;
+    while (TRUE) {
+        size_t space;
+        char* dst = DecoderWritable(conn.in, space);
+        ssize_t recvLen = recv(conn.sock, dst, space, 0);
+        if (recvLen == 0 || (recvLen < 0 && errno != EAGAIN && errno != EINTR)) {
+            return FALSE;
+        }
+        if (recvLen < 0) {
+            break;
+        }
+        DecoderCommit(conn.in, recvLen);
+        received += recvLen;
+    }
+    uint64_t now = NowNs();
+    if (Measuring(now)) {
+        worker.bytesReceived += received;
+    }
+    FrameView view;
+    DecodeStatus status;
+    while ((status = DecoderNext(conn.in, view)) == DECODE_FRAME) {
+        if (view.type == BATCH) {
+            const BatchPayload* batch = reinterpret_cast<const BatchPayload*>(view.payload);
+            const char* records = view.payload + sizeof(BatchPayload);
+            uint32_t remaining = view.payloadLength - sizeof(BatchPayload);
+            const char* record;
+            uint32_t recordLength;
+            for (uint32_t i = 0; i < batch->count && NextBatchRecord(records, remaining, record, recordLength); i++) {
+                RecordMessage(worker, batch->record_type, record, recordLength, now);
+            }
+        } else {
+            RecordMessage(worker, view.type, view.payload, view.payloadLength, now);
+        }
+    }
+    return status != DECODE_ERROR;
+}
+
+void RunWorker(BenchWorker* worker) {
+    sockaddr_in servAddr;
+    ZeroMemory(&servAddr, sizeof(servAddr));
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = inet_addr(benchConfig.host);
+    servAddr.sin_port = htons(benchConfig.port);
+
+    int epollFd = epoll_create1(0);
+    for (uint32_t i = 0; i < worker->connections.size(); i++) {
+        BenchConnection& conn = worker->connections[i];
+        if (!SetupConnection(conn, worker->first + i, servAddr)) {
+            fprintf(stderr, "[ ERROR ] Connection %u could not log in and join channel %u: %d\n", worker->first + i,
+                    conn.channelId, errno);
+            worker->failed = TRUE;
+            break;
+        }
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.sock, &event);
+    }
+    workersReady.fetch_add(1);
+    uint64_t start;
+    while ((start = startNs.load()) == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Sends are spread evenly over the first interval, then repeat
+    uint64_t interval = (uint64_t)(1e9 / benchConfig.rate);
+    uint64_t sendEnd = start + (benchConfig.warmupS + benchConfig.durationS) * 1000000000ull;
+    uint64_t stop = sendEnd + benchConfig.drainMs * 1000000ull;
+    typedef std::pair<uint64_t, uint32_t> Due;  // (send time, connection)
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule;
+    std::mt19937_64 random(worker->id);
+    for (uint32_t i = 0; !worker->failed && i < worker->connections.size(); i++) {
+        schedule.push(Due(start + random() % interval, i));
+    }
+
+    epoll_event events[BENCH_MAX_EVENTS];
+    uint64_t now = start;
+    while (!worker->failed && now < stop) {
+        while (!schedule.empty() && schedule.top().first <= now && now < sendEnd) {
+            Due due = schedule.top();
+            schedule.pop();
+            BenchConnection& conn = worker->connections[due.second];
+            if (conn.sock != INVALID_SOCKET) {
+                SendBenchMessage(*worker, conn, now);
+                schedule.push(Due(std::max(due.first + interval, now), due.second));
+            }
+        }
+        uint64_t wake = schedule.empty() || now >= sendEnd ? stop : std::min(schedule.top().first, stop);
+        int timeoutMs = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        int ready = epoll_wait(epollFd, events, BENCH_MAX_EVENTS, timeoutMs);
+        for (int i = 0; i < ready; i++) {
+            BenchConnection& conn = worker->connections[events[i].data.u32];
+            if (conn.sock == INVALID_SOCKET) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                FlushConnection(conn);
+            }
+            if (!ReadConnection(*worker, conn)) {
+                closesocket(conn.sock);
+                conn.sock = INVALID_SOCKET;
+                worker->closed++;
+            }
+        }
+        now = NowNs();
+    }
+
+    for (BenchConnection& conn : worker->connections) {
+        if (conn.sock != INVALID_SOCKET) {
+            closesocket(conn.sock);
+        }
+        DecoderFree(conn.in);
+    }
+    close(epollFd);
+}
+
+void PrintUsage() {
+    fprintf(stderr, "Usage: orzchat_bench [options]\n");
+    fprintf(stderr, "  --host ADDR          server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  --port N             server port (default 12345)\n");
+    fprintf(stderr, "  --connections N      clients to open (default 1000)\n");
+    fprintf(stderr, "  --threads N          threads driving the clients (default 4)\n");
+    fprintf(stderr, "  --channel-size N     clients per channel (default 10)\n");
+    fprintf(stderr, "  --rate R             messages per second each client sends (default 1)\n");
+    fprintf(stderr, "  --message-chars N    characters per message, at least %u (default 64)\n", STAMP_CHARS);
+    fprintf(stderr, "  --warmup-s N         seconds of traffic before measuring (default 2)\n");
+    fprintf(stderr, "  --duration-s N       seconds of traffic that are measured (default 10)\n");
+    fprintf(stderr, "  --drain-ms N         how long to wait for late deliveries after sending stops (default 1000)\n");
+    fprintf(stderr, "  --utf8               log in with LOGIN_UTF8 and compact, batched frames\n");
+    fprintf(stderr, "  --out FILE           write the JSON report to FILE instead of stdout\n");
+}
+
+BOOL ParseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            benchConfig.host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            benchConfig.port = (uint16_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            benchConfig.connections = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            benchConfig.threads = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--channel-size") == 0 && i + 1 < argc) {
+            benchConfig.channelSize = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            benchConfig.rate = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--message-chars") == 0 && i + 1 < argc) {
+            benchConfig.messageChars = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--warmup-s") == 0 && i + 1 < argc) {
+            benchConfig.warmupS = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--duration-s") == 0 && i + 1 < argc) {
+            benchConfig.durationS = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--drain-ms") == 0 && i + 1 < argc) {
+            benchConfig.drainMs = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--utf8") == 0) {
+            benchConfig.utf8 = TRUE;
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            benchConfig.outPath = argv[++i];
+        } else {
+            PrintUsage();
+            return FALSE;
+        }
+    }
+    if (benchConfig.connections == 0 || benchConfig.threads == 0 || benchConfig.channelSize == 0 ||
+        !(benchConfig.rate > 0) || benchConfig.durationS == 0 || benchConfig.messageChars > 1023) {
+        PrintUsage();
+        return FALSE;
+    }
+    benchConfig.threads = std::min(benchConfig.threads, benchConfig.connections);
+    return TRUE;
+}
+
+void WriteReport(FILE* out, const std::vector<BenchWorker*>& workers) {
+    LatencyHistogram latency;
+    memset(&latency, 0, sizeof(latency));
+    uint64_t sent = 0, expected = 0, delivered = 0, bytesReceived = 0, sendStalls = 0, closed = 0;
+    for (BenchWorker* worker : workers) {
+        HistogramMerge(latency, worker->latency);
+        sent += worker->sent;
+        expected += worker->expected;
+        delivered += worker->delivered;
+        bytesReceived += worker->bytesReceived;
+        sendStalls += worker->sendStalls;
+        closed += worker->closed;
+    }
+    double seconds = benchConfig.durationS;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"host\": \"%s\", \"port\": %u, \"connections\": %u, \"threads\": %u, "
+                 "\"channel_size\": %u, \"rate_per_connection\": %g, \"message_chars\": %u, \"encoding\": \"%s\", "
+                 "\"warmup_s\": %u, \"duration_s\": %u, \"drain_ms\": %u},\n",
+            benchConfig.host, benchConfig.port, benchConfig.connections, benchConfig.threads, benchConfig.channelSize,
+            benchConfig.rate, benchConfig.messageChars, benchConfig.utf8 ? "utf8" : "wide", benchConfig.warmupS,
+            benchConfig.durationS, benchConfig.drainMs);
+    fprintf(out, "  \"sent\": %" PRIu64 ",\n", sent);
+    fprintf(out, "  \"expected_deliveries\": %" PRIu64 ",\n", expected);
+    fprintf(out, "  \"delivered\": %" PRIu64 ",\n", delivered);
+    fprintf(out, "  \"send_stalls\": %" PRIu64 ",\n", sendStalls);
+    fprintf(out, "  \"connections_closed\": %" PRIu64 ",\n", closed);
+    fprintf(out, "  \"throughput\": {\"sent_per_s\": %.1f, \"delivered_per_s\": %.1f, \"received_mib_per_s\": %.2f},\n",
+            sent / seconds, delivered / seconds, bytesReceived / seconds / (1024.0 * 1024.0));
+    fprintf(out, "  \"latency_us\": {\"min\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+                 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}\n",
+            latency.min, latency.count ? (double)latency.sum / latency.count : 0.0, HistogramPercentile(latency, 50),
+            HistogramPercentile(latency, 90), HistogramPercentile(latency, 99), HistogramPercentile(latency, 99.9),
+            latency.max);
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (!ParseArgs(argc, argv)) {
+        return 1;
+    }
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+    // Thousands of sockets need more than the default descriptor limit
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    // Connections are dealt out to workers in order, channels are consecutive runs of them
+    std::vector<BenchWorker*> workers;
+    uint32_t first = 0;
+    for (uint32_t w = 0; w < benchConfig.threads; w++) {
+        BenchWorker* worker = new BenchWorker();
+        worker->id = w;
+        worker->first = first;
+        uint32_t count = benchConfig.connections / benchConfig.threads + (w < benchConfig.connections % benchConfig.threads);
+        worker->connections.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t index = first + i;
+            uint32_t channel = index / benchConfig.channelSize;
+            BenchConnection& conn = worker->connections[i];
+            conn.sock = INVALID_SOCKET;
+            conn.channelId = channel + 1;  // channel 0 holds every user
+            conn.peers = std::min(benchConfig.channelSize, benchConfig.connections - channel * benchConfig.channelSize) - 1;
+        }
+        first += count;
+        workers.push_back(worker);
+    }
+
+    fprintf(stderr, "[ INFO ] Opening %u connections from %u threads...\n", benchConfig.connections, benchConfig.threads);
+    std::vector<std::thread> threads;
+    for (BenchWorker* worker : workers) {
+        threads.emplace_back(RunWorker, worker);
+    }
+    while (workersReady.load() < benchConfig.threads) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    BOOL failed = FALSE;
+    for (BenchWorker* worker : workers) {
+        failed |= worker->failed;
+    }
+    if (!failed) {
+        fprintf(stderr, "[ INFO ] Running for %u s, measuring the last %u s...\n",
+                benchConfig.warmupS + benchConfig.durationS, benchConfig.durationS);
+    }
+    startNs.store(NowNs());
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        return 1;
+    }
+
+    FILE* out = benchConfig.outPath != nullptr ? fopen(benchConfig.outPath, "w") : stdout;
+    if (out == nullptr) {
+        fprintf(stderr, "[ ERROR ] Unable to open %s\n", benchConfig.outPath);
+        return 1;
+    }
+    WriteReport(out, workers);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (BenchWorker* worker : workers) {
+        delete worker;
+    }
+    WSACleanup();
+    return 0;
+}
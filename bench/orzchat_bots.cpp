@@ -0,0 +1,144 @@
+#include "../src/liborzchat.cpp"
+#include <chrono>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+// OrzChat bots
+// Runs --bots liborzchat sessions from a single thread. Every bot logs in,
+// joins channel 1 + its index / --channel-size, and sends --messages
+// messages to it, all pipelined right behind the login without waiting for
+// any reply. The run ends once every login, join and send has completed and
+// --drain-ms passed without a message arriving. The counts are printed as
+// one JSON object.
+
+typedef struct {
+    sockaddr_in server;
+    uint32_t bots;
+    uint32_t channelSize;
+    uint32_t messages;
+    uint32_t drainMs;
+} BotsConfig;
+
+typedef struct {
+    uint64_t loggedIn;
+    uint64_t joined;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t failed;  // requests that did not complete with ORZ_OK
+    uint64_t rateLimited;  // sends the server dropped for going over a rate limit
+    uint64_t open;  // requests not completed yet
+    uint64_t lastMessageMs;
+} BotsCounters;
+
+static BotsConfig botsConfig = {};
+static BotsCounters counters = {};
+
+uint64_t NowMs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Completed(OrzSession*, void* context, OrzResult result) {
+    counters.open--;
+    if (result != ORZ_OK) {
+        counters.failed++;
+    } else {
+        (*(uint64_t*)context)++;
+    }
+}
+
+void Received(OrzSession*, const OrzMessage&) {
+    counters.received++;
+    counters.lastMessageMs = NowMs();
+}
+
+void Refused(OrzSession*, uint32_t errCode, uint32_t) {
+    if (errCode == ERR_RATE_LIMITED) {
+        counters.rateLimited++;
+    }
+}
+
+BOOL ParseBotsArgs(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    int port = 12345;
+    botsConfig.bots = 100;
+    botsConfig.channelSize = 10;
+    botsConfig.messages = 10;
+    botsConfig.drainMs = 500;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bots") == 0 && i + 1 < argc) {
+            botsConfig.bots = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--channel-size") == 0 && i + 1 < argc) {
+            botsConfig.channelSize = std::max<uint32_t>((uint32_t)strtoul(argv[++i], nullptr, 10), 1);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            botsConfig.messages = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--drain-ms") == 0 && i + 1 < argc) {
+            botsConfig.drainMs = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "Usage: orzchat_bots [--host IP] [--port N] [--bots N] [--channel-size N] "
+                            "[--messages N] [--drain-ms N]\n");
+            return FALSE;
+        }
+    }
+    ZeroMemory(&botsConfig.server, sizeof(botsConfig.server));
+    botsConfig.server.sin_family = AF_INET;
+    botsConfig.server.sin_addr.s_addr = inet_addr(host);
+    botsConfig.server.sin_port = htons((uint16_t)port);
+    return TRUE;
+}
+
+int main(int argc, char* argv[]) {
+    if (!ParseBotsArgs(argc, argv)) {
+        return 1;
+    }
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+    static const OrzCallbacks callbacks = {Received, Refused, nullptr, nullptr};
+    std::vector<OrzSession*> sessions;
+    uint64_t start = NowMs();
+    for (uint32_t i = 0; i < botsConfig.bots; i++) {
+        std::string nickname = "bot" + std::to_string(i);
+        counters.open++;
+        OrzSession* session = OrzConnect(botsConfig.server, nickname.c_str(), &callbacks, nullptr, Completed,
+                                         &counters.loggedIn);
+        if (session == nullptr) {
+            fprintf(stderr, "Out of sockets after %u bots\n", i);
+            counters.open--;
+            break;
+        }
+        sessions.push_back(session);
+        uint32_t channelId = 1 + i / botsConfig.channelSize;
+        counters.open++;
+        OrzJoin(session, channelId, Completed, &counters.joined);
+        for (uint32_t m = 0; m < botsConfig.messages; m++) {
+            std::string text = nickname + " says " + std::to_string(m);
+            counters.open++;
+            OrzSend(session, channelId, text.data(), (uint32_t)text.size(), Completed, &counters.sent);
+        }
+    }
+
+    counters.lastMessageMs = NowMs();
+    while (OrzPoll(sessions.data(), sessions.size(), 50) > 0 &&
+           (counters.open > 0 || NowMs() - counters.lastMessageMs < botsConfig.drainMs)) {
+    }
+    uint64_t elapsedMs = NowMs() - start;
+
+    uint64_t closed = 0;
+    for (OrzSession* session : sessions) {
+        closed += session->closed ? 1 : 0;
+        OrzFree(session);
+    }
+    printf("{\"bots\": %u, \"logged_in\": %" PRIu64 ", \"joined\": %" PRIu64 ", \"sent\": %" PRIu64
+           ", \"received\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"rate_limited\": %" PRIu64 ", \"closed_by_server\": %" PRIu64
+           ", \"elapsed_ms\": %" PRIu64 "}\n",
+           botsConfig.bots, counters.loggedIn, counters.joined, counters.sent, counters.received, counters.failed,
+           counters.rateLimited, closed, elapsedMs);
+    WSACleanup();
+    return counters.failed == 0 ? 0 : 1;
+}
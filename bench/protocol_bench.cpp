@@ -0,0 +1,234 @@
+#include "allocs.cpp"
+#include <string>
+#include <vector>
+#include "../src/protocol.cpp"
+#include "../src/sharedframe.cpp"
+#include "../src/decoder.cpp"
+
+// Encoding and decoding cost of the hot-path messages, heap Pack* versus the
+// Pack*Into variants writing to the stack or a pooled frame. Message
+// benchmarks take the message length in characters, LOGIN_SUCCESS the
+// number of channels listed. allocs/op counts calls to operator new.
+
+static wchar_t benchNickname[32] = L"alice";
+static const char benchNicknameUtf8[] = "alice";
+
+// Text of the given length, ASCII like most chat messages
+std::wstring BenchText(int64_t chars) {
+    static const wchar_t pangram[] = L"the quick brown fox jumps over the lazy dog ";
+    std::wstring text;
+    while ((int64_t)text.size() < chars) {
+        text += pangram;
+    }
+    text.resize(chars);
+    return text;
+}
+
+#define MESSAGE_SIZES RangeMultiplier(4)->Range(16, 4096)
+
+// The broadcast path before the pool: PackNewMsg plus a SharedFrame around it
+static void BM_NewMsgHeap(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize;
+        char* buf = PackNewMsg(1, 7, 1, benchNickname, message.c_str(), totalSize);
+        SharedFrame* frame = AdoptFrame(buf, totalSize);
+        benchmark::DoNotOptimize(frame->data);
+        ReleaseFrame(frame);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_NewMsgHeap)->MESSAGE_SIZES;
+
+static void BM_NewMsgPooled(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        SharedFrame* frame = NewFrame(NewMsgSize(message.c_str()));
+        PackNewMsgInto(frame->data, frame->size, 1, 7, 1, benchNickname, message.c_str());
+        benchmark::DoNotOptimize(frame->data);
+        ReleaseFrame(frame);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_NewMsgPooled)->MESSAGE_SIZES;
+
+static void BM_NewMsgUtf8Pooled(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    std::string text(message.begin(), message.end());
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        SharedFrame* frame = NewFrame(NewMsgUtf8Size(sizeof(benchNicknameUtf8) - 1, text.size()));
+        PackNewMsgUtf8Into(frame->data, frame->size, 1, 7, 1, benchNicknameUtf8, sizeof(benchNicknameUtf8) - 1,
+                           text.data(), text.size());
+        benchmark::DoNotOptimize(frame->data);
+        ReleaseFrame(frame);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_NewMsgUtf8Pooled)->MESSAGE_SIZES;
+
+static void BM_NewMsgCompactPooled(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    std::string text(message.begin(), message.end());
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        SharedFrame* frame = NewFrame(NewMsgCompactSize(1, 7, 1, text.size()));
+        PackNewMsgCompactInto(frame->data, frame->size, 1, 7, 1, text.data(), text.size());
+        benchmark::DoNotOptimize(frame->data);
+        ReleaseFrame(frame);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_NewMsgCompactPooled)->MESSAGE_SIZES;
+
+static void BM_SendMsgHeap(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize;
+        char* buf = PackSendMsg(1, 7, message.c_str(), totalSize);
+        benchmark::DoNotOptimize(buf);
+        delete[] buf;
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_SendMsgHeap)->MESSAGE_SIZES;
+
+static void BM_SendMsgInto(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    std::vector<char> buf(SendMsgSize(message.c_str()));
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize = PackSendMsgInto(buf.data(), buf.size(), 1, 7, message.c_str());
+        benchmark::DoNotOptimize(buf.data());
+        benchmark::DoNotOptimize(totalSize);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_SendMsgInto)->MESSAGE_SIZES;
+
+#define CHANNEL_COUNTS RangeMultiplier(10)->Range(1, 100000)
+
+static void BM_LoginSuccessHeap(benchmark::State& state) {
+    std::vector<uint32_t> channels(state.range(0));
+    for (size_t i = 0; i < channels.size(); i++) {
+        channels[i] = (uint32_t)i;
+    }
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize;
+        char* buf = PackLoginSuccess(1, channels.size(), channels.data(), FEATURE_UTF8, 1, totalSize);
+        benchmark::DoNotOptimize(buf);
+        delete[] buf;
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_LoginSuccessHeap)->CHANNEL_COUNTS;
+
+static void BM_LoginSuccessInto(benchmark::State& state) {
+    std::vector<uint32_t> channels(state.range(0));
+    for (size_t i = 0; i < channels.size(); i++) {
+        channels[i] = (uint32_t)i;
+    }
+    std::vector<char> buf(LoginSuccessSize(channels.size()));
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize = PackLoginSuccessInto(buf.data(), buf.size(), 1, channels.size(), channels.data(),
+                                                  FEATURE_UTF8, 1);
+        benchmark::DoNotOptimize(buf.data());
+        benchmark::DoNotOptimize(totalSize);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_LoginSuccessInto)->CHANNEL_COUNTS;
+
+// Takes the string length, the server converts dotted IPv4 addresses
+static void BM_ConvertCharToWChar(benchmark::State& state) {
+    std::wstring wide = BenchText(state.range(0));
+    std::string text(wide.begin(), wide.end());
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        wchar_t* converted = ConvertCharToWChar(text.c_str());
+        benchmark::DoNotOptimize(converted);
+        delete[] converted;
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_ConvertCharToWChar)->RangeMultiplier(4)->Range(16, 1024);
+
+static void BM_JoinChannelSuccessHeap(benchmark::State& state) {
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        uint32_t totalSize;
+        char* buf = PackJoinChannelSuccess(1, 7, totalSize);
+        benchmark::DoNotOptimize(buf);
+        delete[] buf;
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_JoinChannelSuccessHeap);
+
+static void BM_JoinChannelSuccessStack(benchmark::State& state) {
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        char buf[64];
+        uint32_t totalSize = PackJoinChannelSuccessInto(buf, sizeof(buf), 1, 7);
+        benchmark::DoNotOptimize(buf);
+        benchmark::DoNotOptimize(totalSize);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_JoinChannelSuccessStack);
+
+static void BM_JoinChannelSuccessFixed(benchmark::State& state) {
+    uint64_t before = allocations.load();
+    uint32_t channelId = 7;
+    for (auto _ : state) {
+        FixedFrame<JOIN_CHANNEL_SUCCESS> frame = BuildFrame<JOIN_CHANNEL_SUCCESS>({1, channelId});
+        benchmark::DoNotOptimize(frame);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_JoinChannelSuccessFixed);
+
+static void BM_JoinChannelDecode(benchmark::State& state) {
+    FixedFrame<JOIN_CHANNEL> frame = BuildFrame<JOIN_CHANNEL>({1, 7});
+    const char* data = (const char*)&frame;
+    benchmark::DoNotOptimize(data);
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        JoinChannelPayload payload;
+        BOOL ok = DecodeFrame<JOIN_CHANNEL>(data, sizeof(frame), payload);
+        benchmark::DoNotOptimize(ok);
+        benchmark::DoNotOptimize(payload);
+    }
+    ReportAllocations(state, before);
+}
+BENCHMARK(BM_JoinChannelDecode);
+
+// A SEND_MSG_UTF8 frame through the stream decoder, lent in place like the
+// reactor does with each read
+static void BM_SendMsgUtf8Decode(benchmark::State& state) {
+    std::wstring message = BenchText(state.range(0));
+    std::string text(message.begin(), message.end());
+    std::vector<char> frame(SendMsgUtf8Size(text.size()));
+    PackSendMsgUtf8Into(frame.data(), frame.size(), 1, 7, text.data(), text.size());
+    FrameDecoder decoder;
+    DecoderInit(decoder, MAX_PAYLOAD_LENGTH, DECODER_REJECT);
+    uint64_t before = allocations.load();
+    for (auto _ : state) {
+        FrameView view;
+        DecoderFeed(decoder, frame.data(), frame.size());
+        DecodeStatus status = DecoderNext(decoder, view);
+        benchmark::DoNotOptimize(status);
+        benchmark::DoNotOptimize(view.payload);
+        DecoderSettle(decoder);
+    }
+    ReportAllocations(state, before);
+    DecoderFree(decoder);
+}
+BENCHMARK(BM_SendMsgUtf8Decode)->MESSAGE_SIZES;
+
+BENCHMARK_MAIN();
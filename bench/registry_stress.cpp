@@ -0,0 +1,216 @@
+#include "../src/registry.cpp"
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Registry stress test
+// --threads threads each own --users users, as each connection owns its user
+// in the server, and run --ops random operations on them: log in, join,
+// leave, snapshot a channel's members and log out, over --channels channels
+// so that shards and channels are shared between threads all the time. Each
+// thread keeps its own model of which channels its users are in.
+//
+// Once all threads are done the registry must agree with the models, and
+// with itself:
+// - every member's slot is its index in the channel's members
+// - a user lists a channel exactly when the channel lists the user
+// - no channel is left without members
+// - ChannelActivity reported each channel that is left as active, and every
+//   other one as gone
+//
+// Prints the counts as one JSON object, exits with 1 on any violation.
+
+typedef struct {
+    uint32_t threads;
+    uint32_t users;  // per thread
+    uint32_t channels;  // besides the global channel
+    uint64_t ops;  // per thread
+} StressConfig;
+
+static StressConfig stressConfig = {};
+static std::vector<std::atomic<int>> activity;  // ChannelActivity balance per channel
+static std::atomic<uint64_t> violations{0};
+
+void CountActivity(uint32_t channelId, BOOL active) {
+    activity[channelId] += active ? 1 : -1;
+}
+
+void Violation(const char* what, uint32_t channelId, uint32_t userId) {
+    if (violations++ < 10) {
+        fprintf(stderr, "%s: channel %u, user %u\n", what, channelId, userId);
+    }
+}
+
+// A snapshot never holds a user twice
+void CheckSnapshot(uint32_t channelId, std::vector<Recipient>& recipients) {
+    recipients.clear();
+    RegistryRecipients(channelId, UINT32_MAX, recipients);
+    std::set<uint32_t> seen;
+    for (const Recipient& recipient : recipients) {
+        if (!seen.insert(recipient.userId).second) {
+            Violation("user twice in a snapshot", channelId, recipient.userId);
+        }
+    }
+}
+
+// models[i] is the channels of the thread's user i, empty while logged out
+void StressThread(uint32_t index, std::vector<std::set<uint32_t>>& models) {
+    std::mt19937 random(index + 1);
+    std::vector<Recipient> recipients;
+    uint32_t firstUser = index * stressConfig.users;
+    for (uint64_t op = 0; op < stressConfig.ops; op++) {
+        uint32_t user = random() % stressConfig.users;
+        uint32_t userId = firstUser + user;
+        uint32_t channelId = 1 + random() % stressConfig.channels;
+        std::set<uint32_t>& model = models[user];
+        switch (random() % 8) {
+        case 0:
+            if (model.empty()) {
+                RegistryAddUser(userId, (SOCKET)userId, index, 0, L"stress");
+                model.insert(GLOBAL_CHANNEL);
+            }
+            break;
+        case 1:
+        case 2:
+            if (!model.empty()) {
+                RegistryJoin(userId, channelId);
+                model.insert(channelId);
+            }
+            break;
+        case 3:
+        case 4:
+            RegistryLeave(userId, channelId);
+            model.erase(channelId);
+            break;
+        case 5:
+        case 6:
+            CheckSnapshot(random() % 4 == 0 ? GLOBAL_CHANNEL : channelId, recipients);
+            break;
+        default:
+            RegistryRemoveUser(userId);
+            model.clear();
+            break;
+        }
+    }
+}
+
+BOOL ParseStressArgs(int argc, char* argv[]) {
+    stressConfig.threads = 8;
+    stressConfig.users = 64;
+    stressConfig.channels = 16;
+    stressConfig.ops = 50000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            stressConfig.threads = std::max<uint32_t>((uint32_t)strtoul(argv[++i], nullptr, 10), 1);
+        } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            stressConfig.users = std::max<uint32_t>((uint32_t)strtoul(argv[++i], nullptr, 10), 1);
+        } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc) {
+            stressConfig.channels = std::max<uint32_t>((uint32_t)strtoul(argv[++i], nullptr, 10), 1);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            stressConfig.ops = strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "Usage: registry_stress [--threads N] [--users N] [--channels N] [--ops N]\n");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+int main(int argc, char* argv[]) {
+    if (!ParseStressArgs(argc, argv)) {
+        return 1;
+    }
+    activity = std::vector<std::atomic<int>>(stressConfig.channels + 1);
+    ChannelActivity = CountActivity;
+
+    std::vector<std::vector<std::set<uint32_t>>> models(stressConfig.threads,
+                                                        std::vector<std::set<uint32_t>>(stressConfig.users));
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < stressConfig.threads; i++) {
+        threads.emplace_back(StressThread, i, std::ref(models[i]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // Channels as the registry has them, checked against their own slots
+    std::vector<std::set<uint32_t>> members(stressConfig.channels + 1);
+    uint64_t channelCount = 0;
+    for (uint32_t s = 0; s < REGISTRY_SHARDS; s++) {
+        for (auto& pair : channelShards[s].channels) {
+            uint32_t channelId = pair.first;
+            const ChannelEntry& channel = pair.second;
+            channelCount++;
+            if (channel.members.empty()) {
+                Violation("empty channel left", channelId, 0);
+            }
+            if (channel.slots.size() != channel.members.size()) {
+                Violation("slots and members differ in size", channelId, 0);
+            }
+            for (uint32_t i = 0; i < channel.members.size(); i++) {
+                uint32_t userId = channel.members[i].userId;
+                auto slot = channel.slots.find(userId);
+                if (slot == channel.slots.end() || slot->second != i) {
+                    Violation("slot is not the member's index", channelId, userId);
+                }
+                members[channelId].insert(userId);
+            }
+        }
+    }
+    for (uint32_t channelId = 0; channelId <= stressConfig.channels; channelId++) {
+        if (activity[channelId] != (members[channelId].empty() ? 0 : 1)) {
+            Violation("channel activity does not match", channelId, 0);
+        }
+    }
+
+    // Users as the registry has them, against the channels and the models
+    uint64_t userCount = 0;
+    uint64_t memberships = 0;
+    for (uint32_t s = 0; s < REGISTRY_SHARDS; s++) {
+        for (auto& pair : userShards[s].users) {
+            uint32_t userId = pair.first;
+            userCount++;
+            std::set<uint32_t> listed(pair.second.channels.begin(), pair.second.channels.end());
+            if (listed.size() != pair.second.channels.size()) {
+                Violation("user lists a channel twice", 0, userId);
+            }
+            for (uint32_t channelId : listed) {
+                if (members[channelId].count(userId) == 0) {
+                    Violation("user lists a channel that does not list it", channelId, userId);
+                }
+            }
+            if (listed != models[userId / stressConfig.users][userId % stressConfig.users]) {
+                Violation("user's channels differ from its model", 0, userId);
+            }
+            memberships += listed.size();
+        }
+    }
+    for (uint32_t channelId = 0; channelId <= stressConfig.channels; channelId++) {
+        for (uint32_t userId : members[channelId]) {
+            auto& users = UserShardOf(userId).users;
+            auto user = users.find(userId);
+            if (user == users.end() || std::find(user->second.channels.begin(), user->second.channels.end(),
+                                                 channelId) == user->second.channels.end()) {
+                Violation("channel lists a user that does not list it", channelId, userId);
+            }
+        }
+    }
+    for (uint32_t t = 0; t < stressConfig.threads; t++) {
+        for (uint32_t user = 0; user < stressConfig.users; user++) {
+            uint32_t userId = t * stressConfig.users + user;
+            if (!models[t][user].empty() && UserShardOf(userId).users.count(userId) == 0) {
+                Violation("user missing", 0, userId);
+            }
+        }
+    }
+
+    printf("{\"threads\": %u, \"ops\": %llu, \"users\": %llu, \"channels\": %llu, \"memberships\": %llu, "
+           "\"violations\": %llu}\n",
+           stressConfig.threads, (unsigned long long)(stressConfig.ops * stressConfig.threads),
+           (unsigned long long)userCount, (unsigned long long)channelCount, (unsigned long long)memberships,
+           (unsigned long long)violations.load());
+    return violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include "myconsole.cpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Chat view
+// The message area above the prompt. Lines are appended as frames are
+// decoded and the area is repainted at most VIEW_FPS times a second, all of
+// it in one console write that leaves the cursor in the prompt alone:
+//
+// +--------------------------------------------------+
+// | -- 120 messages skipped, /up to scroll back --   |  status row
+// | alice (1) @ Channel 2 > hi                       |
+// | bob (2) @ Channel 2 > hello                      |  newest lines, or an
+// | ...                                              |  older page after /up
+// +--------------------------------------------------+
+// | carol (3) @ Channel 2 > _                        |  prompt, not painted
+// +--------------------------------------------------+
+//
+// Lines that arrive faster than the screen shows them scroll past between
+// two paints without ever being visible. They stay in the scrollback, and
+// the status row counts them until the user scrolls.
+
+const uint32_t VIEW_FPS = 20;
+const size_t VIEW_SCROLLBACK_LINES = 5000;
+
+typedef struct {
+    std::mutex lock;
+    std::deque<std::wstring> lines;  // oldest first
+    uint64_t appended;  // lines ever appended, the first in lines is number appended - lines.size()
+    uint64_t painted;  // appended as of the last paint
+    uint64_t skipped;  // lines never painted since the user last scrolled
+    size_t scroll;  // lines scrolled back from the newest
+    BOOL dirty;
+    std::chrono::steady_clock::time_point lastPaint;
+    HANDLE console;  // NULL until ViewStart, lines are printed directly before that
+    short width;
+    short height;  // rows above the prompt, including the status row
+} ChatView;
+
+void ViewStart(ChatView& view, HANDLE console, short width, short height) {
+    std::lock_guard<std::mutex> guard(view.lock);
+    view.console = console;
+    view.width = (std::max)(width, (short)1);
+    view.height = (std::max)(height, (short)2);
+    view.dirty = TRUE;
+}
+
+// Append one line, control characters in it are shown as spaces
+void ViewAppend(ChatView& view, std::wstring&& line) {
+    std::replace_if(line.begin(), line.end(), [](wchar_t c) { return c < L' '; }, L' ');
+    std::lock_guard<std::mutex> guard(view.lock);
+    view.lines.push_back(std::move(line));
+    view.appended++;
+    if (view.lines.size() > VIEW_SCROLLBACK_LINES) {
+        view.lines.pop_front();
+    }
+    // a page scrolled back stays where it is
+    if (view.scroll > 0) {
+        view.scroll = (std::min)(view.scroll + 1, view.lines.size() - 1);
+    }
+    view.dirty = TRUE;
+}
+
+// Format into the view, a line per \n
+void ViewPrintf(ChatView& view, const wchar_t* format, ...) {
+    wchar_t buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vswprintf(buffer, sizeof(buffer) / sizeof(wchar_t), format, args);
+    va_end(args);
+    if (view.console == NULL) {
+        win_printf(GetStdHandle(STD_OUTPUT_HANDLE), L"%ls", buffer);
+        return;
+    }
+    const wchar_t* line = buffer;
+    while (*line != L'\0') {
+        const wchar_t* end = wcschr(line, L'\n');
+        if (end == nullptr) {
+            end = line + wcslen(line);
+        }
+        ViewAppend(view, std::wstring(line, end));
+        line = *end == L'\0' ? end : end + 1;
+    }
+}
+
+// Scroll back (lines > 0) or forward, a page when lines is 0
+void ViewScroll(ChatView& view, int lines, BOOL back) {
+    std::lock_guard<std::mutex> guard(view.lock);
+    size_t count = lines > 0 ? (size_t)lines : (size_t)(std::max)(view.height - 2, 1);
+    size_t limit = view.lines.empty() ? 0 : view.lines.size() - 1;
+    view.scroll = back ? (std::min)(view.scroll + count, limit) : view.scroll - (std::min)(count, view.scroll);
+    view.skipped = 0;
+    view.dirty = TRUE;
+}
+
+// Milliseconds until the view should be painted, -1 if it is up to date
+int ViewWaitMs(ChatView& view) {
+    std::lock_guard<std::mutex> guard(view.lock);
+    if (!view.dirty || view.console == NULL) {
+        return -1;
+    }
+    auto since = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - view.lastPaint);
+    return (int)(std::max)((int64_t)0, (int64_t)(1000 / VIEW_FPS) - (int64_t)since.count());
+}
+
+void ViewPaint(ChatView& view) {
+    std::lock_guard<std::mutex> guard(view.lock);
+    if (view.console == NULL) {
+        return;
+    }
+    short top = 0;
+#ifdef _WIN32
+    short left = 0;
+    // follow the window if it was resized
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (!GetConsoleScreenBufferInfo(view.console, &csbi)) {
+        csbi.wAttributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+    } else {
+        top = csbi.srWindow.Top;
+        left = csbi.srWindow.Left;
+        view.width = (std::max)((short)(csbi.srWindow.Right - csbi.srWindow.Left + 1), (short)1);
+        view.height = (std::max)((short)(csbi.srWindow.Bottom - csbi.srWindow.Top), (short)2);
+    }
+#endif
+    size_t width = view.width;
+    size_t rows = view.height - 1;
+
+    // Lay out the lines bottom up, long lines wrap over several rows
+    std::vector<std::wstring> screen;
+    uint64_t first = view.appended - view.lines.size();
+    uint64_t shownNew = 0;
+    for (size_t i = view.lines.size() - view.scroll; i-- > 0 && screen.size() < rows;) {
+        const std::wstring& line = view.lines[i];
+        size_t chunks = line.empty() ? 1 : (line.size() + width - 1) / width;
+        for (size_t chunk = chunks; chunk-- > 0 && screen.size() < rows;) {
+            screen.push_back(line.substr(chunk * width, width));
+        }
+        if (first + i >= view.painted) {
+            shownNew++;
+        }
+    }
+    if (view.scroll == 0) {
+        view.skipped += view.appended - view.painted - shownNew;
+    }
+
+    wchar_t status[128] = L"";
+    if (view.scroll > 0) {
+        swprintf(status, 128, L" -- %zu newer lines below, /down to return --", view.scroll);
+    } else if (view.skipped > 0) {
+        swprintf(status, 128, L" -- %llu messages skipped, /up to scroll back --", (unsigned long long)view.skipped);
+    }
+    screen.push_back(std::wstring(status).substr(0, width));
+    std::reverse(screen.begin(), screen.end());
+    screen.resize(rows + 1);
+
+#ifdef _WIN32
+    std::vector<CHAR_INFO> cells(screen.size() * width);
+    for (size_t row = 0; row < screen.size(); row++) {
+        for (size_t column = 0; column < width; column++) {
+            CHAR_INFO& cell = cells[row * width + column];
+            cell.Char.UnicodeChar = column < screen[row].size() ? screen[row][column] : L' ';
+            cell.Attributes = csbi.wAttributes;
+        }
+    }
+    COORD size = {(SHORT)width, (SHORT)screen.size()};
+    COORD origin = {0, 0};
+    SMALL_RECT region = {left, top, (SHORT)(left + width - 1), (SHORT)(top + screen.size() - 1)};
+    WriteConsoleOutputW(view.console, cells.data(), size, origin, &region);
+#else
+    // save the cursor, rewrite every row, and put the cursor back
+    std::wstring out = L"\0337";
+    for (size_t row = 0; row < screen.size(); row++) {
+        wchar_t move[32];
+        swprintf(move, 32, L"\033[%zu;1H\033[2K", top + row + 1);
+        out += move;
+        out += screen[row];
+    }
+    out += L"\0338";
+    std::string utf8(out.size() * 4, '\0');
+    utf8.resize(WideToUtf8(out.c_str(), out.size(), &utf8[0]));
+    fwrite(utf8.data(), 1, utf8.size(), (FILE*)view.console);
+    fflush((FILE*)view.console);
+#endif
+
+    view.painted = view.appended;
+    view.dirty = FALSE;
+    view.lastPaint = std::chrono::steady_clock::now();
+}
@@ -1,16 +1,43 @@
 #include <winsock2.h>
 #include <windows.h>
-#include "myconsole.cpp"
+#include "chatview.cpp"
 #include "protocol.cpp"
+#include "decoder.cpp"
+#include "compress.cpp"
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #pragma comment(lib, "ws2_32.lib")
 // #define DEBUG
 
-const int BUF_SIZE = 4096;
 const char INET_ADDR[] = "127.0.0.1";
 const int PORT = 12345;
+// Reconnect attempts after the connection drops, the delay doubles each time
+const int RECONNECT_ATTEMPTS = 6;
+const DWORD RECONNECT_DELAY_MS = 500;
 wchar_t nickname[32];
 static uint32_t activeChannel = 0;
+// Outgoing frames are built on the stack, a message has at most 1024 characters
+// which take up to 4 bytes each in either encoding
+const uint32_t MAX_TEXT_BYTES = 1024 * 4;
+const uint32_t SEND_BUFFER_SIZE = sizeof(MessageHeader) + sizeof(SendMsgPayload) + MAX_TEXT_BYTES;
+// FEATURE_* bits asked for and granted at login
+static uint32_t clientFeatures = 0;
+static uint32_t serverFeatures = 0;
+// Presented when reconnecting to get the session back
+static uint64_t resumeToken = 0;
+// Sequence number of the newest message seen per channel, a resume replays what came after
+static std::unordered_map<uint32_t, uint64_t> lastSeen;
+// Nicknames from USER_INFO, compact messages only carry the user ID
+static std::unordered_map<uint32_t, std::wstring> userDirectory;
+// Handed from the login exchange to the receive thread, frames after the
+// login reply may already be buffered
+static FrameDecoder decoder;
+// Frames unpacked from COMPRESSED frames, read before anything received after them
+static FrameDecoder inflated;
+// Everything shown above the prompt once logged in
+static ChatView chatView;
 
 typedef struct {
     SOCKET clientSock;
@@ -19,7 +46,7 @@ typedef struct {
 } ThreadParams;
 
 DWORD WINAPI ReceiveMessages(LPVOID lpParam);
-void SendMessageToServer(ThreadParams params);
+void SendMessageToServer(ThreadParams* params);
 
 ThreadParams PackThreadParams(SOCKET clientSock, wchar_t nickname[32], uint32_t userID){
     ThreadParams params;
@@ -29,6 +56,42 @@ ThreadParams PackThreadParams(SOCKET clientSock, wchar_t nickname[32], uint32_t
     return params;
 }
 
+// Connect to the server, returns INVALID_SOCKET on failure
+SOCKET ConnectToServer() {
+    SOCKET clientSock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (clientSock == INVALID_SOCKET) {
+        ViewPrintf(chatView, L"socket failed with error code: %ld\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+
+    sockaddr_in servAddr;
+    ZeroMemory(&servAddr, sizeof(servAddr));
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = inet_addr(INET_ADDR);
+    servAddr.sin_port = htons(PORT);
+
+    if (connect(clientSock, (SOCKADDR*)&servAddr, sizeof(servAddr)) == SOCKET_ERROR) {
+        ViewPrintf(chatView, L"connect failed with error code: %ld\n", WSAGetLastError());
+        closesocket(clientSock);
+        return INVALID_SOCKET;
+    }
+    return clientSock;
+}
+
+#ifdef DEBUG
+// Show a frame as hex bytes, one line in the view
+void ShowFrameBytes(const wchar_t* label, const char* frame, uint32_t size) {
+    std::wstring line(label);
+    for (uint32_t i = 0; i < size; i++) {
+        wchar_t hex[4];
+        swprintf(hex, 4, L"%02x ", static_cast<unsigned char>(frame[i]));
+        line += hex;
+    }
+    ViewAppend(chatView, std::move(line));
+}
+#endif
+
 int main() {
     HANDLE hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
     HANDLE hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
@@ -44,23 +107,8 @@ int main() {
         return 1;
     }
 
-    SOCKET clientSock = socket(AF_INET, SOCK_STREAM, 0);
-
+    SOCKET clientSock = ConnectToServer();
     if (clientSock == INVALID_SOCKET) {
-        win_printf(hConsoleOut, L"socket failed with error code: %ld\n", WSAGetLastError());
-        WSACleanup();
-        return 1;
-    }
-
-    sockaddr_in servAddr;
-    ZeroMemory(&servAddr, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = inet_addr(INET_ADDR);
-    servAddr.sin_port = htons(PORT);
-
-    if (connect(clientSock, (SOCKADDR*)&servAddr, sizeof(servAddr)) == SOCKET_ERROR) {
-        win_printf(hConsoleOut, L"connect failed with error code: %ld\n", WSAGetLastError());
-        closesocket(clientSock);
         WSACleanup();
         return 1;
     }
@@ -80,43 +128,72 @@ int main() {
     win_printf(hConsoleOut, L"Enter your nickname: ");
     win_scanf(hConsoleIn, L"%31ls", &nickname);
 
-    // Send nickname to server
-    uint32_t totalSize;
-    char* buffer = PackLogin(nickname, totalSize);
-    send(clientSock, buffer, totalSize, 0);
+    // Send nickname to server, asking for UTF-8 text on the wire
+    char nicknameUtf8[31 * 4];
+    uint8_t nicknameBytes = (uint8_t)WideToUtf8(nickname, wcsnlen(nickname, 31), nicknameUtf8);
+    char loginBuffer[SEND_BUFFER_SIZE];
+    clientFeatures = FEATURE_UTF8 | FEATURE_COMPACT | FEATURE_BATCH | FEATURE_PING;
+    if (CompressionAvailable()) {
+        clientFeatures |= FEATURE_DEFLATE;
+    }
+    uint32_t totalSize = PackLoginUtf8Into(loginBuffer, sizeof(loginBuffer), clientFeatures, nicknameUtf8, nicknameBytes);
+    send(clientSock, loginBuffer, totalSize, 0);
 
     // Waiting for server's response
     uint32_t userId;
-    char recvBuffer[BUF_SIZE];
-    int recvLen = recv(clientSock, recvBuffer, BUF_SIZE, 0);
-    recvBuffer[recvLen] = '\0';
-
     win_printf(hConsoleOut, L"Waiting for server's response\n");
+    DecoderInit(decoder, MAX_PAYLOAD_LENGTH, DECODER_RESYNC);
+    DecoderInit(inflated, MAX_PAYLOAD_LENGTH, DECODER_RESYNC);
+    FrameView view;
+    while (DecoderNext(decoder, view) != DECODE_FRAME) {
+        size_t space;
+        char* dst = DecoderWritable(decoder, space);
+        int recvLen = recv(clientSock, dst, (int)space, 0);
+        if (recvLen <= 0) {
+            win_printf(hConsoleOut, L"Server closed the connection\n");
+            closesocket(clientSock);
+            WSACleanup();
+            return 1;
+        }
+        DecoderCommit(decoder, recvLen);
+    }
+
     // Unpack the response
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(recvBuffer);
+    MessageHeader* header = view.header;
     if (header->type == MessageType::LOGIN_SUCCESS) {
-        LoginSuccessPayload* payload = reinterpret_cast<LoginSuccessPayload*>(recvBuffer + sizeof(MessageHeader));
+        LoginSuccessPayload* payload = reinterpret_cast<LoginSuccessPayload*>(view.payload);
         userId = payload->user_id;
-        win_printf(hConsoleOut, L"Your ID is %d\n", payload->user_id);
+        serverFeatures = LoginSuccessFeatures(view.frame, view.size);
+        resumeToken = LoginSuccessToken(view.frame, view.size);
+        if (serverFeatures & FEATURE_COMPACT) {
+            DecoderAllowCompact(decoder);
+            DecoderAllowCompact(inflated);
+        }
+
+        // The chat screen, the message area above the prompt on the bottom row
+        ClearConsole();
+        GetConsoleScreenBufferInfo(hConsoleOut, &csbi);
+        ViewStart(chatView, hConsoleOut, csbi.srWindow.Right - csbi.srWindow.Left + 1,
+                  csbi.srWindow.Bottom - csbi.srWindow.Top);
+        ViewPrintf(chatView, L"Your ID is %d\n", payload->user_id);
 
 #ifdef DEBUG
-        win_printf(hConsoleOut, L"Received: ");
-        for (int i = 0; i < recvLen; i++) {
-            win_printf(hConsoleOut, L"%02x ", static_cast<unsigned char>(recvBuffer[i]));
-        }
-        win_printf(hConsoleOut, L"\n");
+        ShowFrameBytes(L"Received: ", view.frame, view.size);
 #endif
 
         // print out the channel list
-        win_printf(hConsoleOut, L"Channel list:\n");
-        uint32_t* channelIds = reinterpret_cast<uint32_t*>(recvBuffer + sizeof(MessageHeader) + sizeof(LoginSuccessPayload));
-        for (int i = 0; i < payload->channel_amount; i++) {
-            win_printf(hConsoleOut, L"  - Channel %d\n", channelIds[i]);
+        ViewPrintf(chatView, L"Channel list:\n");
+        uint32_t* channelIds = reinterpret_cast<uint32_t*>(view.payload + sizeof(LoginSuccessPayload));
+        uint32_t channelAmount = (header->payload_length - sizeof(LoginSuccessPayload)) / sizeof(uint32_t);
+        for (uint32_t i = 0; i < payload->channel_amount && i < channelAmount; i++) {
+            ViewPrintf(chatView, L"  - Channel %d\n", channelIds[i]);
         }
+        ViewPaint(chatView);
 
     } else if (header->type == MessageType::ERR) {
-        ErrorPayload* payload = reinterpret_cast<ErrorPayload*>(recvBuffer + sizeof(MessageHeader));
-        win_printf(hConsoleOut, L"Error code: %d\n", payload->err_code);
+        ErrorPayload payload = {0};
+        DecodeFrame<ERR>(view.frame, view.size, payload);
+        win_printf(hConsoleOut, L"Error code: %d\n", payload.err_code);
         // win_printf(hConsoleOut, L"Error message: %S\n", payload->err_msg);
         closesocket(clientSock);
         WSACleanup();
@@ -128,9 +205,6 @@ int main() {
         return 1;
     }
 
-    // Clear the console to main chat screen
-    // system("CLS");
-
     // Start a thread to receive messages from the server
     ThreadParams params = PackThreadParams(clientSock, nickname, userId);
     DWORD dwThreadId;
@@ -142,97 +216,321 @@ int main() {
     }
 
     // Send messages to the server
-    SendMessageToServer(params);
+    SendMessageToServer(&params);
 
     // Kill the thread
     TerminateThread(hThread, 0);
     CloseHandle(hThread);
 
-    closesocket(clientSock);
+    closesocket(params.clientSock);
     WSACleanup();
 
     return 0;
 }
 
+// Note a message as seen, returns FALSE if it was seen before. A resume replay
+// may repeat messages that also arrived live.
+BOOL MarkSeen(uint32_t channelId, uint64_t seq) {
+    if (seq == 0) {
+        return TRUE;
+    }
+    uint64_t& last = lastSeen[channelId];
+    if (seq <= last) {
+        return FALSE;
+    }
+    last = seq;
+    return TRUE;
+}
+
+// One chat message as a line of the view
+void ShowChatMessage(const wchar_t* sender, uint32_t userId, uint32_t channelId, const wchar_t* message, size_t length) {
+    wchar_t prefix[32 * 4 + 64];
+    swprintf(prefix, sizeof(prefix) / sizeof(wchar_t), L"%.128ls (%d) @ Channel %u > ", sender, userId, channelId);
+    std::wstring line(prefix);
+    line.append(message, length);
+    ViewAppend(chatView, std::move(line));
+}
+
+// Show one NEW_MSG in any of its encodings, returns FALSE for other message types
+BOOL PrintChatMessage(uint8_t type, const char* data, uint32_t length) {
+    if (type != MessageType::NEW_MSG && type != MessageType::NEW_MSG_UTF8 && type != MessageType::NEW_MSG_COMPACT) {
+        return FALSE;
+    }
+    // Records inside a BATCH have not been checked by the decoder
+    if (length < MinPayloadLength(type)) {
+        return TRUE;
+    }
+    if (type == MessageType::NEW_MSG) {
+        const NewMsgPayload* payload = reinterpret_cast<const NewMsgPayload*>(data);
+        if (!MarkSeen(payload->channel_id, NewMsgSeq(type, data, length))) {
+            return TRUE;
+        }
+        // get the message, clamped to the frame in case it is not terminated
+        const wchar_t* message = reinterpret_cast<const wchar_t*>(data + sizeof(NewMsgPayload));
+        size_t messageLength = min((length - sizeof(NewMsgPayload)) / sizeof(wchar_t), (size_t)payload->msg_length);
+        wchar_t sender[33];
+        wcsncpy(sender, payload->nickname, 32);
+        sender[32] = L'\0';
+        ShowChatMessage(sender, payload->user_id, payload->channel_id, message, wcsnlen(message, messageLength));
+    } else if (type == MessageType::NEW_MSG_UTF8) {
+        const NewMsgUtf8Payload* payload = reinterpret_cast<const NewMsgUtf8Payload*>(data);
+        if (!MarkSeen(payload->channel_id, NewMsgSeq(type, data, length))) {
+            return TRUE;
+        }
+        // both strings are clamped to the frame
+        const char* text = data + sizeof(NewMsgUtf8Payload);
+        uint32_t available = length - sizeof(NewMsgUtf8Payload);
+        uint32_t nicknameBytes = min((uint32_t)payload->nickname_length, available);
+        uint32_t messageBytes = min(payload->msg_length, available - nicknameBytes);
+        wchar_t sender[32 * 4];
+        sender[Utf8ToWide(text, min(nicknameBytes, 31u * 4), sender)] = L'\0';
+        std::wstring message(WideMaxChars(messageBytes) + 1, L'\0');
+        message.resize(Utf8ToWide(text + nicknameBytes, messageBytes, &message[0]));
+        ShowChatMessage(sender, payload->user_id, payload->channel_id, message.data(), message.size());
+    } else if (type == MessageType::NEW_MSG_COMPACT) {
+        uint32_t ids[2];
+        const char* text;
+        uint32_t messageBytes;
+        uint64_t seq;
+        int seqBytes;
+        if (ParseCompactIds(data, length, ids, 2, text, messageBytes) && (seqBytes = GetVarint64(text, messageBytes, seq)) > 0) {
+            text += seqBytes;
+            messageBytes -= seqBytes;
+            if (!MarkSeen(ids[1], seq)) {
+                return TRUE;
+            }
+            auto sender = userDirectory.find(ids[0]);
+            std::wstring message(WideMaxChars(messageBytes) + 1, L'\0');
+            message.resize(Utf8ToWide(text, messageBytes, &message[0]));
+            ShowChatMessage(sender != userDirectory.end() ? sender->second.c_str() : L"?", ids[0], ids[1],
+                            message.data(), message.size());
+        }
+    }
+    return TRUE;
+}
+
+// Connect again after the connection dropped and ask for the session back,
+// with the newest message seen per channel. The reply is handled by the
+// receive loop. Returns FALSE if the server stays unreachable.
+BOOL Reconnect(ThreadParams* params) {
+    closesocket(params->clientSock);
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+        ViewPrintf(chatView, L" * Connection lost, reconnecting...\n");
+        ViewPaint(chatView);
+        Sleep(RECONNECT_DELAY_MS << attempt);
+        SOCKET clientSock = ConnectToServer();
+        if (clientSock == INVALID_SOCKET) {
+            continue;
+        }
+
+        char nicknameUtf8[31 * 4];
+        uint8_t nicknameBytes = (uint8_t)WideToUtf8(params->nickname, wcsnlen(params->nickname, 31), nicknameUtf8);
+        std::vector<ResumeCursor> cursors;
+        for (auto& seen : lastSeen) {
+            cursors.push_back({seen.first, seen.second});
+        }
+        std::vector<char> login(LoginResumeSize(nicknameBytes, (uint32_t)cursors.size()));
+        uint32_t totalSize = PackLoginResumeInto(login.data(), (uint32_t)login.size(), clientFeatures, nicknameUtf8,
+                                                 nicknameBytes, resumeToken, cursors.data(), (uint32_t)cursors.size());
+        if (send(clientSock, login.data(), totalSize, 0) == SOCKET_ERROR) {
+            closesocket(clientSock);
+            continue;
+        }
+
+        // Nothing from the old connection carries over
+        DecoderFree(decoder);
+        DecoderFree(inflated);
+        DecoderInit(decoder, MAX_PAYLOAD_LENGTH, DECODER_RESYNC);
+        DecoderInit(inflated, MAX_PAYLOAD_LENGTH, DECODER_RESYNC);
+        params->clientSock = clientSock;
+        return TRUE;
+    }
+    ViewPrintf(chatView, L" * Server is unreachable\n");
+    ViewPaint(chatView);
+    return FALSE;
+}
+
 DWORD WINAPI ReceiveMessages(LPVOID lpParam) {
     ThreadParams* params = (ThreadParams*)lpParam;
-    SOCKET clientSock = params->clientSock;
-    wchar_t nickname[32];
-    wcscpy(nickname, params->nickname);
-    uint32_t userId = params->userID;
 
-    char buffer[BUF_SIZE];
-    int recvLen;
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    FrameView view;
+    while (true) {
+        // Frames only add lines to the view, which is painted when it comes
+        // due, between frames while they keep coming and on a timeout after
+        int waitMs = ViewWaitMs(chatView);
+        if (waitMs == 0) {
+            ViewPaint(chatView);
+        }
 
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hConsole, &csbi);
-    COORD coordBottom;
-    coordBottom.X = 0;
-    coordBottom.Y = csbi.srWindow.Bottom;
+        // One recv may carry several frames, or only part of a large one
+        BOOL unpacked = DecoderNext(inflated, view) == DECODE_FRAME;
+        if (!unpacked && DecoderNext(decoder, view) != DECODE_FRAME) {
+            if (waitMs > 0) {
+                fd_set readable;
+                FD_ZERO(&readable);
+                FD_SET(params->clientSock, &readable);
+                timeval timeout = {0, waitMs * 1000};
+                if (select((int)params->clientSock + 1, &readable, NULL, NULL, &timeout) == 0) {
+                    continue;
+                }
+            }
+            size_t space;
+            char* dst = DecoderWritable(decoder, space);
+            int recvLen = recv(params->clientSock, dst, (int)space, 0);
+            if (recvLen <= 0) {
+                if (!Reconnect(params)) {
+                    break;
+                }
+                continue;
+            }
+            DecoderCommit(decoder, recvLen);
+            continue;
+        }
 
-    while ((recvLen = recv(clientSock, buffer, BUF_SIZE - 1, 0)) > 0) {
-        buffer[recvLen] = '\0';
-        
-        // Clean the last line
-        SetConsoleCursorPosition(hConsole, coordBottom);
-        win_printf(hConsole, L"%*s", csbi.dwSize.X, L"");
-        SetConsoleCursorPosition(hConsole, coordBottom);
+        // The server never nests COMPRESSED frames
+        if (view.type == MessageType::COMPRESSED) {
+            if (unpacked || !InflateFrames(inflated, view.payload, view.payloadLength)) {
+                ViewPrintf(chatView, L"Dropped a corrupt compressed frame\n");
+            }
+            continue;
+        }
 
-#ifdef DEBUG
-        // Print the received message
-        win_printf(hConsole, L"Received: ");
-        for (int i = 0; i < recvLen; i++) {
-            win_printf(hConsole, L"%02x ", static_cast<unsigned char>(buffer[i]));
+        // Directory updates for compact messages, nothing to show
+        if (view.type == MessageType::USER_INFO) {
+            uint32_t id;
+            const char* text;
+            uint32_t nicknameBytes;
+            if (ParseCompactIds(view.payload, view.payloadLength, &id, 1, text, nicknameBytes)) {
+                std::wstring& name = userDirectory[id];
+                name.assign(WideMaxChars(nicknameBytes), L'\0');
+                name.resize(Utf8ToWide(text, nicknameBytes, &name[0]));
+            }
+            continue;
+        }
+
+        // The server checks we are still there, answer right away
+        if (view.type == MessageType::PING) {
+            PingPayload payload;
+            if (DecodeFrame<PING>(view.frame, view.size, payload)) {
+                char reply[FixedFrame<PONG>::SIZE];
+                send(params->clientSock, reply, PackPingInto(reply, sizeof(reply), payload.token, TRUE), 0);
+            }
+            continue;
         }
+
+#ifdef DEBUG
+        ShowFrameBytes(L"Received: ", view.frame, view.size);
 #endif
 
-        // unpack the message
-        MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-        if (header->type == MessageType::NEW_MSG) {
-            NewMsgPayload* payload = reinterpret_cast<NewMsgPayload*>(buffer + sizeof(MessageHeader));
-            // get the message
-            wchar_t* message = reinterpret_cast<wchar_t*>(buffer + sizeof(MessageHeader) + sizeof(NewMsgPayload));
-            win_printf(hConsole, L"%ls (%d) @ Channel %u > ", payload->nickname, payload->user_id, payload->channel_id);
-            win_printf(hConsole, L"%ls", message);
-            win_printf(hConsole, L"\n");
-        } else if (header->type == MessageType::ERR) {
-            ErrorPayload* payload = reinterpret_cast<ErrorPayload*>(buffer + sizeof(MessageHeader));
-            win_printf(hConsole, L"Error code: %d\n", payload->err_code);
-            // win_printf(hConsole, L"Error message: %S\n", payload->err_msg);
-        } else if (header->type == MessageType::JOIN_CHANNEL_SUCCESS) {
-            JoinChannelSuccessPayload* payload = reinterpret_cast<JoinChannelSuccessPayload*>(buffer + sizeof(MessageHeader));
-            win_printf(hConsole, L" * Joined channel %u, type /switch %u to switch ur channel.\n", payload->channel_id, payload->channel_id);
-        } else if (header->type == MessageType::LEAVE_CHANNEL_SUCCESS) {
-            LeaveChannelSuccessPayload* payload = reinterpret_cast<LeaveChannelSuccessPayload*>(buffer + sizeof(MessageHeader));
-            win_printf(hConsole, L" * Left channel %u, type /switch <channelID> to switch ur channel.\n", payload->channel_id);
+        // unpack the message, compact frames have no MessageHeader
+        if (view.type == MessageType::LOGIN_SUCCESS) {
+            // reply to a reconnect, the session is back if the user ID is
+            const LoginSuccessPayload* payload = reinterpret_cast<const LoginSuccessPayload*>(view.payload);
+            serverFeatures = LoginSuccessFeatures(view.frame, view.size);
+            resumeToken = LoginSuccessToken(view.frame, view.size);
+            if (serverFeatures & FEATURE_COMPACT) {
+                DecoderAllowCompact(decoder);
+                DecoderAllowCompact(inflated);
+            }
+            if (payload->user_id == params->userID) {
+                ViewPrintf(chatView, L" * Reconnected\n");
+            } else {
+                ViewPrintf(chatView, L" * Reconnected as a new user, your ID is %u\n", payload->user_id);
+                params->userID = payload->user_id;
+                lastSeen.clear();
+            }
+        } else if (view.type == MessageType::HISTORY_RESULT) {
+            const HistoryResultPayload* result = reinterpret_cast<const HistoryResultPayload*>(view.payload);
+            const char* records = view.payload + sizeof(HistoryResultPayload);
+            uint32_t remaining = view.payloadLength - sizeof(HistoryResultPayload);
+            HistoryRecord record;
+            const char* sender;
+            const char* text;
+            uint32_t messageBytes;
+            ViewPrintf(chatView, L" * %u earlier message(s) in channel %u\n", result->count, result->channel_id);
+            while (NextHistoryRecord(records, remaining, record, sender, text, messageBytes)) {
+                wchar_t name[32 * 4];
+                name[Utf8ToWide(sender, min((uint32_t)record.nickname_length, 31u * 4), name)] = L'\0';
+                std::wstring message(WideMaxChars(messageBytes) + 1, L'\0');
+                message.resize(Utf8ToWide(text, messageBytes, &message[0]));
+                ViewPrintf(chatView, L"   #%llu %ls (%d) > %ls\n", (unsigned long long)record.seq, name, record.user_id,
+                           message.c_str());
+                // replayed after a reconnect, or older than anything seen
+                MarkSeen(result->channel_id, record.seq);
+            }
+        } else if (view.type == MessageType::STATS_RESULT) {
+            const StatsResultPayload* result = reinterpret_cast<const StatsResultPayload*>(view.payload);
+            const char* entries = view.payload + sizeof(StatsResultPayload);
+            uint32_t remaining = view.payloadLength - sizeof(StatsResultPayload);
+            const char* name;
+            uint8_t nameBytes;
+            uint64_t value;
+            ViewPrintf(chatView, L" * Server stats:\n");
+            for (uint32_t i = 0; i < result->count && NextStatsEntry(entries, remaining, name, nameBytes, value); i++) {
+                wchar_t wideName[256];
+                wideName[Utf8ToWide(name, nameBytes, wideName)] = L'\0';
+                ViewPrintf(chatView, L"   %ls = %llu\n", wideName, (unsigned long long)value);
+            }
+        } else if (view.type == MessageType::BATCH) {
+            // several chat messages, each record is the payload of a record_type frame
+            const BatchPayload* batch = reinterpret_cast<const BatchPayload*>(view.payload);
+            const char* records = view.payload + sizeof(BatchPayload);
+            uint32_t remaining = view.payloadLength - sizeof(BatchPayload);
+            const char* record;
+            uint32_t recordLength;
+            for (uint32_t i = 0; i < batch->count && NextBatchRecord(records, remaining, record, recordLength); i++) {
+                PrintChatMessage(batch->record_type, record, recordLength);
+            }
+        } else if (PrintChatMessage(view.type, view.payload, view.payloadLength)) {
+            // a single chat message
+        } else if (view.type == MessageType::ERR) {
+            ErrorPayload payload = {0};
+            DecodeFrame<ERR>(view.frame, view.size, payload);
+            if (payload.err_code == ERR_RATE_LIMITED) {
+                ViewPrintf(chatView, L" * Slow down, the message was dropped. Try again in %u ms.\n",
+                           ErrorRetryAfterMs(view.frame, view.size));
+            } else {
+                ViewPrintf(chatView, L"Error code: %d\n", payload.err_code);
+            }
+            // ViewPrintf(chatView, L"Error message: %S\n", payload.err_msg);
+        } else if (view.type == MessageType::JOIN_CHANNEL_SUCCESS) {
+            JoinChannelSuccessPayload payload = {0, 0};
+            DecodeFrame<JOIN_CHANNEL_SUCCESS>(view.frame, view.size, payload);
+            ViewPrintf(chatView, L" * Joined channel %u, type /switch %u to switch ur channel.\n", payload.channel_id, payload.channel_id);
+        } else if (view.type == MessageType::LEAVE_CHANNEL_SUCCESS) {
+            LeaveChannelSuccessPayload payload = {0, 0};
+            DecodeFrame<LEAVE_CHANNEL_SUCCESS>(view.frame, view.size, payload);
+            ViewPrintf(chatView, L" * Left channel %u, type /switch <channelID> to switch ur channel.\n", payload.channel_id);
+            lastSeen.erase(payload.channel_id);
         } else {
-            win_printf(hConsole, L"Message type not supported\n");
+            ViewPrintf(chatView, L"Message type not supported\n");
         }
-        win_printf(hConsole, L"%ls (%d) @ Channel %u > ", nickname, userId, activeChannel);
     }
 
     return 0;
 }
 
-void SendMessageToServer(ThreadParams params) {
+void SendMessageToServer(ThreadParams* params) {
     HANDLE hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
     HANDLE hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
 
     CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hConsoleOut, &csbi);
     COORD coordBottom;
     coordBottom.X = 0;
-    coordBottom.Y = csbi.srWindow.Bottom;
-    COORD coordTop;
-    coordTop.X = 0;
-    coordTop.Y = 0;
 
     while (true) {
-        // Move cursor to the input position
+        // Show what the last command printed, the receive thread only paints
+        // for incoming frames
+        ViewPaint(chatView);
+
+        // Clear the input line and move the cursor there
+        GetConsoleScreenBufferInfo(hConsoleOut, &csbi);
+        coordBottom.Y = csbi.srWindow.Bottom;
+        SetConsoleCursorPosition(hConsoleOut, coordBottom);
+        win_printf(hConsoleOut, L"%*s", csbi.srWindow.Right - csbi.srWindow.Left, L"");
         SetConsoleCursorPosition(hConsoleOut, coordBottom);
         wchar_t message[1024] = {0};
-        win_printf(hConsoleOut, L"%ls (%d) @ Channel %u > ", params.nickname, params.userID, activeChannel);
+        win_printf(hConsoleOut, L"%ls (%d) @ Channel %u > ", params->nickname, params->userID, activeChannel);
         win_scanf(hConsoleIn, L"%1023[^\n]", &message);
         
         // win_printf(hConsoleOut, L"%d\n", wcslen(message));
@@ -243,83 +541,100 @@ void SendMessageToServer(ThreadParams params) {
 
         // warn if message is too long
         if (wcslen(message) > 1023) {
-            win_printf(hConsoleOut, L"Message too long, truncated to 1023 characters\n");
+            ViewPrintf(chatView, L"Message too long, truncated to 1023 characters\n");
             message[1023] = L'\0';
         }
 
+        char buffer[SEND_BUFFER_SIZE];
+
         // command starts with /
         if (message[0] == L'/') {
             if (wcsncmp(message, L"/quit", 5) == 0) {
                 // send quit message to server
-                uint32_t totalSize;
-                char* buffer = PackDisconnect(params.userID, totalSize);
-                send(params.clientSock, buffer, totalSize, 0);
-                delete[] buffer;
+                uint32_t totalSize = PackDisconnectInto(buffer, sizeof(buffer), params->userID);
+                send(params->clientSock, buffer, totalSize, 0);
                 win_printf(hConsoleOut, L"Bye!\n");
                 system("CLS");
                 break;
             } else if (wcsncmp(message, L"/join ", 6) == 0) {
                 int64_t channelID = wcstoul(message + 6, nullptr, 10);
                 if (channelID > 0) {
-                    uint32_t totalSize;
-                    char* buffer = PackJoinChannel(params.userID, (uint32_t)channelID, totalSize);
-                    send(params.clientSock, buffer, totalSize, 0);
-                    delete[] buffer;
+                    uint32_t totalSize = PackJoinChannelInto(buffer, sizeof(buffer), params->userID, (uint32_t)channelID);
+                    send(params->clientSock, buffer, totalSize, 0);
                 } else {
-                    win_printf(hConsoleOut, L"Invalid channel ID\n");
+                    ViewPrintf(chatView, L"Invalid channel ID\n");
                 }
             } else if (wcsncmp(message, L"/leave ", 7) == 0) {
                 int64_t channelID = wcstoul(message + 7, nullptr, 10);
                 if (channelID > 0) {
-                    uint32_t totalSize;
-                    char* buffer = PackLeaveChannel(params.userID, (uint32_t)channelID, totalSize);
-                    send(params.clientSock, buffer, totalSize, 0);
-                    delete[] buffer;
+                    uint32_t totalSize = PackLeaveChannelInto(buffer, sizeof(buffer), params->userID, (uint32_t)channelID);
+                    send(params->clientSock, buffer, totalSize, 0);
                 } else {
-                    win_printf(hConsoleOut, L"Invalid channel ID\n");
+                    ViewPrintf(chatView, L"Invalid channel ID\n");
                 }
             } else if (wcsncmp(message, L"/switch ", 8) == 0) {
                 int64_t channelID = wcstoul(message + 8, nullptr, 10);
                 if (channelID >= 0) {
                     activeChannel = (uint32_t)channelID;
-                    win_printf(hConsoleOut, L" * Switched to channel %u\n", activeChannel);
+                    ViewPrintf(chatView, L" * Switched to channel %u\n", activeChannel);
                 } else {
-                    win_printf(hConsoleOut, L"Invalid channel ID\n");
+                    ViewPrintf(chatView, L"Invalid channel ID\n");
                 }
+            } else if (wcsncmp(message, L"/history", 8) == 0) {
+                // older messages of the active channel, before the given sequence number if any
+                uint64_t beforeSeq = wcstoull(message + 8, nullptr, 10);
+                uint32_t totalSize = PackHistoryInto(buffer, sizeof(buffer), activeChannel, beforeSeq, 20);
+                send(params->clientSock, buffer, totalSize, 0);
+            } else if (wcsncmp(message, L"/stats", 6) == 0) {
+                // only answered for clients on the server machine
+                uint32_t totalSize = PackStatsInto(buffer, sizeof(buffer), params->userID);
+                send(params->clientSock, buffer, totalSize, 0);
+            } else if (wcsncmp(message, L"/up", 3) == 0) {
+                ViewScroll(chatView, (int)wcstoul(message + 3, nullptr, 10), TRUE);
+                continue;
+            } else if (wcsncmp(message, L"/down", 5) == 0) {
+                ViewScroll(chatView, (int)wcstoul(message + 5, nullptr, 10), FALSE);
+                continue;
             } else if (wcsncmp(message, L"/help", 5) == 0 || wcsncmp(message, L"/?", 2) == 0) {
-                win_printf(hConsoleOut, L" * Commands:\n");
-                win_printf(hConsoleOut, L"   /join <channel_id>: join a channel\n");
-                win_printf(hConsoleOut, L"   /leave <channel_id>: leave a channel\n");
-                win_printf(hConsoleOut, L"   /switch <channel_id>: switch to another channel\n");
-                win_printf(hConsoleOut, L"   /quit: quit the program\n");
-                win_printf(hConsoleOut, L"   /help or /?: show this help message\n");
+                ViewPrintf(chatView, L" * Commands:\n");
+                ViewPrintf(chatView, L"   /join <channel_id>: join a channel\n");
+                ViewPrintf(chatView, L"   /leave <channel_id>: leave a channel\n");
+                ViewPrintf(chatView, L"   /switch <channel_id>: switch to another channel\n");
+                ViewPrintf(chatView, L"   /history [seq]: show earlier messages of the channel, before #seq if given\n");
+                ViewPrintf(chatView, L"   /stats: show server counters, for clients on the server machine\n");
+                ViewPrintf(chatView, L"   /up [lines]: scroll back a page, or the given number of lines\n");
+                ViewPrintf(chatView, L"   /down [lines]: scroll forward a page, or the given number of lines\n");
+                ViewPrintf(chatView, L"   /quit: quit the program\n");
+                ViewPrintf(chatView, L"   /help or /?: show this help message\n");
                 continue;
             } else {
-                win_printf(hConsoleOut, L"Unknown command: %ls\n", message);
+                ViewPrintf(chatView, L"Unknown command: %ls\n", message);
                 continue;
             }
         } else {
             // normal message
             uint32_t totalSize;
-            char* buffer = PackSendMsg(params.userID, activeChannel, nickname, message, totalSize);
+            if (serverFeatures & FEATURE_UTF8) {
+                char text[MAX_TEXT_BYTES];
+                uint32_t textBytes = (uint32_t)WideToUtf8(message, wcslen(message), text);
+                totalSize = PackSendMsgUtf8Into(buffer, sizeof(buffer), params->userID, activeChannel, text, textBytes);
+            } else {
+                totalSize = PackSendMsgInto(buffer, sizeof(buffer), params->userID, activeChannel, message);
+            }
 
 #ifdef DEBUG
             // preview the buffer
-            win_printf(hConsoleOut, L"Send: ");
-            for (int i = 0; i < totalSize; i++) {
-                win_printf(hConsoleOut, L"%02x ", static_cast<unsigned char>(buffer[i]));
-            }
-            win_printf(hConsoleOut, L"\n");
+            ShowFrameBytes(L"Send: ", buffer, totalSize);
 #endif
 
-            int result = send(params.clientSock, buffer, totalSize, 0);
+            int result = send(params->clientSock, buffer, totalSize, 0);
             if (result == SOCKET_ERROR) {
+                // the receive thread reconnects, the message is not resent
                 if (WSAGetLastError() == WSAECONNRESET) {
-                    win_printf(hConsoleOut, L"Server is down\n");
+                    ViewPrintf(chatView, L"Server is down, message not sent\n");
                 } else {
-                    win_printf(hConsoleOut, L"send failed with error code: %d\n", WSAGetLastError());
+                    ViewPrintf(chatView, L"send failed with error code: %d\n", WSAGetLastError());
                 }
-                break;
             }
         }
     }
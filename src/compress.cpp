@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include "platform.cpp"
+#include "protocol.cpp"
+#include "sharedframe.cpp"
+#include "decoder.cpp"
+#ifdef ORZCHAT_ZLIB
+#include <zlib.h>
+#endif
+
+// Frame compression
+// Clients granted FEATURE_DEFLATE may get any run of frames as one COMPRESSED
+// frame instead. Each one is a self-contained raw deflate stream primed with
+// a dictionary of protocol boilerplate and common chat words, so how a frame
+// compresses does not depend on what else its connection was sent. That is
+// what lets a broadcast be compressed once for every recipient: the first
+// connection that needs the compressed form stores it on the SharedFrame.
+// A connection with several frames queued compresses them together, as one
+// window, which does far better than frame by frame.
+//
+// Built without zlib, the server never grants FEATURE_DEFLATE.
+
+const uint32_t COMPRESS_MIN_BYTES = 96;  // smaller frames gain next to nothing
+const uint32_t COMPRESS_WINDOW_BYTES = 64 * 1024;  // raw bytes in one COMPRESSED frame
+const uint32_t COMPRESS_RAW_MAX = MAX_PAYLOAD_LENGTH;  // largest RawLength a client inflates
+
+// Preset dictionary, part of the protocol: both sides must use these exact
+// bytes. Deflate favours the end of the dictionary, so the most common
+// strings come last. Changing it needs a new feature bit.
+static const char DEFLATE_DICTIONARY[] =
+    "thanks thank you please sorry what when where why how who because about "
+    "really think know good great nice cool okay sure yes no maybe tomorrow today "
+    "morning night everyone anyone someone something http https www .com "
+    "lol haha hello hi hey bye see you later the and that this with have for are "
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "CzrO\x07" "CzrO\x0c" "CzrO\x0f" "\xfc\x0d" "\xfc\x0e";
+
+#ifdef ORZCHAT_ZLIB
+// deflateInit allocates a few hundred KiB, every thread keeps one stream
+struct Deflater {
+    z_stream stream;
+    BOOL ready = FALSE;
+
+    ~Deflater() {
+        if (ready) {
+            deflateEnd(&stream);
+        }
+    }
+};
+
+struct Inflater {
+    z_stream stream;
+    BOOL ready = FALSE;
+
+    ~Inflater() {
+        if (ready) {
+            inflateEnd(&stream);
+        }
+    }
+};
+
+static thread_local Deflater deflater;
+static thread_local Inflater inflater;
+
+// The thread's deflate stream, reset and primed with the dictionary
+z_stream* StartDeflate() {
+    z_stream* stream = &deflater.stream;
+    if (!deflater.ready) {
+        memset(stream, 0, sizeof(*stream));
+        // negative window bits: raw deflate, no zlib header or checksum
+        if (deflateInit2(stream, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return nullptr;
+        }
+        deflater.ready = TRUE;
+    } else {
+        deflateReset(stream);
+    }
+    deflateSetDictionary(stream, (const Bytef*)DEFLATE_DICTIONARY, sizeof(DEFLATE_DICTIONARY) - 1);
+    return stream;
+}
+
+z_stream* StartInflate() {
+    z_stream* stream = &inflater.stream;
+    if (!inflater.ready) {
+        memset(stream, 0, sizeof(*stream));
+        if (inflateInit2(stream, -15) != Z_OK) {
+            return nullptr;
+        }
+        inflater.ready = TRUE;
+    } else {
+        inflateReset(stream);
+    }
+    inflateSetDictionary(stream, (const Bytef*)DEFLATE_DICTIONARY, sizeof(DEFLATE_DICTIONARY) - 1);
+    return stream;
+}
+#endif
+
+BOOL CompressionAvailable() {
+#ifdef ORZCHAT_ZLIB
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+// Deflate count frames into one COMPRESSED frame, nullptr if that would not
+// make them smaller
+SharedFrame* CompressFrames(SharedFrame* const* frames, size_t count) {
+#ifdef ORZCHAT_ZLIB
+    uint32_t rawBytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        rawBytes += frames[i]->size;
+    }
+    if (rawBytes < COMPRESS_MIN_BYTES || rawBytes > COMPRESS_RAW_MAX) {
+        return nullptr;
+    }
+    z_stream* stream = StartDeflate();
+    if (stream == nullptr) {
+        return nullptr;
+    }
+
+    uint32_t headerSize = sizeof(MessageHeader) + sizeof(CompressedPayload);
+    uint32_t bound = (uint32_t)deflateBound(stream, rawBytes);
+    SharedFrame* packed = NewFrame(headerSize + bound);
+    stream->next_out = (Bytef*)packed->data + headerSize;
+    stream->avail_out = bound;
+    int status = Z_OK;
+    for (size_t i = 0; i < count && status == Z_OK; i++) {
+        stream->next_in = (Bytef*)frames[i]->data;
+        stream->avail_in = frames[i]->size;
+        status = deflate(stream, i + 1 == count ? Z_FINISH : Z_NO_FLUSH);
+    }
+    uint32_t deflated = bound - stream->avail_out;
+    if (status != Z_STREAM_END || headerSize + deflated >= rawBytes) {
+        ReleaseFrame(packed);
+        return nullptr;
+    }
+
+    CompressedPayload* payload = reinterpret_cast<CompressedPayload*>(
+        PackHeader(packed->data, COMPRESSED, sizeof(CompressedPayload) + deflated));
+    payload->raw_length = rawBytes;
+    packed->size = headerSize + deflated;  // the slab is bigger, only this much is sent
+    return packed;
+#else
+    (void)frames;
+    (void)count;
+    return nullptr;
+#endif
+}
+
+// What to send instead of a shared frame: its COMPRESSED form, or the frame
+// itself when compressing does not pay. Worked out once per frame, no matter
+// how many threads ask. The result belongs to the frame.
+SharedFrame* CompressedForm(SharedFrame* frame) {
+    SharedFrame* cached = frame->compressed.load(std::memory_order_acquire);
+    if (cached != nullptr) {
+        return cached;
+    }
+    SharedFrame* packed = CompressFrames(&frame, 1);
+    if (packed == nullptr) {
+        packed = frame;
+    }
+    if (!frame->compressed.compare_exchange_strong(cached, packed, std::memory_order_acq_rel,
+                                                   std::memory_order_acquire)) {
+        // another thread was first
+        if (packed != frame) {
+            ReleaseFrame(packed);
+        }
+        return cached;
+    }
+    return packed;
+}
+
+// Inflate a COMPRESSED payload and queue the frames it holds in decoder.
+// Returns FALSE if the payload is corrupt.
+BOOL InflateFrames(FrameDecoder& decoder, const char* data, uint32_t length) {
+#ifdef ORZCHAT_ZLIB
+    const CompressedPayload* payload = reinterpret_cast<const CompressedPayload*>(data);
+    if (length < sizeof(CompressedPayload) || payload->raw_length > COMPRESS_RAW_MAX) {
+        return FALSE;
+    }
+    z_stream* stream = StartInflate();
+    if (stream == nullptr) {
+        return FALSE;
+    }
+    uint32_t rawLength = payload->raw_length;
+    DecoderReserve(decoder, rawLength);
+    stream->next_in = (Bytef*)data + sizeof(CompressedPayload);
+    stream->avail_in = length - sizeof(CompressedPayload);
+    stream->next_out = (Bytef*)decoder.data + decoder.tail;
+    stream->avail_out = rawLength;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out != 0) {
+        return FALSE;
+    }
+    DecoderCommit(decoder, rawLength);
+    return TRUE;
+#else
+    (void)decoder;
+    (void)data;
+    (void)length;
+    return FALSE;
+#endif
+}
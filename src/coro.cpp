@@ -0,0 +1,189 @@
+#pragma once
+#include "reactor.cpp"
+#ifdef ORZCHAT_COROUTINES
+#include <coroutine>
+#include <exception>
+
+// Coroutine reactors
+// The epoll reactors with the per-connection protocol written as two C++20
+// coroutines instead of callbacks:
+//
+// - ServeClient reads like the blocking ClientHandler: wait for a LOGIN, then
+//   handle one message after another until the client leaves
+// - WriteClient writes queued output whenever there is some and the socket
+//   takes it
+//
+// Neither owns a thread. Waiting for a frame or for output parks the
+// coroutine in its Connection and returns to the reactor, which resumes it
+// when epoll reports the socket ready and a complete frame has arrived, or
+// when the pass queued output for it. A parked connection costs its two
+// coroutine frames, a few hundred bytes, instead of a thread stack.
+
+enum ReadResult {
+    READ_FRAME,      // a complete frame is in the view
+    READ_MALFORMED,  // the client sent a frame we cannot decode
+    READ_CLOSED,     // the connection is gone
+    READ_PENDING     // nothing more until the socket is readable again
+};
+
+// A coroutine that starts right away and frees itself when it returns.
+// Nobody waits for it, CoroStop destroys it if the connection goes first.
+typedef struct CoroTask {
+    struct promise_type {
+        CoroTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+} CoroTask;
+
+// Decode the next frame, reading from the socket as needed. Frames are
+// decoded straight out of the reactor's read buffer, like HandleReadable
+// does, and the partial rest is copied into the connection before it
+// waits, when another connection may reuse the buffer.
+ReadResult ReadFrame(Reactor* reactor, Connection* conn, FrameView& view) {
+    while (!conn->closing) {
+        uint64_t skipped = conn->in.skipped;
+        DecodeStatus status = DecoderNext(conn->in, view);
+        if (conn->in.skipped != skipped) {
+            MetricsAdd(METRIC_SKIPPED_BYTES, conn->in.skipped - skipped);
+            LogPrintf(LOG_WARNING, L"Skipped %u bytes of garbage from client %u",
+                      (uint32_t)(conn->in.skipped - skipped), conn->userID);
+        }
+        if (status == DECODE_FRAME) {
+            MetricsFrameIn(view.type);
+            LivenessFrame(conn->liveness, view.type, reactor->now);
+            return READ_FRAME;
+        }
+        if (status == DECODE_ERROR) {
+            return READ_MALFORMED;
+        }
+
+        DecoderSettle(conn->in);
+        ssize_t recvLen = recv(conn->sock, reactor->readBuffer, REACTOR_READ_SIZE, 0);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (recvLen == 0) {
+            LogPrintf(LOG_INFO, L"Client disconnected");
+            return READ_CLOSED;
+        } else if (recvLen < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? READ_PENDING : READ_CLOSED;
+        }
+        MetricsAdd(METRIC_BYTES_IN, recvLen);
+        LivenessHeard(conn->liveness, reactor->now);
+        DecoderFeed(conn->in, reactor->readBuffer, recvLen);
+    }
+    return READ_CLOSED;
+}
+
+// co_await NextFrame{...} gives the next ReadResult other than READ_PENDING.
+// While it is pending the coroutine waits in conn->reader, and CoroReadable
+// only resumes it once there is something to return.
+typedef struct NextFrame {
+    Reactor* reactor;
+    Connection* conn;
+    FrameView& view;
+    ReadResult result = READ_PENDING;
+    std::coroutine_handle<> handle = nullptr;
+
+    bool await_ready() {
+        result = ReadFrame(reactor, conn, view);
+        return result != READ_PENDING;
+    }
+    void await_suspend(std::coroutine_handle<> waiting) {
+        handle = waiting;
+        conn->reader = this;
+    }
+    ReadResult await_resume() { return result; }
+} NextFrame;
+
+// co_await NextOutput{conn} waits in conn->writer until CoroWritable
+typedef struct NextOutput {
+    Connection* conn;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> waiting) { conn->writer = waiting.address(); }
+    void await_resume() {}
+} NextOutput;
+
+CoroTask ServeClient(Reactor* reactor, Connection* conn) {
+    FrameView view;
+    ReadResult result = co_await NextFrame{reactor, conn, view};
+    if (result == READ_FRAME && !IsLoginFrame(view.header)) {
+        RejectLogin(conn->sock);
+        result = READ_CLOSED;
+    }
+    if (result == READ_FRAME) {
+        uint32_t features;
+        conn->userID = HandleLogin(conn->sock, view.header, view.frame, features);
+        ConnectionLoggedIn(reactor, conn, features);
+
+        while ((result = co_await NextFrame{reactor, conn, view}) == READ_FRAME) {
+            if (!HandleMessage(conn->sock, conn->userID, conn->introductions, conn->sendRate, view.header, view.frame)) {
+                conn->loggedIn = FALSE;  // DISCONNECT already removed the user
+                break;
+            }
+        }
+    }
+    if (result == READ_MALFORMED && !conn->closing) {
+        MetricsAdd(METRIC_DECODE_ERRORS);
+        LogPrintf(LOG_ERROR, L"Client sent a malformed frame");
+    }
+    ScheduleClose(reactor, conn);
+}
+
+CoroTask WriteClient(Reactor* reactor, Connection* conn) {
+    while (true) {
+        co_await NextOutput{conn};
+        if (OutboundFlush(conn->out, conn->sock) < 0) {
+            OutboundReport(conn->out);
+            ScheduleClose(reactor, conn);
+            co_return;
+        }
+        OutboundReport(conn->out);
+    }
+}
+
+void CoroStart(Reactor* reactor, Connection* conn) {
+    WriteClient(reactor, conn);
+    ServeClient(reactor, conn);
+}
+
+// The socket is readable, resume the reader if that completes its frame
+void CoroReadable(Reactor* reactor, Connection* conn) {
+    NextFrame* waiting = (NextFrame*)conn->reader;
+    if (waiting == nullptr) {
+        return;
+    }
+    waiting->result = ReadFrame(reactor, conn, waiting->view);
+    if (waiting->result != READ_PENDING) {
+        conn->reader = nullptr;
+        waiting->handle.resume();
+    }
+}
+
+// Output was queued or the socket drained, resume the writer
+void CoroWritable(Reactor*, Connection* conn) {
+    void* waiting = conn->writer;
+    if (waiting != nullptr) {
+        conn->writer = nullptr;
+        std::coroutine_handle<>::from_address(waiting).resume();
+    }
+}
+
+// Destroy the coroutines still waiting on a connection that is being closed
+void CoroStop(Connection* conn) {
+    if (conn->reader != nullptr) {
+        ((NextFrame*)conn->reader)->handle.destroy();
+        conn->reader = nullptr;
+    }
+    if (conn->writer != nullptr) {
+        std::coroutine_handle<>::from_address(conn->writer).destroy();
+        conn->writer = nullptr;
+    }
+}
+
+#endif
@@ -0,0 +1,234 @@
+#pragma once
+#include <cstring>
+#include <algorithm>
+#include "protocol.cpp"
+
+// Streaming frame decoder
+// Bytes from the socket go into a growable buffer and complete frames are
+// handed out as views into it, so a frame is never copied to be dispatched.
+// The read and write positions rewind to the start as soon as everything has
+// been consumed; only when a partial frame sits at the end of the buffer is
+// it moved to the front (or the buffer grown) to make room for the rest.
+// Frames up to maxPayload bytes are accepted whatever the read size is.
+//
+// Readers that recv into a shared scratch buffer can lend it to the decoder
+// with DecoderFeed instead. Frames are then decoded straight out of that
+// buffer and only a trailing partial frame is copied into the decoder.
+//
+// A frame view stays valid until the next DecoderWritable, DecoderFeed or
+// DecoderSettle call.
+//
+// Compact frames are only recognized once DecoderAllowCompact was called,
+// their views have no MessageHeader, use type and payloadLength instead.
+
+const uint32_t MAX_PAYLOAD_LENGTH = 1 << 20;
+const size_t DECODER_MIN_READ = 16 * 1024;
+
+enum DecodeStatus {
+    DECODE_FRAME,      // view holds the next frame
+    DECODE_NEED_MORE,  // no complete frame buffered
+    DECODE_ERROR       // malformed input and the policy is to reject it
+};
+
+enum DecoderPolicy {
+    DECODER_REJECT,  // a bad header is fatal for the stream
+    DECODER_RESYNC   // skip ahead to the next magic number
+};
+
+typedef struct {
+    MessageHeader* header;  // nullptr for compact frames
+    uint8_t type;
+    uint32_t payloadLength;
+    char* frame;    // header followed by the payload
+    char* payload;
+    uint32_t size;  // header + payload
+} FrameView;
+
+typedef struct {
+    char* data;
+    size_t capacity;
+    size_t head;  // first unconsumed byte
+    size_t tail;  // end of the received bytes
+    size_t pending;  // size of the incomplete frame at head, 0 if unknown
+    char* borrowed;  // caller's buffer lent by DecoderFeed
+    size_t borrowedLen;
+    size_t borrowedPos;
+    uint32_t maxPayload;
+    DecoderPolicy policy;
+    BOOL compact;  // accept compact frames
+    uint64_t skipped;  // garbage bytes dropped while resynchronizing
+} FrameDecoder;
+
+void DecoderInit(FrameDecoder& decoder, uint32_t maxPayload, DecoderPolicy policy) {
+    memset(&decoder, 0, sizeof(decoder));
+    decoder.maxPayload = maxPayload;
+    decoder.policy = policy;
+}
+
+void DecoderAllowCompact(FrameDecoder& decoder) {
+    decoder.compact = TRUE;
+}
+
+void DecoderFree(FrameDecoder& decoder) {
+    delete[] decoder.data;
+    decoder.data = nullptr;
+    decoder.capacity = 0;
+    decoder.head = 0;
+    decoder.tail = 0;
+    decoder.pending = 0;
+}
+
+size_t DecoderBuffered(const FrameDecoder& decoder) {
+    return decoder.tail - decoder.head;
+}
+
+BOOL IsValidHeader(const MessageHeader* header, uint32_t maxPayload) {
+    return header->magic_number == FRAME_MAGIC &&
+           header->payload_length <= maxPayload &&
+           header->payload_length >= MinPayloadLength(header->type);
+}
+
+// Make room for at least need bytes after tail
+void DecoderReserve(FrameDecoder& decoder, size_t need) {
+    size_t used = DecoderBuffered(decoder);
+    if (used == 0) {
+        decoder.head = decoder.tail = 0;
+    }
+    if (decoder.capacity - decoder.tail >= need) {
+        return;
+    }
+    if (decoder.head > 0 && decoder.capacity - used >= need) {
+        memmove(decoder.data, decoder.data + decoder.head, used);
+    } else {
+        size_t capacity = std::max(std::max(decoder.capacity * 2, used + need), DECODER_MIN_READ);
+        char* data = new char[capacity];
+        if (used > 0) {
+            memcpy(data, decoder.data + decoder.head, used);
+        }
+        delete[] decoder.data;
+        decoder.data = data;
+        decoder.capacity = capacity;
+    }
+    decoder.head = 0;
+    decoder.tail = used;
+}
+
+// Space to recv into, large enough for the rest of a pending frame
+char* DecoderWritable(FrameDecoder& decoder, size_t& len) {
+    size_t need = DECODER_MIN_READ;
+    if (decoder.pending > DecoderBuffered(decoder)) {
+        need = std::max(need, decoder.pending - DecoderBuffered(decoder));
+    }
+    DecoderReserve(decoder, need);
+    len = decoder.capacity - decoder.tail;
+    return decoder.data + decoder.tail;
+}
+
+void DecoderCommit(FrameDecoder& decoder, size_t len) {
+    decoder.tail += len;
+}
+
+void DecoderAppend(FrameDecoder& decoder, const char* src, size_t len) {
+    DecoderReserve(decoder, len);
+    memcpy(decoder.data + decoder.tail, src, len);
+    decoder.tail += len;
+}
+
+// Lend a received chunk to the decoder. Unless bytes of an earlier frame are
+// still buffered, frames are decoded in place; call DecoderSettle afterwards.
+void DecoderFeed(FrameDecoder& decoder, char* src, size_t len) {
+    if (DecoderBuffered(decoder) == 0) {
+        decoder.borrowed = src;
+        decoder.borrowedLen = len;
+        decoder.borrowedPos = 0;
+    } else {
+        DecoderAppend(decoder, src, len);
+    }
+}
+
+// Keep the undecoded rest of a lent chunk. An idle decoder gives its memory back.
+void DecoderSettle(FrameDecoder& decoder) {
+    if (decoder.borrowed != nullptr) {
+        DecoderAppend(decoder, decoder.borrowed + decoder.borrowedPos, decoder.borrowedLen - decoder.borrowedPos);
+        decoder.borrowed = nullptr;
+    }
+    if (DecoderBuffered(decoder) == 0) {
+        DecoderFree(decoder);
+    }
+}
+
+// Offset of the next possible frame start after a bad header. The last three
+// bytes are kept when nothing is found, they may be the start of a magic number.
+size_t FindResyncPoint(const char* data, size_t len, BOOL compact) {
+    const uint32_t magic = FRAME_MAGIC;
+    for (size_t i = 1; i < len; i++) {
+        if (compact && (uint8_t)data[i] == COMPACT_TAG) {
+            return i;
+        }
+        if (i + sizeof(magic) <= len && memcmp(data + i, &magic, sizeof(magic)) == 0) {
+            return i;
+        }
+    }
+    return len < sizeof(magic) ? 1 : len - sizeof(magic) + 1;
+}
+
+// Parse the header at data, returns its size, 0 if more bytes are needed or
+// -1 if it is not a valid header
+int ParseFrameHeader(const FrameDecoder& decoder, const char* data, size_t len, uint8_t& type, uint32_t& payloadLength) {
+    if (decoder.compact && len > 0 && (uint8_t)data[0] == COMPACT_TAG) {
+        int size = ParseCompactHeader(data, len, type, payloadLength);
+        return size > 0 && payloadLength > decoder.maxPayload ? -1 : size;
+    }
+    if (len < sizeof(MessageHeader)) {
+        return 0;
+    }
+    const MessageHeader* header = (const MessageHeader*)data;
+    if (!IsValidHeader(header, decoder.maxPayload)) {
+        return -1;
+    }
+    type = header->type;
+    payloadLength = header->payload_length;
+    return sizeof(MessageHeader);
+}
+
+DecodeStatus DecoderNext(FrameDecoder& decoder, FrameView& view) {
+    BOOL lent = decoder.borrowed != nullptr;
+    char* base = lent ? decoder.borrowed : decoder.data;
+    size_t& pos = lent ? decoder.borrowedPos : decoder.head;
+    size_t end = lent ? decoder.borrowedLen : decoder.tail;
+
+    while (end > pos) {
+        uint8_t type;
+        uint32_t payloadLength;
+        int headerSize = ParseFrameHeader(decoder, base + pos, end - pos, type, payloadLength);
+        if (headerSize == 0) {
+            break;
+        }
+        if (headerSize < 0) {
+            if (decoder.policy == DECODER_REJECT) {
+                return DECODE_ERROR;
+            }
+            size_t skip = FindResyncPoint(base + pos, end - pos, decoder.compact);
+            decoder.skipped += skip;
+            pos += skip;
+            continue;
+        }
+
+        size_t size = headerSize + (size_t)payloadLength;
+        if (end - pos < size) {
+            decoder.pending = size;
+            return DECODE_NEED_MORE;  // wait for the complete message to be received
+        }
+        view.frame = base + pos;
+        view.header = (uint8_t)view.frame[0] == COMPACT_TAG ? nullptr : (MessageHeader*)view.frame;
+        view.type = type;
+        view.payloadLength = payloadLength;
+        view.payload = view.frame + headerSize;
+        view.size = (uint32_t)size;
+        pos += size;
+        decoder.pending = 0;
+        return DECODE_FRAME;
+    }
+    decoder.pending = 0;
+    return DECODE_NEED_MORE;
+}
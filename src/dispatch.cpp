@@ -0,0 +1,553 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
+#include "platform.cpp"
+#include "logger.cpp"
+#include "protocol.cpp"
+#include "sharedframe.cpp"
+#include "framepool.cpp"
+#include "registry.cpp"
+#include "decoder.cpp"
+#include "compress.cpp"
+#include "history.cpp"
+#include "session.cpp"
+#include "metrics.cpp"
+#include "liveness.cpp"
+#include "ratelimit.cpp"
+
+// #define DEBUG
+
+// Server state and message dispatch
+// Shared by every I/O model: the thread-per-client handler and the epoll
+// reactor both reassemble frames and hand them to HandleLogin/HandleMessage.
+
+static std::atomic<uint32_t> userID{0};
+static std::atomic<BOOL> userIDsWrapped{FALSE};
+
+// Federated servers put their node ID in the top bits of every user ID, so
+// IDs stay unique across the cluster. 0 for a server on its own.
+const uint32_t NODE_ID_SHIFT = 24;
+const uint32_t NODE_ID_MAX = 255;
+static uint32_t localNodeId = 0;
+
+// User IDs are handed out in order. A federated node has 2^24 of them, a
+// server on its own 2^32. Once they have all been used the count starts
+// over, skipping IDs still logged in or held by a resumable session.
+uint32_t GetUserID() {
+    uint32_t mask = localNodeId == 0 ? UINT32_MAX : (1u << NODE_ID_SHIFT) - 1;
+    for (uint64_t tries = 0; tries <= mask; tries++) {
+        uint32_t local = userID++ & mask;
+        if (local == mask && !userIDsWrapped.exchange(TRUE)) {
+            LogPrintf(LOG_ERROR, L"All %llu user IDs have been handed out, reusing those no longer taken",
+                       (unsigned long long)mask + 1);
+        }
+        uint32_t id = (localNodeId << NODE_ID_SHIFT) | local;
+        if (!userIDsWrapped.load() || (!RegistryHasUser(id) && !SessionHolds(id))) {
+            return id;
+        }
+    }
+    // Every ID is taken, there is no telling them apart any more
+    return (localNodeId << NODE_ID_SHIFT) | (userID++ & mask);
+}
+
+std::vector<uint32_t> channelIds = {1024};
+
+// Limits applied to frames coming from clients, read by the server's
+// connection handlers and unused in tools that only borrow the dispatch code
+[[maybe_unused]] static uint32_t maxPayloadLength = MAX_PAYLOAD_LENGTH;
+[[maybe_unused]] static DecoderPolicy inboundPolicy = DECODER_REJECT;
+
+// Reactor shard owning the calling thread's connections, 0 outside the reactors
+static thread_local uint32_t currentShard = 0;
+
+// Payloads start right after the 9 byte header, so wide strings inside a frame
+// are not wchar_t aligned. Copy them out, clamped to the frame, before any wcs*
+// function touches them. text keeps its capacity between calls.
+void CopyWideString(const char* src, size_t maxChars, std::wstring& text) {
+    text.assign(maxChars, L'\0');
+    memcpy(&text[0], src, maxChars * sizeof(wchar_t));
+    text.resize(wcsnlen(text.c_str(), maxChars));
+}
+
+// Decode UTF-8 text from a frame, text keeps its capacity between calls
+void Utf8ToWideString(const char* src, size_t len, std::wstring& text) {
+    text.resize(WideMaxChars(len));
+    text.resize(Utf8ToWide(src, len, &text[0]));
+}
+
+// Features this server grants when a client asks for them
+const uint32_t SERVER_FEATURES = FEATURE_UTF8 | FEATURE_COMPACT | FEATURE_BATCH | FEATURE_PING |
+                                 (CompressionAvailable() ? FEATURE_DEFLATE : 0);
+
+// Compact recipients learn a sender's nickname from one USER_INFO frame.
+// Every connection remembers which users it has introduced its own user to;
+// all of a user's messages are handled by the thread owning its connection,
+// so the set needs no lock and the USER_INFO is always queued before the
+// first message. User IDs are never reused, entries only go stale when the
+// recipient disconnects, and the set is simply reset once it gets too big.
+const size_t INTRODUCTIONS_MAX = 64 * 1024;
+
+typedef struct {
+    std::unordered_set<uint32_t> users;
+} Introductions;
+
+// Returns TRUE if the recipient has not been introduced yet
+BOOL Introduce(Introductions& introductions, uint32_t recipientId) {
+    if (introductions.users.size() >= INTRODUCTIONS_MAX) {
+        introductions.users.clear();
+    }
+    return introductions.users.insert(recipientId).second;
+}
+
+// Scratch space reused by every message a thread handles
+static thread_local std::wstring messageScratch;
+static thread_local std::string utf8Scratch;
+static thread_local std::vector<Recipient> recipientScratch;
+static thread_local std::vector<SharedFrame*> partScratch;
+
+// Counts the bytes, callers count the frame before it is compressed
+int SocketSend(SOCKET sock, const char* buf, int len) {
+    int sent = send(sock, buf, len, 0);
+    MetricsAdd(METRIC_SYSCALLS);
+    if (sent > 0) {
+        MetricsAdd(METRIC_BYTES_OUT, sent);
+    }
+    return sent;
+}
+
+int BlockingSend(SOCKET sock, const char* buf, int len) {
+    MetricsFrameOut(buf, len);
+    return SocketSend(sock, buf, len);
+}
+
+void DirectDeliver(const Recipient& to, SharedFrame* frame) {
+    MetricsFrameOut(frame->data, frame->size);
+    if (to.features & FEATURE_DEFLATE) {
+        frame = CompressedForm(frame);
+    }
+    SocketSend(to.sock, frame->data, frame->size);
+}
+
+void NoFlush() {
+}
+
+// One send for all the parts, other threads write to the same socket
+int BlockingSendParts(SOCKET sock, SharedFrame* const* parts, size_t count) {
+    static thread_local std::string joined;
+    joined.clear();
+    for (size_t i = 0; i < count; i++) {
+        joined.append(parts[i]->data, parts[i]->size);
+    }
+    return BlockingSend(sock, joined.data(), (int)joined.size());
+}
+
+// How frames reach a client socket. Thread-per-client mode sends directly,
+// the reactor installs versions that queue on the non-blocking connection and
+// hand frames for users on other shards to that shard's mailbox. DeliverFrame
+// takes its own reference, so one encoded frame can go to every recipient.
+// SendFrameParts sends one frame made of several pieces, back to back.
+int (*SendFrame)(SOCKET sock, const char* buf, int len) = BlockingSend;
+int (*SendFrameParts)(SOCKET sock, SharedFrame* const* parts, size_t count) = BlockingSendParts;
+void (*DeliverFrame)(const Recipient& to, SharedFrame* frame) = DirectDeliver;
+void (*FlushDeliveries)() = NoFlush;
+
+BOOL IsLoginFrame(const MessageHeader* header) {
+    return header->type == MessageType::LOGIN || header->type == MessageType::LOGIN_UTF8;
+}
+
+// Put a resumed user back into its channels and replay what it missed in
+// the channels the client gave a LastSeq for
+void ResumeSession(SOCKET clientSock, uint32_t userId, const ParkedSession& session,
+                   const ResumeCursor* cursors, uint32_t cursorCount) {
+    std::vector<SharedFrame*>& parts = partScratch;
+    parts.clear();
+    uint64_t lost = 0;
+    for (uint32_t channelId : session.channels) {
+        const ResumeCursor* cursor = nullptr;
+        for (uint32_t i = 0; i < cursorCount && cursor == nullptr; i++) {
+            if (cursors[i].channel_id == channelId) {
+                cursor = &cursors[i];
+            }
+        }
+        if (cursor == nullptr) {
+            RegistryJoin(userId, channelId);
+        } else {
+            lost += HistoryRejoin(userId, channelId, cursor->last_seq, parts);
+        }
+    }
+    LogPrintf(LOG_INFO, L"Client %u resumed its session, %u channel(s), %llu missed message(s) no longer kept",
+               userId, (uint32_t)session.channels.size(), (unsigned long long)lost);
+    if (!parts.empty()) {
+        SendFrameParts(clientSock, parts.data(), parts.size());
+    }
+    for (SharedFrame* part : parts) {
+        ReleaseFrame(part);
+    }
+}
+
+// Register a logged in user and reply with LOGIN_SUCCESS, returns the user ID.
+// LOGIN_UTF8 negotiates features, a legacy LOGIN gets none. A LOGIN_UTF8
+// with a valid resume token gets its parked session back.
+uint32_t HandleLogin(SOCKET clientSock, MessageHeader* header, char* buffer, uint32_t& features) {
+
+    features = 0;
+    ParkedSession session;
+    BOOL resumed = FALSE;
+    const ResumeCursor* cursors = nullptr;
+    uint32_t cursorCount = 0;
+    std::wstring& nickname = messageScratch;
+    if (header->type == MessageType::LOGIN_UTF8) {
+        LoginUtf8Payload* payload = reinterpret_cast<LoginUtf8Payload*>(buffer + sizeof(MessageHeader));
+        features = (payload->features | FEATURE_UTF8) & SERVER_FEATURES;
+        uint32_t length = std::min<uint32_t>(payload->nickname_length, header->payload_length - sizeof(LoginUtf8Payload));
+        Utf8ToWideString(buffer + sizeof(MessageHeader) + sizeof(LoginUtf8Payload), length, nickname);
+        if (nickname.size() > 31) {
+            nickname.resize(31);
+        }
+        uint64_t resumeToken;
+        resumed = ParseLoginResume(buffer + sizeof(MessageHeader), header->payload_length, resumeToken, cursors, cursorCount) &&
+                  SessionResume(resumeToken, session);
+    } else {
+        CopyWideString(buffer + sizeof(MessageHeader), 31, nickname);
+    }
+    uint32_t userID = resumed ? session.userId : GetUserID();
+    RegistryAddUser(userID, clientSock, currentShard, features, nickname.c_str());
+    uint64_t token = header->type == MessageType::LOGIN_UTF8 ? SessionOpen(userID) : 0;
+    LogPrintf(LOG_INFO, L"Client logged in with nickname: %ls", nickname.c_str());
+
+    // Send login success message
+    uint8_t sizeClass;
+    uint32_t totalSize = LoginSuccessSize(channelIds.size());
+    char* buf = PoolAlloc(totalSize, sizeClass);
+    PackLoginSuccessInto(buf, totalSize, userID, channelIds.size(), channelIds.data(), features, token);
+
+#ifdef DEBUG
+    LogHex(L"Send: %s", buf, totalSize);
+#endif
+
+    SendFrame(clientSock, buf, totalSize);
+    PoolFree(buf, sizeClass);
+    if (resumed) {
+        ResumeSession(clientSock, userID, session, cursors, cursorCount);
+    }
+    return userID;
+}
+
+// Probe a quiet client, it answers with a PONG
+void SendPing(SOCKET clientSock, uint64_t token) {
+    FixedFrame<PING> ping = BuildFrame<PING>({token});
+    SendFrame(clientSock, (const char*)&ping, sizeof(ping));
+}
+
+// Refuse a connection whose first frame is not a login
+void RejectLogin(SOCKET clientSock) {
+    LogPrintf(LOG_ERROR, L"Client sent invalid login message");
+    // send error message
+    FixedFrame<ERR> reply = BuildFrame<ERR>({ERR_NOT_LOGGED_IN});
+    SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+}
+
+// Remove the user from all channels and from the user list, after DISCONNECT
+void RemoveUser(uint32_t userId) {
+    SessionClose(userId);
+    RegistryRemoveUser(userId);
+}
+
+// The user's connection went away without DISCONNECT, it may come back
+void DropUser(uint32_t userId) {
+    std::vector<uint32_t> channels = RegistryRemoveUser(userId);
+    SessionPark(userId, channels);
+}
+
+// How a recipient wants NEW_MSG encoded
+uint32_t WireFormat(uint32_t features) {
+    if (features & FEATURE_COMPACT) {
+        return FEATURE_COMPACT;
+    }
+    return features & FEATURE_UTF8;
+}
+
+// UTF-8 text of the message, shared by the history record and the UTF-8 based formats
+const std::string& MessageUtf8(const std::wstring& message) {
+    std::string& text = utf8Scratch;
+    text.resize(Utf8MaxBytes(message.size()));
+    text.resize(WideToUtf8(message.data(), message.size(), &text[0]));
+    return text;
+}
+
+// Encode a numbered message once per wire format its recipients use and hand
+// the frames to each of them. One pass per format, so a reactor's batch for
+// another shard carries a single frame. USER_INFO goes out before any compact
+// message.
+void FanOutMessage(Introductions& introductions, const std::vector<Recipient>& recipients, uint32_t userId,
+                   uint32_t channelId, uint64_t seq, const Nickname& nickname, const std::wstring& message,
+                   const std::string& text) {
+    SharedFrame* wideFrame = nullptr;
+    SharedFrame* utf8Frame = nullptr;
+    SharedFrame* userInfoFrame = nullptr;
+    SharedFrame* compactFrame = nullptr;
+    for (const Recipient& recipient : recipients) {
+        if (WireFormat(recipient.features) != 0) {
+            continue;
+        }
+        if (wideFrame == nullptr) {
+            wideFrame = NewFrame(NewMsgSize(message.c_str()));
+            PackNewMsgInto(wideFrame->data, wideFrame->size, userId, channelId, seq, nickname.wide, message.c_str());
+        }
+        DeliverFrame(recipient, wideFrame);
+    }
+    for (const Recipient& recipient : recipients) {
+        if (WireFormat(recipient.features) != FEATURE_UTF8) {
+            continue;
+        }
+        if (utf8Frame == nullptr) {
+            utf8Frame = NewFrame(NewMsgUtf8Size(nickname.utf8Length, text.size()));
+            PackNewMsgUtf8Into(utf8Frame->data, utf8Frame->size, userId, channelId, seq,
+                               nickname.utf8, nickname.utf8Length, text.data(), text.size());
+        }
+        DeliverFrame(recipient, utf8Frame);
+    }
+    for (const Recipient& recipient : recipients) {
+        if (WireFormat(recipient.features) != FEATURE_COMPACT || !Introduce(introductions, recipient.userId)) {
+            continue;
+        }
+        if (userInfoFrame == nullptr) {
+            userInfoFrame = NewFrame(UserInfoSize(userId, nickname.utf8Length));
+            PackUserInfoInto(userInfoFrame->data, userInfoFrame->size, userId, nickname.utf8, nickname.utf8Length);
+        }
+        DeliverFrame(recipient, userInfoFrame);
+    }
+    for (const Recipient& recipient : recipients) {
+        if (WireFormat(recipient.features) != FEATURE_COMPACT) {
+            continue;
+        }
+        if (compactFrame == nullptr) {
+            compactFrame = NewFrame(NewMsgCompactSize(userId, channelId, seq, text.size()));
+            PackNewMsgCompactInto(compactFrame->data, compactFrame->size, userId, channelId, seq, text.data(), text.size());
+        }
+        DeliverFrame(recipient, compactFrame);
+    }
+    FlushDeliveries();
+    SharedFrame* frames[] = {wideFrame, utf8Frame, userInfoFrame, compactFrame};
+    for (SharedFrame* frame : frames) {
+        if (frame != nullptr) {
+            ReleaseFrame(frame);
+        }
+    }
+}
+
+void NoForward(uint32_t, uint32_t, const Nickname&, const std::string&) {
+}
+
+// Hands a local user's message to the other nodes of a federation
+void (*ForwardMessage)(uint32_t userId, uint32_t channelId, const Nickname& nickname,
+                       const std::string& text) = NoForward;
+
+// Number a message, sent here or forwarded by another node, and fan it out
+// to the channel's members on this server. It is encoded at most once per
+// wire format, and only for formats some recipient actually uses.
+void PublishMessage(Introductions& introductions, uint32_t userId, uint32_t channelId, const Nickname& nickname,
+                    const std::wstring& message, const std::string& text) {
+
+    // Number the message before the recipients are looked up, a resuming
+    // user is either among them or gets the message replayed.
+    // channel 0 is the global channel, every logged in user is a member.
+    uint64_t seq = HistoryAppend(channelId, userId, nickname.utf8, nickname.utf8Length, text.data(), text.size());
+
+    // Snapshot the recipients so nothing is sent while holding a lock
+    std::vector<Recipient>& recipients = recipientScratch;
+    recipients.clear();
+    RegistryRecipients(channelId, userId, recipients);
+
+    LogPrintf(LOG_INFO, L"%ls (%d) say to channel %d: %ls",
+                nickname.wide, userId, channelId, message.c_str());
+
+    uint64_t start = MetricsNowNs();
+    FanOutMessage(introductions, recipients, userId, channelId, seq, nickname, message, text);
+    MetricsRecord(HISTOGRAM_FANOUT_SIZE, recipients.size());
+    MetricsRecord(HISTOGRAM_FANOUT_LATENCY, MetricsNowNs() - start);
+}
+
+// Fan a chat message from a local user out to the channel, here and on
+// every other node with members in it
+void BroadcastMessage(Introductions& introductions, uint32_t userId, uint32_t channelId, const std::wstring& message) {
+    Nickname nickname = {};
+    RegistryNickname(userId, nickname);
+    const std::string& text = MessageUtf8(message);
+    PublishMessage(introductions, userId, channelId, nickname, message, text);
+    ForwardMessage(userId, channelId, nickname, text);
+}
+
+// Check a chat message before anything is done with it: only members send to
+// a channel, which is all that keeps channel IDs nobody joined from getting a
+// history, and sendRate is the sending connection's bucket. Refused messages
+// get an ERR, over the rate with how long to wait.
+BOOL AdmitMessage(SOCKET clientSock, uint64_t& sendRate, uint32_t userId, uint32_t channelId) {
+    if (!RegistryIsMember(userId, channelId)) {
+        LogPrintf(LOG_DEBUG, L"Client %u sent to channel %u without joining it", userId, channelId);
+        FixedFrame<ERR> reply = BuildFrame<ERR>({ERR_NOT_PERMITTED});
+        SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+        return FALSE;
+    }
+    uint32_t waitMs = RateTake(sendRate, channelId, RateNowUs());
+    if (waitMs == 0) {
+        return TRUE;
+    }
+    MetricsAdd(METRIC_RATE_LIMITED);
+    LogPrintf(LOG_DEBUG, L"Client %u is sending to channel %u too fast, retry in %u ms", userId, channelId, waitMs);
+    char reply[RATE_LIMITED_SIZE];
+    SendFrame(clientSock, reply, PackRateLimitedInto(reply, sizeof(reply), waitMs));
+    return FALSE;
+}
+
+// Metrics are only for the machine the server runs on
+BOOL IsLoopbackPeer(SOCKET sock) {
+    sockaddr_in addr;
+    socklen_t addrSize = sizeof(addr);
+    if (getpeername(sock, (SOCKADDR*)&addr, &addrSize) == SOCKET_ERROR || addr.sin_family != AF_INET) {
+        return FALSE;
+    }
+    return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+// Answer STATS with every counter and histogram summary, summed over threads
+void SendStats(SOCKET clientSock) {
+    static thread_local std::vector<std::pair<std::string, uint64_t>> entries;
+    entries.clear();
+    MetricsEntries(entries);
+    uint32_t entryBytes = 0;
+    for (const auto& entry : entries) {
+        entryBytes += StatsEntrySize((uint8_t)entry.first.size());
+    }
+    SharedFrame* frame = NewFrame(sizeof(MessageHeader) + sizeof(StatsResultPayload) + entryBytes);
+    char* out = PackStatsResultHeader(frame->data, (uint32_t)entries.size(), entryBytes);
+    for (const auto& entry : entries) {
+        out = PackStatsEntry(out, entry.first.data(), (uint8_t)entry.first.size(), entry.second);
+    }
+    SendFrame(clientSock, frame->data, frame->size);
+    ReleaseFrame(frame);
+}
+
+// Handle one complete frame from the logged in client userId, introductions
+// and the sendRate bucket belong to its connection. The user ID inside a
+// payload is ignored, a connection only ever acts as its own user, which also
+// keeps everything done to one user on the thread owning its connection.
+// Returns FALSE once the client has disconnected and its socket should be
+// closed.
+BOOL HandleMessage(SOCKET clientSock, uint32_t userId, Introductions& introductions, uint64_t& sendRate,
+                   MessageHeader* header, char* buffer) {
+    size_t frameSize = sizeof(MessageHeader) + header->payload_length;
+
+    switch (header->type) {
+    case MessageType::JOIN_CHANNEL:
+    {
+        JoinChannelPayload request;
+        if (!DecodeFrame<JOIN_CHANNEL>(buffer, frameSize, request)) {
+            break;
+        }
+        LogPrintf(LOG_INFO, L"Client %d joined channel %d", userId, request.channel_id);
+        RegistryJoin(userId, request.channel_id);
+
+        // Send join channel success message
+        FixedFrame<JOIN_CHANNEL_SUCCESS> reply = BuildFrame<JOIN_CHANNEL_SUCCESS>({userId, request.channel_id});
+        SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+        break;
+    }
+    case MessageType::LEAVE_CHANNEL:
+    {
+        LeaveChannelPayload request;
+        if (!DecodeFrame<LEAVE_CHANNEL>(buffer, frameSize, request)) {
+            break;
+        }
+        LogPrintf(LOG_INFO, L"Client %d left channel %d", userId, request.channel_id);
+        RegistryLeave(userId, request.channel_id);
+
+        // Send leave channel success message
+        FixedFrame<LEAVE_CHANNEL_SUCCESS> reply = BuildFrame<LEAVE_CHANNEL_SUCCESS>({userId, request.channel_id});
+        SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+        break;
+    }
+    case MessageType::SEND_MSG:
+    {
+        SendMsgPayload* payload = reinterpret_cast<SendMsgPayload*>(buffer + sizeof(MessageHeader));
+        if (header->payload_length < sizeof(SendMsgPayload) ||
+            !AdmitMessage(clientSock, sendRate, userId, payload->channel_id)) {
+            break;
+        }
+        CopyWideString(buffer + sizeof(MessageHeader) + sizeof(SendMsgPayload),
+                       (header->payload_length - sizeof(SendMsgPayload)) / sizeof(wchar_t), messageScratch);
+        BroadcastMessage(introductions, userId, payload->channel_id, messageScratch);
+        break;
+    }
+    case MessageType::SEND_MSG_UTF8:
+    {
+        SendMsgUtf8Payload* payload = reinterpret_cast<SendMsgUtf8Payload*>(buffer + sizeof(MessageHeader));
+        if (!AdmitMessage(clientSock, sendRate, userId, payload->channel_id)) {
+            break;
+        }
+        uint32_t length = std::min<uint32_t>(payload->msg_length, header->payload_length - sizeof(SendMsgUtf8Payload));
+        Utf8ToWideString(buffer + sizeof(MessageHeader) + sizeof(SendMsgUtf8Payload), length, messageScratch);
+        BroadcastMessage(introductions, userId, payload->channel_id, messageScratch);
+        break;
+    }
+    case MessageType::HISTORY:
+    {
+        HistoryPayload request;
+        if (!DecodeFrame<HISTORY>(buffer, frameSize, request)) {
+            break;
+        }
+        std::vector<SharedFrame*>& parts = partScratch;
+        parts.clear();
+        HistoryPage(request.channel_id, request.before_seq, request.max_count, parts);
+        SendFrameParts(clientSock, parts.data(), parts.size());
+        for (SharedFrame* part : parts) {
+            ReleaseFrame(part);
+        }
+        break;
+    }
+    case MessageType::STATS:
+    {
+        StatsPayload request;
+        if (!DecodeFrame<STATS>(buffer, frameSize, request)) {
+            break;
+        }
+        if (!IsLoopbackPeer(clientSock)) {
+            LogPrintf(LOG_WARNING, L"Client %d asked for stats from a remote address", userId);
+            FixedFrame<ERR> reply = BuildFrame<ERR>({ERR_NOT_PERMITTED});
+            SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+            break;
+        }
+        SendStats(clientSock);
+        break;
+    }
+    case MessageType::PING:
+    {
+        PingPayload request;
+        if (DecodeFrame<PING>(buffer, frameSize, request)) {
+            FixedFrame<PONG> reply = BuildFrame<PONG>({request.token});
+            SendFrame(clientSock, (const char*)&reply, sizeof(reply));
+        }
+        break;
+    }
+    case MessageType::PONG:
+        // the frame itself was the sign of life
+        break;
+    case MessageType::DISCONNECT:
+    {
+        DisconnectPayload request;
+        if (DecodeFrame<DISCONNECT>(buffer, frameSize, request)) {
+            LogPrintf(LOG_INFO, L"Client %d disconnected", userId);
+            RemoveUser(userId);
+        }
+        return FALSE;
+    }
+    default:
+        LogPrintf(LOG_ERROR, L"Message type not supported");
+        break;
+    }
+
+    return TRUE;
+}
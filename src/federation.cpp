@@ -0,0 +1,582 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include "platform.cpp"
+#include "logger.cpp"
+#include "protocol.cpp"
+#include "sharedframe.cpp"
+#include "registry.cpp"
+#include "decoder.cpp"
+#include "dispatch.cpp"
+
+// Federation
+// Several servers, each with its own node ID, share their channels. Every
+// pair of nodes is connected by one TCP link. Over a link each node
+// announces the channels it has local members in, the whole list first and
+// then every change, and a message sent by a local user is forwarded once
+// to each node that announced its channel, however many of that node's
+// users are in it. The receiving node numbers the message in its own
+// history and fans it out to its own members, it never forwards it again.
+// User IDs carry the node ID, so they are unique in the cluster.
+//
+// Every link has a reader thread, the one that set the link up, and a
+// writer thread sending from a queue, so a slow peer never blocks the
+// reactors. A peer that falls too far behind loses the link; the side that
+// dialed redials it, the announcements start over and the messages in
+// between are lost.
+//
+// The peer port only listens on --peer-bind, the loopback interface unless
+// told otherwise, and with a --peer-key both ends of a link check that the
+// other's PEER_HELLO carries the same key. The key travels in the clear, it
+// keeps strangers out but not anyone who can watch the peer network.
+
+const uint32_t PEER_MAX_PAYLOAD = 16 * 1024 * 1024;
+const size_t PEER_QUEUE_BYTES = 64 * 1024 * 1024;  // unsent bytes before a link is dropped
+const uint32_t PEER_RETRY_MS = 1000;
+const size_t PEER_SENDERS_MAX = 4096;  // remote senders a link remembers introductions for
+
+const uint32_t PEER_KEY_MAX = 255;
+
+typedef struct {
+    int port;  // where other nodes connect, 0 = do not listen
+    in_addr bindAddress;  // the interface the peer port listens on
+    std::string key;  // pre-shared by every node of the cluster, empty = none
+    std::vector<sockaddr_in> peers;  // nodes to dial
+} FederationConfig;
+
+static FederationConfig federationConfig = {0, {htonl(INADDR_LOOPBACK)}, "", {}};
+
+typedef struct PeerLink {
+    SOCKET sock;
+    uint32_t nodeId;  // the peer's, 0 until its PEER_HELLO arrived
+    BOOL dialed;  // this node connected to the peer
+    std::atomic<int> refs;  // reader and writer thread
+
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::deque<SharedFrame*> queue;
+    size_t queuedBytes;
+    BOOL closed;
+
+    std::unordered_set<uint32_t> channels;  // announced by the peer, under federationLock
+    std::unordered_map<uint32_t, Introductions> senders;  // reader thread only
+} PeerLink;
+
+static std::shared_mutex federationLock;  // the links and the channels announced over them
+static std::vector<PeerLink*> peerLinks;  // established, one per node
+static std::unordered_set<uint32_t> localChannels;  // channels with members on this node
+
+// Text scratch of the reader threads
+static thread_local std::string peerTextScratch;
+static thread_local std::wstring peerNicknameScratch;
+
+// "a.b.c.d:port"
+BOOL ParsePeerAddress(const char* text, sockaddr_in& addr) {
+    const char* colon = strrchr(text, ':');
+    if (colon == nullptr) {
+        return FALSE;
+    }
+    std::string host(text, colon - text);
+    int port = atoi(colon + 1);
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    addr.sin_port = htons((uint16_t)port);
+    return addr.sin_addr.s_addr != INADDR_NONE && port > 0 && port < 65536;
+}
+
+BOOL SendAll(SOCKET sock, const char* data, size_t size) {
+    while (size > 0) {
+        int sent = SocketSend(sock, data, (int)std::min<size_t>(size, INT32_MAX));
+        if (sent <= 0) {
+            if (sent < 0 && WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            return FALSE;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return TRUE;
+}
+
+void ReleaseLink(PeerLink* link) {
+    if (--link->refs == 0) {
+        for (SharedFrame* frame : link->queue) {
+            ReleaseFrame(frame);
+        }
+        closesocket(link->sock);
+        delete link;
+    }
+}
+
+// Stop both threads of the link, the socket is closed with the last of them
+void CloseLink(PeerLink* link) {
+    std::lock_guard<std::mutex> lock(link->queueLock);
+    if (!link->closed) {
+        link->closed = TRUE;
+        shutdown(link->sock, SD_BOTH);
+    }
+    link->queueReady.notify_one();
+}
+
+// Queue a reference to frame for the writer
+void LinkSend(PeerLink* link, SharedFrame* frame) {
+    std::unique_lock<std::mutex> lock(link->queueLock);
+    if (link->closed) {
+        return;
+    }
+    if (link->queuedBytes + frame->size > PEER_QUEUE_BYTES) {
+        lock.unlock();
+        LogPrintf(LOG_WARNING, L"Node %u fell behind, dropping its link", link->nodeId);
+        CloseLink(link);
+        return;
+    }
+    link->queue.push_back(AcquireFrame(frame));
+    link->queuedBytes += frame->size;
+    if (link->queue.size() == 1) {
+        link->queueReady.notify_one();
+    }
+}
+
+// Everything queued since the last send leaves in one write
+DWORD WINAPI PeerWriter(LPVOID param) {
+    PeerLink* link = (PeerLink*)param;
+    std::deque<SharedFrame*> frames;
+    std::string joined;
+    BOOL sent = TRUE;
+    while (sent) {
+        {
+            std::unique_lock<std::mutex> lock(link->queueLock);
+            link->queueReady.wait(lock, [link] { return link->closed || !link->queue.empty(); });
+            if (link->closed) {
+                break;
+            }
+            frames.swap(link->queue);
+            link->queuedBytes = 0;
+        }
+        joined.clear();
+        for (SharedFrame* frame : frames) {
+            MetricsFrameOut(frame->data, frame->size);
+            joined.append(frame->data, frame->size);
+            ReleaseFrame(frame);
+        }
+        frames.clear();
+        sent = SendAll(link->sock, joined.data(), joined.size());
+    }
+    CloseLink(link);
+    ReleaseLink(link);
+    return 0;
+}
+
+// When two links to the same node come up both ends keep the one dialed by
+// the lower node ID, otherwise the newer link replaces the old one
+BOOL PreferLink(const PeerLink* link, const PeerLink* other) {
+    uint32_t lower = std::min(localNodeId, link->nodeId);
+    uint32_t dialer = link->dialed ? localNodeId : link->nodeId;
+    uint32_t otherDialer = other->dialed ? localNodeId : other->nodeId;
+    return dialer == lower || otherDialer != lower;
+}
+
+// Make the link the one to its node, start its writer and announce our
+// channels over it. Returns FALSE if the node is linked already.
+BOOL RegisterLink(PeerLink* link) {
+    SharedFrame* summary;
+    {
+        std::unique_lock<std::shared_mutex> lock(federationLock);
+        for (size_t i = 0; i < peerLinks.size(); i++) {
+            PeerLink* other = peerLinks[i];
+            if (other->nodeId != link->nodeId) {
+                continue;
+            }
+            if (!PreferLink(link, other)) {
+                LogPrintf(LOG_DEBUG, L"Already linked to node %u", link->nodeId);
+                return FALSE;
+            }
+            peerLinks.erase(peerLinks.begin() + i);
+            CloseLink(other);
+            break;
+        }
+
+        link->refs++;
+        DWORD threadId;
+        HANDLE thread = CreateThread(NULL, 0, PeerWriter, link, 0, &threadId);
+        if (thread == NULL) {
+            link->refs--;
+            return FALSE;
+        }
+        CloseHandle(thread);
+        peerLinks.push_back(link);
+
+        // Under the lock, so no change is announced before the summary
+        std::vector<uint32_t> channels(localChannels.begin(), localChannels.end());
+        summary = NewFrame(PeerChannelsSize((uint32_t)channels.size()));
+        PackPeerChannelsInto(summary->data, summary->size, channels.data(), (uint32_t)channels.size());
+        LinkSend(link, summary);
+    }
+    ReleaseFrame(summary);
+    LogPrintf(LOG_INFO, L"Linked to node %u", link->nodeId);
+    return TRUE;
+}
+
+// TRUE if a link to the node is up, whichever side dialed it
+BOOL NodeLinked(uint32_t nodeId) {
+    std::shared_lock<std::shared_mutex> lock(federationLock);
+    for (PeerLink* link : peerLinks) {
+        if (link->nodeId == nodeId) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Compare the key of a PEER_HELLO with ours, in the same time wherever they differ
+BOOL PeerKeyMatches(const FrameView& view) {
+    const char* key = nullptr;
+    uint8_t keyBytes = 0;
+    if (!ParsePeerHelloKey(view.frame, view.size, key, keyBytes) &&
+        view.payloadLength != sizeof(PeerHelloPayload)) {
+        return FALSE;
+    }
+    const std::string& ours = federationConfig.key;
+    uint8_t differ = keyBytes != ours.size() ? 1 : 0;
+    for (size_t i = 0; i < ours.size(); i++) {
+        differ |= (uint8_t)(ours[i] ^ (i < keyBytes ? key[i] : 0));
+    }
+    return differ == 0;
+}
+
+void UnregisterLink(PeerLink* link) {
+    std::unique_lock<std::shared_mutex> lock(federationLock);
+    auto found = std::find(peerLinks.begin(), peerLinks.end(), link);
+    if (found != peerLinks.end()) {
+        peerLinks.erase(found);
+        LogPrintf(LOG_INFO, L"Lost the link to node %u", link->nodeId);
+    }
+}
+
+// Number and fan out a message a user of the peer sent
+void ReceivePeerMessage(PeerLink* link, const FrameView& view) {
+    const PeerMsgPayload* payload = reinterpret_cast<const PeerMsgPayload*>(view.payload);
+    if (view.payloadLength < sizeof(PeerMsgPayload) ||
+        sizeof(PeerMsgPayload) + (uint64_t)payload->nickname_length + payload->msg_length > view.payloadLength) {
+        return;
+    }
+    uint32_t userId = payload->user_id;
+    if (userId >> NODE_ID_SHIFT != link->nodeId) {
+        LogPrintf(LOG_WARNING, L"Node %u forwarded a message of user %u, not one of its own", link->nodeId, userId);
+        return;
+    }
+    // Sent before the peer heard that the channel's last member here left
+    {
+        std::shared_lock<std::shared_mutex> lock(federationLock);
+        if (localChannels.count(payload->channel_id) == 0) {
+            return;
+        }
+    }
+    const char* nicknameUtf8 = view.payload + sizeof(PeerMsgPayload);
+    const char* text = nicknameUtf8 + payload->nickname_length;
+
+    Nickname nickname = {};
+    nickname.utf8Length = (uint8_t)std::min<uint32_t>(payload->nickname_length, NICKNAME_UTF8_BYTES);
+    memcpy(nickname.utf8, nicknameUtf8, nickname.utf8Length);
+    Utf8ToWideString(nickname.utf8, nickname.utf8Length, peerNicknameScratch);
+    size_t nicknameChars = std::min<size_t>(peerNicknameScratch.size(), 31);
+    memcpy(nickname.wide, peerNicknameScratch.data(), nicknameChars * sizeof(wchar_t));
+    nickname.wide[nicknameChars] = L'\0';
+
+    peerTextScratch.assign(text, payload->msg_length);
+    Utf8ToWideString(text, payload->msg_length, messageScratch);
+
+    auto sender = link->senders.find(userId);
+    if (sender == link->senders.end()) {
+        if (link->senders.size() >= PEER_SENDERS_MAX) {
+            link->senders.clear();
+        }
+        sender = link->senders.emplace(userId, Introductions()).first;
+    }
+    RateCharge(payload->channel_id, RateNowUs());
+    PublishMessage(sender->second, userId, payload->channel_id, nickname, messageScratch, peerTextScratch);
+}
+
+// Returns FALSE when the link has to go
+BOOL HandlePeerFrame(PeerLink* link, const FrameView& view) {
+    // The first frame has to be the hello
+    if (link->nodeId == 0) {
+        PeerHelloPayload hello;
+        if (!DecodeFrame<PEER_HELLO>(view.frame, view.size, hello) || hello.node_id == 0 ||
+            hello.node_id > NODE_ID_MAX || hello.node_id == localNodeId) {
+            LogPrintf(LOG_WARNING, L"Peer did not introduce itself with a valid node ID");
+            return FALSE;
+        }
+        if (!PeerKeyMatches(view)) {
+            LogPrintf(LOG_WARNING, L"Peer claiming to be node %u did not present the cluster's key", hello.node_id);
+            return FALSE;
+        }
+        link->nodeId = hello.node_id;
+        return RegisterLink(link);
+    }
+
+    switch (view.type) {
+    case MessageType::PEER_CHANNELS:
+    {
+        const PeerChannelsPayload* payload = reinterpret_cast<const PeerChannelsPayload*>(view.payload);
+        uint32_t count = std::min<uint32_t>(payload->count,
+                                            (view.payloadLength - sizeof(PeerChannelsPayload)) / sizeof(uint32_t));
+        const char* channels = view.payload + sizeof(PeerChannelsPayload);
+        std::unique_lock<std::shared_mutex> lock(federationLock);
+        link->channels.clear();
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t channelId;
+            memcpy(&channelId, channels + i * sizeof(uint32_t), sizeof(channelId));
+            link->channels.insert(channelId);
+        }
+        break;
+    }
+    case MessageType::PEER_SUBSCRIBE:
+    {
+        PeerSubscribePayload request;
+        if (DecodeFrame<PEER_SUBSCRIBE>(view.frame, view.size, request)) {
+            std::unique_lock<std::shared_mutex> lock(federationLock);
+            link->channels.insert(request.channel_id);
+        }
+        break;
+    }
+    case MessageType::PEER_UNSUBSCRIBE:
+    {
+        PeerUnsubscribePayload request;
+        if (DecodeFrame<PEER_UNSUBSCRIBE>(view.frame, view.size, request)) {
+            std::unique_lock<std::shared_mutex> lock(federationLock);
+            link->channels.erase(request.channel_id);
+        }
+        break;
+    }
+    case MessageType::PEER_MSG:
+        ReceivePeerMessage(link, view);
+        break;
+    default:
+        break;
+    }
+    return TRUE;
+}
+
+// Run a connected link until it drops, on the thread that dialed or accepted
+// it. Returns the peer's node ID, 0 if it never said hello.
+uint32_t RunLink(SOCKET sock, BOOL dialed) {
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable));
+    char hello[PEER_HELLO_SIZE_MAX];
+    uint32_t helloSize = PackPeerHelloInto(hello, sizeof(hello), localNodeId, federationConfig.key.data(),
+                                           (uint8_t)federationConfig.key.size());
+    MetricsFrameOut(hello, helloSize);
+    if (!SendAll(sock, hello, helloSize)) {
+        closesocket(sock);
+        return 0;
+    }
+
+    PeerLink* link = new PeerLink();
+    link->sock = sock;
+    link->nodeId = 0;
+    link->dialed = dialed;
+    link->refs = 1;
+    link->queuedBytes = 0;
+    link->closed = FALSE;
+
+    FrameDecoder decoder;
+    FrameView view;
+    DecodeStatus status = DECODE_NEED_MORE;
+    DecoderInit(decoder, PEER_MAX_PAYLOAD, DECODER_REJECT);
+    BOOL open = TRUE;
+    while (open) {
+        size_t space;
+        char* dst = DecoderWritable(decoder, space);
+        int recvLen = recv(sock, dst, (int)space, 0);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (recvLen <= 0) {
+            if (recvLen < 0 && WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            break;
+        }
+        DecoderCommit(decoder, recvLen);
+        MetricsAdd(METRIC_BYTES_IN, recvLen);
+        while (open && (status = DecoderNext(decoder, view)) == DECODE_FRAME) {
+            MetricsFrameIn(view.type);
+            open = HandlePeerFrame(link, view);
+        }
+        if (status == DECODE_ERROR) {
+            MetricsAdd(METRIC_DECODE_ERRORS);
+            LogPrintf(LOG_ERROR, L"Node %u sent a malformed frame", link->nodeId);
+            break;
+        }
+    }
+
+    uint32_t nodeId = link->nodeId;
+    UnregisterLink(link);
+    DecoderFree(decoder);
+    CloseLink(link);
+    ReleaseLink(link);
+    return nodeId;
+}
+
+// Keep a link to one configured peer up, redialing after it drops. While the
+// peer is linked through a connection it dialed itself there is nothing to
+// do, a second link would only be dropped again by both ends.
+DWORD WINAPI PeerDialer(LPVOID param) {
+    sockaddr_in addr = federationConfig.peers[(size_t)(intptr_t)param];
+    BOOL reported = FALSE;
+    uint32_t nodeId = 0;  // the peer's, once a link told us
+    while (true) {
+        if (nodeId != 0 && NodeLinked(nodeId)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(PEER_RETRY_MS));
+            continue;
+        }
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock != INVALID_SOCKET && connect(sock, (SOCKADDR*)&addr, sizeof(addr)) != SOCKET_ERROR) {
+            uint32_t linked = RunLink(sock, TRUE);
+            nodeId = linked != 0 ? linked : nodeId;
+            reported = FALSE;
+        } else {
+            if (!reported) {
+                LogPrintf(LOG_WARNING, L"Unable to reach peer %s:%d, error code: %d", inet_ntoa(addr.sin_addr),
+                          ntohs(addr.sin_port), WSAGetLastError());
+                reported = TRUE;
+            }
+            if (sock != INVALID_SOCKET) {
+                closesocket(sock);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(PEER_RETRY_MS));
+    }
+    return 0;
+}
+
+DWORD WINAPI PeerAccepted(LPVOID param) {
+    RunLink((SOCKET)(intptr_t)param, FALSE);
+    return 0;
+}
+
+DWORD WINAPI PeerListener(LPVOID param) {
+    SOCKET listenSock = (SOCKET)(intptr_t)param;
+    while (true) {
+        SOCKET sock = accept(listenSock, nullptr, nullptr);
+        if (sock == INVALID_SOCKET) {
+            if (WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            break;
+        }
+        DWORD threadId;
+        HANDLE thread = CreateThread(NULL, 0, PeerAccepted, (LPVOID)(intptr_t)sock, 0, &threadId);
+        if (thread == NULL) {
+            closesocket(sock);
+            continue;
+        }
+        CloseHandle(thread);
+    }
+    closesocket(listenSock);
+    return 0;
+}
+
+// Registry hook: tell every linked node when a channel starts or stops
+// having members here
+void AnnounceChannel(uint32_t channelId, BOOL active) {
+    SharedFrame* frame = NewFrame(FixedFrame<PEER_SUBSCRIBE>::SIZE);
+    PackPeerSubscribeInto(frame->data, frame->size, channelId, active);
+    {
+        std::unique_lock<std::shared_mutex> lock(federationLock);
+        if (active) {
+            localChannels.insert(channelId);
+        } else {
+            localChannels.erase(channelId);
+        }
+        for (PeerLink* link : peerLinks) {
+            LinkSend(link, frame);
+        }
+    }
+    ReleaseFrame(frame);
+}
+
+// Dispatch hook: one PEER_MSG per node with members in the channel
+void ForwardToPeers(uint32_t userId, uint32_t channelId, const Nickname& nickname, const std::string& text) {
+    SharedFrame* frame = nullptr;
+    {
+        std::shared_lock<std::shared_mutex> lock(federationLock);
+        for (PeerLink* link : peerLinks) {
+            if (link->channels.count(channelId) == 0) {
+                continue;
+            }
+            if (frame == nullptr) {
+                frame = NewFrame(PeerMsgSize(nickname.utf8Length, (uint32_t)text.size()));
+                PackPeerMsgInto(frame->data, frame->size, userId, channelId, nickname.utf8, nickname.utf8Length,
+                                text.data(), (uint32_t)text.size());
+            }
+            LinkSend(link, frame);
+        }
+    }
+    if (frame != nullptr) {
+        ReleaseFrame(frame);
+    }
+}
+
+// Install the hooks, listen for other nodes and dial the configured ones.
+// Nothing to do without a node ID.
+BOOL FederationStart() {
+    if (localNodeId == 0) {
+        return TRUE;
+    }
+    ChannelActivity = AnnounceChannel;
+    ForwardMessage = ForwardToPeers;
+
+    if (federationConfig.port != 0) {
+        SOCKET listenSock = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSock == INVALID_SOCKET) {
+            LogPrintf(LOG_ERROR, L"socket failed with error code: %d", WSAGetLastError());
+            return FALSE;
+        }
+        int enable = 1;
+        setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable));
+        sockaddr_in addr;
+        ZeroMemory(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr = federationConfig.bindAddress;
+        addr.sin_port = htons((uint16_t)federationConfig.port);
+        if (bind(listenSock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listenSock, SOMAXCONN) == SOCKET_ERROR) {
+            LogPrintf(LOG_ERROR, L"Unable to listen for peers on port %d, error code: %d", federationConfig.port,
+                      WSAGetLastError());
+            closesocket(listenSock);
+            return FALSE;
+        }
+        DWORD threadId;
+        HANDLE thread = CreateThread(NULL, 0, PeerListener, (LPVOID)(intptr_t)listenSock, 0, &threadId);
+        if (thread == NULL) {
+            closesocket(listenSock);
+            return FALSE;
+        }
+        CloseHandle(thread);
+    }
+
+    for (size_t i = 0; i < federationConfig.peers.size(); i++) {
+        DWORD threadId;
+        HANDLE thread = CreateThread(NULL, 0, PeerDialer, (LPVOID)(intptr_t)i, 0, &threadId);
+        if (thread == NULL) {
+            return FALSE;
+        }
+        CloseHandle(thread);
+    }
+    LogPrintf(LOG_INFO, L"Federation node %u, peer port %s:%d%s, dialing %u peer(s)", localNodeId,
+              inet_ntoa(federationConfig.bindAddress), federationConfig.port,
+              federationConfig.key.empty() ? "" : " with a key", (uint32_t)federationConfig.peers.size());
+    return TRUE;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+// Frame pool
+// Size-classed slabs for encoded frames, cached per thread so taking and
+// returning one is a vector push/pop instead of a trip through the heap. A
+// broadcast is usually finished by another reactor than the one that encoded
+// it, its slab then simply joins the cache of the thread that freed it. Each
+// cache holds a bounded number of bytes per class, anything beyond that or
+// larger than the biggest class goes back to the heap.
+
+const uint32_t FRAME_POOL_CLASSES = 5;  // 256 B, 1 KiB, 4 KiB, 16 KiB, 64 KiB
+const uint32_t FRAME_POOL_SMALLEST = 256;
+const uint8_t FRAME_POOL_UNPOOLED = FRAME_POOL_CLASSES;  // too large, plain new[]
+const size_t FRAME_POOL_CACHE_BYTES = 256 * 1024;  // per class and thread
+
+struct FramePoolCache {
+    std::vector<char*> slabs[FRAME_POOL_CLASSES];
+
+    // Threads come and go in thread-per-client mode, give their slabs back
+    ~FramePoolCache() {
+        for (uint32_t i = 0; i < FRAME_POOL_CLASSES; i++) {
+            for (char* slab : slabs[i]) {
+                delete[] slab;
+            }
+        }
+    }
+};
+
+static thread_local FramePoolCache framePool;
+
+uint32_t PoolClassSize(uint8_t sizeClass) {
+    return FRAME_POOL_SMALLEST << (2 * sizeClass);
+}
+
+uint8_t PoolClassOf(size_t size) {
+    for (uint8_t i = 0; i < FRAME_POOL_CLASSES; i++) {
+        if (size <= PoolClassSize(i)) {
+            return i;
+        }
+    }
+    return FRAME_POOL_UNPOOLED;
+}
+
+// A slab of at least size bytes, hand it back with PoolFree and the same class
+char* PoolAlloc(size_t size, uint8_t& sizeClass) {
+    sizeClass = PoolClassOf(size);
+    if (sizeClass == FRAME_POOL_UNPOOLED) {
+        return new char[size];
+    }
+    std::vector<char*>& slabs = framePool.slabs[sizeClass];
+    if (slabs.empty()) {
+        return new char[PoolClassSize(sizeClass)];
+    }
+    char* slab = slabs.back();
+    slabs.pop_back();
+    return slab;
+}
+
+void PoolFree(char* slab, uint8_t sizeClass) {
+    if (sizeClass == FRAME_POOL_UNPOOLED) {
+        delete[] slab;
+        return;
+    }
+    std::vector<char*>& slabs = framePool.slabs[sizeClass];
+    if (slabs.size() * PoolClassSize(sizeClass) >= FRAME_POOL_CACHE_BYTES) {
+        delete[] slab;
+        return;
+    }
+    slabs.push_back(slab);
+}
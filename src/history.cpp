@@ -0,0 +1,693 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include "platform.cpp"
+#include "logger.cpp"
+#include "protocol.cpp"
+#include "decoder.cpp"
+#include "sharedframe.cpp"
+#include "registry.cpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+// Message history
+// Every chat message gets the next sequence number of its channel. The last
+// replayCapacity messages of each channel stay in memory, in a ring indexed
+// by sequence number, so a client that resumes after its connection dropped
+// is sent only what it missed (see HistoryRejoin). The rings of all channels
+// hold REPLAY_RING_BYTES of records at most, past that new messages are not
+// kept for replay.
+//
+// With a history directory every chat message is also appended to the log of its channel, a directory of
+// segment files named after the sequence number of their first record:
+//   <dir>/channel-<id>/<seq>.seg
+// A segment is preallocated, mapped once and stays mapped while the server
+// runs. It holds the records in their HISTORY_RESULT layout, so a page of
+// history is sent straight out of the mapping without copying. Every
+// HISTORY_INDEX_INTERVAL records a (seq, offset) pair goes into a sparse
+// index that finds where a page starts.
+//
+// Fan-out never waits for the log. It only takes the next sequence number
+// and pushes the record onto a lock-free queue, one writer thread copies the
+// queued records into the segments, a group every commitMs, and msyncs each
+// group when asked to. If the writer falls HISTORY_QUEUE_BYTES behind, new
+// messages are left out of the log instead.
+//
+// Ring and log share the record, encoded once in the HISTORY_RESULT layout.
+//
+// Only channels with members get messages, and a channel that loses its last
+// member frees its ring. Without a history directory its whole log goes, and
+// the next log of that channel carries on numbering where it stopped, so a
+// client never sees a sequence number twice.
+//
+// A record's Length is written last and segments start out zeroed, so the
+// logs are recovered on startup by scanning them up to the first empty slot.
+// Mapped segments need POSIX, other builds run without history.
+
+const uint32_t HISTORY_SHARDS = 64;
+const uint32_t HISTORY_INDEX_INTERVAL = 64;  // records per sparse index entry
+const uint32_t HISTORY_PAGE_MAX = 100;  // records in one HISTORY_RESULT
+const uint32_t HISTORY_PAGE_BYTES = MAX_PAYLOAD_LENGTH - sizeof(HistoryResultPayload);  // so clients can read it
+const size_t HISTORY_QUEUE_BYTES = 64 * 1024 * 1024;
+const uint32_t REPLAY_FRAME_BYTES = 64 * 1024;  // bytes of records per replayed HISTORY_RESULT
+const size_t REPLAY_RING_BYTES = 64 * 1024 * 1024;  // records in the replay rings of all channels
+
+typedef struct {
+    std::string dir;  // empty: no history
+    size_t segmentBytes;
+    uint64_t commitMs;  // how long the writer gathers a group
+    BOOL fsync;  // msync every group before taking the next one
+} HistoryConfig;
+
+static HistoryConfig historyConfig = {"", 16 * 1024 * 1024, 10, FALSE};
+static uint32_t replayCapacity = 256;  // recent messages per channel kept for resuming clients
+
+typedef struct {
+    uint64_t seq;
+    uint32_t offset;
+} HistoryIndexEntry;
+
+typedef struct {
+    uint64_t firstSeq;
+    char* base;
+    size_t size;
+    size_t end;  // bytes of complete records
+    uint32_t records;
+    std::vector<HistoryIndexEntry> index;
+} HistorySegment;
+
+typedef struct {
+    uint32_t channelId;
+    std::atomic<uint32_t> refs;  // the shard's and one per user of the log
+    std::mutex appendLock;  // sequence numbers are queued in order
+    BOOL evicted;  // gone from the shard, under appendLock
+    uint64_t nextSeq;
+    std::vector<SharedFrame*> recent;  // replay ring, under appendLock
+    std::mutex lock;  // segments as seen by readers, only the writer changes them
+    std::vector<HistorySegment> segments;
+    uint64_t lastSeq;  // newest record in the segments, 0 if none
+    // writer only
+    size_t syncedSegment;
+    size_t syncedEnd;
+    BOOL dirty;
+} ChannelLog;
+
+typedef struct {
+    std::mutex lock;
+    std::unordered_map<uint32_t, ChannelLog*> logs;  // removed only without a history directory
+    uint64_t seqFloor;  // where new logs start numbering, past every log evicted from the shard
+} HistoryShard;
+
+typedef struct HistoryEntry {
+    struct HistoryEntry* next;
+    ChannelLog* log;
+    SharedFrame* record;
+} HistoryEntry;
+
+typedef struct {
+    char* data;
+    uint32_t size;
+} HistorySlice;
+
+static HistoryShard historyShards[HISTORY_SHARDS];
+static std::atomic<HistoryEntry*> historyQueue{nullptr};
+static std::atomic<size_t> historyQueued{0};
+static std::atomic<uint64_t> historyDropped{0};
+static std::atomic<BOOL> historyStopping{FALSE};
+static std::atomic<size_t> replayHeld{0};  // bytes of records in the replay rings
+static std::mutex historyWakeLock;
+static std::condition_variable historyWake;
+static std::thread* historyWriter = nullptr;  // never destroyed, exit() may come from a signal
+
+BOOL HistoryEnabled() {
+    return historyWriter != nullptr;
+}
+
+uint64_t WallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Returns the channel's log with a reference the caller releases with ReleaseLog
+ChannelLog* ChannelLogOf(uint32_t channelId, BOOL create) {
+    HistoryShard& shard = historyShards[channelId % HISTORY_SHARDS];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.logs.find(channelId);
+    if (it != shard.logs.end()) {
+        it->second->refs++;
+        return it->second;
+    }
+    if (!create) {
+        return nullptr;
+    }
+    ChannelLog* log = new ChannelLog();
+    log->channelId = channelId;
+    log->refs = 2;
+    log->evicted = FALSE;
+    log->nextSeq = std::max<uint64_t>(shard.seqFloor, 1);
+    log->lastSeq = 0;
+    log->syncedSegment = 0;
+    log->syncedEnd = 0;
+    log->dirty = FALSE;
+    shard.logs[channelId] = log;
+    return log;
+}
+
+void ReleaseLog(ChannelLog* log) {
+    if (--log->refs == 0) {
+        delete log;
+    }
+}
+
+// Drop the replay ring, call with log->appendLock held
+void FreeRing(ChannelLog* log) {
+    for (SharedFrame* record : log->recent) {
+        if (record != nullptr) {
+            replayHeld -= record->size;
+            ReleaseFrame(record);
+        }
+    }
+    std::vector<SharedFrame*>().swap(log->recent);
+}
+
+// ChannelActivity before history hooked into it
+static void (*registryActivity)(uint32_t channelId, BOOL active) = nullptr;
+
+// A channel lost its last member, nobody is left to replay its ring to. Runs
+// under the registry's lock of the channel, so a log busy numbering a message
+// or rejoining a user, which takes that lock under appendLock, is left alone.
+void HistoryChannelActivity(uint32_t channelId, BOOL active) {
+    if (registryActivity != nullptr) {
+        registryActivity(channelId, active);
+    }
+    if (active) {
+        return;
+    }
+    HistoryShard& shard = historyShards[channelId % HISTORY_SHARDS];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.logs.find(channelId);
+    if (it == shard.logs.end()) {
+        return;
+    }
+    ChannelLog* log = it->second;
+    std::unique_lock<std::mutex> append(log->appendLock, std::try_to_lock);
+    if (!append.owns_lock()) {
+        return;
+    }
+    FreeRing(log);
+    // The segments are the history, they stay
+    if (HistoryEnabled()) {
+        return;
+    }
+    shard.seqFloor = std::max(shard.seqFloor, log->nextSeq);
+    log->evicted = TRUE;
+    shard.logs.erase(it);
+    append.unlock();
+    ReleaseLog(log);
+}
+
+// Index a record the writer or the recovery scan just added to segment
+void IndexRecord(HistorySegment& segment, uint64_t seq, size_t offset) {
+    if (segment.records % HISTORY_INDEX_INTERVAL == 0) {
+        segment.index.push_back(HistoryIndexEntry{seq, (uint32_t)offset});
+    }
+    segment.records++;
+}
+
+#ifndef _WIN32
+std::string ChannelLogDir(uint32_t channelId) {
+    char name[32];
+    snprintf(name, sizeof(name), "/channel-%u", channelId);
+    return historyConfig.dir + name;
+}
+
+// Map a new segment starting at firstSeq behind the others
+BOOL OpenSegment(ChannelLog* log, uint64_t firstSeq, size_t size) {
+    std::string dir = ChannelLogDir(log->channelId);
+    mkdir(dir.c_str(), 0755);
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu.seg", (unsigned long long)firstSeq);
+    std::string path = dir + name;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        LogPrintf(LOG_ERROR, L"Unable to create history segment %llu of channel %u, error code: %d",
+                   (unsigned long long)firstSeq, log->channelId, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return FALSE;
+    }
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LogPrintf(LOG_ERROR, L"Unable to map history segment %llu of channel %u, error code: %d",
+                   (unsigned long long)firstSeq, log->channelId, errno);
+        return FALSE;
+    }
+
+    std::lock_guard<std::mutex> guard(log->lock);
+    log->segments.push_back(HistorySegment{firstSeq, (char*)base, size, 0, 0, {}});
+    return TRUE;
+}
+
+// Map an existing segment and find where its records end. Segments without
+// a single record are left alone.
+void RecoverSegment(ChannelLog* log, const std::string& path, uint64_t firstSeq) {
+    int fd = open(path.c_str(), O_RDWR);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(HistoryRecord)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    size_t size = (size_t)info.st_size;
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return;
+    }
+
+    HistorySegment segment = {firstSeq, (char*)base, size, 0, 0, {}};
+    while (segment.end + sizeof(HistoryRecord) <= size) {
+        HistoryRecord record;
+        memcpy(&record, segment.base + segment.end, sizeof(record));
+        if (record.length < sizeof(HistoryRecord) + record.nickname_length ||
+            record.length > size - segment.end || record.seq <= log->lastSeq) {
+            break;
+        }
+        IndexRecord(segment, record.seq, segment.end);
+        segment.end += record.length;
+        log->lastSeq = record.seq;
+    }
+    if (segment.records == 0) {
+        munmap(base, size);
+        return;
+    }
+    log->segments.push_back(segment);
+}
+
+void RecoverChannel(uint32_t channelId) {
+    std::string dir = ChannelLogDir(channelId);
+    DIR* handle = opendir(dir.c_str());
+    if (handle == nullptr) {
+        return;
+    }
+    std::vector<uint64_t> firstSeqs;
+    while (struct dirent* entry = readdir(handle)) {
+        unsigned long long firstSeq;
+        int used = 0;
+        if (sscanf(entry->d_name, "%llu.seg%n", &firstSeq, &used) == 1 && entry->d_name[used] == '\0' && used > 0) {
+            firstSeqs.push_back(firstSeq);
+        }
+    }
+    closedir(handle);
+    std::sort(firstSeqs.begin(), firstSeqs.end());
+
+    ChannelLog* log = ChannelLogOf(channelId, TRUE);
+    ReleaseLog(log);
+    for (uint64_t firstSeq : firstSeqs) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu.seg", (unsigned long long)firstSeq);
+        RecoverSegment(log, dir + name, firstSeq);
+    }
+    log->nextSeq = log->lastSeq + 1;
+    if (!log->segments.empty()) {
+        log->syncedSegment = log->segments.size() - 1;
+        log->syncedEnd = log->segments.back().end;
+    }
+}
+#else
+BOOL OpenSegment(ChannelLog* log, uint64_t firstSeq, size_t size) {
+    (void)log;
+    (void)firstSeq;
+    (void)size;
+    return FALSE;
+}
+#endif
+
+// Copy a queued record to the end of its log
+void WriteRecord(ChannelLog* log, const char* record, uint32_t size) {
+    HistoryRecord header;
+    memcpy(&header, record, sizeof(header));
+    if (log->segments.empty() || log->segments.back().end + size > log->segments.back().size) {
+        if (!OpenSegment(log, header.seq, std::max(historyConfig.segmentBytes, (size_t)size))) {
+            historyDropped++;
+            return;
+        }
+    }
+    HistorySegment& segment = log->segments.back();
+    char* out = segment.base + segment.end;
+    // Length goes in last, it is what makes the record part of the log
+    memcpy(out + sizeof(header.length), record + sizeof(header.length), size - sizeof(header.length));
+    memcpy(out, record, sizeof(header.length));
+
+    std::lock_guard<std::mutex> guard(log->lock);
+    IndexRecord(segment, header.seq, segment.end);
+    segment.end += size;
+    log->lastSeq = header.seq;
+    log->dirty = TRUE;
+}
+
+// Flush what the writer added to a log since the last sync
+void SyncLog(ChannelLog* log) {
+#ifndef _WIN32
+    size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    for (size_t i = log->syncedSegment; i < log->segments.size(); i++) {
+        HistorySegment& segment = log->segments[i];
+        size_t from = i == log->syncedSegment ? log->syncedEnd & ~pageMask : 0;
+        msync(segment.base + from, segment.end - from, MS_SYNC);
+    }
+    log->syncedSegment = log->segments.size() - 1;
+    log->syncedEnd = log->segments.back().end;
+#endif
+    log->dirty = FALSE;
+}
+
+void HistoryWriter() {
+#ifndef _WIN32
+    // Leave Ctrl-C to the other threads, the handler waits for this one
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+    std::vector<ChannelLog*> touched;
+    uint64_t reported = 0;
+    while (true) {
+        {
+            // A push can slip in between the check and the wait, hence the timeout
+            std::unique_lock<std::mutex> guard(historyWakeLock);
+            historyWake.wait_for(guard, std::chrono::milliseconds(100), [] {
+                return historyQueue.load(std::memory_order_relaxed) != nullptr || historyStopping.load();
+            });
+        }
+        if (historyConfig.commitMs > 0 && !historyStopping.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(historyConfig.commitMs));
+        }
+
+        HistoryEntry* entry = historyQueue.exchange(nullptr, std::memory_order_acquire);
+        if (entry == nullptr) {
+            if (historyStopping.load()) {
+                break;
+            }
+            continue;
+        }
+        // The queue is newest first
+        HistoryEntry* ordered = nullptr;
+        while (entry != nullptr) {
+            HistoryEntry* next = entry->next;
+            entry->next = ordered;
+            ordered = entry;
+            entry = next;
+        }
+
+        while (ordered != nullptr) {
+            HistoryEntry* next = ordered->next;
+            ChannelLog* log = ordered->log;
+            if (!log->dirty) {
+                touched.push_back(log);
+            }
+            WriteRecord(log, ordered->record->data, ordered->record->size);
+            historyQueued -= ordered->record->size;
+            ReleaseFrame(ordered->record);
+            delete ordered;
+            ordered = next;
+        }
+        for (ChannelLog* log : touched) {
+            if (historyConfig.fsync && log->dirty) {
+                SyncLog(log);
+            }
+            log->dirty = FALSE;
+        }
+        touched.clear();
+
+        uint64_t dropped = historyDropped.load();
+        if (dropped != reported) {
+            LogPrintf(LOG_WARNING, L"%llu message(s) could not be added to the history",
+                       (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+}
+
+// Lock the append side of the channel's log, which is created if need be.
+// Returns it with a reference.
+ChannelLog* LockAppend(uint32_t channelId) {
+    while (true) {
+        ChannelLog* log = ChannelLogOf(channelId, TRUE);
+        log->appendLock.lock();
+        if (!log->evicted) {
+            return log;
+        }
+        // Its channel emptied in between, the next log numbers on
+        log->appendLock.unlock();
+        ReleaseLog(log);
+    }
+}
+
+// Number a message, keep it for replay and queue it for the log.
+// Returns its sequence number.
+uint64_t HistoryAppend(uint32_t channelId, uint32_t userId, const char* nickname, uint8_t nicknameBytes,
+                       const char* msg, uint32_t msgBytes) {
+    SharedFrame* record = NewFrame(HistoryRecordSize(nicknameBytes, msgBytes));
+    PackHistoryRecord(record->data, 0, userId, WallClockMs(), nickname, nicknameBytes, msg, msgBytes);
+    HistoryEntry* entry = nullptr;
+    BOOL queued = FALSE;
+    if (HistoryEnabled()) {
+        if (historyQueued.fetch_add(record->size) + record->size <= HISTORY_QUEUE_BYTES) {
+            queued = TRUE;
+        } else {
+            historyQueued -= record->size;
+            historyDropped++;
+        }
+    }
+
+    HistoryEntry* head = historyQueue.load(std::memory_order_relaxed);
+    uint64_t seq;
+    ChannelLog* log = LockAppend(channelId);
+    {
+        std::lock_guard<std::mutex> guard(log->appendLock, std::adopt_lock);
+        // Logs with a history directory are never freed, the writer keeps no reference
+        if (queued) {
+            entry = new HistoryEntry{nullptr, log, AcquireFrame(record)};
+        }
+        seq = log->nextSeq++;
+        reinterpret_cast<HistoryRecord*>(record->data)->seq = seq;
+        if (replayCapacity > 0) {
+            if (log->recent.empty()) {
+                log->recent.assign(replayCapacity, nullptr);
+            }
+            // The slot's old record goes either way, it is replayCapacity messages old
+            SharedFrame*& slot = log->recent[seq % replayCapacity];
+            if (slot != nullptr) {
+                replayHeld -= slot->size;
+            }
+            if (replayHeld.fetch_add(record->size) + record->size <= REPLAY_RING_BYTES) {
+                std::swap(slot, record);
+            } else {
+                replayHeld -= record->size;
+                if (slot != nullptr) {
+                    ReleaseFrame(slot);
+                    slot = nullptr;
+                }
+            }
+        }
+        if (entry != nullptr) {
+            do {
+                entry->next = head;
+            } while (!historyQueue.compare_exchange_weak(head, entry, std::memory_order_release,
+                                                         std::memory_order_relaxed));
+        }
+    }
+    ReleaseLog(log);
+    // The evicted record, or this one when nothing is kept
+    if (record != nullptr) {
+        ReleaseFrame(record);
+    }
+    // Only the push that made the queue non-empty needs to wake the writer
+    if (entry != nullptr && head == nullptr) {
+        historyWake.notify_one();
+    }
+    return seq;
+}
+
+// Put a resuming user back into a channel and queue HISTORY_RESULT frames
+// with the messages after afterSeq that the replay ring still holds. Both
+// happen under the lock that numbers the channel's messages, so every later
+// message is sent to the user live and every earlier one is replayed.
+// Messages numbered just before may arrive live as well, clients skip those
+// by their Seq. Returns how many missed messages are gone from the ring.
+// Only for channels of the session being resumed, ResumeSession passes no
+// other, so a resume request cannot name channels into existence.
+uint64_t HistoryRejoin(uint32_t userId, uint32_t channelId, uint64_t afterSeq, std::vector<SharedFrame*>& parts) {
+    static thread_local std::vector<SharedFrame*> records;
+    records.clear();
+    ChannelLog* log = LockAppend(channelId);
+    uint64_t lost = 0;
+    {
+        std::lock_guard<std::mutex> guard(log->appendLock, std::adopt_lock);
+        RegistryJoin(userId, channelId);
+        uint64_t first = afterSeq < log->nextSeq ? afterSeq + 1 : log->nextSeq;
+        uint64_t oldest = log->nextSeq > replayCapacity ? log->nextSeq - replayCapacity : 1;
+        if (first < oldest) {
+            lost = oldest - first;
+            first = oldest;
+        }
+        // Slots are empty from before the ring was last freed
+        for (uint64_t seq = first; seq < log->nextSeq; seq++) {
+            SharedFrame* record = log->recent.empty() ? nullptr : log->recent[seq % replayCapacity];
+            if (record != nullptr) {
+                records.push_back(AcquireFrame(record));
+            } else {
+                lost++;
+            }
+        }
+    }
+    ReleaseLog(log);
+
+    // One HISTORY_RESULT per REPLAY_FRAME_BYTES of records, sent as they are
+    size_t first = 0;
+    while (first < records.size()) {
+        size_t end = first;
+        uint32_t recordBytes = 0;
+        while (end < records.size() && (end == first || recordBytes + records[end]->size <= REPLAY_FRAME_BYTES)) {
+            recordBytes += records[end++]->size;
+        }
+        SharedFrame* header = NewFrame(HistoryResultSize(0));
+        PackHistoryResultHeader(header->data, channelId, (uint32_t)(end - first), recordBytes);
+        parts.push_back(header);
+        parts.insert(parts.end(), records.begin() + first, records.begin() + end);
+        first = end;
+    }
+    return lost;
+}
+
+// Find the records of log with seqs from first to last, a slice each. Call
+// with log->lock held.
+void CollectRecords(ChannelLog* log, uint64_t first, uint64_t last, std::vector<HistorySlice>& slices) {
+    // The last segment starting at or before first, then its last index entry that does
+    auto segment = std::upper_bound(log->segments.begin(), log->segments.end(), first,
+                                    [](uint64_t seq, const HistorySegment& s) { return seq < s.firstSeq; });
+    if (segment != log->segments.begin()) {
+        segment--;
+    }
+    auto mark = std::upper_bound(segment->index.begin(), segment->index.end(), first,
+                                 [](uint64_t seq, const HistoryIndexEntry& e) { return seq < e.seq; });
+    size_t offset = mark == segment->index.begin() ? 0 : (mark - 1)->offset;
+
+    for (; segment != log->segments.end(); segment++, offset = 0) {
+        while (offset < segment->end) {
+            HistoryRecord record;
+            memcpy(&record, segment->base + offset, sizeof(record));
+            if (record.seq > last) {
+                return;
+            }
+            if (record.seq >= first) {
+                slices.push_back(HistorySlice{segment->base + offset, record.length});
+            }
+            offset += record.length;
+        }
+    }
+}
+
+// Build the HISTORY_RESULT for up to maxCount messages of a channel before
+// beforeSeq (0: the newest). The oldest of them are left out when they would
+// take the frame past HISTORY_PAGE_BYTES, which clients cannot read, but the
+// newest is always sent. parts gets a header frame followed by frames
+// mapping the records in place, adjacent records in one.
+void HistoryPage(uint32_t channelId, uint64_t beforeSeq, uint32_t maxCount, std::vector<SharedFrame*>& parts) {
+    static thread_local std::vector<HistorySlice> slices;
+    slices.clear();
+    maxCount = std::min(maxCount, HISTORY_PAGE_MAX);
+    ChannelLog* log = HistoryEnabled() ? ChannelLogOf(channelId, FALSE) : nullptr;
+    if (log != nullptr && maxCount > 0) {
+        std::lock_guard<std::mutex> guard(log->lock);
+        uint64_t last = beforeSeq == 0 ? log->lastSeq : std::min(beforeSeq - 1, log->lastSeq);
+        if (last > 0 && !log->segments.empty()) {
+            uint64_t first = last >= maxCount ? last - maxCount + 1 : 1;
+            CollectRecords(log, first, last, slices);
+        }
+    }
+    if (log != nullptr) {
+        ReleaseLog(log);
+    }
+
+    size_t start = slices.size();
+    uint32_t recordBytes = 0;
+    while (start > 0 && (start == slices.size() || recordBytes + slices[start - 1].size <= HISTORY_PAGE_BYTES)) {
+        recordBytes += slices[--start].size;
+    }
+
+    SharedFrame* header = NewFrame(HistoryResultSize(0));
+    PackHistoryResultHeader(header->data, channelId, (uint32_t)(slices.size() - start), recordBytes);
+    parts.push_back(header);
+    for (size_t i = start; i < slices.size();) {
+        HistorySlice run = slices[i++];
+        while (i < slices.size() && run.data + run.size == slices[i].data) {
+            run.size += slices[i++].size;
+        }
+        parts.push_back(MapFrame(run.data, run.size));
+    }
+}
+
+// Recover the logs in historyConfig.dir and start the writer, does nothing
+// when history is off
+BOOL HistoryStart() {
+    registryActivity = ChannelActivity;
+    ChannelActivity = HistoryChannelActivity;
+    if (historyConfig.dir.empty()) {
+        return TRUE;
+    }
+#ifdef _WIN32
+    LogPrintf(LOG_ERROR, L"Message history is not available on this platform");
+    return FALSE;
+#else
+    if (mkdir(historyConfig.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LogPrintf(LOG_ERROR, L"Unable to create the history directory, error code: %d", errno);
+        return FALSE;
+    }
+    DIR* handle = opendir(historyConfig.dir.c_str());
+    if (handle == nullptr) {
+        LogPrintf(LOG_ERROR, L"Unable to open the history directory, error code: %d", errno);
+        return FALSE;
+    }
+    uint32_t channels = 0;
+    while (struct dirent* entry = readdir(handle)) {
+        unsigned int channelId;
+        int used = 0;
+        if (sscanf(entry->d_name, "channel-%u%n", &channelId, &used) == 1 && entry->d_name[used] == '\0') {
+            RecoverChannel(channelId);
+            channels++;
+        }
+    }
+    closedir(handle);
+
+    historyStopping = FALSE;
+    historyWriter = new std::thread(HistoryWriter);
+    LogPrintf(LOG_INFO, L"Message history enabled, %u channel log(s) recovered", channels);
+    return TRUE;
+#endif
+}
+
+// Write out everything still queued and stop the writer
+void HistoryStop() {
+    if (historyWriter == nullptr || historyStopping.exchange(TRUE)) {
+        return;
+    }
+    historyWake.notify_one();
+    historyWriter->join();
+}
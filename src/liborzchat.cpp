@@ -0,0 +1,558 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "platform.cpp"
+#include "protocol.cpp"
+#include "decoder.cpp"
+#include "compress.cpp"
+
+// liborzchat
+// The client side of the protocol without a user interface. A session logs
+// in, joins, leaves and sends without ever blocking, and reports replies
+// and chat messages through callbacks, so bots and load tools can run
+// thousands of sessions from one thread: with OrzPoll, or from their own
+// event loop through OrzWantsWrite, OrzReadable and OrzWritable.
+//
+// Requests are pipelined. Each is queued the moment it is made, even before
+// the login reply brings the user ID it has to carry, and everything queued
+// leaves in as few writes as the socket allows. Nothing waits for a reply:
+// the server handles a connection's frames in order, so a join and the sends
+// into the channel right after it can all be in flight at once. Replies are
+// matched to requests in the same order.
+//
+// Callbacks may make new requests and may call OrzClose, but must not free
+// the session they are called for.
+
+enum OrzResult {
+    ORZ_OK,
+    ORZ_REFUSED,  // the server answered with an Error
+    ORZ_CLOSED    // the connection went away before the request completed
+};
+
+typedef struct OrzSession OrzSession;
+
+// Completion of one request: a login or a join or leave when the server
+// confirms it, a send once it is written to the socket, the protocol has no
+// reply for it
+typedef void (*OrzDone)(OrzSession* session, void* context, OrzResult result);
+
+// A chat message in any of its encodings
+typedef struct {
+    uint32_t userId;
+    uint32_t channelId;
+    uint64_t seq;
+    const char* nickname;  // UTF-8, empty for a compact message from a sender not introduced yet
+    uint32_t nicknameBytes;
+    const char* text;  // UTF-8
+    uint32_t textBytes;
+} OrzMessage;
+
+// Every callback may be null, the struct has to outlive the sessions using it
+typedef struct {
+    void (*message)(OrzSession* session, const OrzMessage& message);
+    // Errors that did not answer a login, retryAfterMs is the wait ERR_RATE_LIMITED asks for
+    void (*error)(OrzSession* session, uint32_t errCode, uint32_t retryAfterMs);
+    void (*frame)(OrzSession* session, const FrameView& view);  // anything else, like HISTORY_RESULT
+    void (*closed)(OrzSession* session);  // the connection went away, not called by OrzClose
+} OrzCallbacks;
+
+typedef struct {
+    MessageType type;  // JOIN_CHANNEL, LEAVE_CHANNEL or SEND_MSG_UTF8
+    uint32_t channelId;
+    std::string text;
+    OrzDone done;
+    void* context;
+} OrzRequest;
+
+typedef struct {
+    uint8_t reply;  // frame type that completes it
+    OrzDone done;
+    void* context;
+} OrzPending;
+
+typedef struct {
+    uint64_t end;  // the send is written once this many bytes are
+    OrzDone done;
+    void* context;
+} OrzWrite;
+
+struct OrzSession {
+    SOCKET sock;
+    const OrzCallbacks* callbacks;
+    void* userData;  // for the caller
+    BOOL connecting;
+    BOOL loggedIn;
+    BOOL closed;
+    uint32_t userId;
+    uint32_t features;  // granted at login
+
+    OrzDone loginDone;
+    void* loginContext;
+    std::vector<OrzRequest> deferred;  // made before the login reply
+    std::deque<OrzPending> pending;  // waiting for their reply, in order
+    std::deque<OrzWrite> writes;  // sends waiting to be written, in order
+
+    std::string out;
+    size_t outHead;  // first unwritten byte of out
+    uint64_t written;  // bytes written since the session started
+    FrameDecoder in;
+    FrameDecoder inflated;  // frames unpacked from COMPRESSED, read before the rest
+    std::unordered_map<uint32_t, std::string> directory;  // nicknames from USER_INFO
+};
+
+// Text of the message being reported, from wide NEW_MSG frames
+static thread_local std::string orzNicknameScratch;
+static thread_local std::string orzTextScratch;
+
+// Append a frame of size bytes to the output and return where it goes
+char* OrzAppend(OrzSession* session, uint32_t size) {
+    size_t at = session->out.size();
+    session->out.resize(at + size);
+    return &session->out[at];
+}
+
+uint64_t OrzQueuedEnd(const OrzSession* session) {
+    return session->written + (session->out.size() - session->outHead);
+}
+
+void OrzEncode(OrzSession* session, const OrzRequest& request) {
+    if (request.type == JOIN_CHANNEL) {
+        PackJoinChannelInto(OrzAppend(session, FixedFrame<JOIN_CHANNEL>::SIZE), FixedFrame<JOIN_CHANNEL>::SIZE,
+                            session->userId, request.channelId);
+        session->pending.push_back({JOIN_CHANNEL_SUCCESS, request.done, request.context});
+    } else if (request.type == LEAVE_CHANNEL) {
+        PackLeaveChannelInto(OrzAppend(session, FixedFrame<LEAVE_CHANNEL>::SIZE), FixedFrame<LEAVE_CHANNEL>::SIZE,
+                             session->userId, request.channelId);
+        session->pending.push_back({LEAVE_CHANNEL_SUCCESS, request.done, request.context});
+    } else {
+        uint32_t size = SendMsgUtf8Size((uint32_t)request.text.size());
+        PackSendMsgUtf8Into(OrzAppend(session, size), size, session->userId, request.channelId, request.text.data(),
+                            (uint32_t)request.text.size());
+        if (request.done != nullptr) {
+            session->writes.push_back({OrzQueuedEnd(session), request.done, request.context});
+        }
+    }
+}
+
+void OrzSubmit(OrzSession* session, OrzRequest&& request) {
+    if (session->closed) {
+        if (request.done != nullptr) {
+            request.done(session, request.context, ORZ_CLOSED);
+        }
+    } else if (session->loggedIn) {
+        OrzEncode(session, request);
+    } else {
+        session->deferred.push_back(std::move(request));
+    }
+}
+
+void OrzLost(OrzSession* session);
+
+// Connect and log in as nickname (UTF-8), done is called with the login
+// result, right away with ORZ_CLOSED if the connect fails at once. Returns
+// nullptr if there is no socket to connect with.
+OrzSession* OrzConnect(const sockaddr_in& addr, const char* nickname, const OrzCallbacks* callbacks, void* userData,
+                       OrzDone done, void* context) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        return nullptr;
+    }
+    unsigned long nonBlocking = 1;
+    int enable = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable));
+
+    OrzSession* session = new OrzSession();
+    session->sock = sock;
+    session->callbacks = callbacks;
+    session->userData = userData;
+    session->connecting = TRUE;
+    session->loggedIn = FALSE;
+    session->closed = FALSE;
+    session->userId = 0;
+    session->features = 0;
+    session->loginDone = done;
+    session->loginContext = context;
+    session->outHead = 0;
+    session->written = 0;
+    DecoderInit(session->in, MAX_PAYLOAD_LENGTH, DECODER_REJECT);
+    DecoderInit(session->inflated, MAX_PAYLOAD_LENGTH, DECODER_REJECT);
+
+    uint8_t nicknameBytes = (uint8_t)std::min<size_t>(strlen(nickname), 31 * 4);
+    uint32_t features = FEATURE_UTF8 | FEATURE_COMPACT | FEATURE_BATCH | FEATURE_PING |
+                        (CompressionAvailable() ? FEATURE_DEFLATE : 0);
+    uint32_t size = LoginUtf8Size(nicknameBytes);
+    PackLoginUtf8Into(OrzAppend(session, size), size, features, nickname, nicknameBytes);
+
+    if (connect(sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        int err = WSAGetLastError();
+        if (err != WSAEWOULDBLOCK && err != WSAEINPROGRESS) {
+            OrzLost(session);
+        }
+    }
+    return session;
+}
+
+void OrzJoin(OrzSession* session, uint32_t channelId, OrzDone done, void* context) {
+    OrzSubmit(session, {JOIN_CHANNEL, channelId, std::string(), done, context});
+}
+
+void OrzLeave(OrzSession* session, uint32_t channelId, OrzDone done, void* context) {
+    OrzSubmit(session, {LEAVE_CHANNEL, channelId, std::string(), done, context});
+}
+
+// Send UTF-8 text to a channel, done may be null
+void OrzSend(OrzSession* session, uint32_t channelId, const char* text, uint32_t textBytes, OrzDone done,
+             void* context) {
+    OrzSubmit(session, {SEND_MSG_UTF8, channelId, std::string(text, textBytes), done, context});
+}
+
+// Close the connection, every request still open completes with ORZ_CLOSED
+void OrzClose(OrzSession* session) {
+    if (session->closed) {
+        return;
+    }
+    session->closed = TRUE;
+    closesocket(session->sock);
+    session->sock = INVALID_SOCKET;
+    if (session->loginDone != nullptr) {
+        OrzDone done = session->loginDone;
+        session->loginDone = nullptr;
+        done(session, session->loginContext, ORZ_CLOSED);
+    }
+    std::vector<OrzRequest> deferred;
+    deferred.swap(session->deferred);
+    for (OrzRequest& request : deferred) {
+        if (request.done != nullptr) {
+            request.done(session, request.context, ORZ_CLOSED);
+        }
+    }
+    while (!session->pending.empty()) {
+        OrzPending pending = session->pending.front();
+        session->pending.pop_front();
+        if (pending.done != nullptr) {
+            pending.done(session, pending.context, ORZ_CLOSED);
+        }
+    }
+    while (!session->writes.empty()) {
+        OrzWrite write = session->writes.front();
+        session->writes.pop_front();
+        write.done(session, write.context, ORZ_CLOSED);
+    }
+}
+
+// The connection went away under us
+void OrzLost(OrzSession* session) {
+    if (!session->closed) {
+        OrzClose(session);
+        if (session->callbacks->closed != nullptr) {
+            session->callbacks->closed(session);
+        }
+    }
+}
+
+void OrzFree(OrzSession* session) {
+    OrzClose(session);
+    DecoderFree(session->in);
+    DecoderFree(session->inflated);
+    delete session;
+}
+
+BOOL OrzWantsWrite(const OrzSession* session) {
+    return !session->closed && (session->connecting || session->outHead < session->out.size());
+}
+
+// Write as much of the queued output as the socket takes
+void OrzFlush(OrzSession* session) {
+    while (!session->closed && !session->connecting && session->outHead < session->out.size()) {
+        int sent = send(session->sock, session->out.data() + session->outHead,
+                        (int)std::min<size_t>(session->out.size() - session->outHead, INT32_MAX), 0);
+        if (sent < 0) {
+            int err = WSAGetLastError();
+            if (err == WSAEINTR) {
+                continue;
+            }
+            if (err != WSAEWOULDBLOCK) {
+                OrzLost(session);
+            }
+            return;
+        }
+        session->outHead += sent;
+        session->written += sent;
+        while (!session->writes.empty() && session->writes.front().end <= session->written) {
+            OrzWrite write = session->writes.front();
+            session->writes.pop_front();
+            write.done(session, write.context, ORZ_OK);
+        }
+    }
+    if (session->outHead == session->out.size()) {
+        session->out.clear();
+        session->outHead = 0;
+    }
+}
+
+// The socket became writable: the connect finished or there is room to send
+void OrzWritable(OrzSession* session) {
+    if (session->connecting && !session->closed) {
+        int err = 0;
+        socklen_t errSize = sizeof(err);
+        getsockopt(session->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &errSize);
+        if (err != 0) {
+            OrzLost(session);
+            return;
+        }
+        session->connecting = FALSE;
+    }
+    OrzFlush(session);
+}
+
+void OrzReportMessage(OrzSession* session, uint8_t type, const char* data, uint32_t length) {
+    // Records inside a BATCH have not been checked by the decoder
+    if (length < MinPayloadLength(type) || session->callbacks->message == nullptr) {
+        return;
+    }
+    OrzMessage message = {};
+    message.seq = NewMsgSeq(type, data, length);
+    if (type == NEW_MSG) {
+        const NewMsgPayload* payload = reinterpret_cast<const NewMsgPayload*>(data);
+        wchar_t nickname[32];
+        memcpy(nickname, payload->nickname, sizeof(nickname));
+        size_t nicknameChars = wcsnlen(nickname, 31);
+        std::wstring text((length - sizeof(NewMsgPayload)) / sizeof(wchar_t), L'\0');
+        memcpy(&text[0], data + sizeof(NewMsgPayload), text.size() * sizeof(wchar_t));
+        text.resize(wcsnlen(text.c_str(), std::min<size_t>(text.size(), payload->msg_length)));
+        orzNicknameScratch.resize(Utf8MaxBytes(nicknameChars));
+        orzNicknameScratch.resize(WideToUtf8(nickname, nicknameChars, &orzNicknameScratch[0]));
+        orzTextScratch.resize(Utf8MaxBytes(text.size()));
+        orzTextScratch.resize(WideToUtf8(text.data(), text.size(), &orzTextScratch[0]));
+        message.userId = payload->user_id;
+        message.channelId = payload->channel_id;
+        message.nickname = orzNicknameScratch.data();
+        message.nicknameBytes = (uint32_t)orzNicknameScratch.size();
+        message.text = orzTextScratch.data();
+        message.textBytes = (uint32_t)orzTextScratch.size();
+    } else if (type == NEW_MSG_UTF8) {
+        // both strings are clamped to the frame
+        const NewMsgUtf8Payload* payload = reinterpret_cast<const NewMsgUtf8Payload*>(data);
+        uint32_t available = length - sizeof(NewMsgUtf8Payload);
+        message.userId = payload->user_id;
+        message.channelId = payload->channel_id;
+        message.nickname = data + sizeof(NewMsgUtf8Payload);
+        message.nicknameBytes = std::min<uint32_t>(payload->nickname_length, available);
+        message.text = message.nickname + message.nicknameBytes;
+        message.textBytes = std::min<uint32_t>(payload->msg_length, available - message.nicknameBytes);
+    } else if (type == NEW_MSG_COMPACT) {
+        uint32_t ids[2];
+        const char* text;
+        uint32_t textBytes;
+        uint64_t seq;
+        int seqBytes;
+        if (!ParseCompactIds(data, length, ids, 2, text, textBytes) || (seqBytes = GetVarint64(text, textBytes, seq)) <= 0) {
+            return;
+        }
+        auto sender = session->directory.find(ids[0]);
+        message.userId = ids[0];
+        message.channelId = ids[1];
+        message.nickname = sender != session->directory.end() ? sender->second.data() : "";
+        message.nicknameBytes = sender != session->directory.end() ? (uint32_t)sender->second.size() : 0;
+        message.text = text + seqBytes;
+        message.textBytes = textBytes - seqBytes;
+    } else {
+        return;
+    }
+    session->callbacks->message(session, message);
+}
+
+void OrzLoggedIn(OrzSession* session, const FrameView& view) {
+    if (session->loggedIn) {
+        return;
+    }
+    session->loggedIn = TRUE;
+    session->userId = reinterpret_cast<const LoginSuccessPayload*>(view.payload)->user_id;
+    session->features = LoginSuccessFeatures(view.frame, view.size);
+    if (session->features & FEATURE_COMPACT) {
+        DecoderAllowCompact(session->in);
+        DecoderAllowCompact(session->inflated);
+    }
+    std::vector<OrzRequest> deferred;
+    deferred.swap(session->deferred);
+    for (const OrzRequest& request : deferred) {
+        OrzEncode(session, request);
+    }
+    if (session->loginDone != nullptr) {
+        OrzDone done = session->loginDone;
+        session->loginDone = nullptr;
+        done(session, session->loginContext, ORZ_OK);
+    }
+}
+
+// Complete the oldest request waiting for this reply
+void OrzReplied(OrzSession* session, uint8_t reply) {
+    if (!session->pending.empty() && session->pending.front().reply == reply) {
+        OrzPending pending = session->pending.front();
+        session->pending.pop_front();
+        if (pending.done != nullptr) {
+            pending.done(session, pending.context, ORZ_OK);
+        }
+    }
+}
+
+void OrzHandleFrame(OrzSession* session, const FrameView& view, BOOL unpacked) {
+    switch (view.type) {
+    case MessageType::LOGIN_SUCCESS:
+        OrzLoggedIn(session, view);
+        break;
+    case MessageType::JOIN_CHANNEL_SUCCESS:
+    case MessageType::LEAVE_CHANNEL_SUCCESS:
+        OrzReplied(session, view.type);
+        break;
+    case MessageType::ERR:
+    {
+        ErrorPayload payload = {0};
+        DecodeFrame<ERR>(view.frame, view.size, payload);
+        if (!session->loggedIn && session->loginDone != nullptr) {
+            OrzDone done = session->loginDone;
+            session->loginDone = nullptr;
+            done(session, session->loginContext, ORZ_REFUSED);
+        } else if (session->callbacks->error != nullptr) {
+            session->callbacks->error(session, payload.err_code, ErrorRetryAfterMs(view.frame, view.size));
+        }
+        break;
+    }
+    case MessageType::PING:
+    {
+        // the server checks we are alive, the PONG goes out with the next flush
+        PingPayload payload;
+        if (DecodeFrame<PING>(view.frame, view.size, payload)) {
+            uint32_t size = FixedFrame<PONG>::SIZE;
+            PackPingInto(OrzAppend(session, size), size, payload.token, TRUE);
+        }
+        break;
+    }
+    case MessageType::USER_INFO:
+    {
+        uint32_t id;
+        const char* nickname;
+        uint32_t nicknameBytes;
+        if (ParseCompactIds(view.payload, view.payloadLength, &id, 1, nickname, nicknameBytes)) {
+            session->directory[id].assign(nickname, nicknameBytes);
+        }
+        break;
+    }
+    case MessageType::BATCH:
+    {
+        const BatchPayload* batch = reinterpret_cast<const BatchPayload*>(view.payload);
+        const char* records = view.payload + sizeof(BatchPayload);
+        uint32_t remaining = view.payloadLength - sizeof(BatchPayload);
+        const char* record;
+        uint32_t recordLength;
+        for (uint32_t i = 0; i < batch->count && NextBatchRecord(records, remaining, record, recordLength); i++) {
+            OrzReportMessage(session, batch->record_type, record, recordLength);
+        }
+        break;
+    }
+    case MessageType::NEW_MSG:
+    case MessageType::NEW_MSG_UTF8:
+    case MessageType::NEW_MSG_COMPACT:
+        OrzReportMessage(session, view.type, view.payload, view.payloadLength);
+        break;
+    case MessageType::COMPRESSED:
+    {
+        // The server never nests COMPRESSED frames
+        FrameView inner;
+        if (unpacked || !InflateFrames(session->inflated, view.payload, view.payloadLength)) {
+            OrzLost(session);
+            break;
+        }
+        while (!session->closed && DecoderNext(session->inflated, inner) == DECODE_FRAME) {
+            OrzHandleFrame(session, inner, TRUE);
+        }
+        break;
+    }
+    default:
+        if (session->callbacks->frame != nullptr) {
+            session->callbacks->frame(session, view);
+        }
+        break;
+    }
+}
+
+// The socket became readable: take everything it has and handle the frames
+void OrzReadable(OrzSession* session) {
+    FrameView view;
+    while (!session->closed) {
+        DecodeStatus status = DECODE_NEED_MORE;
+        while (!session->closed && (status = DecoderNext(session->in, view)) == DECODE_FRAME) {
+            OrzHandleFrame(session, view, FALSE);
+        }
+        if (session->closed) {
+            return;
+        }
+        if (status == DECODE_ERROR) {
+            OrzLost(session);
+            return;
+        }
+
+        size_t space;
+        char* dst = DecoderWritable(session->in, space);
+        int recvLen = recv(session->sock, dst, (int)space, 0);
+        if (recvLen == 0) {
+            OrzLost(session);
+            return;
+        } else if (recvLen < 0) {
+            int err = WSAGetLastError();
+            if (err == WSAEINTR) {
+                continue;
+            }
+            if (err != WSAEWOULDBLOCK) {
+                OrzLost(session);
+            }
+            return;
+        }
+        DecoderCommit(session->in, recvLen);
+    }
+}
+
+// Flush every session, then wait up to timeoutMs for any of them to become
+// readable or writable and handle what happened. Closed sessions are
+// skipped. Returns the number of sessions still open.
+size_t OrzPoll(OrzSession* const* sessions, size_t count, int timeoutMs) {
+    static thread_local std::vector<WSAPOLLFD> fds;
+    static thread_local std::vector<OrzSession*> polled;
+    fds.clear();
+    polled.clear();
+    for (size_t i = 0; i < count; i++) {
+        OrzSession* session = sessions[i];
+        OrzFlush(session);
+        if (session->closed) {
+            continue;
+        }
+        WSAPOLLFD fd;
+        fd.fd = session->sock;
+        fd.events = POLLIN | (OrzWantsWrite(session) ? POLLOUT : 0);
+        fd.revents = 0;
+        fds.push_back(fd);
+        polled.push_back(session);
+    }
+    if (fds.empty()) {
+        return 0;
+    }
+    if (WSAPoll(fds.data(), (unsigned long)fds.size(), timeoutMs) > 0) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                OrzWritable(polled[i]);
+            }
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                OrzReadable(polled[i]);
+            }
+        }
+    }
+    size_t open = 0;
+    for (OrzSession* session : polled) {
+        open += session->closed ? 0 : 1;
+    }
+    return open;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include "protocol.cpp"
+#include "timerwheel.cpp"
+
+// Connection liveness
+// Every client connection has a single timer in its thread's wheel, set for
+// the earliest of its deadlines:
+//
+// - login: a connection that has not logged in loginTimeoutMs after it was
+//   accepted is closed
+// - heartbeat: a client with FEATURE_PING that has sent nothing for
+//   heartbeatMs gets a PING, and is closed if it is still silent
+//   heartbeatMs later
+// - idle: a client that has sent no frame other than PING and PONG for
+//   idleTimeoutMs is closed, whatever its features
+//
+// Incoming data only stamps the time. When the timer fires it checks the
+// stamps and moves itself to the next deadline, so a busy connection costs
+// no wheel operations at all and a quiet one a few per heartbeat.
+
+typedef struct {
+    uint64_t loginTimeoutMs;  // 0 = no limit
+    uint64_t heartbeatMs;  // 0 = never ping
+    uint64_t idleTimeoutMs;  // 0 = never reap idle clients
+} LivenessConfig;
+
+static LivenessConfig livenessConfig = {10 * 1000, 30 * 1000, 0};
+
+enum LivenessVerdict {
+    LIVENESS_WAIT,  // nothing due, arm the timer again
+    LIVENESS_PING,  // send a PING, then arm the timer again
+    LIVENESS_DEAD   // close the connection
+};
+
+// The stamps are written by the thread reading the socket, which in the
+// thread-per-client mode is not the one running the wheel
+typedef struct {
+    TimerNode timer;
+    uint64_t acceptedAt;
+    std::atomic<uint64_t> lastHeard;  // any bytes
+    std::atomic<uint64_t> lastActive;  // any frame but PING and PONG
+    uint64_t pingedAt;  // 0 or when the last PING went out
+    BOOL loggedIn;
+    BOOL pingable;
+} Liveness;
+
+void LivenessStart(Liveness& liveness, void* owner, uint64_t now) {
+    TimerInit(liveness.timer, owner);
+    liveness.acceptedAt = now;
+    liveness.lastHeard.store(now, std::memory_order_relaxed);
+    liveness.lastActive.store(now, std::memory_order_relaxed);
+    liveness.pingedAt = 0;
+    liveness.loggedIn = FALSE;
+    liveness.pingable = FALSE;
+}
+
+void LivenessHeard(Liveness& liveness, uint64_t now) {
+    liveness.lastHeard.store(now, std::memory_order_relaxed);
+}
+
+void LivenessFrame(Liveness& liveness, uint8_t type, uint64_t now) {
+    if (type != MessageType::PING && type != MessageType::PONG) {
+        liveness.lastActive.store(now, std::memory_order_relaxed);
+    }
+}
+
+void LivenessLoggedIn(Liveness& liveness, uint32_t features) {
+    liveness.loggedIn = TRUE;
+    liveness.pingable = (features & FEATURE_PING) != 0;
+}
+
+// The earliest moment a check could find something due, 0 if never
+uint64_t LivenessDeadline(const Liveness& liveness) {
+    if (!liveness.loggedIn) {
+        return livenessConfig.loginTimeoutMs != 0 ? liveness.acceptedAt + livenessConfig.loginTimeoutMs : 0;
+    }
+    uint64_t deadline = UINT64_MAX;
+    if (livenessConfig.idleTimeoutMs != 0) {
+        deadline = liveness.lastActive.load(std::memory_order_relaxed) + livenessConfig.idleTimeoutMs;
+    }
+    if (livenessConfig.heartbeatMs != 0 && liveness.pingable) {
+        uint64_t lastHeard = liveness.lastHeard.load(std::memory_order_relaxed);
+        uint64_t since = liveness.pingedAt > lastHeard ? liveness.pingedAt : lastHeard;
+        deadline = std::min(deadline, since + livenessConfig.heartbeatMs);
+    }
+    return deadline != UINT64_MAX ? deadline : 0;
+}
+
+// What to do with the connection now that its timer fired. reason says why
+// a dead connection is closed.
+LivenessVerdict LivenessCheck(Liveness& liveness, uint64_t now, const wchar_t*& reason) {
+    if (!liveness.loggedIn) {
+        reason = L"did not log in in time";
+        uint64_t deadline = LivenessDeadline(liveness);
+        return deadline != 0 && now >= deadline ? LIVENESS_DEAD : LIVENESS_WAIT;
+    }
+    if (livenessConfig.idleTimeoutMs != 0 &&
+        now >= liveness.lastActive.load(std::memory_order_relaxed) + livenessConfig.idleTimeoutMs) {
+        reason = L"was idle for too long";
+        return LIVENESS_DEAD;
+    }
+    if (livenessConfig.heartbeatMs == 0 || !liveness.pingable) {
+        return LIVENESS_WAIT;
+    }
+    uint64_t lastHeard = liveness.lastHeard.load(std::memory_order_relaxed);
+    if (liveness.pingedAt > lastHeard) {
+        reason = L"did not answer a PING";
+        return now >= liveness.pingedAt + livenessConfig.heartbeatMs ? LIVENESS_DEAD : LIVENESS_WAIT;
+    }
+    if (now >= lastHeard + livenessConfig.heartbeatMs) {
+        liveness.pingedAt = now;
+        return LIVENESS_PING;
+    }
+    return LIVENESS_WAIT;
+}
+
+// Set the timer for the next deadline, or stop it if there is none
+void LivenessArm(TimerWheel& wheel, Liveness& liveness) {
+    uint64_t deadline = LivenessDeadline(liveness);
+    if (deadline != 0) {
+        TimerSchedule(wheel, liveness.timer, deadline);
+    } else {
+        TimerCancel(wheel, liveness.timer);
+    }
+}
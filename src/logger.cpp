@@ -0,0 +1,428 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <ctime>
+#include <cwchar>
+#include "platform.cpp"
+#include "utf8.cpp"
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+// Asynchronous server log
+// LogPrintf only copies its arguments into a slot of a fixed ring, the
+// formatting and the console or file write happen on a background thread.
+// Producers claim slots with a compare-and-swap on the tail and never wait:
+// when the ring is full the record is dropped and counted, the writer
+// reports the count. The ring is Vyukov's bounded queue, each slot carries a
+// sequence number telling whose turn it is.
+//
+// Formats have to be string literals, only the pointer is kept. String
+// arguments are copied as UTF-8 and cut to what fits in the slot.
+
+enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    LOG_LEVELS
+};
+
+const uint32_t LOG_RING_SLOTS = 4096;  // power of two
+const uint32_t LOG_MAX_ARGS = 8;
+const uint32_t LOG_TEXT_BYTES = 400;  // string arguments of one record
+const uint32_t LOG_LINE_CHARS = 2048;
+
+enum LogArgType : uint8_t {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_TEXT
+};
+
+typedef struct {
+    uint8_t type;
+    uint16_t textOffset;  // LOG_ARG_TEXT, bytes in LogRecord::text
+    uint16_t textLength;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    };
+} LogArg;
+
+typedef struct {
+    std::atomic<uint64_t> seq;  // == position when free, position + 1 once written
+    const wchar_t* format;
+    uint64_t timeMs;
+    uint8_t level;
+    uint8_t argCount;
+    uint16_t textBytes;
+    LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_BYTES];
+} LogRecord;
+
+typedef struct {
+    LogLevel level;
+    const char* path;  // nullptr writes to stdout
+} LogConfig;
+
+static LogConfig logConfig = {LOG_INFO, nullptr};
+static LogRecord* logRing = nullptr;
+static std::atomic<uint64_t> logTail{0};  // next slot to claim
+static std::atomic<uint64_t> logHead{0};  // next slot to write out, only the writer moves it
+static std::atomic<uint64_t> logDropped{0};
+static std::atomic<BOOL> logStopping{FALSE};
+static std::mutex logWakeLock;
+static std::condition_variable logWake;
+static std::thread* logWriter = nullptr;  // never destroyed, exit() may come from a signal
+static FILE* logFile = nullptr;
+
+static const wchar_t* logPrefixes[LOG_LEVELS] = {L"[ DEBUG ] ", L"[ INFO ] ", L"[ WARNING ] ", L"[ ERROR ] "};
+
+BOOL ParseLogLevel(const char* name, LogLevel* level) {
+    static const char* names[LOG_LEVELS] = {"debug", "info", "warning", "error"};
+    for (int i = 0; i < LOG_LEVELS; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+uint64_t LogDropped() {
+    return logDropped.load(std::memory_order_relaxed);
+}
+
+// Argument capture, by C++ type since the format is not looked at here
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+LogArgument(LogRecord& record, T value) {
+    LogArg& arg = record.args[record.argCount++];
+    if (std::is_signed<T>::value) {
+        arg.type = LOG_ARG_INT;
+        arg.i = (int64_t)value;
+    } else {
+        arg.type = LOG_ARG_UINT;
+        arg.u = (uint64_t)value;
+    }
+}
+
+inline void LogArgument(LogRecord& record, double value) {
+    LogArg& arg = record.args[record.argCount++];
+    arg.type = LOG_ARG_DOUBLE;
+    arg.d = value;
+}
+
+inline void LogArgument(LogRecord& record, const wchar_t* value) {
+    LogArg& arg = record.args[record.argCount++];
+    arg.type = LOG_ARG_TEXT;
+    arg.textOffset = record.textBytes;
+    char* dst = record.text + record.textBytes;
+    size_t room = LOG_TEXT_BYTES - record.textBytes;
+    size_t length = 0;
+    // One character at a time, a long message only costs what fits
+    char utf8[4];
+    for (size_t i = 0; value != nullptr && value[i] != L'\0';) {
+        // a UTF-16 surrogate pair goes in as one character
+        size_t chars = sizeof(wchar_t) == 2 && (uint32_t)value[i] >= 0xD800 && (uint32_t)value[i] <= 0xDBFF &&
+                       value[i + 1] != L'\0' ? 2 : 1;
+        size_t bytes = WideToUtf8(value + i, chars, utf8);
+        if (length + bytes > room) {
+            break;
+        }
+        memcpy(dst + length, utf8, bytes);
+        length += bytes;
+        i += chars;
+    }
+    arg.textLength = (uint16_t)length;
+    record.textBytes += (uint16_t)length;
+}
+
+inline void LogArgument(LogRecord& record, const char* value) {
+    LogArg& arg = record.args[record.argCount++];
+    arg.type = LOG_ARG_TEXT;
+    arg.textOffset = record.textBytes;
+    size_t length = value == nullptr ? 0 : std::min<size_t>(strlen(value), LOG_TEXT_BYTES - record.textBytes);
+    memcpy(record.text + record.textBytes, value, length);
+    arg.textLength = (uint16_t)length;
+    record.textBytes += (uint16_t)length;
+}
+
+inline void LogArgument(LogRecord& record, const void* value) {
+    LogArgument(record, (uint64_t)(uintptr_t)value);
+}
+
+inline void LogArguments(LogRecord&) {
+}
+
+template <typename T, typename... Rest>
+void LogArguments(LogRecord& record, T value, Rest... rest) {
+    LogArgument(record, value);
+    LogArguments(record, rest...);
+}
+
+// Queue a log line, formatted later like printf. Never blocks.
+template <typename... Args>
+void LogPrintf(LogLevel level, const wchar_t* format, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+    if (level < logConfig.level || logRing == nullptr) {
+        return;
+    }
+    uint64_t pos = logTail.load(std::memory_order_relaxed);
+    LogRecord* record;
+    while (true) {
+        record = &logRing[pos & (LOG_RING_SLOTS - 1)];
+        int64_t lag = (int64_t)(record->seq.load(std::memory_order_acquire) - pos);
+        if (lag == 0) {
+            if (logTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            // the writer has not freed this slot yet, the ring is full
+            logDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = logTail.load(std::memory_order_relaxed);
+        }
+    }
+    record->format = format;
+    record->timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record->level = (uint8_t)level;
+    record->argCount = 0;
+    record->textBytes = 0;
+    LogArguments(*record, args...);
+    record->seq.store(pos + 1, std::memory_order_release);
+    // Only a record going into an empty ring needs to wake the writer
+    if (pos == logHead.load(std::memory_order_relaxed)) {
+        logWake.notify_one();
+    }
+}
+
+// Log the bytes of a frame in hex at LOG_DEBUG, format takes them as %s.
+// Only the start of a large frame fits.
+void LogHex(const wchar_t* format, const char* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[LOG_TEXT_BYTES];
+    size_t length = 0;
+    for (size_t i = 0; i < size && length + 3 < sizeof(hex); i++) {
+        hex[length++] = digits[(unsigned char)data[i] >> 4];
+        hex[length++] = digits[(unsigned char)data[i] & 0xF];
+        hex[length++] = ' ';
+    }
+    hex[length] = '\0';
+    LogPrintf(LOG_DEBUG, format, (const char*)hex);
+}
+
+// Deferred formatting
+// Each conversion of the format is handed to swprintf on its own, with the
+// length modifier replaced to match the captured argument.
+
+void LogFormat(const LogRecord& record, std::wstring& line) {
+    wchar_t spec[32];
+    wchar_t piece[LOG_LINE_CHARS];
+    uint32_t next = 0;
+    for (const wchar_t* p = record.format; *p != L'\0'; p++) {
+        if (*p != L'%') {
+            line += *p;
+            continue;
+        }
+        if (p[1] == L'%') {
+            line += L'%';
+            p++;
+            continue;
+        }
+        // flags, width and precision are kept, length modifiers are dropped
+        size_t specLength = 0;
+        spec[specLength++] = L'%';
+        const wchar_t* q = p + 1;
+        while (*q != L'\0' && wcschr(L"-+ #0123456789.", *q) != nullptr && specLength < 24) {
+            spec[specLength++] = *q++;
+        }
+        while (*q != L'\0' && wcschr(L"hlLqjzt", *q) != nullptr) {
+            q++;
+        }
+        wchar_t conversion = *q;
+        if (conversion == L'\0') {
+            break;
+        }
+        p = q;
+        if (next >= record.argCount) {
+            continue;
+        }
+        const LogArg& arg = record.args[next++];
+        if (arg.type == LOG_ARG_TEXT || conversion == L's' || conversion == L'S') {
+            std::wstring text;
+            if (arg.type == LOG_ARG_TEXT) {
+                text.resize(WideMaxChars(arg.textLength));
+                text.resize(Utf8ToWide(record.text + arg.textOffset, arg.textLength, &text[0]));
+            } else {
+                text = arg.type == LOG_ARG_DOUBLE ? std::to_wstring(arg.d) :
+                       arg.type == LOG_ARG_INT ? std::to_wstring(arg.i) : std::to_wstring(arg.u);
+            }
+            wcscpy(spec + specLength, L"ls");
+            swprintf(piece, LOG_LINE_CHARS, spec, text.c_str());
+        } else if (wcschr(L"fFeEgGaA", conversion) != nullptr) {
+            spec[specLength++] = conversion;
+            spec[specLength] = L'\0';
+            double value = arg.type == LOG_ARG_DOUBLE ? arg.d : arg.type == LOG_ARG_INT ? (double)arg.i : (double)arg.u;
+            swprintf(piece, LOG_LINE_CHARS, spec, value);
+        } else if (conversion == L'c') {
+            wcscpy(spec + specLength, L"lc");
+            swprintf(piece, LOG_LINE_CHARS, spec, (wint_t)arg.u);
+        } else {
+            BOOL isSigned = conversion == L'd' || conversion == L'i';
+            wcscpy(spec + specLength, L"ll");
+            spec[specLength + 2] = conversion == L'p' ? L'x' : conversion;
+            spec[specLength + 3] = L'\0';
+            uint64_t value = arg.type == LOG_ARG_DOUBLE ? (uint64_t)(int64_t)arg.d : arg.u;
+            if (isSigned) {
+                swprintf(piece, LOG_LINE_CHARS, spec, (long long)value);
+            } else {
+                swprintf(piece, LOG_LINE_CHARS, spec, (unsigned long long)value);
+            }
+        }
+        line += piece;
+    }
+}
+
+void LogWrite(const std::wstring& line) {
+#ifdef _WIN32
+    if (logFile == stdout) {
+        WriteConsoleW(GetStdHandle(STD_OUTPUT_HANDLE), line.c_str(), (DWORD)line.size(), NULL, NULL);
+        return;
+    }
+#endif
+    static std::string utf8;
+    utf8.resize(Utf8MaxBytes(line.size()));
+    fwrite(utf8.data(), 1, WideToUtf8(line.c_str(), line.size(), &utf8[0]), logFile);
+}
+
+// Write out every record that is ready, returns how many there were
+size_t LogDrain(std::wstring& line) {
+    size_t written = 0;
+    uint64_t head = logHead.load(std::memory_order_relaxed);
+    while (true) {
+        LogRecord& record = logRing[head & (LOG_RING_SLOTS - 1)];
+        if (record.seq.load(std::memory_order_acquire) != head + 1) {
+            break;
+        }
+        line.clear();
+        if (logFile != stdout) {
+            // files get a timestamp, the console looks like it always did
+            time_t seconds = (time_t)(record.timeMs / 1000);
+            struct tm local;
+#ifdef _WIN32
+            localtime_s(&local, &seconds);
+#else
+            localtime_r(&seconds, &local);
+#endif
+            wchar_t stamp[32];
+            swprintf(stamp, 32, L"%04d-%02d-%02d %02d:%02d:%02d.%03u ", local.tm_year + 1900, local.tm_mon + 1,
+                     local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec, (uint32_t)(record.timeMs % 1000));
+            line += stamp;
+        }
+        line += logPrefixes[record.level];
+        LogFormat(record, line);
+        line += L'\n';
+        record.seq.store(head + LOG_RING_SLOTS, std::memory_order_release);
+        logHead.store(++head, std::memory_order_relaxed);
+        LogWrite(line);
+        written++;
+    }
+    return written;
+}
+
+void LogWriterLoop() {
+#ifndef _WIN32
+    // Leave Ctrl-C to the other threads, the handler waits for this one
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+    std::wstring line;
+    uint64_t reported = 0;
+    while (true) {
+        BOOL stopping = logStopping.load();
+        size_t written = LogDrain(line);
+        uint64_t dropped = LogDropped();
+        if (dropped != reported) {
+            line.clear();
+            line += logPrefixes[LOG_WARNING];
+            line += std::to_wstring(dropped - reported);
+            line += L" log message(s) dropped, the log could not keep up\n";
+            LogWrite(line);
+            reported = dropped;
+            written++;
+        }
+        if (written > 0) {
+            fflush(logFile);
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        // A record can slip in between the check and the wait, hence the timeout
+        std::unique_lock<std::mutex> guard(logWakeLock);
+        logWake.wait_for(guard, std::chrono::milliseconds(100), [] {
+            LogRecord& record = logRing[logHead.load(std::memory_order_relaxed) & (LOG_RING_SLOTS - 1)];
+            return record.seq.load(std::memory_order_acquire) == logHead.load(std::memory_order_relaxed) + 1 ||
+                   logStopping.load();
+        });
+    }
+}
+
+BOOL LogStart() {
+    logFile = stdout;
+    if (logConfig.path != nullptr) {
+        logFile = fopen(logConfig.path, "ab");
+        if (logFile == nullptr) {
+            logFile = stdout;
+            fprintf(stderr, "[ ERROR ] Unable to open log file %s, error code: %d\n", logConfig.path, errno);
+            return FALSE;
+        }
+    }
+    logRing = new LogRecord[LOG_RING_SLOTS];
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+        logRing[i].seq.store(i, std::memory_order_relaxed);
+    }
+    logStopping = FALSE;
+    logWriter = new std::thread(LogWriterLoop);
+    return TRUE;
+}
+
+// Wait until everything logged so far is written, for output that does not
+// go through the log
+void LogFlush() {
+    if (logWriter == nullptr) {
+        return;
+    }
+    uint64_t tail = logTail.load();
+    while (logHead.load() < tail) {
+        logWake.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    fflush(logFile);
+}
+
+// Write out everything still queued and stop the writer
+void LogStop() {
+    if (logWriter == nullptr || logStopping.exchange(TRUE)) {
+        return;
+    }
+    logWake.notify_one();
+    logWriter->join();
+    if (logFile != stdout) {
+        fclose(logFile);
+    }
+}
@@ -0,0 +1,460 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <cstdarg>
+#include "platform.cpp"
+#include "logger.cpp"
+#include "protocol.cpp"
+
+// Server metrics
+// Every thread that handles clients counts into its own ThreadMetrics block.
+// The owning thread is the only writer, so an update is a relaxed load and
+// store, with no locked instruction and no shared cache line. Readers walk
+// the list of blocks and add them up without taking a lock. A snapshot may
+// be a few events behind, but no single value is ever torn.
+//
+// Blocks are never freed. When a thread exits, its block goes to a free list
+// and the next new thread continues counting into it. Thread-per-client mode
+// therefore keeps one block per concurrent client, not one per client ever.
+//
+// Histograms are log-linear like HdrHistogram, with 2^METRIC_SUB_BITS buckets
+// per power of two (12.5% resolution).
+
+const uint32_t METRIC_SUB_BITS = 3;
+const uint32_t METRIC_BUCKETS = (64 - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS;
+const uint32_t METRIC_TYPES = 256;  // frame counters by MessageType
+
+enum MetricCounter {
+    METRIC_ACCEPTED,       // connections accepted
+    METRIC_CLOSED,         // connections closed
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_DECODE_ERRORS,  // malformed frames that closed a connection
+    METRIC_SKIPPED_BYTES,  // garbage skipped while resynchronizing
+    METRIC_LOG_DROPPED,    // log messages lost to a full log ring, kept by the log
+    METRIC_SYSCALLS,       // system calls made for network I/O
+    METRIC_TIMED_OUT,      // connections closed for missing a login, heartbeat or idle deadline
+    METRIC_RATE_LIMITED,   // chat messages dropped for going over a send rate limit
+    METRIC_OUTQ_BYTES,     // gauge, unsent bytes in outbound queues
+    METRIC_OUTQ_FRAMES,    // gauge, frames in outbound queues
+    METRIC_COUNTERS
+};
+
+enum MetricHistogramId {
+    HISTOGRAM_FANOUT_SIZE,     // recipients per broadcast
+    HISTOGRAM_FANOUT_LATENCY,  // nanoseconds to encode and hand out a broadcast
+    HISTOGRAM_OUTQ_DEPTH,      // frames in a connection's queue after each push
+    METRIC_HISTOGRAMS
+};
+
+typedef struct {
+    std::atomic<uint64_t> buckets[METRIC_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+} MetricHistogram;
+
+typedef struct ThreadMetrics {
+    ThreadMetrics* next;  // all blocks, newest first
+    std::atomic<uint64_t> counters[METRIC_COUNTERS];
+    std::atomic<uint64_t> framesIn[METRIC_TYPES];
+    std::atomic<uint64_t> framesOut[METRIC_TYPES];
+    MetricHistogram histograms[METRIC_HISTOGRAMS];
+} ThreadMetrics;
+
+// Totals over every block, as plain numbers
+typedef struct {
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} HistogramTotals;
+
+typedef struct {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t framesIn[METRIC_TYPES];
+    uint64_t framesOut[METRIC_TYPES];
+    HistogramTotals histograms[METRIC_HISTOGRAMS];
+} MetricsTotals;
+
+static std::atomic<ThreadMetrics*> metricBlocks{nullptr};
+static std::mutex metricFreeLock;
+static std::vector<ThreadMetrics*> metricFreeBlocks;
+
+ThreadMetrics* AcquireMetrics() {
+    {
+        std::lock_guard<std::mutex> guard(metricFreeLock);
+        if (!metricFreeBlocks.empty()) {
+            ThreadMetrics* block = metricFreeBlocks.back();
+            metricFreeBlocks.pop_back();
+            return block;
+        }
+    }
+    // value-initialized, every counter starts at 0
+    ThreadMetrics* block = new ThreadMetrics();
+    ThreadMetrics* head = metricBlocks.load(std::memory_order_relaxed);
+    do {
+        block->next = head;
+    } while (!metricBlocks.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+    return block;
+}
+
+// Hands the thread's block back when the thread exits
+typedef struct MetricsOwner {
+    ThreadMetrics* block = AcquireMetrics();
+    ~MetricsOwner() {
+        std::lock_guard<std::mutex> guard(metricFreeLock);
+        metricFreeBlocks.push_back(block);
+    }
+} MetricsOwner;
+
+inline ThreadMetrics& LocalMetrics() {
+    static thread_local MetricsOwner owner;
+    return *owner.block;
+}
+
+// Single writer per block, no read-modify-write needed
+inline void Bump(std::atomic<uint64_t>& value, uint64_t delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+inline void MetricsAdd(MetricCounter counter, uint64_t delta = 1) {
+    Bump(LocalMetrics().counters[counter], delta);
+}
+
+// Gauges are kept as wrapping sums of signed changes
+inline void MetricsGauge(MetricCounter gauge, int64_t delta) {
+    Bump(LocalMetrics().counters[gauge], (uint64_t)delta);
+}
+
+inline void MetricsFrameIn(uint8_t type) {
+    Bump(LocalMetrics().framesIn[type], 1);
+}
+
+inline void MetricsFramesOut(uint8_t type, uint64_t count = 1) {
+    Bump(LocalMetrics().framesOut[type], count);
+}
+
+// Count a frame about to be sent, in either framing
+void MetricsFrameOut(const char* frame, size_t size) {
+    uint8_t type;
+    uint32_t payloadLength;
+    if (size > 0 && (uint8_t)frame[0] == COMPACT_TAG) {
+        if (ParseCompactHeader(frame, size, type, payloadLength) > 0) {
+            MetricsFramesOut(type);
+        }
+    } else if (size >= sizeof(MessageHeader)) {
+        MetricsFramesOut(reinterpret_cast<const MessageHeader*>(frame)->type);
+    }
+}
+
+// Index of the highest set bit, value is not 0
+inline uint32_t HighestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+uint32_t MetricBucket(uint64_t value) {
+    if (value < (1u << METRIC_SUB_BITS)) {
+        return (uint32_t)value;
+    }
+    uint32_t shift = HighestBit(value) - METRIC_SUB_BITS;
+    return ((shift + 1) << METRIC_SUB_BITS) + (uint32_t)((value >> shift) & ((1u << METRIC_SUB_BITS) - 1));
+}
+
+// Smallest value that falls into the bucket
+uint64_t MetricBucketValue(uint32_t bucket) {
+    if (bucket < (1u << METRIC_SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t shift = (bucket >> METRIC_SUB_BITS) - 1;
+    return ((uint64_t)(1u << METRIC_SUB_BITS) + (bucket & ((1u << METRIC_SUB_BITS) - 1))) << shift;
+}
+
+void MetricsRecord(MetricHistogramId id, uint64_t value) {
+    MetricHistogram& histogram = LocalMetrics().histograms[id];
+    Bump(histogram.buckets[MetricBucket(value)], 1);
+    Bump(histogram.count, 1);
+    Bump(histogram.sum, value);
+    if (value > histogram.max.load(std::memory_order_relaxed)) {
+        histogram.max.store(value, std::memory_order_relaxed);
+    }
+}
+
+inline uint64_t MetricsNowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MetricsCollect(MetricsTotals& totals) {
+    memset(&totals, 0, sizeof(totals));
+    for (ThreadMetrics* block = metricBlocks.load(std::memory_order_acquire); block != nullptr; block = block->next) {
+        for (uint32_t i = 0; i < METRIC_COUNTERS; i++) {
+            totals.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+        }
+        for (uint32_t i = 0; i < METRIC_TYPES; i++) {
+            totals.framesIn[i] += block->framesIn[i].load(std::memory_order_relaxed);
+            totals.framesOut[i] += block->framesOut[i].load(std::memory_order_relaxed);
+        }
+        for (uint32_t h = 0; h < METRIC_HISTOGRAMS; h++) {
+            const MetricHistogram& from = block->histograms[h];
+            HistogramTotals& into = totals.histograms[h];
+            for (uint32_t i = 0; i < METRIC_BUCKETS; i++) {
+                into.buckets[i] += from.buckets[i].load(std::memory_order_relaxed);
+            }
+            into.count += from.count.load(std::memory_order_relaxed);
+            into.sum += from.sum.load(std::memory_order_relaxed);
+            into.max = std::max(into.max, from.max.load(std::memory_order_relaxed));
+        }
+    }
+    totals.counters[METRIC_LOG_DROPPED] = LogDropped();
+}
+
+uint64_t HistogramPercentile(const HistogramTotals& histogram, double percentile) {
+    if (histogram.count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (histogram.count - 1)) + 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < METRIC_BUCKETS; i++) {
+        seen += histogram.buckets[i];
+        if (seen >= rank) {
+            return std::min(MetricBucketValue(i), histogram.max);
+        }
+    }
+    return histogram.max;
+}
+
+// Values of all buckets below 2^octave
+uint64_t HistogramBelow(const HistogramTotals& histogram, uint32_t octave) {
+    uint32_t end = octave < METRIC_SUB_BITS ? (1u << octave) : (octave - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS;
+    uint64_t below = 0;
+    for (uint32_t i = 0; i < end && i < METRIC_BUCKETS; i++) {
+        below += histogram.buckets[i];
+    }
+    return below;
+}
+
+const char* MessageTypeName(uint8_t type) {
+    switch (type) {
+    case LOGIN: return "LOGIN";
+    case JOIN_CHANNEL: return "JOIN_CHANNEL";
+    case SEND_MSG: return "SEND_MSG";
+    case LEAVE_CHANNEL: return "LEAVE_CHANNEL";
+    case DISCONNECT: return "DISCONNECT";
+    case LOGIN_SUCCESS: return "LOGIN_SUCCESS";
+    case JOIN_CHANNEL_SUCCESS: return "JOIN_CHANNEL_SUCCESS";
+    case NEW_MSG: return "NEW_MSG";
+    case LEAVE_CHANNEL_SUCCESS: return "LEAVE_CHANNEL_SUCCESS";
+    case ERR: return "ERR";
+    case LOGIN_UTF8: return "LOGIN_UTF8";
+    case SEND_MSG_UTF8: return "SEND_MSG_UTF8";
+    case NEW_MSG_UTF8: return "NEW_MSG_UTF8";
+    case NEW_MSG_COMPACT: return "NEW_MSG_COMPACT";
+    case USER_INFO: return "USER_INFO";
+    case BATCH: return "BATCH";
+    case COMPRESSED: return "COMPRESSED";
+    case HISTORY: return "HISTORY";
+    case HISTORY_RESULT: return "HISTORY_RESULT";
+    case STATS: return "STATS";
+    case STATS_RESULT: return "STATS_RESULT";
+    case PEER_HELLO: return "PEER_HELLO";
+    case PEER_CHANNELS: return "PEER_CHANNELS";
+    case PEER_SUBSCRIBE: return "PEER_SUBSCRIBE";
+    case PEER_UNSUBSCRIBE: return "PEER_UNSUBSCRIBE";
+    case PEER_MSG: return "PEER_MSG";
+    case PING: return "PING";
+    case PONG: return "PONG";
+    default: return nullptr;
+    }
+}
+
+typedef struct {
+    const char* name;
+    const char* help;
+    double scale;  // exported value per recorded unit
+    uint32_t octaves;  // Prometheus buckets at 2^0 .. 2^octaves
+} HistogramInfo;
+
+static const HistogramInfo histogramInfo[METRIC_HISTOGRAMS] = {
+    {"fanout_recipients", "Recipients per broadcast message.", 1.0, 20},
+    {"fanout_latency_seconds", "Time to encode a broadcast and hand it to every recipient.", 1e-9, 34},
+    {"outbound_queue_depth", "Frames in a connection's outbound queue after each push.", 1.0, 20},
+};
+
+static const char* counterNames[METRIC_COUNTERS] = {
+    "connections_accepted", "connections_closed", "received_bytes", "sent_bytes",
+    "decode_errors", "skipped_bytes", "log_dropped", "io_syscalls",
+    "connections_timed_out", "messages_rate_limited",
+    "outbound_queued_bytes", "outbound_queued_frames",
+};
+
+// Named values for STATS_RESULT: counters, frames by type and histogram
+// percentiles. Latencies are in nanoseconds.
+void MetricsEntries(std::vector<std::pair<std::string, uint64_t>>& entries) {
+    MetricsTotals totals;
+    MetricsCollect(totals);
+    for (uint32_t i = 0; i < METRIC_COUNTERS; i++) {
+        entries.push_back(std::make_pair(counterNames[i], totals.counters[i]));
+    }
+    for (uint32_t type = 0; type < METRIC_TYPES; type++) {
+        const char* name = MessageTypeName((uint8_t)type);
+        if (name == nullptr) {
+            continue;
+        }
+        if (totals.framesIn[type] != 0) {
+            entries.push_back(std::make_pair(std::string("frames_received.") + name, totals.framesIn[type]));
+        }
+        if (totals.framesOut[type] != 0) {
+            entries.push_back(std::make_pair(std::string("frames_sent.") + name, totals.framesOut[type]));
+        }
+    }
+    static const char* histogramNames[METRIC_HISTOGRAMS] = {"fanout_recipients", "fanout_latency_ns", "outbound_queue_depth"};
+    static const std::pair<const char*, double> percentiles[] = {{"p50", 50}, {"p90", 90}, {"p99", 99}, {"p999", 99.9}};
+    for (uint32_t h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const HistogramTotals& histogram = totals.histograms[h];
+        std::string name = histogramNames[h];
+        entries.push_back(std::make_pair(name + ".count", histogram.count));
+        for (const auto& percentile : percentiles) {
+            entries.push_back(std::make_pair(name + "." + percentile.first, HistogramPercentile(histogram, percentile.second)));
+        }
+        entries.push_back(std::make_pair(name + ".max", histogram.max));
+    }
+}
+
+void AppendFormat(std::string& out, const char* format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out.append(line, std::min<size_t>(std::max(len, 0), sizeof(line) - 1));
+}
+
+// Prometheus text exposition format, version 0.0.4
+void MetricsPrometheus(std::string& out) {
+    MetricsTotals totals;
+    MetricsCollect(totals);
+    for (uint32_t i = 0; i < METRIC_COUNTERS; i++) {
+        BOOL gauge = i == METRIC_OUTQ_BYTES || i == METRIC_OUTQ_FRAMES;
+        AppendFormat(out, "# TYPE orzchat_%s%s %s\n", counterNames[i], gauge ? "" : "_total", gauge ? "gauge" : "counter");
+        if (gauge) {
+            AppendFormat(out, "orzchat_%s %" PRId64 "\n", counterNames[i], (int64_t)totals.counters[i]);
+        } else {
+            AppendFormat(out, "orzchat_%s_total %" PRIu64 "\n", counterNames[i], totals.counters[i]);
+        }
+    }
+    const char* directions[] = {"received", "sent"};
+    const uint64_t* frames[] = {totals.framesIn, totals.framesOut};
+    for (int d = 0; d < 2; d++) {
+        AppendFormat(out, "# TYPE orzchat_frames_%s_total counter\n", directions[d]);
+        for (uint32_t type = 0; type < METRIC_TYPES; type++) {
+            const char* name = MessageTypeName((uint8_t)type);
+            if (name != nullptr && frames[d][type] != 0) {
+                AppendFormat(out, "orzchat_frames_%s_total{type=\"%s\"} %" PRIu64 "\n", directions[d], name, frames[d][type]);
+            }
+        }
+    }
+    for (uint32_t h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const HistogramInfo& info = histogramInfo[h];
+        const HistogramTotals& histogram = totals.histograms[h];
+        AppendFormat(out, "# HELP orzchat_%s %s\n", info.name, info.help);
+        AppendFormat(out, "# TYPE orzchat_%s histogram\n", info.name);
+        // Recorded values are integers, below 2^k means at most 2^k - 1
+        for (uint32_t octave = 0; octave <= info.octaves; octave++) {
+            AppendFormat(out, "orzchat_%s_bucket{le=\"%.10g\"} %" PRIu64 "\n", info.name,
+                         (double)((1ull << octave) - 1) * info.scale, HistogramBelow(histogram, octave));
+        }
+        AppendFormat(out, "orzchat_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", info.name, histogram.count);
+        AppendFormat(out, "orzchat_%s_sum %.10g\n", info.name, (double)histogram.sum * info.scale);
+        AppendFormat(out, "orzchat_%s_count %" PRIu64 "\n", info.name, histogram.count);
+    }
+}
+
+// Prometheus endpoint
+// A thread of its own answers every connection to the metrics port with the
+// text format and closes it, whatever was asked. It only listens on the
+// loopback interface.
+
+const int METRICS_RECV_TIMEOUT_MS = 1000;
+
+DWORD WINAPI MetricsEndpoint(LPVOID lpParam) {
+    SOCKET listenSock = (SOCKET)(intptr_t)lpParam;
+    std::string body;
+    std::string response;
+    while (true) {
+        SOCKET sock = accept(listenSock, nullptr, nullptr);
+        if (sock == INVALID_SOCKET) {
+            if (WSAGetLastError() == WSAEINTR) {
+                continue;
+            }
+            break;
+        }
+        // Read the request so closing does not reset the connection, a
+        // scraper that sends nothing only holds the endpoint up for a second
+#ifdef _WIN32
+        DWORD timeout = METRICS_RECV_TIMEOUT_MS;
+#else
+        timeval timeout = {METRICS_RECV_TIMEOUT_MS / 1000, (METRICS_RECV_TIMEOUT_MS % 1000) * 1000};
+#endif
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        char request[2048];
+        recv(sock, request, sizeof(request), 0);
+
+        body.clear();
+        MetricsPrometheus(body);
+        response.clear();
+        AppendFormat(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %u\r\nConnection: close\r\n\r\n", (uint32_t)body.size());
+        response += body;
+        for (size_t sent = 0; sent < response.size();) {
+            int written = send(sock, response.data() + sent, (int)(response.size() - sent), 0);
+            if (written <= 0) {
+                break;
+            }
+            sent += written;
+        }
+        closesocket(sock);
+    }
+    closesocket(listenSock);
+    return 0;
+}
+
+// Listen on 127.0.0.1:port and serve metrics from a background thread
+BOOL StartMetricsEndpoint(int port) {
+    SOCKET listenSock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSock == INVALID_SOCKET) {
+        LogPrintf(LOG_ERROR, L"socket failed with error code: %d", WSAGetLastError());
+        return FALSE;
+    }
+    int enable = 1;
+    setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable));
+    sockaddr_in addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(listenSock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listenSock, SOMAXCONN) == SOCKET_ERROR) {
+        LogPrintf(LOG_ERROR, L"Unable to serve metrics on port %d, error code: %d", port, WSAGetLastError());
+        closesocket(listenSock);
+        return FALSE;
+    }
+    DWORD threadId;
+    HANDLE thread = CreateThread(NULL, 0, MetricsEndpoint, (LPVOID)(intptr_t)listenSock, 0, &threadId);
+    if (thread == NULL) {
+        closesocket(listenSock);
+        return FALSE;
+    }
+    CloseHandle(thread);
+    LogPrintf(LOG_INFO, L"Serving metrics on http://127.0.0.1:%d/metrics", port);
+    return TRUE;
+}
@@ -1,6 +1,8 @@
-#include <windows.h>
+#pragma once
+#include "platform.cpp"
 #include <cwchar>
 #include <cstdarg>
+#include "utf8.cpp"
 
 void win_printf(HANDLE consoleHandle, const wchar_t* format, ...) {
     wchar_t buffer[1024];
@@ -8,17 +10,39 @@ void win_printf(HANDLE consoleHandle, const wchar_t* format, ...) {
     va_start(args, format);
     vswprintf(buffer, sizeof(buffer)/sizeof(wchar_t), format, args);
     va_end(args);
+#ifdef _WIN32
     WriteConsoleW(consoleHandle, buffer, wcslen(buffer), NULL, NULL);
+#else
+    char utf8[4 * sizeof(buffer) / sizeof(wchar_t)];
+    size_t len = WideToUtf8(buffer, wcslen(buffer), utf8);
+    fwrite(utf8, 1, len, (FILE*)consoleHandle);
+    fflush((FILE*)consoleHandle);
+#endif
 }
 
 void win_scanf(HANDLE consoleHandle, const wchar_t* format, ...) {
     wchar_t buffer[1024];
+#ifdef _WIN32
     DWORD charsRead;
     ReadConsoleW(consoleHandle, buffer, sizeof(buffer)/sizeof(wchar_t) - 1, &charsRead, NULL);
     buffer[charsRead] = L'\0';
-    
+#else
+    if (fgetws(buffer, sizeof(buffer)/sizeof(wchar_t), (FILE*)consoleHandle) == NULL) {
+        buffer[0] = L'\0';
+    }
+#endif
+
     va_list args;
     va_start(args, format);
     vswscanf(buffer, format, args);
     va_end(args);
 }
+
+void ClearConsole() {
+#ifdef _WIN32
+    system("CLS");
+#else
+    printf("\033[2J\033[H");
+    fflush(stdout);
+#endif
+}
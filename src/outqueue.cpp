@@ -0,0 +1,473 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "platform.cpp"
+#include "protocol.cpp"
+#include "sharedframe.cpp"
+#include "compress.cpp"
+#include "metrics.cpp"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+// Outbound queues
+// Every non-blocking connection owns a bounded queue of frame references.
+// It is drained with one scatter/gather write per batch of frames whenever
+// the socket is writable. When a client falls behind by more than maxBytes,
+// or its oldest unsent frame is older than maxAgeMs, the slow-consumer policy
+// decides what happens. Only NEW_MSG broadcasts (in any encoding) are ever
+// dropped, replies to the client's own requests always go out. A client the
+// policy cannot bring back under the limits that way is disconnected, so the
+// queue stays bounded whatever it holds.
+//
+// Clients granted FEATURE_BATCH get runs of queued broadcasts merged into
+// BATCH frames right before they are written. This only happens when
+// messages pile up, either within one reactor pass or because the socket
+// was full. A single pending message is sent on its own, so batching adds no
+// latency. A batch spans at most maxBytes of records and messages queued no
+// more than windowMs apart.
+//
+// For clients granted FEATURE_DEFLATE the frames about to be written are then
+// compressed, a lone frame through its shared CompressedForm and a longer run
+// as one window of its own.
+
+const int OUTBOUND_IOV_BATCH = 64;
+
+enum SlowConsumerPolicy {
+    POLICY_DROP_OLDEST,  // drop the oldest queued messages until back under the limit
+    POLICY_COALESCE,     // keep only the newest queued message per channel
+    POLICY_DISCONNECT    // close the connection
+};
+
+typedef struct {
+    size_t maxBytes;
+    uint64_t maxAgeMs;  // 0 disables the age check
+    SlowConsumerPolicy policy;
+} OutboundLimits;
+
+typedef struct {
+    size_t maxBytes;  // 0 disables batching
+    uint64_t windowMs;
+} BatchLimits;
+
+typedef struct {
+    SharedFrame* frame;
+    uint32_t offset;  // bytes of the frame already written
+    uint64_t queuedAt;
+    BOOL droppable;  // a whole NEW_MSG frame the policy may discard
+    BOOL packed;  // compression already had its go, send it as it is
+} OutboundFrame;
+
+typedef struct {
+    std::vector<OutboundFrame> frames;
+    size_t head;
+    size_t bytes;  // unsent bytes
+    uint64_t dropped;  // messages discarded by the policy
+    BOOL batching;  // the client understands BATCH frames
+    BOOL compressing;  // the client understands COMPRESSED frames
+    size_t reportedBytes;  // what the outbound queue gauges last heard
+    size_t reportedFrames;
+} OutboundQueue;
+
+static OutboundLimits outboundLimits = {4 * 1024 * 1024, 0, POLICY_DROP_OLDEST};
+static BatchLimits batchLimits = {64 * 1024, 2};
+
+size_t OutboundDepth(const OutboundQueue& queue) {
+    return queue.frames.size() - queue.head;
+}
+
+BOOL OutboundEmpty(const OutboundQueue& queue) {
+    return queue.head == queue.frames.size();
+}
+
+// Pass the change since the last call on to the outbound queue gauges
+void OutboundReport(OutboundQueue& queue) {
+    size_t frames = OutboundDepth(queue);
+    if (queue.bytes != queue.reportedBytes || frames != queue.reportedFrames) {
+        MetricsGauge(METRIC_OUTQ_BYTES, (int64_t)queue.bytes - (int64_t)queue.reportedBytes);
+        MetricsGauge(METRIC_OUTQ_FRAMES, (int64_t)frames - (int64_t)queue.reportedFrames);
+        queue.reportedBytes = queue.bytes;
+        queue.reportedFrames = frames;
+    }
+}
+
+void OutboundPush(OutboundQueue& queue, SharedFrame* frame, uint64_t now, BOOL droppable) {
+    queue.frames.push_back(OutboundFrame{AcquireFrame(frame), 0, now, droppable, FALSE});
+    queue.bytes += frame->size;
+}
+
+// Queue a piece of a frame. Pieces are never dropped, merged or compressed,
+// their bytes have to reach the client exactly as they are.
+void OutboundPushPart(OutboundQueue& queue, SharedFrame* part, uint64_t now) {
+    queue.frames.push_back(OutboundFrame{AcquireFrame(part), 0, now, FALSE, TRUE});
+    queue.bytes += part->size;
+}
+
+// Type and payload of a queued frame in either framing
+BOOL FrameBody(const SharedFrame* frame, uint8_t& type, const char*& payload, uint32_t& payloadLength) {
+    if (frame->size > 0 && (uint8_t)frame->data[0] == COMPACT_TAG) {
+        int headerSize = ParseCompactHeader(frame->data, frame->size, type, payloadLength);
+        if (headerSize <= 0) {
+            return FALSE;
+        }
+        payload = frame->data + headerSize;
+        return TRUE;
+    }
+    if (frame->size < sizeof(MessageHeader)) {
+        return FALSE;
+    }
+    const MessageHeader* header = (const MessageHeader*)frame->data;
+    type = header->type;
+    payload = frame->data + sizeof(MessageHeader);
+    payloadLength = header->payload_length;
+    return TRUE;
+}
+
+// Broadcast messages are the only frames a slow consumer may lose
+BOOL IsBroadcastFrame(const SharedFrame* frame) {
+    uint8_t type;
+    const char* payload;
+    uint32_t payloadLength;
+    if (!FrameBody(frame, type, payload, payloadLength)) {
+        return FALSE;
+    }
+    return type == MessageType::NEW_MSG || type == MessageType::NEW_MSG_UTF8 ||
+           type == MessageType::NEW_MSG_COMPACT;
+}
+
+void OutboundClear(OutboundQueue& queue) {
+    for (size_t i = queue.head; i < queue.frames.size(); i++) {
+        ReleaseFrame(queue.frames[i].frame);
+    }
+    // Give the memory back, idle connections should not hold any
+    std::vector<OutboundFrame>().swap(queue.frames);
+    queue.head = 0;
+    queue.bytes = 0;
+}
+
+BOOL IsDroppable(const OutboundFrame& pending) {
+    return pending.droppable && pending.offset == 0;
+}
+
+// NEW_MSG and NEW_MSG_UTF8 both start with the user and channel IDs,
+// NEW_MSG_COMPACT with the same two as varints
+uint32_t FrameChannel(const OutboundFrame& pending) {
+    uint8_t type;
+    const char* payload;
+    uint32_t payloadLength;
+    FrameBody(pending.frame, type, payload, payloadLength);
+    if (type == MessageType::NEW_MSG_COMPACT) {
+        uint32_t ids[2] = {0, 0};
+        const char* text;
+        uint32_t textBytes;
+        ParseCompactIds(payload, payloadLength, ids, 2, text, textBytes);
+        return ids[1];
+    }
+    return ((const NewMsgPayload*)payload)->channel_id;
+}
+
+// Remove the frames marked in drop, keeping the order of the rest
+void OutboundCompact(OutboundQueue& queue, const std::vector<bool>& drop) {
+    size_t kept = queue.head;
+    for (size_t i = queue.head; i < queue.frames.size(); i++) {
+        if (drop[i - queue.head]) {
+            queue.bytes -= queue.frames[i].frame->size;
+            ReleaseFrame(queue.frames[i].frame);
+            queue.dropped++;
+        } else {
+            queue.frames[kept++] = queue.frames[i];
+        }
+    }
+    queue.frames.resize(kept);
+}
+
+BOOL OutboundWithinLimits(const OutboundQueue& queue, const OutboundLimits& limits, uint64_t now) {
+    BOOL tooBig = queue.bytes > limits.maxBytes;
+    BOOL tooOld = limits.maxAgeMs != 0 && !OutboundEmpty(queue) &&
+                  now - queue.frames[queue.head].queuedAt > limits.maxAgeMs;
+    return !tooBig && !tooOld;
+}
+
+// Apply the slow-consumer policy, returns FALSE if the connection must be closed
+BOOL OutboundEnforce(OutboundQueue& queue, const OutboundLimits& limits, uint64_t now) {
+    if (OutboundWithinLimits(queue, limits, now)) {
+        return TRUE;
+    }
+
+    std::vector<bool> drop(OutboundDepth(queue), false);
+    switch (limits.policy) {
+    case POLICY_DISCONNECT:
+        return FALSE;
+    case POLICY_DROP_OLDEST:
+    {
+        size_t bytes = queue.bytes;
+        for (size_t i = queue.head; i < queue.frames.size(); i++) {
+            const OutboundFrame& pending = queue.frames[i];
+            BOOL stale = limits.maxAgeMs != 0 && now - pending.queuedAt > limits.maxAgeMs;
+            if (bytes <= limits.maxBytes && !stale) {
+                break;
+            }
+            if (IsDroppable(pending)) {
+                drop[i - queue.head] = true;
+                bytes -= pending.frame->size;
+            }
+        }
+        break;
+    }
+    case POLICY_COALESCE:
+    {
+        // Walk newest to oldest, anything behind a newer message for the same channel goes
+        std::vector<uint32_t> seen;
+        for (size_t i = queue.frames.size(); i-- > queue.head; ) {
+            const OutboundFrame& pending = queue.frames[i];
+            if (!IsDroppable(pending)) {
+                continue;
+            }
+            uint32_t channel = FrameChannel(pending);
+            if (std::find(seen.begin(), seen.end(), channel) != seen.end()) {
+                drop[i - queue.head] = true;
+            } else {
+                seen.push_back(channel);
+            }
+        }
+        break;
+    }
+    }
+    OutboundCompact(queue, drop);
+    // What is left over the limits cannot be dropped: replies, frames partly
+    // written, or the newest message of too many channels
+    return OutboundWithinLimits(queue, limits, now);
+}
+
+// A broadcast nothing has been written of yet, and the type its record would have
+BOOL IsBatchable(const OutboundFrame& pending, uint8_t& type, const char*& payload, uint32_t& payloadLength) {
+    return IsDroppable(pending) && FrameBody(pending.frame, type, payload, payloadLength) &&
+           (type == MessageType::NEW_MSG_UTF8 || type == MessageType::NEW_MSG_COMPACT);
+}
+
+// End of the run of frames starting at first that fit in one batch, and the size of their records
+size_t BatchRun(const OutboundQueue& queue, size_t first, const BatchLimits& limits, uint32_t& recordBytes) {
+    uint8_t runType;
+    const char* payload;
+    uint32_t payloadLength;
+    recordBytes = 0;
+    if (!IsBatchable(queue.frames[first], runType, payload, payloadLength)) {
+        return first + 1;
+    }
+    size_t end = first;
+    while (end < queue.frames.size()) {
+        uint8_t type;
+        const OutboundFrame& pending = queue.frames[end];
+        if (!IsBatchable(pending, type, payload, payloadLength) || type != runType ||
+            pending.queuedAt - queue.frames[first].queuedAt > limits.windowMs ||
+            recordBytes + BatchRecordSize(payloadLength) > limits.maxBytes) {
+            break;
+        }
+        recordBytes += BatchRecordSize(payloadLength);
+        end++;
+    }
+    return std::max(end, first + 1);
+}
+
+// Replace runs of pending broadcasts with BATCH frames, up to the frames
+// one write can take
+void OutboundBatch(OutboundQueue& queue, const BatchLimits& limits) {
+    size_t write = queue.head;
+    size_t read = queue.head;
+    while (read < queue.frames.size() && write - queue.head < OUTBOUND_IOV_BATCH) {
+        uint32_t recordBytes;
+        size_t end = BatchRun(queue, read, limits, recordBytes);
+        if (end - read < 2) {
+            queue.frames[write++] = queue.frames[read++];
+            continue;
+        }
+
+        uint8_t type;
+        const char* payload;
+        uint32_t payloadLength;
+        FrameBody(queue.frames[read].frame, type, payload, payloadLength);
+        SharedFrame* batch = NewFrame(BatchSize(recordBytes));
+        char* out = PackBatchHeader(batch->data, type, (uint32_t)(end - read), recordBytes);
+        uint64_t queuedAt = queue.frames[read].queuedAt;
+        for (; read < end; read++) {
+            SharedFrame* frame = queue.frames[read].frame;
+            FrameBody(frame, type, payload, payloadLength);
+            out = PackBatchRecord(out, payload, payloadLength);
+            queue.bytes -= frame->size;
+            ReleaseFrame(frame);
+        }
+        // Already merged, a batch is never dropped or merged again
+        queue.frames[write++] = OutboundFrame{batch, 0, queuedAt, FALSE, FALSE};
+        queue.bytes += batch->size;
+    }
+    if (write != read) {
+        queue.frames.erase(queue.frames.begin() + write, queue.frames.begin() + read);
+    }
+}
+
+// Frames that may go into a compression window
+BOOL IsCompressible(const OutboundFrame& pending) {
+    return !pending.packed && pending.offset == 0 && pending.frame->size <= COMPRESS_WINDOW_BYTES;
+}
+
+// Replace windows of pending frames with COMPRESSED frames, up to the frames
+// one write can take. Frames that would not shrink are marked and left alone.
+void OutboundCompress(OutboundQueue& queue) {
+    static thread_local std::vector<SharedFrame*> window;
+    size_t write = queue.head;
+    size_t read = queue.head;
+    while (read < queue.frames.size() && write - queue.head < OUTBOUND_IOV_BATCH) {
+        window.clear();
+        uint32_t rawBytes = 0;
+        size_t end = read;
+        while (end < queue.frames.size() && IsCompressible(queue.frames[end]) &&
+               rawBytes + queue.frames[end].frame->size <= COMPRESS_WINDOW_BYTES) {
+            window.push_back(queue.frames[end].frame);
+            rawBytes += queue.frames[end].frame->size;
+            end++;
+        }
+        if (window.empty()) {
+            queue.frames[write++] = queue.frames[read++];
+            continue;
+        }
+
+        SharedFrame* packed;
+        if (window.size() == 1) {
+            packed = CompressedForm(window[0]);
+            packed = packed == window[0] ? nullptr : AcquireFrame(packed);
+        } else {
+            packed = CompressFrames(window.data(), window.size());
+        }
+        if (packed == nullptr) {
+            for (; read < end; read++) {
+                queue.frames[read].packed = TRUE;
+                queue.frames[write++] = queue.frames[read];
+            }
+            continue;
+        }
+        uint64_t queuedAt = queue.frames[read].queuedAt;
+        for (; read < end; read++) {
+            queue.bytes -= queue.frames[read].frame->size;
+            ReleaseFrame(queue.frames[read].frame);
+        }
+        queue.frames[write++] = OutboundFrame{packed, 0, queuedAt, FALSE, TRUE};
+        queue.bytes += packed->size;
+    }
+    if (write != read) {
+        queue.frames.erase(queue.frames.begin() + write, queue.frames.begin() + read);
+    }
+}
+
+// Merge and compress what is pending, as the client allows
+void OutboundPrepare(OutboundQueue& queue) {
+    if (queue.batching && batchLimits.maxBytes > 0 && OutboundDepth(queue) > 1) {
+        OutboundBatch(queue, batchLimits);
+    }
+    if (queue.compressing) {
+        OutboundCompress(queue);
+    }
+}
+
+// Drop what a write took off the front of the queue. Returns TRUE when it
+// took less than requested, the socket is full.
+BOOL OutboundAdvance(OutboundQueue& queue, size_t sent, size_t requested) {
+    MetricsAdd(METRIC_BYTES_OUT, sent);
+    queue.bytes -= sent;
+    BOOL shortWrite = sent < requested;
+    while (sent > 0) {
+        OutboundFrame& pending = queue.frames[queue.head];
+        size_t remaining = pending.frame->size - pending.offset;
+        if (sent < remaining) {
+            pending.offset += sent;
+            break;
+        }
+        sent -= remaining;
+        ReleaseFrame(pending.frame);
+        queue.head++;
+    }
+    // A connection that always has a backlog never gets to OutboundClear,
+    // forget the sent frames once they are half the queue
+    if (queue.head > 0 && queue.head * 2 >= queue.frames.size()) {
+        queue.frames.erase(queue.frames.begin(), queue.frames.begin() + queue.head);
+        queue.head = 0;
+    }
+    return shortWrite;
+}
+
+#ifndef _WIN32
+// Point iov at up to OUTBOUND_IOV_BATCH unsent frames from the front of the
+// queue. Returns how many, requested gets their bytes.
+size_t OutboundGather(OutboundQueue& queue, struct iovec* iov, size_t& requested) {
+    size_t count = std::min<size_t>(OutboundDepth(queue), OUTBOUND_IOV_BATCH);
+    requested = 0;
+    for (size_t i = 0; i < count; i++) {
+        OutboundFrame& pending = queue.frames[queue.head + i];
+        iov[i].iov_base = pending.frame->data + pending.offset;
+        iov[i].iov_len = pending.frame->size - pending.offset;
+        requested += iov[i].iov_len;
+    }
+    return count;
+}
+#endif
+
+// Write queued frames until the queue is empty or the socket is full.
+// Returns 1 when drained, 0 when the socket would block, -1 on error.
+int OutboundFlush(OutboundQueue& queue, SOCKET sock) {
+    while (!OutboundEmpty(queue)) {
+        OutboundPrepare(queue);
+#ifdef _WIN32
+        size_t count = std::min<size_t>(OutboundDepth(queue), OUTBOUND_IOV_BATCH);
+        size_t requested = 0;
+        WSABUF iov[OUTBOUND_IOV_BATCH];
+        for (size_t i = 0; i < count; i++) {
+            OutboundFrame& pending = queue.frames[queue.head + i];
+            iov[i].buf = pending.frame->data + pending.offset;
+            iov[i].len = pending.frame->size - pending.offset;
+            requested += iov[i].len;
+        }
+        DWORD written = 0;
+        MetricsAdd(METRIC_SYSCALLS);
+        if (WSASend(sock, iov, (DWORD)count, &written, 0, NULL, NULL) == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+        }
+        size_t sent = written;
+#else
+        struct iovec iov[OUTBOUND_IOV_BATCH];
+        size_t requested;
+        size_t count = OutboundGather(queue, iov, requested);
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t written = sendmsg(sock, &message, MSG_NOSIGNAL);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        size_t sent = written;
+#endif
+
+        if (OutboundAdvance(queue, sent, requested)) {
+            return 0;  // the socket is full
+        }
+    }
+    OutboundClear(queue);
+    return 1;
+}
+
+BOOL ParseSlowConsumerPolicy(const char* name, SlowConsumerPolicy* policy) {
+    if (strcmp(name, "drop-oldest") == 0) {
+        *policy = POLICY_DROP_OLDEST;
+    } else if (strcmp(name, "coalesce") == 0) {
+        *policy = POLICY_COALESCE;
+    } else if (strcmp(name, "disconnect") == 0) {
+        *policy = POLICY_DISCONNECT;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <stdint.h>
+
+// Platform layer
+// On Windows this is just WinSock and the Win32 API. On POSIX systems the
+// handful of Win32 names used by the server are mapped onto BSD sockets and
+// pthreads, so the same sources build on both.
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <windows.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+typedef int socklen_t;
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef int SOCKET;
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef struct sockaddr SOCKADDR;
+typedef struct {
+    int unused;
+} WSADATA;
+
+#define WINAPI
+#define TRUE 1
+#define FALSE 0
+#define NO_ERROR 0
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define WSAEINTR EINTR
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAEINPROGRESS EINPROGRESS
+#define WSAECONNRESET ECONNRESET
+#define WSAECONNABORTED ECONNABORTED
+#define SD_BOTH SHUT_RDWR
+#define STD_INPUT_HANDLE 0
+#define STD_OUTPUT_HANDLE 1
+#define CTRL_C_EVENT 0
+#define MAKEWORD(low, high) ((uint16_t)(((uint8_t)(low)) | (((uint16_t)(uint8_t)(high)) << 8)))
+#define ZeroMemory(dst, len) memset((dst), 0, (len))
+
+typedef BOOL (*PHANDLER_ROUTINE)(DWORD);
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+inline int closesocket(SOCKET sock) {
+    return close(sock);
+}
+
+inline int WSAGetLastError() {
+    return errno;
+}
+
+// FIONBIO only, for non-blocking sockets
+inline int ioctlsocket(SOCKET sock, long command, unsigned long* arg) {
+    int value = (int)*arg;
+    return ioctl(sock, command, &value);
+}
+
+typedef struct pollfd WSAPOLLFD;
+
+inline int WSAPoll(WSAPOLLFD* fds, unsigned long count, int timeoutMs) {
+    return poll(fds, count, timeoutMs);
+}
+
+inline int WSAStartup(uint16_t, WSADATA*) {
+    // A peer closing its end must surface as an error from send, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+inline int WSACleanup() {
+    return 0;
+}
+
+inline HANDLE GetStdHandle(int which) {
+    return which == STD_INPUT_HANDLE ? (HANDLE)stdin : (HANDLE)stdout;
+}
+
+static PHANDLER_ROUTINE consoleCtrlHandler = nullptr;
+
+inline void ConsoleSignalHandler(int) {
+    if (consoleCtrlHandler != nullptr) {
+        consoleCtrlHandler(CTRL_C_EVENT);
+    }
+}
+
+inline BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE handler, BOOL add) {
+    consoleCtrlHandler = add ? handler : nullptr;
+    return signal(SIGINT, add ? ConsoleSignalHandler : SIG_DFL) != SIG_ERR;
+}
+
+typedef struct {
+    LPTHREAD_START_ROUTINE start;
+    LPVOID param;
+} ThreadStart;
+
+inline void* ThreadTrampoline(void* arg) {
+    ThreadStart start = *(ThreadStart*)arg;
+    delete (ThreadStart*)arg;
+    start.start(start.param);
+    return nullptr;
+}
+
+// Threads are always detached, the returned handle only signals success
+inline HANDLE CreateThread(void*, size_t, LPTHREAD_START_ROUTINE start,
+                           LPVOID param, DWORD, DWORD* threadId) {
+    pthread_t thread;
+    ThreadStart* arg = new ThreadStart{start, param};
+    if (pthread_create(&thread, nullptr, ThreadTrampoline, arg) != 0) {
+        delete arg;
+        return nullptr;
+    }
+    pthread_detach(thread);
+    if (threadId != nullptr) {
+        *threadId = (DWORD)(uintptr_t)thread;
+    }
+    return (HANDLE)(uintptr_t)thread;
+}
+
+inline BOOL CloseHandle(HANDLE) {
+    return TRUE;
+}
+
+// Milliseconds since an arbitrary point, like the Win32 call
+inline uint64_t GetTickCount64() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+inline void Sleep(DWORD milliseconds) {
+    usleep((useconds_t)milliseconds * 1000);
+}
+
+#endif
@@ -1,7 +1,12 @@
+#pragma once
 #include <stdint.h>
 #include <cstring>
+#include <cwchar>
 #include <vector>
-#pragma pack(1)
+#include <algorithm>
+#include "platform.cpp"
+#include "utf8.cpp"
+#pragma pack(push, 1)
 
 // Message Header
 // +------------+---------+--------------+
@@ -25,6 +30,31 @@
 //       0x07 -- NewMsg
 //       0x08 -- LeaveChannelSuccess
 //       0x09 -- Error
+// ------------------ UTF-8 ---------------------------
+//       0x0A -- LoginUtf8
+//       0x0B -- SendMsgUtf8
+//       0x0C -- NewMsgUtf8
+// ------------------ Compact -------------------------
+//       0x0D -- NewMsgCompact
+//       0x0E -- UserInfo
+// ------------------ Batch ---------------------------
+//       0x0F -- Batch
+//       0x10 -- Compressed
+// ------------------ History -------------------------
+//       0x11 -- History
+//       0x12 -- HistoryResult
+// ------------------ Admin ---------------------------
+//       0x13 -- Stats
+//       0x14 -- StatsResult
+// ------------------ Federation ----------------------
+//       0x15 -- PeerHello
+//       0x16 -- PeerChannels
+//       0x17 -- PeerSubscribe
+//       0x18 -- PeerUnsubscribe
+//       0x19 -- PeerMsg
+// ------------------ Liveness ------------------------
+//       0x1A -- Ping
+//       0x1B -- Pong
 // PayloadLength: length of payload
 // Payload: See below
 
@@ -44,9 +74,34 @@ enum MessageType : uint8_t {
     JOIN_CHANNEL_SUCCESS = 0x06,
     NEW_MSG = 0x07,
     LEAVE_CHANNEL_SUCCESS = 0x08,
-    ERR = 0x09
+    ERR = 0x09,
+    LOGIN_UTF8 = 0x0A,
+    SEND_MSG_UTF8 = 0x0B,
+    NEW_MSG_UTF8 = 0x0C,
+    NEW_MSG_COMPACT = 0x0D,
+    USER_INFO = 0x0E,
+    BATCH = 0x0F,
+    COMPRESSED = 0x10,
+    HISTORY = 0x11,
+    HISTORY_RESULT = 0x12,
+    STATS = 0x13,
+    STATS_RESULT = 0x14,
+    PEER_HELLO = 0x15,
+    PEER_CHANNELS = 0x16,
+    PEER_SUBSCRIBE = 0x17,
+    PEER_UNSUBSCRIBE = 0x18,
+    PEER_MSG = 0x19,
+    PING = 0x1A,
+    PONG = 0x1B
 };
 
+// Optional protocol features, requested in LOGIN_UTF8 and granted in LOGIN_SUCCESS
+const uint32_t FEATURE_UTF8 = 1 << 0;  // SEND_MSG_UTF8 / NEW_MSG_UTF8 instead of wchar_t text
+const uint32_t FEATURE_COMPACT = 1 << 1;  // NEW_MSG_COMPACT and USER_INFO in compact frames
+const uint32_t FEATURE_BATCH = 1 << 2;  // several messages per BATCH frame
+const uint32_t FEATURE_DEFLATE = 1 << 3;  // frames may arrive deflated inside COMPRESSED frames
+const uint32_t FEATURE_PING = 1 << 4;  // the client answers PING, so the server may probe it when it is quiet
+
 // Login Payload
 // +----------------+
 // |    Nickname    |
@@ -59,16 +114,59 @@ typedef struct {
     wchar_t nickname[32];
 } LoginPayload;
 
+// LoginUtf8 Payload
+// +----------+------------+----------+----------+
+// | Features | NickLength | Nickname | Resume   |
+// +----------+------------+----------+----------+
+// |  4 bytes |   1 byte   |   ...    | optional |
+// +----------+------------+----------+----------+
+// Client sends nickname to server, portable replacement for Login
+// Features: FEATURE_* bits the client supports, implies FEATURE_UTF8
+// NickLength: length of nickname in bytes
+// Nickname: nickname, in UTF-8 encoding, not terminated
+// Resume: only when reconnecting after the connection dropped
+//
+// Resume
+// +-------------+--------------+-----------+---------+-------+
+// | ResumeToken | ChannelCount | ChannelID | LastSeq |  ...  |
+// +-------------+--------------+-----------+---------+-------+
+// |   8 bytes   |   4 bytes    |  4 bytes  | 8 bytes |  ...  |
+// +-------------+--------------+-----------+---------+-------+
+// ResumeToken: from the LoginSuccess of the connection that dropped
+// ChannelID, LastSeq: newest message the client has seen in each channel
+// While the token is valid the client gets its UserID back, is put back into
+// its channels, and right after LoginSuccess each listed channel's messages
+// after LastSeq are replayed as HistoryResult frames, as far as the server
+// still has them. Otherwise the client logs in as a new user.
+
+typedef struct {
+    uint32_t features;
+    uint8_t nickname_length;
+} LoginUtf8Payload;
+
+typedef struct {
+    uint64_t token;
+    uint32_t channel_count;
+} ResumePayload;
+
+typedef struct {
+    uint32_t channel_id;
+    uint64_t last_seq;
+} ResumeCursor;
+
 // LoginSuccess Payload
-// +----------+---------------+-----------+-----------+-------+
-// |  UserID  | ChannelAmount | ChannelID | ChannelID |  ...  |
-// +----------+---------------+-----------+-----------+-------+
-// |  4 bytes |    4 bytes    |  4 bytes  |  4 bytes  |  ...  |
-// +----------+---------------+-----------+-----------+-------+
+// +----------+---------------+-----------+-------+----------+-------------+
+// |  UserID  | ChannelAmount | ChannelID |  ...  | Features | ResumeToken |
+// +----------+---------------+-----------+-------+----------+-------------+
+// |  4 bytes |    4 bytes    |  4 bytes  |  ...  |  4 bytes |   8 bytes   |
+// +----------+---------------+-----------+-------+----------+-------------+
 // Server responds to login request
 // UserID: assign a unique ID to user
 // ChannelAmount: amount of channels available on server
 // ChannelID: ID of channel
+// Features: FEATURE_* bits granted to this connection, older clients ignore it
+// ResumeToken: lets a LoginUtf8 resume this session if the connection drops,
+// 0 if it can not be resumed. Older clients ignore it.
 
 typedef struct {
     uint32_t user_id;
@@ -110,7 +208,7 @@ typedef JoinChannelPayload JoinChannelSuccessPayload;
 // ChannelID: ID of channel
 // Nickname: nickname of sender
 // MsgLength: length of message
-// Msg: message, in UTF-16LE encoding
+// Msg: message, as wchar_t (UTF-16 on Windows, UTF-32 elsewhere)
 
 typedef struct {
     uint32_t user_id;
@@ -120,20 +218,56 @@ typedef struct {
 } SendMsgPayload;
 
 // NewMsg Payload
-// +----------+-----------+----------+-----------+----------+
-// |  UserID  | ChannelID | Nickname | MsgLength |   Msg    |
-// +----------+-----------+----------+-----------+----------+
-// |  4 bytes |  4 bytes  | 64 bytes |  4 bytes  |  ...     |
-// +----------+-----------+----------+-----------+----------+
+// +----------+-----------+----------+-----------+----------+---------+
+// |  UserID  | ChannelID | Nickname | MsgLength |   Msg    |   Seq   |
+// +----------+-----------+----------+-----------+----------+---------+
+// |  4 bytes |  4 bytes  | 64 bytes |  4 bytes  |  ...     | 8 bytes |
+// +----------+-----------+----------+-----------+----------+---------+
 // Server sends message to all users in channel
 // UserID: ID of sender
 // ChannelID: ID of channel
 // Nickname: nickname of sender
 // MsgLength: length of message
-// Msg: message, in UTF-8 encoding
+// Msg: message, as wchar_t like SendMsg
+// Seq: sequence number of the message in its channel, 1 for the first one
+// and one more for every message after it. Older clients ignore it.
 
 typedef SendMsgPayload NewMsgPayload;
 
+// SendMsgUtf8 Payload
+// +----------+-----------+-----------+----------+
+// |  UserID  | ChannelID | MsgLength |   Msg    |
+// +----------+-----------+-----------+----------+
+// |  4 bytes |  4 bytes  |  4 bytes  |  ...     |
+// +----------+-----------+-----------+----------+
+// Client sends message to channel, when FEATURE_UTF8 was granted
+// MsgLength: length of message in bytes
+// Msg: message, in UTF-8 encoding, not terminated
+
+typedef struct {
+    uint32_t user_id;
+    uint32_t channel_id;
+    uint32_t msg_length;
+} SendMsgUtf8Payload;
+
+// NewMsgUtf8 Payload
+// +----------+-----------+------------+-----------+----------+-------+---------+
+// |  UserID  | ChannelID | NickLength | MsgLength | Nickname |  Msg  |   Seq   |
+// +----------+-----------+------------+-----------+----------+-------+---------+
+// |  4 bytes |  4 bytes  |   1 byte   |  4 bytes  |   ...    |  ...  | 8 bytes |
+// +----------+-----------+------------+-----------+----------+-------+---------+
+// Server sends message to users that were granted FEATURE_UTF8
+// NickLength, MsgLength: lengths in bytes
+// Nickname, Msg: in UTF-8 encoding, not terminated
+// Seq: as in NewMsg
+
+typedef struct {
+    uint32_t user_id;
+    uint32_t channel_id;
+    uint8_t nickname_length;
+    uint32_t msg_length;
+} NewMsgUtf8Payload;
+
 // LeaveChannel Payload
 // +----------+-----------+
 // |  UserID  | ChannelID |
@@ -165,243 +299,1105 @@ typedef struct {
     uint32_t user_id;
 } DisconnectPayload;
 
-// Error Payload
+// Batch Payload
+// +------------+---------+--------+-------+
+// | RecordType |  Count  | Record |  ...  |
+// +------------+---------+--------+-------+
+// |   1 byte   | 4 bytes |  ...   |  ...  |
+// +------------+---------+--------+-------+
+// Server packs messages that queued up for a busy client into one frame,
+// only to clients that were granted FEATURE_BATCH
+// RecordType: message type of every record, NewMsgUtf8 or NewMsgCompact
+// Count: number of records
+// Record: | Length (varint) | Payload of a RecordType frame |
+
+typedef struct {
+    uint8_t record_type;
+    uint32_t count;
+} BatchPayload;
+
+// Compressed Payload
+// +-----------+----------+
+// | RawLength | Deflated |
+// +-----------+----------+
+// |  4 bytes  |   ...    |
+// +-----------+----------+
+// Server sends frames compressed to clients granted FEATURE_DEFLATE, mixed
+// with frames sent as they are
+// RawLength: size of the frames once inflated
+// Deflated: raw deflate stream (RFC 1951) holding one or more complete
+// frames, compressed with DEFLATE_DICTIONARY as preset dictionary and
+// independent of every other Compressed frame
+
+typedef struct {
+    uint32_t raw_length;
+} CompressedPayload;
+
+// History Payload
+// +-----------+-----------+----------+
+// | ChannelID | BeforeSeq | MaxCount |
+// +-----------+-----------+----------+
+// |  4 bytes  |  8 bytes  | 4 bytes  |
+// +-----------+-----------+----------+
+// Client asks for the messages of a channel older than BeforeSeq
+// BeforeSeq: sequence number to page back from, 0 for the newest messages
+// MaxCount: most messages wanted, the server caps it at HISTORY_PAGE_MAX and
+// sends fewer when they would not fit in one frame
+
+typedef struct {
+    uint32_t channel_id;
+    uint64_t before_seq;
+    uint32_t max_count;
+} HistoryPayload;
+
+// HistoryResult Payload
+// +-----------+---------+--------+-------+
+// | ChannelID |  Count  | Record |  ...  |
+// +-----------+---------+--------+-------+
+// |  4 bytes  | 4 bytes |  ...   |  ...  |
+// +-----------+---------+--------+-------+
+// Server answers History with up to MaxCount records, oldest first.
+// Count is 0 when there is nothing older. To page further back, ask again
+// with the Seq of the first record as BeforeSeq.
+//
+// History Record
+// +--------+-----+--------+-----------+-------------+----------+-----+
+// | Length | Seq | UserID | Timestamp | NickLength  | Nickname | Msg |
+// +--------+-----+--------+-----------+-------------+----------+-----+
+// |   4    |  8  |   4    |     8     |   1 byte    |   ...    | ... |
+// +--------+-----+--------+-----------+-------------+----------+-----+
+// Length: size of the whole record
+// Seq: position of the message in its channel, starting at 1
+// Timestamp: milliseconds since the Unix epoch
+// Nickname, Msg: in UTF-8 encoding, Msg is the rest of the record
+// Records are stored on disk in this same layout.
+
+typedef struct {
+    uint32_t channel_id;
+    uint32_t count;
+} HistoryResultPayload;
+
+typedef struct {
+    uint32_t length;
+    uint64_t seq;
+    uint32_t user_id;
+    uint64_t timestamp;
+    uint8_t nickname_length;
+} HistoryRecord;
+
+// Stats Payload
 // +----------+
-// | ErrCode  |
+// |  UserID  |
 // +----------+
 // |  4 bytes |
 // +----------+
+// Client asks for the server's metrics, only answered for clients connected
+// from the loopback interface, others get Error 2
+
+typedef struct {
+    uint32_t user_id;
+} StatsPayload;
+
+// StatsResult Payload
+// +---------+-------+-------+
+// |  Count  | Entry |  ...  |
+// +---------+-------+-------+
+// | 4 bytes |  ...  |  ...  |
+// +---------+-------+-------+
+// Server answers Stats with Count named values
+//
+// Stats Entry
+// +------------+------+---------+
+// | NameLength | Name |  Value  |
+// +------------+------+---------+
+// |   1 byte   | ...  | 8 bytes |
+// +------------+------+---------+
+// Name: ASCII, like "sent_bytes", "frames_received.SEND_MSG" or
+// "fanout_latency_ns.p99"
+
+typedef struct {
+    uint32_t count;
+} StatsResultPayload;
+
+// Ping / Pong Payload
+// +----------+
+// |  Token   |
+// +----------+
+// |  8 bytes |
+// +----------+
+// Either side may send Ping, the other answers with a Pong carrying the same
+// Token. The server pings quiet clients that asked for FEATURE_PING and
+// closes those that stay silent.
+
+typedef struct {
+    uint64_t token;
+} PingPayload;
+
+typedef PingPayload PongPayload;
+
+// Error Payload
+// +----------+------------+
+// | ErrCode  | RetryAfter |
+// +----------+------------+
+// |  4 bytes |  optional  |
+// +----------+------------+
 // Server sends error message to client
-// ErrCode: error code
+// ErrCode: error code, 1 -- not logged in, 2 -- not permitted (e.g. a message
+// to a channel the client has not joined), 3 -- rate limited
+// RetryAfter: 4 bytes, only with ErrCode 3: milliseconds until the server
+// takes another message from the client. The message was dropped.
+
+const uint32_t ERR_NOT_LOGGED_IN = 1;
+const uint32_t ERR_NOT_PERMITTED = 2;
+const uint32_t ERR_RATE_LIMITED = 3;
 
 typedef struct {
     uint32_t err_code;
 } ErrorPayload;
 
-char* PackLogin(const wchar_t* nickname, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(LoginPayload);
+// PeerHello Payload
+// +----------+-----------+-----+
+// |  NodeID  | KeyLength | Key |
+// +----------+-----------+-----+
+// |  4 bytes |  1 byte   | ... |
+// +----------+-----------+-----+
+// First frame in both directions of a link between two federated servers
+// NodeID: 1..255, the top 8 bits of every UserID the node hands out
+// KeyLength, Key: the cluster's pre-shared key, 0 and empty without one. A
+// node drops links whose hello does not carry the same key as its own.
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+typedef struct {
+    uint32_t node_id;
+} PeerHelloPayload;
+
+// PeerChannels Payload
+// +---------+-----------+-------+
+// |  Count  | ChannelID |  ...  |
+// +---------+-----------+-------+
+// | 4 bytes |  4 bytes  |  ...  |
+// +---------+-----------+-------+
+// Right after PeerHello, every channel the sender has local members in.
+// PeerSubscribe and PeerUnsubscribe then follow the changes.
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = LOGIN;
-    header->payload_length = sizeof(LoginPayload);
+typedef struct {
+    uint32_t count;
+} PeerChannelsPayload;
 
-    LoginPayload* payload = reinterpret_cast<LoginPayload*>(buffer + sizeof(MessageHeader));
-    memcpy(payload->nickname, nickname, 32 * sizeof(wchar_t));
+// PeerSubscribe / PeerUnsubscribe Payload
+// +-----------+
+// | ChannelID |
+// +-----------+
+// |  4 bytes  |
+// +-----------+
+// The sender got its first local member in the channel / lost its last one
 
-    return buffer;
+typedef struct {
+    uint32_t channel_id;
+} PeerSubscribePayload;
+
+typedef PeerSubscribePayload PeerUnsubscribePayload;
+
+// PeerMsg Payload
+// +----------+-----------+------------+-----------+----------+-------+
+// |  UserID  | ChannelID | NickLength | MsgLength | Nickname |  Msg  |
+// +----------+-----------+------------+-----------+----------+-------+
+// |  4 bytes |  4 bytes  |   1 byte   |  4 bytes  |   ...    |  ...  |
+// +----------+-----------+------------+-----------+----------+-------+
+// A message sent by a user of the sender, forwarded once to every node that
+// has members in the channel. The receiver numbers it in its own history.
+// Fields as in NewMsgUtf8, without Seq.
+
+typedef NewMsgUtf8Payload PeerMsgPayload;
+
+#pragma pack(pop)
+
+const uint32_t FRAME_MAGIC = 0x4F727A43; // ASCII for 'OrzC'
+
+// Compact Frame
+// +-----+------+---------------+---------+
+// | Tag | Type | PayloadLength | Payload |
+// +-----+------+---------------+---------+
+// |  1  | var  |      var      |   ...   |
+// +-----+------+---------------+---------+
+// Sent by the server in place of NEW_MSG to clients granted FEATURE_COMPACT,
+// mixed with regular frames on the same stream. The tag can not start a
+// regular frame, whose first byte is the 'C' of the magic number.
+// var: unsigned LEB128 varint, 7 bits per byte, low bits first, at most 5 bytes
+//
+// NewMsgCompact Payload
+// +--------+-----------+-----+------+
+// | UserID | ChannelID | Seq | Msg  |
+// +--------+-----------+-----+------+
+// |  var   |    var    | var | ...  |
+// +--------+-----------+-----+------+
+// Seq: as in NewMsg, a varint of up to 10 bytes
+// Msg: message in UTF-8 encoding, the rest of the payload
+// The sender's nickname is not repeated, see UserInfo
+//
+// UserInfo Payload
+// +--------+----------+
+// | UserID | Nickname |
+// +--------+----------+
+// |  var   |   ...    |
+// +--------+----------+
+// Directory update, sent once per connection before the first NewMsgCompact
+// from that user. Nickname: in UTF-8 encoding, the rest of the payload
+
+const uint8_t COMPACT_TAG = 0xFC;
+const uint32_t VARINT_MAX_BYTES = 5;
+const uint32_t COMPACT_HEADER_MAX = 1 + 2 * VARINT_MAX_BYTES;
+const uint32_t VARINT64_MAX_BYTES = 10;
+
+uint32_t VarintSize(uint32_t value) {
+    uint32_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
 }
 
-char* PackSendMsg(uint32_t userId, uint32_t channelId, wchar_t nickname[32], const wchar_t* msg, uint32_t& totalPackSize) {
-    uint32_t msgLength = wcslen(msg) + 1;
+char* PutVarint(char* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+// Read a varint from src, returns the bytes it took, 0 if src ends inside it
+// or -1 if it is longer than a uint32_t can be
+int GetVarint(const char* src, size_t len, uint32_t& value) {
+    value = 0;
+    for (uint32_t i = 0; i < VARINT_MAX_BYTES; i++) {
+        if (i == len) {
+            return 0;
+        }
+        uint8_t byte = (uint8_t)src[i];
+        value |= (uint32_t)(byte & 0x7F) << (7 * i);
+        if (byte < 0x80) {
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
 
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(SendMsgPayload) + msgLength * sizeof(wchar_t);
+uint32_t VarintSize64(uint64_t value) {
+    uint32_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+char* PutVarint64(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+// GetVarint for sequence numbers
+int GetVarint64(const char* src, size_t len, uint64_t& value) {
+    value = 0;
+    for (uint32_t i = 0; i < VARINT64_MAX_BYTES; i++) {
+        if (i == len) {
+            return 0;
+        }
+        uint8_t byte = (uint8_t)src[i];
+        value |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if (byte < 0x80) {
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+// Parse the header of a compact frame, same return values as GetVarint
+int ParseCompactHeader(const char* src, size_t len, uint8_t& type, uint32_t& payloadLength) {
+    if (len < 1) {
+        return 0;
+    }
+    uint32_t value;
+    int typeBytes = GetVarint(src + 1, len - 1, value);
+    if (typeBytes <= 0) {
+        return typeBytes;
+    }
+    if (value > 0xFF) {
+        return -1;
+    }
+    type = (uint8_t)value;
+    int lengthBytes = GetVarint(src + 1 + typeBytes, len - 1 - typeBytes, payloadLength);
+    if (lengthBytes <= 0) {
+        return lengthBytes;
+    }
+    return 1 + typeBytes + lengthBytes;
+}
+
+// Fixed-size frames
+// Messages whose payload never changes size map to a payload struct here.
+// FixedFrame<Type> is the whole frame as one packed struct with the header
+// and the sizes known at compile time, so building one is a few stores into
+// a stack object and decoding one is a single bounds check and copy.
+
+template <MessageType Type> struct FixedPayload;
+template <> struct FixedPayload<LOGIN> { typedef LoginPayload type; };
+template <> struct FixedPayload<JOIN_CHANNEL> { typedef JoinChannelPayload type; };
+template <> struct FixedPayload<LEAVE_CHANNEL> { typedef LeaveChannelPayload type; };
+template <> struct FixedPayload<DISCONNECT> { typedef DisconnectPayload type; };
+template <> struct FixedPayload<JOIN_CHANNEL_SUCCESS> { typedef JoinChannelSuccessPayload type; };
+template <> struct FixedPayload<LEAVE_CHANNEL_SUCCESS> { typedef LeaveChannelSuccessPayload type; };
+template <> struct FixedPayload<ERR> { typedef ErrorPayload type; };
+template <> struct FixedPayload<HISTORY> { typedef HistoryPayload type; };
+template <> struct FixedPayload<STATS> { typedef StatsPayload type; };
+template <> struct FixedPayload<PEER_HELLO> { typedef PeerHelloPayload type; };
+template <> struct FixedPayload<PEER_SUBSCRIBE> { typedef PeerSubscribePayload type; };
+template <> struct FixedPayload<PEER_UNSUBSCRIBE> { typedef PeerUnsubscribePayload type; };
+template <> struct FixedPayload<PING> { typedef PingPayload type; };
+template <> struct FixedPayload<PONG> { typedef PongPayload type; };
+
+#pragma pack(push, 1)
+template <MessageType Type>
+struct FixedFrame {
+    typedef typename FixedPayload<Type>::type Payload;
+    static constexpr uint32_t PAYLOAD_SIZE = sizeof(Payload);
+    static constexpr uint32_t SIZE = sizeof(MessageHeader) + sizeof(Payload);
+    static constexpr MessageHeader HEADER = {FRAME_MAGIC, Type, PAYLOAD_SIZE};
+
+    MessageHeader header;
+    Payload payload;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FixedFrame<JOIN_CHANNEL>) == FixedFrame<JOIN_CHANNEL>::SIZE, "fixed frames must not be padded");
+static_assert(FixedFrame<JOIN_CHANNEL>::SIZE == 17, "JOIN_CHANNEL frames are 17 bytes on the wire");
+static_assert(FixedFrame<ERR>::SIZE == 13, "ERR frames are 13 bytes on the wire");
+
+template <MessageType Type>
+constexpr FixedFrame<Type> BuildFrame(const typename FixedPayload<Type>::type& payload) {
+    return FixedFrame<Type>{FixedFrame<Type>::HEADER, payload};
+}
+
+// Copy the payload of a frame of the given type out of a received buffer.
+// Returns FALSE if the frame is of another type or shorter than the payload.
+template <MessageType Type>
+BOOL DecodeFrame(const char* frame, size_t size, typename FixedPayload<Type>::type& payload) {
+    const MessageHeader* header = reinterpret_cast<const MessageHeader*>(frame);
+    if (size < FixedFrame<Type>::SIZE || header->type != Type ||
+        header->payload_length < FixedFrame<Type>::PAYLOAD_SIZE) {
+        return FALSE;
+    }
+    memcpy(&payload, frame + sizeof(MessageHeader), sizeof(payload));
+    return TRUE;
+}
+
+// Write a fixed-size frame into a caller buffer, returns its size or 0 if it does not fit
+template <MessageType Type>
+uint32_t PackFixedInto(char* out, uint32_t capacity, const typename FixedPayload<Type>::type& payload) {
+    if (capacity < FixedFrame<Type>::SIZE) {
+        return 0;
+    }
+    FixedFrame<Type> frame = BuildFrame<Type>(payload);
+    memcpy(out, &frame, sizeof(frame));
+    return FixedFrame<Type>::SIZE;
+}
+
+// Smallest valid payload for each message type, unknown types are not checked
+uint32_t MinPayloadLength(uint8_t type) {
+    switch (type) {
+    case LOGIN:
+        return FixedFrame<LOGIN>::PAYLOAD_SIZE;
+    case JOIN_CHANNEL:
+        return FixedFrame<JOIN_CHANNEL>::PAYLOAD_SIZE;
+    case LEAVE_CHANNEL:
+        return FixedFrame<LEAVE_CHANNEL>::PAYLOAD_SIZE;
+    case JOIN_CHANNEL_SUCCESS:
+        return FixedFrame<JOIN_CHANNEL_SUCCESS>::PAYLOAD_SIZE;
+    case LEAVE_CHANNEL_SUCCESS:
+        return FixedFrame<LEAVE_CHANNEL_SUCCESS>::PAYLOAD_SIZE;
+    case DISCONNECT:
+        return FixedFrame<DISCONNECT>::PAYLOAD_SIZE;
+    case ERR:
+        return FixedFrame<ERR>::PAYLOAD_SIZE;
+    case HISTORY:
+        return FixedFrame<HISTORY>::PAYLOAD_SIZE;
+    case STATS:
+        return FixedFrame<STATS>::PAYLOAD_SIZE;
+    case PEER_HELLO:
+        return FixedFrame<PEER_HELLO>::PAYLOAD_SIZE;
+    case PEER_SUBSCRIBE:
+        return FixedFrame<PEER_SUBSCRIBE>::PAYLOAD_SIZE;
+    case PEER_UNSUBSCRIBE:
+        return FixedFrame<PEER_UNSUBSCRIBE>::PAYLOAD_SIZE;
+    case PING:
+        return FixedFrame<PING>::PAYLOAD_SIZE;
+    case PONG:
+        return FixedFrame<PONG>::PAYLOAD_SIZE;
+    case SEND_MSG:
+    case NEW_MSG:
+        return sizeof(SendMsgPayload);
+    case LOGIN_SUCCESS:
+        return sizeof(LoginSuccessPayload);
+    case LOGIN_UTF8:
+        return sizeof(LoginUtf8Payload);
+    case SEND_MSG_UTF8:
+        return sizeof(SendMsgUtf8Payload);
+    case NEW_MSG_UTF8:
+        return sizeof(NewMsgUtf8Payload);
+    case BATCH:
+        return sizeof(BatchPayload);
+    case COMPRESSED:
+        return sizeof(CompressedPayload);
+    case HISTORY_RESULT:
+        return sizeof(HistoryResultPayload);
+    case STATS_RESULT:
+        return sizeof(StatsResultPayload);
+    case PEER_CHANNELS:
+        return sizeof(PeerChannelsPayload);
+    case PEER_MSG:
+        return sizeof(PeerMsgPayload);
+    default:
+        return 0;
+    }
+}
+
+// Every message has a Pack*Into function that serializes it into a buffer
+// owned by the caller (a stack array, a pooled slab, an output queue) and
+// returns the frame size, or 0 if capacity is too small. The Pack* functions
+// below them return a new[] buffer the caller has to delete[].
+
+// Write the frame header and return where the payload starts
+char* PackHeader(char* out, MessageType type, uint32_t payloadLength) {
+    MessageHeader* header = reinterpret_cast<MessageHeader*>(out);
+    header->magic_number = FRAME_MAGIC;
+    header->type = type;
+    header->payload_length = payloadLength;
+    return out + sizeof(MessageHeader);
+}
+
+// Frame sizes of the variable length messages
+uint32_t SendMsgSize(const wchar_t* msg) {
+    return sizeof(MessageHeader) + sizeof(SendMsgPayload) + (uint32_t)(wcslen(msg) + 1) * sizeof(wchar_t);
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
+uint32_t NewMsgSize(const wchar_t* msg) {
+    return sizeof(MessageHeader) + sizeof(NewMsgPayload) + (uint32_t)(wcslen(msg) + 1) * sizeof(wchar_t) +
+           sizeof(uint64_t);
+}
+
+uint32_t LoginSuccessSize(uint32_t channelAmount) {
+    return sizeof(MessageHeader) + sizeof(LoginSuccessPayload) + (channelAmount + 1) * sizeof(uint32_t) +
+           sizeof(uint64_t);
+}
+
+uint32_t LoginUtf8Size(uint32_t nicknameBytes) {
+    return sizeof(MessageHeader) + sizeof(LoginUtf8Payload) + nicknameBytes;
+}
+
+uint32_t LoginResumeSize(uint32_t nicknameBytes, uint32_t channelCount) {
+    return LoginUtf8Size(nicknameBytes) + sizeof(ResumePayload) + channelCount * sizeof(ResumeCursor);
+}
+
+uint32_t SendMsgUtf8Size(uint32_t msgBytes) {
+    return sizeof(MessageHeader) + sizeof(SendMsgUtf8Payload) + msgBytes;
+}
+
+uint32_t NewMsgUtf8Size(uint32_t nicknameBytes, uint32_t msgBytes) {
+    return sizeof(MessageHeader) + sizeof(NewMsgUtf8Payload) + nicknameBytes + msgBytes + sizeof(uint64_t);
+}
+
+uint32_t PeerChannelsSize(uint32_t channelCount) {
+    return sizeof(MessageHeader) + sizeof(PeerChannelsPayload) + channelCount * sizeof(uint32_t);
+}
+
+uint32_t PeerMsgSize(uint32_t nicknameBytes, uint32_t msgBytes) {
+    return sizeof(MessageHeader) + sizeof(PeerMsgPayload) + nicknameBytes + msgBytes;
+}
+
+uint32_t CompactSize(MessageType type, uint32_t payloadLength) {
+    return 1 + VarintSize(type) + VarintSize(payloadLength) + payloadLength;
+}
 
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = SEND_MSG;
-    header->payload_length = sizeof(SendMsgPayload) + msgLength * sizeof(wchar_t);
+uint32_t NewMsgCompactSize(uint32_t userId, uint32_t channelId, uint64_t seq, uint32_t msgBytes) {
+    return CompactSize(NEW_MSG_COMPACT, VarintSize(userId) + VarintSize(channelId) + VarintSize64(seq) + msgBytes);
+}
+
+uint32_t UserInfoSize(uint32_t userId, uint32_t nicknameBytes) {
+    return CompactSize(USER_INFO, VarintSize(userId) + nicknameBytes);
+}
+
+uint32_t BatchRecordSize(uint32_t payloadLength) {
+    return VarintSize(payloadLength) + payloadLength;
+}
+
+uint32_t BatchSize(uint32_t recordBytes) {
+    return sizeof(MessageHeader) + sizeof(BatchPayload) + recordBytes;
+}
+
+uint32_t HistoryRecordSize(uint32_t nicknameBytes, uint32_t msgBytes) {
+    return sizeof(HistoryRecord) + nicknameBytes + msgBytes;
+}
 
-    SendMsgPayload* payload = reinterpret_cast<SendMsgPayload*>(buffer + sizeof(MessageHeader));
+uint32_t HistoryResultSize(uint32_t recordBytes) {
+    return sizeof(MessageHeader) + sizeof(HistoryResultPayload) + recordBytes;
+}
+
+uint32_t PackLoginInto(char* out, uint32_t capacity, const wchar_t* nickname) {
+    LoginPayload payload;
+    memcpy(payload.nickname, nickname, 32 * sizeof(wchar_t));
+    return PackFixedInto<LOGIN>(out, capacity, payload);
+}
+
+uint32_t PackSendMsgInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, const wchar_t* msg) {
+    uint32_t msgLength = wcslen(msg) + 1;
+    uint32_t totalPackSize = sizeof(MessageHeader) + sizeof(SendMsgPayload) + msgLength * sizeof(wchar_t);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+
+    SendMsgPayload* payload = reinterpret_cast<SendMsgPayload*>(
+        PackHeader(out, SEND_MSG, sizeof(SendMsgPayload) + msgLength * sizeof(wchar_t)));
     payload->user_id = userId;
     payload->channel_id = channelId;
+    memset(payload->nickname, 0, sizeof(payload->nickname));  // the server fills in the nickname
     payload->msg_length = msgLength;
 
-    wchar_t* message = reinterpret_cast<wchar_t*>(buffer + sizeof(MessageHeader) + sizeof(SendMsgPayload));
+    wchar_t* message = reinterpret_cast<wchar_t*>(out + sizeof(MessageHeader) + sizeof(SendMsgPayload));
     memcpy(message, msg, msgLength * sizeof(wchar_t));
+    return totalPackSize;
+}
 
-    return buffer;
+uint32_t PackErrorInto(char* out, uint32_t capacity, uint32_t errCode) {
+    return PackFixedInto<ERR>(out, capacity, {errCode});
 }
 
-char* PackError(uint32_t errCode, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(ErrorPayload);
+const uint32_t RATE_LIMITED_SIZE = FixedFrame<ERR>::SIZE + sizeof(uint32_t);
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t PackRateLimitedInto(char* out, uint32_t capacity, uint32_t retryAfterMs) {
+    if (capacity < RATE_LIMITED_SIZE) {
+        return 0;
+    }
+    char* payload = PackHeader(out, ERR, RATE_LIMITED_SIZE - sizeof(MessageHeader));
+    memcpy(payload, &ERR_RATE_LIMITED, sizeof(uint32_t));
+    memcpy(payload + sizeof(uint32_t), &retryAfterMs, sizeof(retryAfterMs));
+    return RATE_LIMITED_SIZE;
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = ERR;
-    header->payload_length = sizeof(ErrorPayload);
+// RetryAfter of an ERR frame, 0 if it has none
+uint32_t ErrorRetryAfterMs(const char* frame, uint32_t size) {
+    uint32_t retryAfterMs = 0;
+    if (size >= RATE_LIMITED_SIZE) {
+        memcpy(&retryAfterMs, frame + FixedFrame<ERR>::SIZE, sizeof(retryAfterMs));
+    }
+    return retryAfterMs;
+}
 
-    ErrorPayload* payload = reinterpret_cast<ErrorPayload*>(buffer + sizeof(MessageHeader));
-    payload->err_code = errCode;
+uint32_t PackLoginSuccessInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelAmount, const uint32_t* channelIds,
+                              uint32_t features, uint64_t resumeToken) {
+    uint32_t totalPackSize = LoginSuccessSize(channelAmount);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
 
-    return buffer;
+    LoginSuccessPayload* payload = reinterpret_cast<LoginSuccessPayload*>(
+        PackHeader(out, LOGIN_SUCCESS, totalPackSize - sizeof(MessageHeader)));
+    payload->user_id = userId;
+    payload->channel_amount = channelAmount;
+    char* channels = out + sizeof(MessageHeader) + sizeof(LoginSuccessPayload);
+    memcpy(channels, channelIds, channelAmount * sizeof(uint32_t));
+    memcpy(channels + channelAmount * sizeof(uint32_t), &features, sizeof(features));
+    memcpy(channels + (channelAmount + 1) * sizeof(uint32_t), &resumeToken, sizeof(resumeToken));
+    return totalPackSize;
+}
+
+// Features granted in a LOGIN_SUCCESS frame, 0 from servers that predate them
+uint32_t LoginSuccessFeatures(const char* frame, uint32_t size) {
+    const LoginSuccessPayload* payload = reinterpret_cast<const LoginSuccessPayload*>(frame + sizeof(MessageHeader));
+    uint32_t offset = sizeof(MessageHeader) + sizeof(LoginSuccessPayload);
+    if (size < offset || (size - offset) / sizeof(uint32_t) <= payload->channel_amount) {
+        return 0;
+    }
+    uint32_t features;
+    memcpy(&features, frame + offset + payload->channel_amount * sizeof(uint32_t), sizeof(features));
+    return features;
 }
 
-char* PackLoginSuccess(uint32_t userId, uint32_t channelAmount, uint32_t* channelIds, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(LoginSuccessPayload) + channelAmount * sizeof(uint32_t);
+// Resume token in a LOGIN_SUCCESS frame, 0 if there is none
+uint64_t LoginSuccessToken(const char* frame, uint32_t size) {
+    const LoginSuccessPayload* payload = reinterpret_cast<const LoginSuccessPayload*>(frame + sizeof(MessageHeader));
+    uint64_t offset = sizeof(MessageHeader) + sizeof(LoginSuccessPayload) +
+                      ((uint64_t)payload->channel_amount + 1) * sizeof(uint32_t);
+    uint64_t token = 0;
+    if (size >= sizeof(MessageHeader) + sizeof(LoginSuccessPayload) && offset + sizeof(token) <= size) {
+        memcpy(&token, frame + offset, sizeof(token));
+    }
+    return token;
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t PackLoginUtf8Into(char* out, uint32_t capacity, uint32_t features, const char* nickname, uint8_t nicknameBytes) {
+    uint32_t totalPackSize = LoginUtf8Size(nicknameBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    LoginUtf8Payload* payload = reinterpret_cast<LoginUtf8Payload*>(
+        PackHeader(out, LOGIN_UTF8, totalPackSize - sizeof(MessageHeader)));
+    payload->features = features;
+    payload->nickname_length = nicknameBytes;
+    memcpy(out + sizeof(MessageHeader) + sizeof(LoginUtf8Payload), nickname, nicknameBytes);
+    return totalPackSize;
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = LOGIN_SUCCESS;
-    header->payload_length = sizeof(LoginSuccessPayload) + channelAmount * sizeof(uint32_t);
+// LOGIN_UTF8 with a Resume block
+uint32_t PackLoginResumeInto(char* out, uint32_t capacity, uint32_t features, const char* nickname, uint8_t nicknameBytes,
+                             uint64_t resumeToken, const ResumeCursor* cursors, uint32_t channelCount) {
+    uint32_t totalPackSize = LoginResumeSize(nicknameBytes, channelCount);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    PackLoginUtf8Into(out, capacity, features, nickname, nicknameBytes);
+    MessageHeader* header = reinterpret_cast<MessageHeader*>(out);
+    header->payload_length = totalPackSize - sizeof(MessageHeader);
+    ResumePayload* resume = reinterpret_cast<ResumePayload*>(out + LoginUtf8Size(nicknameBytes));
+    resume->token = resumeToken;
+    resume->channel_count = channelCount;
+    memcpy(resume + 1, cursors, channelCount * sizeof(ResumeCursor));
+    return totalPackSize;
+}
 
-    LoginSuccessPayload* payload = reinterpret_cast<LoginSuccessPayload*>(buffer + sizeof(MessageHeader));
+// Find the Resume block of a LOGIN_UTF8 payload, returns FALSE if it has none
+BOOL ParseLoginResume(const char* payload, uint32_t payloadLength, uint64_t& resumeToken,
+                      const ResumeCursor*& cursors, uint32_t& channelCount) {
+    const LoginUtf8Payload* login = reinterpret_cast<const LoginUtf8Payload*>(payload);
+    uint32_t offset = sizeof(LoginUtf8Payload) + login->nickname_length;
+    if (payloadLength < offset + sizeof(ResumePayload)) {
+        return FALSE;
+    }
+    const ResumePayload* resume = reinterpret_cast<const ResumePayload*>(payload + offset);
+    resumeToken = resume->token;
+    channelCount = std::min<uint32_t>(resume->channel_count,
+                                      (payloadLength - offset - sizeof(ResumePayload)) / sizeof(ResumeCursor));
+    cursors = reinterpret_cast<const ResumeCursor*>(resume + 1);
+    return TRUE;
+}
+
+uint32_t PackSendMsgUtf8Into(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, const char* msg, uint32_t msgBytes) {
+    uint32_t totalPackSize = SendMsgUtf8Size(msgBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    SendMsgUtf8Payload* payload = reinterpret_cast<SendMsgUtf8Payload*>(
+        PackHeader(out, SEND_MSG_UTF8, totalPackSize - sizeof(MessageHeader)));
     payload->user_id = userId;
-    payload->channel_amount = channelAmount;
-    uint32_t* channelsBuffer = reinterpret_cast<uint32_t*>(buffer + sizeof(MessageHeader) + sizeof(LoginSuccessPayload));
-    for (uint32_t i = 0; i < channelAmount; i++) {
-        channelsBuffer[i] = channelIds[i];
+    payload->channel_id = channelId;
+    payload->msg_length = msgBytes;
+    memcpy(out + sizeof(MessageHeader) + sizeof(SendMsgUtf8Payload), msg, msgBytes);
+    return totalPackSize;
+}
+
+uint32_t PackNewMsgUtf8Into(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, uint64_t seq,
+                            const char* nickname, uint8_t nicknameBytes, const char* msg, uint32_t msgBytes) {
+    uint32_t totalPackSize = NewMsgUtf8Size(nicknameBytes, msgBytes);
+    if (capacity < totalPackSize) {
+        return 0;
     }
+    NewMsgUtf8Payload* payload = reinterpret_cast<NewMsgUtf8Payload*>(
+        PackHeader(out, NEW_MSG_UTF8, totalPackSize - sizeof(MessageHeader)));
+    payload->user_id = userId;
+    payload->channel_id = channelId;
+    payload->nickname_length = nicknameBytes;
+    payload->msg_length = msgBytes;
+    char* text = out + sizeof(MessageHeader) + sizeof(NewMsgUtf8Payload);
+    memcpy(text, nickname, nicknameBytes);
+    memcpy(text + nicknameBytes, msg, msgBytes);
+    memcpy(text + nicknameBytes + msgBytes, &seq, sizeof(seq));
+    return totalPackSize;
+}
 
-    return buffer;
+// Write a compact frame header and return where the payload starts
+char* PackCompactHeader(char* out, MessageType type, uint32_t payloadLength) {
+    *out++ = (char)COMPACT_TAG;
+    out = PutVarint(out, type);
+    return PutVarint(out, payloadLength);
 }
 
-char* PackJoinChannel(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(JoinChannelPayload);
+uint32_t PackNewMsgCompactInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, uint64_t seq,
+                               const char* msg, uint32_t msgBytes) {
+    uint32_t totalPackSize = NewMsgCompactSize(userId, channelId, seq, msgBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    char* payload = PackCompactHeader(out, NEW_MSG_COMPACT,
+                                      VarintSize(userId) + VarintSize(channelId) + VarintSize64(seq) + msgBytes);
+    payload = PutVarint(payload, userId);
+    payload = PutVarint(payload, channelId);
+    payload = PutVarint64(payload, seq);
+    memcpy(payload, msg, msgBytes);
+    return totalPackSize;
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t PackUserInfoInto(char* out, uint32_t capacity, uint32_t userId, const char* nickname, uint8_t nicknameBytes) {
+    uint32_t totalPackSize = UserInfoSize(userId, nicknameBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    char* payload = PackCompactHeader(out, USER_INFO, VarintSize(userId) + nicknameBytes);
+    payload = PutVarint(payload, userId);
+    memcpy(payload, nickname, nicknameBytes);
+    return totalPackSize;
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = JOIN_CHANNEL;
-    header->payload_length = sizeof(JoinChannelPayload);
+// A BATCH is written in place: the header first, then every record with
+// PackBatchRecord, recordBytes being the sum of their BatchRecordSize
+char* PackBatchHeader(char* out, uint8_t recordType, uint32_t count, uint32_t recordBytes) {
+    BatchPayload* payload = reinterpret_cast<BatchPayload*>(
+        PackHeader(out, BATCH, sizeof(BatchPayload) + recordBytes));
+    payload->record_type = recordType;
+    payload->count = count;
+    return out + sizeof(MessageHeader) + sizeof(BatchPayload);
+}
 
-    JoinChannelPayload* payload = reinterpret_cast<JoinChannelPayload*>(buffer + sizeof(MessageHeader));
-    payload->user_id = userId;
-    payload->channel_id = channelId;
+char* PackBatchRecord(char* out, const char* payload, uint32_t payloadLength) {
+    out = PutVarint(out, payloadLength);
+    memcpy(out, payload, payloadLength);
+    return out + payloadLength;
+}
 
-    return buffer;
+// Step through the records of a BATCH payload, records and remaining start
+// right after the BatchPayload. Returns FALSE at the end or on a bad record.
+BOOL NextBatchRecord(const char*& records, uint32_t& remaining, const char*& payload, uint32_t& payloadLength) {
+    int used = GetVarint(records, remaining, payloadLength);
+    if (used <= 0 || payloadLength > remaining - used) {
+        return FALSE;
+    }
+    payload = records + used;
+    records += used + payloadLength;
+    remaining -= used + payloadLength;
+    return TRUE;
 }
 
-char* PackJoinChannelSuccess(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(JoinChannelSuccessPayload);
+// Read the count varint IDs a compact payload starts with, text is what
+// follows them. Returns FALSE if the IDs do not fit in the payload.
+BOOL ParseCompactIds(const char* payload, uint32_t len, uint32_t* ids, uint32_t count,
+                     const char*& text, uint32_t& textBytes) {
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        int used = GetVarint(payload + offset, len - offset, ids[i]);
+        if (used <= 0) {
+            return FALSE;
+        }
+        offset += used;
+    }
+    text = payload + offset;
+    textBytes = len - offset;
+    return TRUE;
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t PackHistoryInto(char* out, uint32_t capacity, uint32_t channelId, uint64_t beforeSeq, uint32_t maxCount) {
+    return PackFixedInto<HISTORY>(out, capacity, {channelId, beforeSeq, maxCount});
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = JOIN_CHANNEL_SUCCESS;
-    header->payload_length = sizeof(JoinChannelSuccessPayload);
+// Write a history record, returns its size
+uint32_t PackHistoryRecord(char* out, uint64_t seq, uint32_t userId, uint64_t timestamp,
+                           const char* nickname, uint8_t nicknameBytes, const char* msg, uint32_t msgBytes) {
+    HistoryRecord* record = reinterpret_cast<HistoryRecord*>(out);
+    record->length = HistoryRecordSize(nicknameBytes, msgBytes);
+    record->seq = seq;
+    record->user_id = userId;
+    record->timestamp = timestamp;
+    record->nickname_length = nicknameBytes;
+    memcpy(out + sizeof(HistoryRecord), nickname, nicknameBytes);
+    memcpy(out + sizeof(HistoryRecord) + nicknameBytes, msg, msgBytes);
+    return record->length;
+}
 
-    JoinChannelSuccessPayload* payload = reinterpret_cast<JoinChannelSuccessPayload*>(buffer + sizeof(MessageHeader));
-    payload->user_id = userId;
+// A HISTORY_RESULT is sent as this header followed by recordBytes of records
+uint32_t PackHistoryResultHeader(char* out, uint32_t channelId, uint32_t count, uint32_t recordBytes) {
+    HistoryResultPayload* payload = reinterpret_cast<HistoryResultPayload*>(
+        PackHeader(out, HISTORY_RESULT, sizeof(HistoryResultPayload) + recordBytes));
     payload->channel_id = channelId;
+    payload->count = count;
+    return sizeof(MessageHeader) + sizeof(HistoryResultPayload);
+}
 
-    return buffer;
+// Step through the records of a HISTORY_RESULT payload, records and remaining
+// start right after the HistoryResultPayload. Returns FALSE at the end or on
+// a bad record.
+BOOL NextHistoryRecord(const char*& records, uint32_t& remaining, HistoryRecord& record,
+                       const char*& nickname, const char*& msg, uint32_t& msgBytes) {
+    if (remaining < sizeof(HistoryRecord)) {
+        return FALSE;
+    }
+    memcpy(&record, records, sizeof(record));
+    if (record.length > remaining || record.length < sizeof(HistoryRecord) + record.nickname_length) {
+        return FALSE;
+    }
+    nickname = records + sizeof(HistoryRecord);
+    msg = nickname + record.nickname_length;
+    msgBytes = record.length - sizeof(HistoryRecord) - record.nickname_length;
+    records += record.length;
+    remaining -= record.length;
+    return TRUE;
 }
 
-char* PackLeaveChannel(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(LeaveChannelPayload);
+uint32_t PackStatsInto(char* out, uint32_t capacity, uint32_t userId) {
+    return PackFixedInto<STATS>(out, capacity, {userId});
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t StatsEntrySize(uint8_t nameBytes) {
+    return 1 + nameBytes + sizeof(uint64_t);
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = LEAVE_CHANNEL;
-    header->payload_length = sizeof(LeaveChannelPayload);
+// A STATS_RESULT is written in place: the header first, then every entry
+// with PackStatsEntry, entryBytes being the sum of their StatsEntrySize
+char* PackStatsResultHeader(char* out, uint32_t count, uint32_t entryBytes) {
+    StatsResultPayload* payload = reinterpret_cast<StatsResultPayload*>(
+        PackHeader(out, STATS_RESULT, sizeof(StatsResultPayload) + entryBytes));
+    payload->count = count;
+    return out + sizeof(MessageHeader) + sizeof(StatsResultPayload);
+}
 
-    LeaveChannelPayload* payload = reinterpret_cast<LeaveChannelPayload*>(buffer + sizeof(MessageHeader));
-    payload->user_id = userId;
-    payload->channel_id = channelId;
+char* PackStatsEntry(char* out, const char* name, uint8_t nameBytes, uint64_t value) {
+    *out++ = (char)nameBytes;
+    memcpy(out, name, nameBytes);
+    memcpy(out + nameBytes, &value, sizeof(value));
+    return out + nameBytes + sizeof(value);
+}
 
-    return buffer;
+// Step through the entries of a STATS_RESULT payload, entries and remaining
+// start right after the StatsResultPayload. Returns FALSE at the end or on a
+// bad entry.
+BOOL NextStatsEntry(const char*& entries, uint32_t& remaining, const char*& name, uint8_t& nameBytes, uint64_t& value) {
+    if (remaining < 1) {
+        return FALSE;
+    }
+    nameBytes = (uint8_t)entries[0];
+    if (remaining < StatsEntrySize(nameBytes)) {
+        return FALSE;
+    }
+    name = entries + 1;
+    memcpy(&value, name + nameBytes, sizeof(value));
+    entries += StatsEntrySize(nameBytes);
+    remaining -= StatsEntrySize(nameBytes);
+    return TRUE;
 }
 
-char* PackLeaveChannelSuccess(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(LeaveChannelSuccessPayload);
+uint32_t PeerHelloSize(uint8_t keyBytes) {
+    return sizeof(MessageHeader) + sizeof(PeerHelloPayload) + 1 + keyBytes;
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+const uint32_t PEER_HELLO_SIZE_MAX = sizeof(MessageHeader) + sizeof(PeerHelloPayload) + 1 + UINT8_MAX;
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43;
-    header->type = LEAVE_CHANNEL_SUCCESS;
-    header->payload_length = sizeof(LeaveChannelSuccessPayload);
+uint32_t PackPeerHelloInto(char* out, uint32_t capacity, uint32_t nodeId, const char* key, uint8_t keyBytes) {
+    uint32_t totalPackSize = PeerHelloSize(keyBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    char* payload = PackHeader(out, PEER_HELLO, totalPackSize - sizeof(MessageHeader));
+    memcpy(payload, &nodeId, sizeof(nodeId));
+    payload[sizeof(PeerHelloPayload)] = (char)keyBytes;
+    memcpy(payload + sizeof(PeerHelloPayload) + 1, key, keyBytes);
+    return totalPackSize;
+}
 
-    LeaveChannelSuccessPayload* payload = reinterpret_cast<LeaveChannelSuccessPayload*>(buffer + sizeof(MessageHeader));
+// Find the Key of a PEER_HELLO frame, returns FALSE if it has none or it is cut short
+BOOL ParsePeerHelloKey(const char* frame, uint32_t size, const char*& key, uint8_t& keyBytes) {
+    uint32_t offset = sizeof(MessageHeader) + sizeof(PeerHelloPayload);
+    if (size < offset + 1 || size - offset - 1 < (uint8_t)frame[offset]) {
+        return FALSE;
+    }
+    keyBytes = (uint8_t)frame[offset];
+    key = frame + offset + 1;
+    return TRUE;
+}
+
+uint32_t PackPeerChannelsInto(char* out, uint32_t capacity, const uint32_t* channels, uint32_t channelCount) {
+    uint32_t totalPackSize = PeerChannelsSize(channelCount);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    PeerChannelsPayload* payload = reinterpret_cast<PeerChannelsPayload*>(
+        PackHeader(out, PEER_CHANNELS, totalPackSize - sizeof(MessageHeader)));
+    payload->count = channelCount;
+    memcpy(out + sizeof(MessageHeader) + sizeof(PeerChannelsPayload), channels, channelCount * sizeof(uint32_t));
+    return totalPackSize;
+}
+
+uint32_t PackPeerSubscribeInto(char* out, uint32_t capacity, uint32_t channelId, BOOL subscribed) {
+    return subscribed ? PackFixedInto<PEER_SUBSCRIBE>(out, capacity, {channelId})
+                      : PackFixedInto<PEER_UNSUBSCRIBE>(out, capacity, {channelId});
+}
+
+uint32_t PackPeerMsgInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, const char* nickname,
+                         uint8_t nicknameBytes, const char* msg, uint32_t msgBytes) {
+    uint32_t totalPackSize = PeerMsgSize(nicknameBytes, msgBytes);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
+    PeerMsgPayload* payload = reinterpret_cast<PeerMsgPayload*>(
+        PackHeader(out, PEER_MSG, totalPackSize - sizeof(MessageHeader)));
     payload->user_id = userId;
     payload->channel_id = channelId;
+    payload->nickname_length = nicknameBytes;
+    payload->msg_length = msgBytes;
+    char* text = out + sizeof(MessageHeader) + sizeof(PeerMsgPayload);
+    memcpy(text, nickname, nicknameBytes);
+    memcpy(text + nicknameBytes, msg, msgBytes);
+    return totalPackSize;
+}
 
-    return buffer;
+uint32_t PackPingInto(char* out, uint32_t capacity, uint64_t token, BOOL reply) {
+    return reply ? PackFixedInto<PONG>(out, capacity, {token}) : PackFixedInto<PING>(out, capacity, {token});
 }
 
-char* PackNewMsg(uint32_t userId, uint32_t channelId, wchar_t nickname[32], const wchar_t* msg, uint32_t& totalPackSize) {
-    uint32_t msgLength = wcslen(msg) + 1;
+uint32_t PackJoinChannelInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId) {
+    return PackFixedInto<JOIN_CHANNEL>(out, capacity, {userId, channelId});
+}
 
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(NewMsgPayload) + msgLength * sizeof(wchar_t);
+uint32_t PackJoinChannelSuccessInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId) {
+    return PackFixedInto<JOIN_CHANNEL_SUCCESS>(out, capacity, {userId, channelId});
+}
 
-    char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+uint32_t PackLeaveChannelInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId) {
+    return PackFixedInto<LEAVE_CHANNEL>(out, capacity, {userId, channelId});
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
+uint32_t PackLeaveChannelSuccessInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId) {
+    return PackFixedInto<LEAVE_CHANNEL_SUCCESS>(out, capacity, {userId, channelId});
+}
 
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = NEW_MSG;
-    header->payload_length = sizeof(NewMsgPayload) + msgLength * sizeof(wchar_t);
+uint32_t PackNewMsgInto(char* out, uint32_t capacity, uint32_t userId, uint32_t channelId, uint64_t seq,
+                        const wchar_t nickname[32], const wchar_t* msg) {
+    uint32_t msgLength = wcslen(msg) + 1;
+    uint32_t totalPackSize = NewMsgSize(msg);
+    if (capacity < totalPackSize) {
+        return 0;
+    }
 
-    NewMsgPayload* payload = reinterpret_cast<NewMsgPayload*>(buffer + sizeof(MessageHeader));
+    NewMsgPayload* payload = reinterpret_cast<NewMsgPayload*>(
+        PackHeader(out, NEW_MSG, totalPackSize - sizeof(MessageHeader)));
     payload->user_id = userId;
     payload->channel_id = channelId;
-    wcscpy(payload->nickname, nickname);
+    // The payload is not wchar_t aligned, copy bytes instead of using wcscpy
+    memset(payload->nickname, 0, sizeof(payload->nickname));
+    memcpy(payload->nickname, nickname, wcsnlen(nickname, 31) * sizeof(wchar_t));
     payload->msg_length = msgLength;
 
-    wchar_t* message = reinterpret_cast<wchar_t*>(buffer + sizeof(MessageHeader) + sizeof(NewMsgPayload));
+    char* message = out + sizeof(MessageHeader) + sizeof(NewMsgPayload);
     memcpy(message, msg, msgLength * sizeof(wchar_t));
+    memcpy(message + msgLength * sizeof(wchar_t), &seq, sizeof(seq));
+    return totalPackSize;
+}
 
+// Sequence number of a NEW_MSG payload in any encoding, 0 if it has none
+uint64_t NewMsgSeq(uint8_t type, const char* payload, uint32_t length) {
+    uint64_t seq = 0;
+    if (type == NEW_MSG && length >= sizeof(NewMsgPayload)) {
+        const NewMsgPayload* msg = reinterpret_cast<const NewMsgPayload*>(payload);
+        uint64_t offset = sizeof(NewMsgPayload) + (uint64_t)msg->msg_length * sizeof(wchar_t);
+        if (offset + sizeof(seq) <= length) {
+            memcpy(&seq, payload + offset, sizeof(seq));
+        }
+    } else if (type == NEW_MSG_UTF8 && length >= sizeof(NewMsgUtf8Payload)) {
+        const NewMsgUtf8Payload* msg = reinterpret_cast<const NewMsgUtf8Payload*>(payload);
+        uint64_t offset = sizeof(NewMsgUtf8Payload) + (uint64_t)msg->nickname_length + msg->msg_length;
+        if (offset + sizeof(seq) <= length) {
+            memcpy(&seq, payload + offset, sizeof(seq));
+        }
+    } else if (type == NEW_MSG_COMPACT) {
+        uint32_t ids[2];
+        const char* rest;
+        uint32_t restBytes;
+        if (!ParseCompactIds(payload, length, ids, 2, rest, restBytes) || GetVarint64(rest, restBytes, seq) <= 0) {
+            seq = 0;
+        }
+    }
+    return seq;
+}
+
+uint32_t PackDisconnectInto(char* out, uint32_t capacity, uint32_t userId) {
+    return PackFixedInto<DISCONNECT>(out, capacity, {userId});
+}
+
+char* PackLogin(const wchar_t* nickname, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<LOGIN>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackLoginInto(buffer, totalPackSize, nickname);
     return buffer;
 }
 
-char* PackDisconnect(uint32_t userId, uint32_t& totalPackSize) {
-    // Calculate total size of the message (header + payload)
-    totalPackSize = sizeof(MessageHeader) + sizeof(DisconnectPayload);
+char* PackSendMsg(uint32_t userId, uint32_t channelId, const wchar_t* msg, uint32_t& totalPackSize) {
+    totalPackSize = SendMsgSize(msg);
+    char* buffer = new char[totalPackSize];
+    PackSendMsgInto(buffer, totalPackSize, userId, channelId, msg);
+    return buffer;
+}
 
+char* PackError(uint32_t errCode, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<ERR>::SIZE;
     char* buffer = new char[totalPackSize];
-    memset(buffer, 0, totalPackSize);
+    PackErrorInto(buffer, totalPackSize, errCode);
+    return buffer;
+}
 
-    MessageHeader* header = reinterpret_cast<MessageHeader*>(buffer);
-    header->magic_number = 0x4F727A43; // ASCII for 'OrzC'
-    header->type = DISCONNECT;
-    header->payload_length = sizeof(DisconnectPayload);
+char* PackLoginSuccess(uint32_t userId, uint32_t channelAmount, uint32_t* channelIds, uint32_t features, uint64_t resumeToken,
+                       uint32_t& totalPackSize) {
+    totalPackSize = LoginSuccessSize(channelAmount);
+    char* buffer = new char[totalPackSize];
+    PackLoginSuccessInto(buffer, totalPackSize, userId, channelAmount, channelIds, features, resumeToken);
+    return buffer;
+}
 
-    DisconnectPayload* payload = reinterpret_cast<DisconnectPayload*>(buffer + sizeof(MessageHeader));
-    payload->user_id = userId;
+char* PackJoinChannel(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<JOIN_CHANNEL>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackJoinChannelInto(buffer, totalPackSize, userId, channelId);
+    return buffer;
+}
+
+char* PackJoinChannelSuccess(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<JOIN_CHANNEL_SUCCESS>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackJoinChannelSuccessInto(buffer, totalPackSize, userId, channelId);
+    return buffer;
+}
 
+char* PackLeaveChannel(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<LEAVE_CHANNEL>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackLeaveChannelInto(buffer, totalPackSize, userId, channelId);
     return buffer;
 }
 
+char* PackLeaveChannelSuccess(uint32_t userId, uint32_t channelId, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<LEAVE_CHANNEL_SUCCESS>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackLeaveChannelSuccessInto(buffer, totalPackSize, userId, channelId);
+    return buffer;
+}
+
+char* PackNewMsg(uint32_t userId, uint32_t channelId, uint64_t seq, wchar_t nickname[32], const wchar_t* msg,
+                 uint32_t& totalPackSize) {
+    totalPackSize = NewMsgSize(msg);
+    char* buffer = new char[totalPackSize];
+    PackNewMsgInto(buffer, totalPackSize, userId, channelId, seq, nickname, msg);
+    return buffer;
+}
+
+char* PackDisconnect(uint32_t userId, uint32_t& totalPackSize) {
+    totalPackSize = FixedFrame<DISCONNECT>::SIZE;
+    char* buffer = new char[totalPackSize];
+    PackDisconnectInto(buffer, totalPackSize, userId);
+    return buffer;
+}
+
+// Decode a NUL-terminated UTF-8 string into a new[] wide string
 wchar_t* ConvertCharToWChar(const char* c) {
-    // Get the length needed for the wchar buffer
-    int cSize = MultiByteToWideChar(CP_UTF8, 0, c, -1, nullptr, 0);
-    if(cSize == 0) {
-        // Handle error, perhaps with GetLastError()
-        return nullptr;
-    }
-    
-    // Allocate memory for wchar buffer.
-    wchar_t* wc = new wchar_t[cSize];
-
-    // Do the conversion.
-    int convResult = MultiByteToWideChar(CP_UTF8, 0, c, -1, wc, cSize);
-    if(convResult == 0) {
-        delete[] wc;
-        // Handle error, perhaps with GetLastError()
-        return nullptr;
-    }
-    
+    size_t len = strlen(c);
+    wchar_t* wc = new wchar_t[WideMaxChars(len) + 1];
+    wc[Utf8ToWide(c, len, wc)] = L'\0';
     return wc;
-}
\ No newline at end of file
+}
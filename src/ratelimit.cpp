@@ -0,0 +1,125 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "platform.cpp"
+#include "registry.cpp"
+
+// Send rate limits
+// Every chat message takes a token from two buckets before it is numbered
+// and fanned out: the bucket of the connection it came from and the bucket
+// of the channel it goes to. A message finding either of them empty is
+// dropped and its sender told how long to wait.
+//
+// A bucket is kept as the single moment it will be full again, so taking a
+// token is moving that moment one interval later:
+//
+//            now                fullAt     now + capacity
+// -----------+--------------------+-------------+--------> time
+//            |<-- tokens used --->|<-- left --->|
+//
+// Taking a token when fullAt would pass now + capacity fails, and the
+// distance it would pass by is how long the sender has to wait.
+//
+// A connection's bucket belongs to the thread handling it. A channel's bucket
+// is an atomic in its registry entry, taken with a compare-and-swap under the
+// channel's shared lock, the one fan-out takes anyway. Only members send to a
+// channel, so a channel somebody sends to here has members and a bucket.
+//
+// In a cluster the node a message is sent on enforces the channel limit.
+// Every node a message is forwarded to charges it to the channel's bucket
+// there without refusing it, it has already been delivered elsewhere. That
+// way each node's local senders share the channel's rate with the whole
+// cluster, rather than every node allowing the full rate of its own.
+
+typedef struct {
+    uint32_t perSecond;  // 0 = unlimited
+    uint32_t burst;  // tokens a full bucket holds, 0 = perSecond
+} RateLimit;
+
+typedef struct {
+    RateLimit user;
+    RateLimit channel;
+} RateConfig;
+
+static RateConfig rateConfig = {{0, 0}, {0, 0}};
+
+uint64_t RateNowUs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t RateInterval(const RateLimit& limit) {
+    return std::max<uint64_t>(1000000 / limit.perSecond, 1);
+}
+
+uint64_t RateCapacity(const RateLimit& limit) {
+    return RateInterval(limit) * (limit.burst != 0 ? limit.burst : limit.perSecond);
+}
+
+// Where fullAt moves when a token is taken now, returns 0 or the
+// milliseconds until a token is available, and then next is not to be used
+uint32_t RateNext(const RateLimit& limit, uint64_t fullAt, uint64_t nowUs, uint64_t& next) {
+    uint64_t interval = RateInterval(limit);
+    uint64_t capacity = RateCapacity(limit);
+    next = std::max(fullAt, nowUs) + interval;
+    if (next <= nowUs + capacity) {
+        return 0;
+    }
+    return (uint32_t)std::min<uint64_t>((next - nowUs - capacity + 999) / 1000, UINT32_MAX);
+}
+
+// Take a token from a channel's bucket, returns 0 or the milliseconds to wait
+uint32_t RateTakeChannel(std::atomic<uint64_t>& fullAt, uint64_t nowUs) {
+    uint64_t current = fullAt.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        uint32_t waitMs = RateNext(rateConfig.channel, current, nowUs, next);
+        if (waitMs != 0) {
+            return waitMs;
+        }
+    } while (!fullAt.compare_exchange_weak(current, next, std::memory_order_relaxed));
+    return 0;
+}
+
+// Take a token from a channel's bucket whether there is one or not, at most
+// emptying it
+uint32_t RateChargeChannel(std::atomic<uint64_t>& fullAt, uint64_t nowUs) {
+    uint64_t interval = RateInterval(rateConfig.channel);
+    uint64_t capacity = RateCapacity(rateConfig.channel);
+    uint64_t current = fullAt.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = std::min(std::max(current, nowUs) + interval, nowUs + capacity);
+    } while (!fullAt.compare_exchange_weak(current, next, std::memory_order_relaxed));
+    return 0;
+}
+
+// Charge a message another node took to channelId
+void RateCharge(uint32_t channelId, uint64_t nowUs) {
+    if (rateConfig.channel.perSecond != 0) {
+        RegistryChannelRate(channelId, nowUs, RateChargeChannel);
+    }
+}
+
+// Take a token for a message from the connection with bucket userFullAt to
+// channelId, returns 0 or the milliseconds until the message would be taken.
+// A message refused by the channel leaves the user's bucket alone.
+uint32_t RateTake(uint64_t& userFullAt, uint32_t channelId, uint64_t nowUs) {
+    uint64_t userNext = userFullAt;
+    if (rateConfig.user.perSecond != 0) {
+        uint32_t waitMs = RateNext(rateConfig.user, userFullAt, nowUs, userNext);
+        if (waitMs != 0) {
+            return waitMs;
+        }
+    }
+    if (rateConfig.channel.perSecond != 0) {
+        uint32_t waitMs = RegistryChannelRate(channelId, nowUs, RateTakeChannel);
+        if (waitMs != 0) {
+            return waitMs;
+        }
+    }
+    userFullAt = userNext;
+    return 0;
+}
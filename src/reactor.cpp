@@ -0,0 +1,721 @@
+#pragma once
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <thread>
+#include "dispatch.cpp"
+#include "outqueue.cpp"
+#include "decoder.cpp"
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define ORZCHAT_URING  // multishot receive and provided buffer rings, Linux 5.19 headers
+#endif
+#endif
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define ORZCHAT_COROUTINES
+#endif
+
+// Edge-triggered epoll reactors
+// Each reactor thread owns a SO_REUSEPORT listening socket, an epoll instance
+// and the connections the kernel hands to it, and is pinned to one core.
+// Sockets are non-blocking and a connection only holds heap buffers while its
+// decoder has a partial frame or there is output the kernel would not take, so
+// an idle client costs one small Connection and its socket.
+//
+// Frames for users on another reactor are never sent from the producing
+// thread. The recipients are batched per target shard and pushed to that
+// shard's lock-free mailbox, which the owner drains after an eventfd wakeup.
+// Broadcasts are queued by reference: every connection holds the same
+// SharedFrame in its bounded outbound queue until it has written it.
+//
+// Login, heartbeat and idle deadlines run on a timer wheel per reactor, one
+// timer per connection, see liveness.cpp. The wheel decides how long the
+// reactor may sleep in epoll_wait.
+
+const int REACTOR_MAX_EVENTS = 1024;
+const int REACTOR_READ_SIZE = 64 * 1024;
+
+typedef struct {
+    SOCKET sock;
+    BOOL loggedIn;
+    BOOL closing;
+    uint32_t userID;
+    FrameDecoder in;  // partial frame carried over between reads
+    OutboundQueue out;  // frames the socket has not accepted yet
+    Introductions introductions;  // compact recipients that know this user
+    uint64_t sendRate;  // the user's send rate bucket
+    BOOL flushScheduled;
+    Liveness liveness;  // deadlines, in the reactor's timer wheel
+    // io_uring only
+    uint32_t inflight;  // requests the kernel still has to complete
+    BOOL fixed;  // the socket is in the ring's registered file table
+    struct UringSend* sending;  // the write in flight, if any
+    // coroutines only
+    void* reader;  // the reading coroutine while it waits for a frame
+    void* writer;  // the writing coroutine while it waits for output
+} Connection;
+
+typedef struct {
+    uint32_t userId;
+    SOCKET sock;
+} ShardTarget;
+
+// One frame and the users on the receiving shard it goes to. The message
+// holds a single reference to the frame.
+typedef struct ShardMessage {
+    ShardMessage* next;
+    SharedFrame* frame;
+    std::vector<ShardTarget> targets;
+} ShardMessage;
+
+typedef struct {
+    uint32_t id;
+    SOCKET listenSock;
+    int epollFd;
+    int wakeFd;
+    std::atomic<ShardMessage*> mailbox;  // multi-producer stack, drained in one swap
+    std::vector<Connection*> connections;  // indexed by socket
+    std::vector<Connection*> pendingClose;
+    std::vector<Connection*> pendingFlush;  // queued output written at the end of the pass
+    std::vector<ShardMessage*> outbox;  // batches being built for other shards
+    uint64_t now;  // tick count at the last wakeup
+    TimerWheel timers;  // a liveness timer per connection
+    struct UringState* ring;  // completion-driven I/O instead of epoll, see uring.cpp
+    BOOL coroutines;  // connections are served by coroutines, see coro.cpp
+    char readBuffer[REACTOR_READ_SIZE];
+} Reactor;
+
+static std::vector<Reactor*> reactors;
+static thread_local Reactor* localReactor = nullptr;
+
+#ifdef ORZCHAT_URING
+void UringWake(Reactor* target);
+void UringFlush(Reactor* reactor, Connection* conn);
+void UringRetire(Reactor* reactor, Connection* conn);
+Reactor* CreateUringReactor(uint32_t id, SOCKET listenSock, uint32_t shardCount);
+void UringLoop(Reactor* reactor, BOOL* running);
+#endif
+#ifdef ORZCHAT_COROUTINES
+void CoroStart(Reactor* reactor, Connection* conn);
+void CoroReadable(Reactor* reactor, Connection* conn);
+void CoroWritable(Reactor* reactor, Connection* conn);
+void CoroStop(Connection* conn);
+#endif
+
+enum ReactorBackend {
+    BACKEND_EPOLL,       // readiness callbacks
+    BACKEND_URING,       // completions, see uring.cpp
+    BACKEND_COROUTINES   // readiness resumes coroutines, see coro.cpp
+};
+
+BOOL SetNonBlocking(SOCKET sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Lift the descriptor limit to the hard maximum so we can hold 100k+ sockets
+void RaiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Open another listening socket on the same port, the kernel spreads incoming
+// connections across all of them
+SOCKET OpenReusePortListener(int port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+    sockaddr_in servAddr;
+    ZeroMemory(&servAddr, sizeof(servAddr));
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = INADDR_ANY;
+    servAddr.sin_port = htons(port);
+    if (bind(sock, (SOCKADDR*)&servAddr, sizeof(servAddr)) == SOCKET_ERROR ||
+        listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+Connection* FindConnection(Reactor* reactor, SOCKET sock) {
+    if (sock < 0 || (size_t)sock >= reactor->connections.size()) {
+        return nullptr;
+    }
+    return reactor->connections[sock];
+}
+
+// Closing is deferred until the current event batch is done, a fan-out loop
+// may still hold references to the connection's user.
+void ScheduleClose(Reactor* reactor, Connection* conn) {
+    if (!conn->closing) {
+        conn->closing = TRUE;
+        reactor->pendingClose.push_back(conn);
+    }
+}
+
+void CloseConnection(Reactor* reactor, Connection* conn) {
+    TimerCancel(reactor->timers, conn->liveness.timer);
+    if (conn->loggedIn) {
+        DropUser(conn->userID);
+    }
+#ifdef ORZCHAT_URING
+    if (reactor->ring != nullptr) {
+        // the socket and its queue go once the kernel is done with them
+        reactor->connections[conn->sock] = nullptr;
+        UringRetire(reactor, conn);
+        return;
+    }
+#endif
+#ifdef ORZCHAT_COROUTINES
+    CoroStop(conn);
+#endif
+    OutboundClear(conn->out);
+    OutboundReport(conn->out);
+    DecoderFree(conn->in);
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, conn->sock, nullptr);
+    closesocket(conn->sock);
+    MetricsAdd(METRIC_SYSCALLS, 2);
+    reactor->connections[conn->sock] = nullptr;
+    delete conn;
+    MetricsAdd(METRIC_CLOSED);
+}
+
+// Write as much queued output as the socket takes, keep the rest for EPOLLOUT
+void FlushConnection(Reactor* reactor, Connection* conn) {
+#ifdef ORZCHAT_URING
+    if (reactor->ring != nullptr) {
+        UringFlush(reactor, conn);
+        return;
+    }
+#endif
+#ifdef ORZCHAT_COROUTINES
+    if (reactor->coroutines) {
+        CoroWritable(reactor, conn);
+        return;
+    }
+#endif
+    if (OutboundFlush(conn->out, conn->sock) < 0) {
+        ScheduleClose(reactor, conn);
+    }
+    OutboundReport(conn->out);
+}
+
+// Frames queued while handling one pass of events leave in a single write
+void ScheduleFlush(Reactor* reactor, Connection* conn) {
+    if (!conn->flushScheduled) {
+        conn->flushScheduled = TRUE;
+        reactor->pendingFlush.push_back(conn);
+    }
+}
+
+void PostToShard(Reactor* target, ShardMessage* batch) {
+    ShardMessage* head = target->mailbox.load(std::memory_order_relaxed);
+    do {
+        batch->next = head;
+    } while (!target->mailbox.compare_exchange_weak(head, batch, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    // Only the push that made the mailbox non-empty needs to wake the owner
+    if (head == nullptr) {
+#ifdef ORZCHAT_URING
+        // Ring to ring needs no syscall of its own, other threads use the eventfd
+        if (target->ring != nullptr && localReactor != nullptr && localReactor->ring != nullptr) {
+            UringWake(target);
+            return;
+        }
+#endif
+        uint64_t one = 1;
+        ssize_t written = write(target->wakeFd, &one, sizeof(one));
+        (void)written;
+        MetricsAdd(METRIC_SYSCALLS);
+    }
+}
+
+// Apply the slow-consumer policy to what was just queued
+void EnforceLimits(Reactor* reactor, Connection* conn) {
+    if (!OutboundEnforce(conn->out, outboundLimits, reactor->now)) {
+        LogPrintf(LOG_WARNING, L"Disconnecting slow client %u, %u frames queued",
+                   conn->userID, (uint32_t)OutboundDepth(conn->out));
+        ScheduleClose(reactor, conn);
+    }
+}
+
+// Queue a reference to frame behind whatever the connection still has pending
+void QueueFrame(Reactor* reactor, Connection* conn, SharedFrame* frame) {
+    if (conn == nullptr || conn->closing) {
+        return;
+    }
+    MetricsFrameOut(frame->data, frame->size);
+    OutboundPush(conn->out, frame, reactor->now, IsBroadcastFrame(frame));
+    MetricsRecord(HISTOGRAM_OUTQ_DEPTH, OutboundDepth(conn->out));
+    ScheduleFlush(reactor, conn);
+    EnforceLimits(reactor, conn);
+    OutboundReport(conn->out);
+}
+
+int ReactorSend(SOCKET sock, const char* buf, int len) {
+    Reactor* reactor = localReactor;
+    Connection* conn = FindConnection(reactor, sock);
+    if (conn == nullptr || conn->closing) {
+        return SOCKET_ERROR;
+    }
+
+    // Try the socket first, only copy what it would not take. With io_uring
+    // everything is written by the ring.
+    MetricsFrameOut(buf, len);
+    int sent = 0;
+    if (OutboundEmpty(conn->out) && reactor->ring == nullptr) {
+        sent = send(sock, buf, len, MSG_NOSIGNAL);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ScheduleClose(reactor, conn);
+                return SOCKET_ERROR;
+            }
+            sent = 0;
+        }
+        MetricsAdd(METRIC_BYTES_OUT, sent);
+    }
+    if (sent < len) {
+        SharedFrame* rest = CopyFrame(buf + sent, len - sent);
+        OutboundPush(conn->out, rest, reactor->now, FALSE);
+        ReleaseFrame(rest);
+        EnforceLimits(reactor, conn);
+        OutboundReport(conn->out);
+        if (reactor->ring != nullptr) {
+            ScheduleFlush(reactor, conn);
+        }
+    }
+    return len;
+}
+
+int ReactorSendParts(SOCKET sock, SharedFrame* const* parts, size_t count) {
+    Reactor* reactor = localReactor;
+    Connection* conn = FindConnection(reactor, sock);
+    if (conn == nullptr || conn->closing) {
+        return SOCKET_ERROR;
+    }
+    // Queued by reference, the next flush writes them with one sendmsg
+    if (count > 0) {
+        MetricsFrameOut(parts[0]->data, parts[0]->size);
+    }
+    int len = 0;
+    for (size_t i = 0; i < count; i++) {
+        OutboundPushPart(conn->out, parts[i], reactor->now);
+        len += parts[i]->size;
+    }
+    EnforceLimits(reactor, conn);
+    OutboundReport(conn->out);
+    ScheduleFlush(reactor, conn);
+    return len;
+}
+
+// Batches for every shard built by a thread that is not a reactor, like a
+// federation link delivering messages from another node
+static thread_local std::vector<ShardMessage*> foreignOutbox;
+
+std::vector<ShardMessage*>& Outbox() {
+    if (localReactor != nullptr) {
+        return localReactor->outbox;
+    }
+    if (foreignOutbox.size() < reactors.size()) {
+        foreignOutbox.resize(reactors.size(), nullptr);
+    }
+    return foreignOutbox;
+}
+
+void ReactorDeliver(const Recipient& to, SharedFrame* frame) {
+    Reactor* reactor = localReactor;
+    if (reactor != nullptr && to.shard == reactor->id) {
+        Connection* conn = FindConnection(reactor, to.sock);
+        if (conn != nullptr && conn->loggedIn && conn->userID == to.userId) {
+            QueueFrame(reactor, conn, frame);
+        }
+        return;
+    }
+
+    ShardMessage*& batch = Outbox()[to.shard];
+    if (batch != nullptr && batch->frame != frame) {
+        PostToShard(reactors[to.shard], batch);
+        batch = nullptr;
+    }
+    if (batch == nullptr) {
+        batch = new ShardMessage();
+        batch->next = nullptr;
+        batch->frame = AcquireFrame(frame);
+    }
+    batch->targets.push_back(ShardTarget{to.userId, to.sock});
+}
+
+void ReactorFlushDeliveries() {
+    std::vector<ShardMessage*>& outbox = Outbox();
+    for (size_t shard = 0; shard < outbox.size(); shard++) {
+        if (outbox[shard] != nullptr) {
+            PostToShard(reactors[shard], outbox[shard]);
+            outbox[shard] = nullptr;
+        }
+    }
+}
+
+// eventfdWake: woken through the eventfd, which has to be read to reset it
+void DrainMailbox(Reactor* reactor, BOOL eventfdWake) {
+    if (eventfdWake) {
+        uint64_t count;
+        ssize_t readLen = read(reactor->wakeFd, &count, sizeof(count));
+        (void)readLen;
+        MetricsAdd(METRIC_SYSCALLS);
+    }
+
+    ShardMessage* batch = reactor->mailbox.exchange(nullptr, std::memory_order_acquire);
+    // The stack is newest first, restore arrival order
+    ShardMessage* ordered = nullptr;
+    while (batch != nullptr) {
+        ShardMessage* next = batch->next;
+        batch->next = ordered;
+        ordered = batch;
+        batch = next;
+    }
+
+    while (ordered != nullptr) {
+        for (const ShardTarget& target : ordered->targets) {
+            Connection* conn = FindConnection(reactor, target.sock);
+            // The socket may have been closed and reused since the sender looked it up
+            if (conn != nullptr && conn->loggedIn && conn->userID == target.userId) {
+                QueueFrame(reactor, conn, ordered->frame);
+            }
+        }
+        ShardMessage* next = ordered->next;
+        ReleaseFrame(ordered->frame);
+        delete ordered;
+        ordered = next;
+    }
+}
+
+void ConnectionLoggedIn(Reactor* reactor, Connection* conn, uint32_t features) {
+    conn->loggedIn = TRUE;
+    conn->out.batching = (features & FEATURE_BATCH) != 0;
+    conn->out.compressing = (features & FEATURE_DEFLATE) != 0;
+    LivenessLoggedIn(conn->liveness, features);
+    LivenessArm(reactor->timers, conn->liveness);
+}
+
+// A connection's liveness timer fired
+void ConnectionTimerExpired(void* context, TimerNode* node) {
+    Reactor* reactor = (Reactor*)context;
+    Connection* conn = (Connection*)node->owner;
+    if (conn->closing) {
+        return;
+    }
+    const wchar_t* reason = L"";
+    switch (LivenessCheck(conn->liveness, reactor->now, reason)) {
+    case LIVENESS_PING:
+        SendPing(conn->sock, reactor->now);
+        LivenessArm(reactor->timers, conn->liveness);
+        break;
+    case LIVENESS_WAIT:
+        LivenessArm(reactor->timers, conn->liveness);
+        break;
+    case LIVENESS_DEAD:
+        LogPrintf(LOG_INFO, L"Closing client %u, it %ls", conn->userID, reason);
+        MetricsAdd(METRIC_TIMED_OUT);
+        ScheduleClose(reactor, conn);
+        break;
+    }
+}
+
+// Dispatch every complete frame the decoder holds, returns FALSE if the
+// connection has to be dropped.
+BOOL ProcessFrames(Reactor* reactor, Connection* conn) {
+    FrameView view;
+    DecodeStatus status = DECODE_NEED_MORE;
+    uint64_t skipped = conn->in.skipped;
+    while (!conn->closing && (status = DecoderNext(conn->in, view)) == DECODE_FRAME) {
+        MetricsFrameIn(view.type);
+        LivenessFrame(conn->liveness, view.type, reactor->now);
+        if (!conn->loggedIn) {
+            if (!IsLoginFrame(view.header)) {
+                RejectLogin(conn->sock);
+                return FALSE;
+            }
+            uint32_t features;
+            conn->userID = HandleLogin(conn->sock, view.header, view.frame, features);
+            ConnectionLoggedIn(reactor, conn, features);
+        } else if (!HandleMessage(conn->sock, conn->userID, conn->introductions, conn->sendRate, view.header, view.frame)) {
+            // DISCONNECT already removed the user
+            conn->loggedIn = FALSE;
+            return FALSE;
+        }
+    }
+    if (conn->in.skipped != skipped) {
+        MetricsAdd(METRIC_SKIPPED_BYTES, conn->in.skipped - skipped);
+        LogPrintf(LOG_WARNING, L"Skipped %u bytes of garbage from client %u",
+                   (uint32_t)(conn->in.skipped - skipped), conn->userID);
+    }
+    if (!conn->closing && status == DECODE_ERROR) {
+        MetricsAdd(METRIC_DECODE_ERRORS);
+        LogPrintf(LOG_ERROR, L"Client sent a malformed frame");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void HandleReadable(Reactor* reactor, Connection* conn) {
+#ifdef ORZCHAT_COROUTINES
+    if (reactor->coroutines) {
+        CoroReadable(reactor, conn);
+        return;
+    }
+#endif
+    char* readBuffer = reactor->readBuffer;
+    while (!conn->closing) {
+        ssize_t recvLen = recv(conn->sock, readBuffer, REACTOR_READ_SIZE, 0);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (recvLen == 0) {
+            LogPrintf(LOG_INFO, L"Client disconnected");
+            ScheduleClose(reactor, conn);
+            return;
+        } else if (recvLen < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ScheduleClose(reactor, conn);
+            }
+            return;
+        }
+
+        // Frames are dispatched straight out of the read buffer, only a
+        // trailing partial frame is copied into the connection
+        MetricsAdd(METRIC_BYTES_IN, recvLen);
+        LivenessHeard(conn->liveness, reactor->now);
+        DecoderFeed(conn->in, readBuffer, recvLen);
+        BOOL ok = ProcessFrames(reactor, conn);
+        DecoderSettle(conn->in);
+        if (!ok) {
+            ScheduleClose(reactor, conn);
+            return;
+        }
+    }
+}
+
+// A Connection for a freshly accepted socket, in the reactor's table
+Connection* AdoptConnection(Reactor* reactor, SOCKET clientSock) {
+    Connection* conn = new Connection();
+    conn->sock = clientSock;
+    conn->loggedIn = FALSE;
+    conn->closing = FALSE;
+    conn->flushScheduled = FALSE;
+    conn->userID = 0;
+    conn->inflight = 0;
+    conn->fixed = FALSE;
+    conn->sending = nullptr;
+    conn->reader = nullptr;
+    conn->writer = nullptr;
+    DecoderInit(conn->in, maxPayloadLength, inboundPolicy);
+    LivenessStart(conn->liveness, conn, reactor->now);
+    LivenessArm(reactor->timers, conn->liveness);
+    if ((size_t)clientSock >= reactor->connections.size()) {
+        reactor->connections.resize(clientSock * 2 + 1, nullptr);
+    }
+    reactor->connections[clientSock] = conn;
+    MetricsAdd(METRIC_ACCEPTED);
+    return conn;
+}
+
+void AcceptConnections(Reactor* reactor) {
+    while (true) {
+        sockaddr_in clientAddr;
+        socklen_t clntAddrSize = sizeof(clientAddr);
+        SOCKET clientSock = accept4(reactor->listenSock, (SOCKADDR*)&clientAddr, &clntAddrSize, SOCK_NONBLOCK);
+        MetricsAdd(METRIC_SYSCALLS);
+        if (clientSock == INVALID_SOCKET) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LogPrintf(LOG_WARNING, L"accept failed with error code: %d", errno);
+            }
+            return;
+        }
+
+        Connection* conn = AdoptConnection(reactor, clientSock);
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = clientSock;
+        MetricsAdd(METRIC_SYSCALLS);
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, clientSock, &event) == -1) {
+            LogPrintf(LOG_WARNING, L"epoll_ctl failed with error code: %d", errno);
+            reactor->connections[clientSock] = nullptr;
+            TimerCancel(reactor->timers, conn->liveness.timer);
+            closesocket(clientSock);
+            DecoderFree(conn->in);
+            delete conn;
+            MetricsAdd(METRIC_CLOSED);
+            continue;
+        }
+#ifdef ORZCHAT_COROUTINES
+        if (reactor->coroutines) {
+            CoroStart(reactor, conn);
+        }
+#endif
+    }
+}
+
+Reactor* CreateReactor(uint32_t id, SOCKET listenSock, uint32_t shardCount) {
+
+    if (!SetNonBlocking(listenSock)) {
+        LogPrintf(LOG_ERROR, L"Unable to make the listening socket non-blocking");
+        return nullptr;
+    }
+
+    Reactor* reactor = new Reactor();
+    reactor->id = id;
+    reactor->listenSock = listenSock;
+    reactor->mailbox.store(nullptr);
+    reactor->outbox.assign(shardCount, nullptr);
+    reactor->epollFd = epoll_create1(0);
+    reactor->wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (reactor->epollFd == -1 || reactor->wakeFd == -1) {
+        LogPrintf(LOG_ERROR, L"Unable to create reactor %u, error code: %d", id, errno);
+        delete reactor;
+        return nullptr;
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = listenSock;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, listenSock, &event);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = reactor->wakeFd;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->wakeFd, &event);
+    return reactor;
+}
+
+void PinToCore(uint32_t id) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(id % cores, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+void ReactorLoop(Reactor* reactor, BOOL* running) {
+    localReactor = reactor;
+    currentShard = reactor->id;
+    PinToCore(reactor->id);
+
+    epoll_event events[REACTOR_MAX_EVENTS];
+    while (*running) {
+        int timeout = TimerWheelNextMs(reactor->timers, GetTickCount64());
+        int ready = epoll_wait(reactor->epollFd, events, REACTOR_MAX_EVENTS, timeout);
+        MetricsAdd(METRIC_SYSCALLS);
+        reactor->now = GetTickCount64();
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LogPrintf(LOG_ERROR, L"epoll_wait failed with error code: %d", errno);
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == reactor->listenSock) {
+                AcceptConnections(reactor);
+                continue;
+            }
+            if (fd == reactor->wakeFd) {
+                DrainMailbox(reactor, TRUE);
+                continue;
+            }
+            Connection* conn = FindConnection(reactor, fd);
+            if (conn == nullptr || conn->closing) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                HandleReadable(reactor, conn);
+            }
+            if ((events[i].events & EPOLLOUT) && !conn->closing) {
+                FlushConnection(reactor, conn);
+            }
+        }
+        TimerWheelAdvance(reactor->timers, reactor->now, ConnectionTimerExpired, reactor);
+
+        for (Connection* conn : reactor->pendingFlush) {
+            conn->flushScheduled = FALSE;
+            if (!conn->closing) {
+                FlushConnection(reactor, conn);
+            }
+        }
+        reactor->pendingFlush.clear();
+
+        for (Connection* conn : reactor->pendingClose) {
+            CloseConnection(reactor, conn);
+        }
+        reactor->pendingClose.clear();
+    }
+}
+
+// Run shardCount reactors until the server stops. The first one serves the
+// already listening socket on the calling thread, the others open their own
+// listeners on the same port.
+int RunReactors(SOCKET listenSock, int port, uint32_t shardCount, ReactorBackend backend, BOOL* running) {
+    Reactor* (*create)(uint32_t, SOCKET, uint32_t) = CreateReactor;
+    void (*loop)(Reactor*, BOOL*) = ReactorLoop;
+#ifdef ORZCHAT_URING
+    if (backend == BACKEND_URING) {
+        create = CreateUringReactor;
+        loop = UringLoop;
+    }
+#endif
+
+    RaiseFileLimit();
+    for (uint32_t id = 0; id < shardCount; id++) {
+        SOCKET sock = id == 0 ? listenSock : OpenReusePortListener(port);
+        if (sock == INVALID_SOCKET) {
+            LogPrintf(LOG_ERROR, L"Unable to open listener for reactor %u, error code: %d", id, errno);
+            return 1;
+        }
+        Reactor* reactor = create(id, sock, shardCount);
+        if (reactor == nullptr) {
+            return 1;
+        }
+        reactor->coroutines = backend == BACKEND_COROUTINES;
+        reactor->now = GetTickCount64();
+        TimerWheelInit(reactor->timers, reactor->now);
+        reactors.push_back(reactor);
+    }
+
+    SendFrame = ReactorSend;
+    SendFrameParts = ReactorSendParts;
+    DeliverFrame = ReactorDeliver;
+    FlushDeliveries = ReactorFlushDeliveries;
+    static const char* backendNames[] = {"epoll", "io_uring", "coroutine"};
+    LogPrintf(LOG_INFO, L"%u %s reactor(s) running, waiting for clients to connect...", shardCount,
+              backendNames[backend]);
+
+    std::vector<std::thread> threads;
+    for (uint32_t id = 1; id < shardCount; id++) {
+        threads.emplace_back(loop, reactors[id], running);
+    }
+    loop(reactors[0], running);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,281 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <cwchar>
+#include <cstring>
+#include "platform.cpp"
+#include "utf8.cpp"
+
+// User and channel registry
+// Users and channels live in separate lock-striped hash tables so handlers on
+// different threads rarely touch the same lock. Channel members are kept in a
+// dense array (swap-remove on leave) together with everything fan-out needs,
+// so a broadcast copies one contiguous block under a shared lock. Each user
+// keeps the list of channels it joined, which makes disconnect proportional
+// to that user's channels instead of all channels.
+//
+// Join, leave and removal of one user are serialized by the connection that
+// owns it. Channel 0 is the global channel every logged in user is part of.
+
+const uint32_t REGISTRY_SHARDS = 64;
+const uint32_t GLOBAL_CHANNEL = 0;
+const uint32_t NICKNAME_UTF8_BYTES = 31 * 4;
+
+typedef struct {
+    uint32_t userId;
+    SOCKET sock;
+    uint32_t shard;  // reactor owning the socket
+    uint32_t features;  // FEATURE_* bits negotiated at login
+} Recipient;
+
+// A nickname in both wire encodings, so broadcasts never convert it
+typedef struct {
+    wchar_t wide[32];
+    char utf8[NICKNAME_UTF8_BYTES];
+    uint8_t utf8Length;
+} Nickname;
+
+typedef struct {
+    Recipient recipient;
+    Nickname nickname;
+    std::vector<uint32_t> channels;  // reverse index
+} UserEntry;
+
+typedef struct {
+    std::vector<Recipient> members;  // dense, order not preserved
+    std::unordered_map<uint32_t, uint32_t> slots;  // user ID -> index in members
+    std::atomic<uint64_t> rateFullAt{0};  // send rate bucket, see ratelimit.cpp
+} ChannelEntry;
+
+typedef struct {
+    std::mutex lock;
+    std::unordered_map<uint32_t, UserEntry> users;
+} UserShard;
+
+typedef struct {
+    std::shared_mutex lock;
+    std::unordered_map<uint32_t, ChannelEntry> channels;
+} ChannelShard;
+
+static UserShard userShards[REGISTRY_SHARDS];
+static ChannelShard channelShards[REGISTRY_SHARDS];
+
+UserShard& UserShardOf(uint32_t userId) {
+    return userShards[userId % REGISTRY_SHARDS];
+}
+
+ChannelShard& ChannelShardOf(uint32_t channelId) {
+    return channelShards[channelId % REGISTRY_SHARDS];
+}
+
+// Called when a channel gets its first member or loses its last one, with
+// the channel's lock held so the calls for one channel arrive in order
+void (*ChannelActivity)(uint32_t channelId, BOOL active) = nullptr;
+
+// Returns FALSE if the user already was a member
+BOOL AddMember(uint32_t channelId, const Recipient& recipient) {
+    ChannelShard& shard = ChannelShardOf(channelId);
+    std::unique_lock<std::shared_mutex> lock(shard.lock);
+    auto inserted = shard.channels.try_emplace(channelId);
+    ChannelEntry& channel = inserted.first->second;
+    if (channel.slots.find(recipient.userId) != channel.slots.end()) {
+        return FALSE;
+    }
+    if (inserted.second && ChannelActivity != nullptr) {
+        ChannelActivity(channelId, TRUE);
+    }
+    channel.slots[recipient.userId] = (uint32_t)channel.members.size();
+    channel.members.push_back(recipient);
+    return TRUE;
+}
+
+void RemoveMember(uint32_t channelId, uint32_t userId) {
+    ChannelShard& shard = ChannelShardOf(channelId);
+    std::unique_lock<std::shared_mutex> lock(shard.lock);
+    auto channel = shard.channels.find(channelId);
+    if (channel == shard.channels.end()) {
+        return;
+    }
+    auto slot = channel->second.slots.find(userId);
+    if (slot == channel->second.slots.end()) {
+        return;
+    }
+
+    // Swap-remove: move the last member into the freed slot
+    std::vector<Recipient>& members = channel->second.members;
+    uint32_t index = slot->second;
+    members[index] = members.back();
+    channel->second.slots[members[index].userId] = index;
+    members.pop_back();
+    channel->second.slots.erase(userId);
+
+    if (members.empty()) {
+        shard.channels.erase(channel);
+        if (ChannelActivity != nullptr) {
+            ChannelActivity(channelId, FALSE);
+        }
+    }
+}
+
+void RegistryAddUser(uint32_t userId, SOCKET sock, uint32_t shard, uint32_t features, const wchar_t* nickname) {
+    Recipient recipient = {userId, sock, shard, features};
+    Nickname name;
+    size_t length = wcsnlen(nickname, 31);
+    memcpy(name.wide, nickname, length * sizeof(wchar_t));
+    name.wide[length] = L'\0';
+    name.utf8Length = (uint8_t)WideToUtf8(name.wide, length, name.utf8);
+    {
+        UserShard& users = UserShardOf(userId);
+        std::lock_guard<std::mutex> lock(users.lock);
+        UserEntry& user = users.users[userId];
+        user.recipient = recipient;
+        user.nickname = name;
+        user.channels.assign(1, GLOBAL_CHANNEL);
+    }
+    AddMember(GLOBAL_CHANNEL, recipient);
+}
+
+// Returns FALSE if the user is not logged in
+BOOL RegistryJoin(uint32_t userId, uint32_t channelId) {
+    Recipient recipient;
+    {
+        UserShard& users = UserShardOf(userId);
+        std::lock_guard<std::mutex> lock(users.lock);
+        auto user = users.users.find(userId);
+        if (user == users.users.end()) {
+            return FALSE;
+        }
+        recipient = user->second.recipient;
+        std::vector<uint32_t>& channels = user->second.channels;
+        for (uint32_t channel : channels) {
+            if (channel == channelId) {
+                return TRUE;
+            }
+        }
+        channels.push_back(channelId);
+    }
+    AddMember(channelId, recipient);
+    return TRUE;
+}
+
+void RegistryLeave(uint32_t userId, uint32_t channelId) {
+    // Everybody stays in the global channel until they disconnect
+    if (channelId == GLOBAL_CHANNEL) {
+        return;
+    }
+    {
+        UserShard& users = UserShardOf(userId);
+        std::lock_guard<std::mutex> lock(users.lock);
+        auto user = users.users.find(userId);
+        if (user == users.users.end()) {
+            return;
+        }
+        std::vector<uint32_t>& channels = user->second.channels;
+        for (size_t i = 0; i < channels.size(); i++) {
+            if (channels[i] == channelId) {
+                channels[i] = channels.back();
+                channels.pop_back();
+                break;
+            }
+        }
+    }
+    RemoveMember(channelId, userId);
+}
+
+// Returns the channels the user was in
+std::vector<uint32_t> RegistryRemoveUser(uint32_t userId) {
+    std::vector<uint32_t> channels;
+    {
+        UserShard& users = UserShardOf(userId);
+        std::lock_guard<std::mutex> lock(users.lock);
+        auto user = users.users.find(userId);
+        if (user == users.users.end()) {
+            return channels;
+        }
+        channels.swap(user->second.channels);
+        users.users.erase(user);
+    }
+    for (uint32_t channelId : channels) {
+        RemoveMember(channelId, userId);
+    }
+    return channels;
+}
+
+BOOL RegistryHasUser(uint32_t userId) {
+    UserShard& users = UserShardOf(userId);
+    std::lock_guard<std::mutex> lock(users.lock);
+    return users.users.count(userId) != 0;
+}
+
+BOOL RegistryIsMember(uint32_t userId, uint32_t channelId) {
+    UserShard& users = UserShardOf(userId);
+    std::lock_guard<std::mutex> lock(users.lock);
+    auto user = users.users.find(userId);
+    if (user == users.users.end()) {
+        return FALSE;
+    }
+    for (uint32_t channel : user->second.channels) {
+        if (channel == channelId) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Copy the user's nickname, returns FALSE if the user is not logged in
+BOOL RegistryNickname(uint32_t userId, Nickname& nickname) {
+    UserShard& users = UserShardOf(userId);
+    std::lock_guard<std::mutex> lock(users.lock);
+    auto user = users.users.find(userId);
+    if (user == users.users.end()) {
+        return FALSE;
+    }
+    nickname = user->second.nickname;
+    return TRUE;
+}
+
+// Snapshot the members of a channel, leaving out one user (the sender)
+void RegistryRecipients(uint32_t channelId, uint32_t excludeUserId, std::vector<Recipient>& recipients) {
+    ChannelShard& shard = ChannelShardOf(channelId);
+    std::shared_lock<std::shared_mutex> lock(shard.lock);
+    auto channel = shard.channels.find(channelId);
+    if (channel == shard.channels.end()) {
+        return;
+    }
+    recipients.reserve(recipients.size() + channel->second.members.size());
+    for (const Recipient& member : channel->second.members) {
+        if (member.userId != excludeUserId) {
+            recipients.push_back(member);
+        }
+    }
+}
+
+// Take a token from the channel's send rate bucket with take, under the
+// channel's shared lock so the bucket outlives the call. Returns what take
+// returns, or 0 without calling it if the channel has no members here, which
+// only happens when its last member left after the message was admitted.
+uint32_t RegistryChannelRate(uint32_t channelId, uint64_t nowUs,
+                             uint32_t (*take)(std::atomic<uint64_t>& fullAt, uint64_t nowUs)) {
+    ChannelShard& shard = ChannelShardOf(channelId);
+    std::shared_lock<std::shared_mutex> lock(shard.lock);
+    auto channel = shard.channels.find(channelId);
+    if (channel == shard.channels.end()) {
+        return 0;
+    }
+    return take(channel->second.rateFullAt, nowUs);
+}
+
+// Sockets of every logged in user, used at shutdown
+std::vector<SOCKET> RegistrySockets() {
+    std::vector<SOCKET> sockets;
+    for (uint32_t i = 0; i < REGISTRY_SHARDS; i++) {
+        std::lock_guard<std::mutex> lock(userShards[i].lock);
+        for (auto& pair : userShards[i].users) {
+            sockets.push_back(pair.second.recipient.sock);
+        }
+    }
+    return sockets;
+}
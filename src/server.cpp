@@ -1,33 +1,114 @@
-#include <vector>
-#include <map>
-#include <string>
-#include <winsock2.h>
-#include <windows.h>
+#include "platform.cpp"
 #include "myconsole.cpp"
 #include "protocol.cpp"
+#include "dispatch.cpp"
+#include "outqueue.cpp"
+#include "reactor.cpp"
+#include "uring.cpp"
+#include "coro.cpp"
+#include "federation.cpp"
 
-#pragma comment(lib, "ws2_32.lib")
-// #define DEBUG
-
-const int BUF_SIZE = 4096;
 const char INET_ADDR[] = "127.0.0.1";
-const int PORT = 12345;
-static uint32_t userID = 0;
-
-uint32_t GetUserID() {
-    return userID++;
-}
-
-std::map<uint32_t, SOCKET> userSockets;
-std::map<uint32_t, wchar_t[32]> nicknames;
-std::map<uint32_t, std::vector<uint32_t>> channelMembers;
-
-std::vector<uint32_t> channelIds = {1024};
+static int serverPort = 12345;
+
+enum ServerMode {
+    MODE_THREADS,   // one blocking thread per client
+    MODE_EPOLL,     // edge-triggered epoll reactors, one per shard (Linux)
+    MODE_URING,     // the same reactors driven by io_uring (Linux 5.19+)
+    MODE_COROUTINES // epoll reactors resuming a coroutine per connection (Linux, C++20)
+};
+
+static ServerMode serverMode = MODE_THREADS;
+static uint32_t reactorCount = 1;
+static int metricsPort = 0;  // Prometheus endpoint, 0 disables it
 SOCKET serverSock;
 static BOOL running = TRUE;
 
 DWORD WINAPI ClientHandler(LPVOID lpParam);
 
+// Thread-per-client mode keeps the liveness timer of every client in one
+// wheel, run by a single thread. A dead client's socket is shut down, which
+// ends the recv its handler is blocked in. PINGs are sent after the wheel is
+// unlocked, a client that does not read must not hold up logins and exits of
+// everyone else, and the handler waits for a PING in flight before it closes
+// the socket.
+typedef struct {
+    SOCKET sock;
+    uint32_t userId;
+    Liveness liveness;
+    BOOL pinging;  // a PING to the client is being sent
+} TimedClient;
+
+typedef struct {
+    TimedClient* client;
+    SOCKET sock;
+    uint64_t token;
+} PendingPing;
+
+static std::mutex clientTimersLock;
+static std::condition_variable clientPinged;
+static TimerWheel clientTimers;
+static std::vector<PendingPing> pendingPings;  // timer thread only
+
+void ClientTimerExpired(void*, TimerNode* node) {
+    TimedClient* client = (TimedClient*)node->owner;
+    uint64_t now = GetTickCount64();
+    const wchar_t* reason = L"";
+    switch (LivenessCheck(client->liveness, now, reason)) {
+    case LIVENESS_PING:
+        client->pinging = TRUE;
+        pendingPings.push_back({client, client->sock, now});
+        LivenessArm(clientTimers, client->liveness);
+        break;
+    case LIVENESS_WAIT:
+        LivenessArm(clientTimers, client->liveness);
+        break;
+    case LIVENESS_DEAD:
+        LogPrintf(LOG_INFO, L"Closing client %u, it %ls", client->userId, reason);
+        MetricsAdd(METRIC_TIMED_OUT);
+        shutdown(client->sock, SD_BOTH);
+        break;
+    }
+}
+
+DWORD WINAPI ClientTimerThread(LPVOID) {
+    while (running) {
+        int waitMs;
+        {
+            std::lock_guard<std::mutex> guard(clientTimersLock);
+            TimerWheelAdvance(clientTimers, GetTickCount64(), ClientTimerExpired, nullptr);
+            waitMs = TimerWheelNextMs(clientTimers, GetTickCount64());
+        }
+        if (!pendingPings.empty()) {
+            for (const PendingPing& ping : pendingPings) {
+                SendPing(ping.sock, ping.token);
+            }
+            {
+                std::lock_guard<std::mutex> guard(clientTimersLock);
+                for (const PendingPing& ping : pendingPings) {
+                    ping.client->pinging = FALSE;
+                }
+            }
+            clientPinged.notify_all();
+            pendingPings.clear();
+        }
+        // Timers set in the meantime are seconds away, a second late at most is fine
+        Sleep(waitMs < 0 || waitMs > 1000 ? 1000 : waitMs);
+    }
+    return 0;
+}
+
+// The handler is about to close the socket, the timer thread must not touch it
+// after. A PING stuck on a client that does not read is cut short.
+void StopClientTimer(TimedClient& client) {
+    std::unique_lock<std::mutex> lock(clientTimersLock);
+    TimerCancel(clientTimers, client.liveness.timer);
+    if (client.pinging) {
+        shutdown(client.sock, SD_BOTH);
+        clientPinged.wait(lock, [&client] { return !client.pinging; });
+    }
+}
+
 BOOL WINAPI ConsoleHandler(DWORD CEvent)
 {
     switch (CEvent)
@@ -35,11 +116,13 @@ BOOL WINAPI ConsoleHandler(DWORD CEvent)
     case CTRL_C_EVENT:
         // Cleanup
         running = FALSE;
-        for (auto& pair : userSockets) {
-            closesocket(pair.second);
+        HistoryStop();
+        for (SOCKET sock : RegistrySockets()) {
+            closesocket(sock);
         }
         closesocket(serverSock);
         WSACleanup();
+        LogStop();
         printf("[ INFO ] Resources cleaned up, exiting...\n");
         exit(0);
         break;
@@ -48,309 +131,456 @@ BOOL WINAPI ConsoleHandler(DWORD CEvent)
     return TRUE;
 }
 
-int main() {
+void PrintUsage(HANDLE hConsoleOut) {
+    win_printf(hConsoleOut, L"Usage: server [--mode threads|epoll|uring|coro] [--reactors N] [options]\n");
+    win_printf(hConsoleOut, L"  --mode threads   one thread per client (default)\n");
+    win_printf(hConsoleOut, L"  --mode epoll     non-blocking epoll reactors, Linux only\n");
+    win_printf(hConsoleOut, L"  --mode uring     io_uring reactors, Linux 5.19+\n");
+    win_printf(hConsoleOut, L"  --mode coro      epoll reactors running each client as coroutines, Linux only\n");
+    win_printf(hConsoleOut, L"  --port N         port clients connect to (default 12345)\n");
+    win_printf(hConsoleOut, L"  --reactors N     reactor threads for the epoll, uring and coro modes, 0 = one per core (default 1)\n");
+    win_printf(hConsoleOut, L"  --outq-bytes N   unsent bytes per client before the slow-consumer policy applies (default 4 MiB)\n");
+    win_printf(hConsoleOut, L"  --outq-age-ms N  age of the oldest unsent frame before the policy applies, 0 = off (default)\n");
+    win_printf(hConsoleOut, L"  --slow-policy drop-oldest|coalesce|disconnect  what to do with slow clients (default drop-oldest)\n");
+    win_printf(hConsoleOut, L"  --batch-bytes N  largest BATCH of queued messages, 0 = no batching (default 64 KiB)\n");
+    win_printf(hConsoleOut, L"  --batch-window-ms N  longest span of messages in one BATCH (default 2)\n");
+    win_printf(hConsoleOut, L"  --max-payload N  largest payload a client may send in one frame (default 1 MiB)\n");
+    win_printf(hConsoleOut, L"  --bad-frames reject|resync  drop clients sending malformed frames, or skip to the next frame (default reject)\n");
+    win_printf(hConsoleOut, L"  --history DIR    keep a message history log per channel in DIR (default off)\n");
+    win_printf(hConsoleOut, L"  --history-segment-mb N  size of a history segment file (default 16)\n");
+    win_printf(hConsoleOut, L"  --history-commit-ms N   how long history appends are gathered into one write (default 10)\n");
+    win_printf(hConsoleOut, L"  --history-fsync  sync every history write to disk before the next one\n");
+    win_printf(hConsoleOut, L"  --replay-messages N  recent messages per channel kept for resuming clients (default 256)\n");
+    win_printf(hConsoleOut, L"  --resume-window-s N  how long a dropped client may resume its session, 0 = never (default 60)\n");
+    win_printf(hConsoleOut, L"  --login-timeout-ms N  close connections that have not logged in by then, 0 = never (default 10000)\n");
+    win_printf(hConsoleOut, L"  --heartbeat-ms N  PING clients quiet for this long, close them if they stay quiet as long again, 0 = off (default 30000)\n");
+    win_printf(hConsoleOut, L"  --idle-timeout-ms N  close clients that sent nothing but PING/PONG for this long, 0 = off (default)\n");
+    win_printf(hConsoleOut, L"  --user-rate N    chat messages a second each client may send, 0 = no limit (default)\n");
+    win_printf(hConsoleOut, L"  --user-burst N   messages a client may send at once after a pause (default the rate)\n");
+    win_printf(hConsoleOut, L"  --channel-rate N chat messages a second each channel takes, 0 = no limit (default)\n");
+    win_printf(hConsoleOut, L"  --channel-burst N  messages a channel takes at once after a pause (default the rate)\n");
+    win_printf(hConsoleOut, L"  --log-level debug|info|warning|error  least severe log messages to keep (default info)\n");
+    win_printf(hConsoleOut, L"  --log-file PATH  append the log to PATH instead of the console\n");
+    win_printf(hConsoleOut, L"  --metrics-port N  serve Prometheus metrics on 127.0.0.1:N, 0 = off (default)\n");
+    win_printf(hConsoleOut, L"  --node-id N      federate with other servers as node N, 1..255 (default off)\n");
+    win_printf(hConsoleOut, L"  --peer-port N    port other nodes connect to, needs --node-id\n");
+    win_printf(hConsoleOut, L"  --peer-bind IP   interface the peer port listens on (default 127.0.0.1)\n");
+    win_printf(hConsoleOut, L"  --peer-key KEY   key every node of the cluster shares, needed to bind beyond loopback\n");
+    win_printf(hConsoleOut, L"  --peer HOST:PORT link to the node at that IPv4 address and peer port, repeatable\n");
+}
+
+BOOL ParseArgs(int argc, char* argv[], HANDLE hConsoleOut) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "threads") == 0) {
+                serverMode = MODE_THREADS;
+            } else if (strcmp(mode, "epoll") == 0) {
+#ifdef __linux__
+                serverMode = MODE_EPOLL;
+#else
+                win_printf(hConsoleOut, L"[ ERROR ] epoll mode is only available on Linux\n");
+                return FALSE;
+#endif
+            } else if (strcmp(mode, "uring") == 0) {
+#ifdef ORZCHAT_URING
+                serverMode = MODE_URING;
+#else
+                win_printf(hConsoleOut, L"[ ERROR ] uring mode needs Linux 5.19 or later headers\n");
+                return FALSE;
+#endif
+            } else if (strcmp(mode, "coro") == 0) {
+#ifdef ORZCHAT_COROUTINES
+                serverMode = MODE_COROUTINES;
+#else
+                win_printf(hConsoleOut, L"[ ERROR ] coro mode needs Linux and C++20 coroutines\n");
+                return FALSE;
+#endif
+            } else {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            serverPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            reactorCount = (uint32_t)strtoul(argv[++i], nullptr, 10);
+#ifdef __linux__
+            if (reactorCount == 0) {
+                reactorCount = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+#endif
+            if (reactorCount == 0) {
+                reactorCount = 1;
+            }
+        } else if (strcmp(argv[i], "--outq-bytes") == 0 && i + 1 < argc) {
+            outboundLimits.maxBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--outq-age-ms") == 0 && i + 1 < argc) {
+            outboundLimits.maxAgeMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            if (!ParseSlowConsumerPolicy(argv[++i], &outboundLimits.policy)) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--batch-bytes") == 0 && i + 1 < argc) {
+            batchLimits.maxBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--batch-window-ms") == 0 && i + 1 < argc) {
+            batchLimits.windowMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--max-payload") == 0 && i + 1 < argc) {
+            maxPayloadLength = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--bad-frames") == 0 && i + 1 < argc) {
+            const char* policy = argv[++i];
+            if (strcmp(policy, "reject") == 0) {
+                inboundPolicy = DECODER_REJECT;
+            } else if (strcmp(policy, "resync") == 0) {
+                inboundPolicy = DECODER_RESYNC;
+            } else {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            historyConfig.dir = argv[++i];
+        } else if (strcmp(argv[i], "--history-segment-mb") == 0 && i + 1 < argc) {
+            historyConfig.segmentBytes = std::max<size_t>(strtoull(argv[++i], nullptr, 10), 1) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--history-commit-ms") == 0 && i + 1 < argc) {
+            historyConfig.commitMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--history-fsync") == 0) {
+            historyConfig.fsync = TRUE;
+        } else if (strcmp(argv[i], "--replay-messages") == 0 && i + 1 < argc) {
+            replayCapacity = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--resume-window-s") == 0 && i + 1 < argc) {
+            resumeWindowMs = strtoull(argv[++i], nullptr, 10) * 1000;
+        } else if (strcmp(argv[i], "--login-timeout-ms") == 0 && i + 1 < argc) {
+            livenessConfig.loginTimeoutMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--heartbeat-ms") == 0 && i + 1 < argc) {
+            livenessConfig.heartbeatMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--idle-timeout-ms") == 0 && i + 1 < argc) {
+            livenessConfig.idleTimeoutMs = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--user-rate") == 0 && i + 1 < argc) {
+            rateConfig.user.perSecond = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--user-burst") == 0 && i + 1 < argc) {
+            rateConfig.user.burst = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--channel-rate") == 0 && i + 1 < argc) {
+            rateConfig.channel.perSecond = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--channel-burst") == 0 && i + 1 < argc) {
+            rateConfig.channel.burst = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (!ParseLogLevel(argv[++i], &logConfig.level)) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            logConfig.path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metricsPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+            localNodeId = (uint32_t)strtoul(argv[++i], nullptr, 10);
+            if (localNodeId == 0 || localNodeId > NODE_ID_MAX) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--peer-port") == 0 && i + 1 < argc) {
+            federationConfig.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--peer-bind") == 0 && i + 1 < argc) {
+            federationConfig.bindAddress.s_addr = inet_addr(argv[++i]);
+            if (federationConfig.bindAddress.s_addr == INADDR_NONE) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--peer-key") == 0 && i + 1 < argc) {
+            federationConfig.key = argv[++i];
+            if (federationConfig.key.size() > PEER_KEY_MAX) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            sockaddr_in peer;
+            if (!ParsePeerAddress(argv[++i], peer)) {
+                PrintUsage(hConsoleOut);
+                return FALSE;
+            }
+            federationConfig.peers.push_back(peer);
+        } else {
+            PrintUsage(hConsoleOut);
+            return FALSE;
+        }
+    }
+    if (localNodeId == 0 && (federationConfig.port != 0 || !federationConfig.peers.empty())) {
+        win_printf(hConsoleOut, L"[ ERROR ] --peer and --peer-port need a --node-id\n");
+        return FALSE;
+    }
+    // Anyone who can reach the peer port can speak for every user of a node
+    if (federationConfig.port != 0 && (ntohl(federationConfig.bindAddress.s_addr) >> 24) != 127 &&
+        federationConfig.key.empty()) {
+        win_printf(hConsoleOut, L"[ ERROR ] --peer-bind beyond the loopback interface needs a --peer-key\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int main(int argc, char* argv[]) {
     HANDLE hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
     HANDLE hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
 
-    win_printf(hConsoleOut, L"[ INFO ] OrzChat server is starting...\n");
+    if (!ParseArgs(argc, argv, hConsoleOut) || !LogStart()) {
+        return 1;
+    }
+
+    LogPrintf(LOG_INFO, L"OrzChat server is starting...");
 
     // init winsock
     WSADATA wsaData;
     int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
 
     if (result != NO_ERROR) {
-        win_printf(hConsoleOut, L"[ ERROR ] WSAStartup failed with error code: %d\n", result);
+        LogPrintf(LOG_ERROR, L"WSAStartup failed with error code: %d", result);
+        LogStop();
         return 1;
     }
 
     serverSock = socket(AF_INET, SOCK_STREAM, 0);
 
     if (serverSock == INVALID_SOCKET) {
-        win_printf(hConsoleOut, L"[ ERROR ] socket failed with error code: %ld\n", WSAGetLastError());
+        LogPrintf(LOG_ERROR, L"socket failed with error code: %d", WSAGetLastError());
         WSACleanup();
+        LogStop();
         return 1;
     }
 
+#ifdef __linux__
+    if (serverMode != MODE_THREADS) {
+        // Every reactor listens on the port, the kernel balances between them
+        int enable = 1;
+        setsockopt(serverSock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+#endif
+
     sockaddr_in servAddr;
     ZeroMemory(&servAddr, sizeof(servAddr));
     servAddr.sin_family = AF_INET;
     servAddr.sin_addr.s_addr = INADDR_ANY;
-    servAddr.sin_port = htons(PORT);
+    servAddr.sin_port = htons((uint16_t)serverPort);
     if (bind(serverSock, (SOCKADDR*)&servAddr, sizeof(servAddr)) == SOCKET_ERROR) {
-        win_printf(hConsoleOut, L"[ ERROR ] bind failed with error code: %ld\n", WSAGetLastError());
+        LogPrintf(LOG_ERROR, L"bind failed with error code: %d", WSAGetLastError());
         closesocket(serverSock);
         WSACleanup();
+        LogStop();
         return 1;
     }
 
-    result = listen(serverSock, 5);
+    result = listen(serverSock, SOMAXCONN);
     if (result == SOCKET_ERROR) {
-        win_printf(hConsoleOut, L"[ ERROR ] listen failed with error code: %ld\n", WSAGetLastError());
+        LogPrintf(LOG_ERROR, L"listen failed with error code: %d", WSAGetLastError());
         closesocket(serverSock);
         WSACleanup();
+        LogStop();
+        return 1;
+    }
+
+    if (!HistoryStart()) {
+        closesocket(serverSock);
+        WSACleanup();
+        LogStop();
+        return 1;
+    }
+
+    if (metricsPort != 0 && !StartMetricsEndpoint(metricsPort)) {
+        HistoryStop();
+        closesocket(serverSock);
+        WSACleanup();
+        LogStop();
+        return 1;
+    }
+
+    if (!FederationStart()) {
+        HistoryStop();
+        closesocket(serverSock);
+        WSACleanup();
+        LogStop();
         return 1;
     }
 
     if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)ConsoleHandler, TRUE)) {
-        win_printf(hConsoleOut, L"[ ERROR ] Unable to install handler!\n");
+        LogPrintf(LOG_ERROR, L"Unable to install handler!");
+        LogStop();
         return 1;
     }
 
-    // Clear the console at the start
-    system("CLS");
+    // Clear the console at the start, after what was logged so far
+    LogFlush();
+    ClearConsole();
+
+#ifdef __linux__
+    if (serverMode != MODE_THREADS) {
+        ReactorBackend backend = serverMode == MODE_URING ? BACKEND_URING
+                               : serverMode == MODE_COROUTINES ? BACKEND_COROUTINES : BACKEND_EPOLL;
+        result = RunReactors(serverSock, serverPort, reactorCount, backend, &running);
+        HistoryStop();
+        for (SOCKET sock : RegistrySockets()) {
+            closesocket(sock);
+        }
+        closesocket(serverSock);
+        WSACleanup();
+        LogStop();
+        printf("[ INFO ] Resources cleaned up, exiting...\n");
+        return result;
+    }
+#endif
+
+    TimerWheelInit(clientTimers, GetTickCount64());
+    HANDLE hTimerThread = CreateThread(NULL, 0, ClientTimerThread, NULL, 0, NULL);
+    CloseHandle(hTimerThread);
 
     // Wait for clients to connect
     while (running) {
-        win_printf(hConsoleOut, L"[ INFO ] Waiting for clients to connect...\n");
+        LogPrintf(LOG_INFO, L"Waiting for clients to connect...");
         sockaddr_in clientAddr;
-        int clntAddrSize = sizeof(clientAddr);
+        socklen_t clntAddrSize = sizeof(clientAddr);
         SOCKET clientSock = accept(serverSock, (SOCKADDR*)&clientAddr, &clntAddrSize);
+        MetricsAdd(METRIC_SYSCALLS);
 
         if (clientSock == INVALID_SOCKET) {
             int err = WSAGetLastError();
             if (err == WSAEINTR) {
                 // Server is shutting down
-                win_printf(hConsoleOut, L"[ INFO ] Server is shutting down\n");
+                LogPrintf(LOG_INFO, L"Server is shutting down");
                 break;
             } else {
-                win_printf(hConsoleOut, L"[ WARNING ] accept failed with error code: %ld\n", err);
+                LogPrintf(LOG_WARNING, L"accept failed with error code: %d", err);
                 continue;
             }
         } else {
-            wchar_t* clientIP = ConvertCharToWChar(inet_ntoa(clientAddr.sin_addr));
-            win_printf(hConsoleOut, L"[ INFO ] Client connected: %s:%d\n", clientIP, ntohs(clientAddr.sin_port));
-            delete[] clientIP;
+            LogPrintf(LOG_INFO, L"Client connected: %s:%d", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+            MetricsAdd(METRIC_ACCEPTED);
         }
 
         // Create a thread to handle the client
         DWORD dwThreadId;
-        HANDLE hThread = CreateThread(NULL, 0, ClientHandler, (LPVOID)clientSock, 0, &dwThreadId);
+        HANDLE hThread = CreateThread(NULL, 0, ClientHandler, (LPVOID)(intptr_t)clientSock, 0, &dwThreadId);
         CloseHandle(hThread);
     }
 
     // Cleanup
-    for (auto& pair : userSockets) {
-        closesocket(pair.second);
+    HistoryStop();
+    for (SOCKET sock : RegistrySockets()) {
+        closesocket(sock);
     }
     closesocket(serverSock);
     WSACleanup();
+    LogStop();
     printf("[ INFO ] Resources cleaned up, exiting...\n");
     return 0;
 }
 
 DWORD WINAPI ClientHandler(LPVOID lpParam) {
-    HANDLE hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
     HANDLE hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
-    SOCKET clientSock = (SOCKET)lpParam;
-    char raw_buffer[BUF_SIZE];
-    char buffer[BUF_SIZE];
-    int recvLen;
-
-    // First wait until client sends login message
-    recvLen = recv(clientSock, raw_buffer, BUF_SIZE, 0);
-
-    if (recvLen > 0) {
-        // Upack the message to get nickname
-        MessageHeader* header = (MessageHeader*)raw_buffer;
-        LoginPayload* payload = (LoginPayload*)(raw_buffer + sizeof(MessageHeader));
-
-        if (header->type != MessageType::LOGIN) {
-            // Error
-            win_printf(hConsoleOut, L"[ ERROR ] Client sent invalid login message\n");
-            // send error message
-            uint32_t totalSize;
-            char* buf = PackError(1, totalSize);
-            send(clientSock, buf, totalSize, 0);
-            delete[] buf;
-            closesocket(clientSock);
-            return 0;
-        }
-
-        win_printf(hConsoleOut, L"[ INFO ] Client logged in with nickname: %ls\n", payload->nickname);
-        uint32_t userID = GetUserID();
-        wcscpy(nicknames[userID], payload->nickname);
-        userSockets[userID] = clientSock;
-
-        // Send login success message
-        uint32_t totalSize;
-        char* buf = PackLoginSuccess(userID, channelIds.size(), channelIds.data(), totalSize);
-
-#ifdef DEBUG
-        win_printf(hConsoleOut, L"[ INFO ] Send: ");
-        for (int i = 0; i < totalSize; i++) {
-            win_printf(hConsoleOut, L"%02x ", static_cast<unsigned char>(buffer[i]));
-        }
-        win_printf(hConsoleOut, L"\n");
-#endif
-
-        send(clientSock, buf, totalSize, 0);
-        delete[] buf;
-
-    } else if (recvLen == 0) {
-        // Client disconnected
-        win_printf(hConsoleOut, L"[ INFO ] Client disconnected\n");
-        closesocket(clientSock);
-        return 0;
-    } else {
-        // Error occurred
-        win_printf(hConsoleOut, L"[ ERROR ] recv failed with error code: %ld\n", WSAGetLastError());
-        closesocket(clientSock);
-        return 0;
+    SOCKET clientSock = (SOCKET)(intptr_t)lpParam;
+    FrameDecoder decoder;
+    FrameView view;
+    DecodeStatus status;
+    BOOL loggedIn = FALSE;
+    uint32_t userId = 0;
+    Introductions introductions;
+    uint64_t sendRate = 0;
+    TimedClient client;
+    client.sock = clientSock;
+    client.userId = 0;
+    client.pinging = FALSE;
+
+    DecoderInit(decoder, maxPayloadLength, inboundPolicy);
+    {
+        std::lock_guard<std::mutex> guard(clientTimersLock);
+        LivenessStart(client.liveness, &client, GetTickCount64());
+        LivenessArm(clientTimers, client.liveness);
     }
 
-    // memset buffer and raw_buffer
-    memset(buffer, 0, BUF_SIZE);
-    memset(raw_buffer, 0, BUF_SIZE);
-    int offset = 0;
-
     while (running) {
-        recvLen = recv(clientSock, raw_buffer + offset, BUF_SIZE - offset, 0);
+        // Receive straight into the decoder, it grows to fit large frames
+        size_t space;
+        char* dst = DecoderWritable(decoder, space);
+        int recvLen = recv(clientSock, dst, (int)space, 0);
+        MetricsAdd(METRIC_SYSCALLS);
 
         if (recvLen == 0) {
             // Client disconnected
-            win_printf(hConsoleOut, L"[ INFO ] Client disconnected\n");
+            LogPrintf(LOG_INFO, L"Client disconnected");
             break;
         } else if (recvLen < 0) {
             // Error occurred
             int err = WSAGetLastError();
             if (err == WSAECONNRESET) {
                 // Client disconnected
-                win_printf(hConsoleOut, L"[ INFO ] Client disconnected\n");
+                LogPrintf(LOG_INFO, L"Client disconnected");
             } else if (err == WSAECONNABORTED) {
                 // Server disconnected
-                win_printf(hConsoleOut, L"[ INFO ] Server disconnected\n");
+                LogPrintf(LOG_INFO, L"Server disconnected");
             } else {
-                win_printf(hConsoleOut, L"[ ERROR ] recv failed with error code: %ld\n", err);
+                LogPrintf(LOG_ERROR, L"recv failed with error code: %d", err);
             }
             break;
         }
 
-        offset += recvLen;
-
-        while (offset >= sizeof(MessageHeader)) {
-            MessageHeader* header = (MessageHeader*)raw_buffer;
-            if (offset < header->payload_length + sizeof(MessageHeader)) {
-                break; // Wait for the complete message to be received
-            }
-
-            // Process the message
-            memcpy(buffer, raw_buffer, sizeof(MessageHeader) + header->payload_length);
+        DecoderCommit(decoder, recvLen);
+        MetricsAdd(METRIC_BYTES_IN, recvLen);
+        uint64_t now = GetTickCount64();
+        LivenessHeard(client.liveness, now);
+        uint64_t skipped = decoder.skipped;
 
+        while ((status = DecoderNext(decoder, view)) == DECODE_FRAME) {
 #ifdef DEBUG
-            win_printf(hConsoleOut, L"[ INFO ] Received: ");
-            for (int i = 0; i < recvLen; i++) {
-                win_printf(hConsoleOut, L"%02x ", static_cast<unsigned char>(buffer[i]));
-            }
-            win_printf(hConsoleOut, L"\n");
+            LogHex(L"Received: %s", view.frame, view.size);
 #endif
-
-            switch (header->type) {
-            case MessageType::JOIN_CHANNEL:
-            {
-                JoinChannelPayload* payload = reinterpret_cast<JoinChannelPayload*>(buffer + sizeof(MessageHeader));
-                win_printf(hConsoleOut, L"[ INFO ] Client %d joined channel %d\n", payload->user_id, payload->channel_id);
-                if (channelMembers.find(payload->channel_id) == channelMembers.end()) {
-                    // Create a new channel and add the user to it
-                    channelMembers[payload->channel_id] = std::vector<uint32_t>{payload->user_id};
-                } else {
-                    // Add the user to the channel
-                    channelMembers[payload->channel_id].push_back(payload->user_id);
-                }
-
-                // Send join channel success message
-                uint32_t totalSize;
-                char* buf = PackJoinChannelSuccess(payload->user_id, payload->channel_id, totalSize);
-                send(clientSock, buf, totalSize, 0);
-                delete[] buf;
-                break;
-            }
-            case MessageType::LEAVE_CHANNEL:
-            {
-                LeaveChannelPayload* payload = reinterpret_cast<LeaveChannelPayload*>(buffer + sizeof(MessageHeader));
-                win_printf(hConsoleOut, L"[ INFO ] Client %d left channel %d\n", payload->user_id, payload->channel_id);
-                if (channelMembers.find(payload->channel_id) != channelMembers.end()) {
-                    // Remove the user from the channel
-                    std::vector<uint32_t>& members = channelMembers[payload->channel_id];
-                    for (int i = 0; i < members.size(); i++) {
-                        if (members[i] == payload->user_id) {
-                            members.erase(members.begin() + i);
-                            break;
-                        }
-                    }
+            MetricsFrameIn(view.type);
+            LivenessFrame(client.liveness, view.type, now);
+
+            // The first message has to be the login
+            if (!loggedIn) {
+                if (!IsLoginFrame(view.header)) {
+                    RejectLogin(clientSock);
+                    StopClientTimer(client);
+                    DecoderFree(decoder);
+                    closesocket(clientSock);
+                    MetricsAdd(METRIC_CLOSED);
+                    return 0;
                 }
-
-                // Send leave channel success message
-                uint32_t totalSize;
-                char* buf = PackLeaveChannelSuccess(payload->user_id, payload->channel_id, totalSize);
-                send(clientSock, buf, totalSize, 0);
-                delete[] buf;
-                break;
-            }
-            case MessageType::SEND_MSG:
-            {   
-                SendMsgPayload* payload = reinterpret_cast<SendMsgPayload*>(buffer + sizeof(MessageHeader));
-                wchar_t* message = reinterpret_cast<wchar_t*>(buffer + sizeof(MessageHeader) + sizeof(SendMsgPayload));
-                win_printf(hConsoleOut, L"[ INFO ] %ls (%d) say to channel %d: %ls\n", 
-                            nicknames[payload->user_id], payload->user_id, payload->channel_id, message);
-
-                // channel 0 is the global channel
-                if (payload->channel_id == 0) {
-                    // Send the message to all members in the global channel
-                    for (auto& pair : userSockets) {
-                        if (pair.first != payload->user_id) {
-                            // Send message
-                            uint32_t totalSize;
-                            char* buf = PackNewMsg(payload->user_id, payload->channel_id, nicknames[payload->user_id], message, totalSize);
-                            send(pair.second, buf, totalSize, 0);
-                            delete[] buf;
-                        }
-                    }
-                } else {
-                    // Send the message to all members in the channel
-                    for (uint32_t member : channelMembers[payload->channel_id]) {
-                        if (member != payload->user_id) {
-                            // Send message
-                            uint32_t totalSize;
-                            char* buf = PackNewMsg(payload->user_id, payload->channel_id, nicknames[payload->user_id], message, totalSize);
-                            send(userSockets[member], buf, totalSize, 0);
-                            delete[] buf;
-                        }
-                    }
-                }
-                break;
-            }
-            case MessageType::DISCONNECT:
-            {
-                DisconnectPayload* payload = reinterpret_cast<DisconnectPayload*>(buffer + sizeof(MessageHeader));
-                win_printf(hConsoleOut, L"[ INFO ] Client %d disconnected\n", payload->user_id);
-                // Remove the user from all channels
-                for (auto& pair : channelMembers) {
-                    std::vector<uint32_t>& members = pair.second;
-                    for (int i = 0; i < members.size(); i++) {
-                        if (members[i] == payload->user_id) {
-                            members.erase(members.begin() + i);
-                            break;
-                        }
-                    }
-                }
-                // Remove the user from the user list
-                userSockets.erase(payload->user_id);
-                nicknames.erase(payload->user_id);
+                // Sends go straight to the socket here, there is nothing to batch,
+                // broadcasts are compressed on delivery
+                uint32_t features;
+                userId = HandleLogin(clientSock, view.header, view.frame, features);
+                loggedIn = TRUE;
+                std::lock_guard<std::mutex> guard(clientTimersLock);
+                client.userId = userId;
+                LivenessLoggedIn(client.liveness, features);
+                LivenessArm(clientTimers, client.liveness);
+            } else if (!HandleMessage(clientSock, userId, introductions, sendRate, view.header, view.frame)) {
+                StopClientTimer(client);
+                DecoderFree(decoder);
                 closesocket(clientSock);
+                MetricsAdd(METRIC_CLOSED);
                 return 0;
             }
-            default:
-                win_printf(hConsoleOut, L"[ ERROR ] Message type not supported\n");
-                break;
-            }
+        }
 
-            // Shift the unprocessed data to the beginning of the buffer
-            offset -= header->payload_length + sizeof(MessageHeader);
-            memmove(raw_buffer, raw_buffer + header->payload_length + sizeof(MessageHeader), offset);
+        if (decoder.skipped != skipped) {
+            MetricsAdd(METRIC_SKIPPED_BYTES, decoder.skipped - skipped);
+            LogPrintf(LOG_WARNING, L"Skipped %u bytes of garbage from client %u",
+                       (uint32_t)(decoder.skipped - skipped), userId);
+        }
+        if (status == DECODE_ERROR) {
+            MetricsAdd(METRIC_DECODE_ERRORS);
+            LogPrintf(LOG_ERROR, L"Client sent a malformed frame");
+            break;
         }
     }
 
+    // The client went away without DISCONNECT, forget it before the socket is
+    // reused, its session stays resumable for a while
+    if (loggedIn) {
+        DropUser(userId);
+    }
+    StopClientTimer(client);
+    DecoderFree(decoder);
     closesocket(clientSock);
-    win_printf(hConsoleOut, L"[ INFO ] Client socket closed\n");
+    MetricsAdd(METRIC_CLOSED);
+    LogPrintf(LOG_INFO, L"Client socket closed");
     return 0;
 }
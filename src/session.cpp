@@ -0,0 +1,109 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <random>
+#include <utility>
+#include "platform.cpp"
+
+// Resumable sessions
+// Every LOGIN_UTF8 connection gets a resume token in its LOGIN_SUCCESS. When
+// the connection drops without DISCONNECT, the user's ID and channels are
+// parked under that token for resumeWindowMs. A LOGIN_UTF8 presenting the
+// token within that time takes the parked session over; a token works once
+// and the new connection gets a fresh one. Sessions are parked in time
+// order, so expiring them is a walk from the front of parkOrder.
+
+const size_t SESSIONS_MAX = 64 * 1024;  // parked at once, more are not kept
+
+typedef struct {
+    uint32_t userId;
+    std::vector<uint32_t> channels;
+    uint64_t parkedAt;
+} ParkedSession;
+
+static uint64_t resumeWindowMs = 60 * 1000;  // 0 disables resuming
+static std::mutex sessionLock;
+static std::unordered_map<uint32_t, uint64_t> sessionTokens;  // user ID -> token of its connection
+static std::unordered_map<uint64_t, ParkedSession> parkedSessions;
+static std::unordered_map<uint32_t, uint64_t> parkedUsers;  // user ID -> token it is parked under
+static std::deque<std::pair<uint64_t, uint64_t>> parkOrder;  // (parkedAt, token), oldest first
+
+// Forget sessions parked for longer than the window. Call with sessionLock held.
+void ExpireSessions(uint64_t now) {
+    while (!parkOrder.empty() && now - parkOrder.front().first >= resumeWindowMs) {
+        auto parked = parkedSessions.find(parkOrder.front().second);
+        if (parked != parkedSessions.end() && parked->second.parkedAt == parkOrder.front().first) {
+            parkedUsers.erase(parked->second.userId);
+            parkedSessions.erase(parked);
+        }
+        parkOrder.pop_front();
+    }
+}
+
+// New resume token for a user's connection, 0 if resuming is off
+uint64_t SessionOpen(uint32_t userId) {
+    if (resumeWindowMs == 0) {
+        return 0;
+    }
+    static std::random_device device;
+    std::lock_guard<std::mutex> guard(sessionLock);
+    uint64_t token = 0;
+    while (token == 0 || parkedSessions.count(token) != 0) {
+        token = ((uint64_t)device() << 32) | device();
+    }
+    sessionTokens[userId] = token;
+    return token;
+}
+
+// The user left with DISCONNECT, its session ends
+void SessionClose(uint32_t userId) {
+    std::lock_guard<std::mutex> guard(sessionLock);
+    sessionTokens.erase(userId);
+}
+
+// The user's connection dropped, keep its session for resuming. Takes the
+// channels it was in.
+void SessionPark(uint32_t userId, std::vector<uint32_t>& channels) {
+    uint64_t now = GetTickCount64();
+    std::lock_guard<std::mutex> guard(sessionLock);
+    auto live = sessionTokens.find(userId);
+    if (live == sessionTokens.end()) {
+        return;
+    }
+    uint64_t token = live->second;
+    sessionTokens.erase(live);
+    ExpireSessions(now);
+    if (parkedSessions.size() >= SESSIONS_MAX) {
+        return;
+    }
+    ParkedSession& session = parkedSessions[token];
+    session.userId = userId;
+    session.channels.swap(channels);
+    session.parkedAt = now;
+    parkOrder.push_back(std::make_pair(now, token));
+    parkedUsers[userId] = token;
+}
+
+// Take over the session parked under token, returns FALSE if there is none
+BOOL SessionResume(uint64_t token, ParkedSession& session) {
+    uint64_t now = GetTickCount64();
+    std::lock_guard<std::mutex> guard(sessionLock);
+    ExpireSessions(now);
+    auto parked = parkedSessions.find(token);
+    if (parked == parkedSessions.end()) {
+        return FALSE;
+    }
+    session = std::move(parked->second);
+    parkedSessions.erase(parked);
+    parkedUsers.erase(session.userId);
+    return TRUE;
+}
+
+// TRUE while the user ID belongs to a connection with a resume token or a
+// parked session, either of which may still come back with it
+BOOL SessionHolds(uint32_t userId) {
+    std::lock_guard<std::mutex> guard(sessionLock);
+    return sessionTokens.count(userId) != 0 || parkedUsers.count(userId) != 0;
+}
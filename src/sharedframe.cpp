@@ -0,0 +1,86 @@
+#pragma once
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <cstring>
+#include "framepool.cpp"
+
+// Shared frames
+// An encoded frame that is queued to many connections at once. It is never
+// modified after creation and is freed by whoever drops the last reference,
+// which for a broadcast is the socket that finishes writing it last.
+
+const uint8_t FRAME_ADOPTED = 0xFF;  // data came from new[], not from the pool
+const uint8_t FRAME_MAPPED = 0xFE;  // data is borrowed, see MapFrame
+
+typedef struct SharedFrame {
+    std::atomic<uint32_t> refs;
+    uint32_t size;
+    char* data;
+    uint8_t poolClass;  // slab class holding the frame and its data, or FRAME_ADOPTED
+    std::atomic<SharedFrame*> compressed;  // see CompressedForm, owned by this frame
+} SharedFrame;
+
+// Take ownership of a buffer returned by one of the Pack* functions
+SharedFrame* AdoptFrame(char* data, uint32_t size) {
+    SharedFrame* frame = new SharedFrame();
+    frame->refs.store(1, std::memory_order_relaxed);
+    frame->size = size;
+    frame->data = data;
+    frame->poolClass = FRAME_ADOPTED;
+    frame->compressed.store(nullptr, std::memory_order_relaxed);
+    return frame;
+}
+
+// An uninitialized frame of size bytes, the bookkeeping and the data share
+// one pooled slab. Fill it with one of the Pack*Into functions.
+SharedFrame* NewFrame(uint32_t size) {
+    uint8_t sizeClass;
+    char* slab = PoolAlloc(sizeof(SharedFrame) + size, sizeClass);
+    SharedFrame* frame = new (slab) SharedFrame();
+    frame->refs.store(1, std::memory_order_relaxed);
+    frame->size = size;
+    frame->data = slab + sizeof(SharedFrame);
+    frame->poolClass = sizeClass;
+    frame->compressed.store(nullptr, std::memory_order_relaxed);
+    return frame;
+}
+
+// Wrap bytes that outlive every frame, such as a history segment that stays
+// mapped while the server runs. Nothing is copied and only the frame itself
+// is freed. A mapped frame may be a slice of a message rather than a whole one.
+SharedFrame* MapFrame(char* data, uint32_t size) {
+    SharedFrame* frame = AdoptFrame(data, size);
+    frame->poolClass = FRAME_MAPPED;
+    return frame;
+}
+
+SharedFrame* CopyFrame(const char* data, uint32_t size) {
+    SharedFrame* frame = NewFrame(size);
+    memcpy(frame->data, data, size);
+    return frame;
+}
+
+SharedFrame* AcquireFrame(SharedFrame* frame) {
+    frame->refs.fetch_add(1, std::memory_order_relaxed);
+    return frame;
+}
+
+void ReleaseFrame(SharedFrame* frame) {
+    if (frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        SharedFrame* compressed = frame->compressed.load(std::memory_order_acquire);
+        if (compressed != nullptr && compressed != frame) {
+            ReleaseFrame(compressed);
+        }
+        if (frame->poolClass == FRAME_ADOPTED) {
+            delete[] frame->data;
+            delete frame;
+        } else if (frame->poolClass == FRAME_MAPPED) {
+            delete frame;
+        } else {
+            uint8_t sizeClass = frame->poolClass;
+            frame->~SharedFrame();
+            PoolFree((char*)frame, sizeClass);
+        }
+    }
+}
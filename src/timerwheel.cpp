@@ -0,0 +1,158 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include "platform.cpp"
+
+// Hierarchical timer wheel
+// Timers are intrusive list nodes hashed by expiry tick into one of four
+// levels of 64 slots. Level 0 holds timers due within the next 64 ticks, one
+// slot per tick; every level above covers 64 times the span of the one below:
+//
+// +---------+----------+-------------------+------------------------+
+// |  Level  |  Slot    |  Timers due in    |  at TIMER_TICK_MS 100  |
+// +---------+----------+-------------------+------------------------+
+// |    0    |  1 tick  |  < 64 ticks       |  6.4 s                 |
+// |    1    |  64      |  < 64^2           |  6.8 min               |
+// |    2    |  64^2    |  < 64^3           |  7.3 h                 |
+// |    3    |  64^3    |  < 64^4 (clamped) |  19 days               |
+// +---------+----------+-------------------+------------------------+
+//
+// Scheduling and cancelling are O(1) list operations. Each tick runs one
+// level 0 slot, and whenever a level wraps the next slot of the level above
+// is redistributed downwards, so a timer moves at most three times before it
+// fires. A wheel belongs to one thread, or is guarded by its owner's lock.
+
+const uint64_t TIMER_TICK_MS = 100;
+const uint32_t TIMER_LEVEL_BITS = 6;
+const uint32_t TIMER_SLOTS = 1 << TIMER_LEVEL_BITS;
+const uint32_t TIMER_LEVELS = 4;
+const uint64_t TIMER_SPAN = (uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS);  // ticks the wheel can hold
+
+typedef struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;  // nullptr while the timer is not scheduled
+    uint64_t expires;  // tick
+    void* owner;
+} TimerNode;
+
+typedef struct {
+    uint64_t tick;  // every tick up to this one has run
+    size_t count;  // scheduled timers
+    TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];  // list heads
+} TimerWheel;
+
+typedef void (*TimerExpired)(void* context, TimerNode* node);
+
+void TimerWheelInit(TimerWheel& wheel, uint64_t nowMs) {
+    wheel.tick = nowMs / TIMER_TICK_MS;
+    wheel.count = 0;
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        for (uint32_t slot = 0; slot < TIMER_SLOTS; slot++) {
+            wheel.slots[level][slot].prev = &wheel.slots[level][slot];
+            wheel.slots[level][slot].next = &wheel.slots[level][slot];
+        }
+    }
+}
+
+void TimerInit(TimerNode& node, void* owner) {
+    node.prev = nullptr;
+    node.next = nullptr;
+    node.expires = 0;
+    node.owner = owner;
+}
+
+BOOL TimerScheduled(const TimerNode& node) {
+    return node.next != nullptr;
+}
+
+void TimerUnlink(TimerNode& node) {
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = nullptr;
+    node.next = nullptr;
+}
+
+// Link the node into the slot its expiry falls in, seen from the current
+// tick. Expired timers go into the current slot, which runs next.
+void TimerLink(TimerWheel& wheel, TimerNode& node) {
+    uint64_t delta = node.expires > wheel.tick ? node.expires - wheel.tick : 0;
+    uint64_t expires = delta < TIMER_SPAN ? node.expires : wheel.tick + TIMER_SPAN - 1;
+    uint32_t level = 0;
+    while (level + 1 < TIMER_LEVELS && delta >= ((uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    TimerNode& head = wheel.slots[level][(expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+}
+
+// (Re)schedule the timer to fire once the clock reaches whenMs, never early
+void TimerSchedule(TimerWheel& wheel, TimerNode& node, uint64_t whenMs) {
+    if (TimerScheduled(node)) {
+        TimerUnlink(node);
+    } else {
+        wheel.count++;
+    }
+    node.expires = std::max((whenMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS, wheel.tick + 1);
+    TimerLink(wheel, node);
+}
+
+void TimerCancel(TimerWheel& wheel, TimerNode& node) {
+    if (TimerScheduled(node)) {
+        TimerUnlink(node);
+        wheel.count--;
+    }
+}
+
+// Run every timer due by nowMs. expired may schedule or cancel any timer,
+// including the one it was called for.
+void TimerWheelAdvance(TimerWheel& wheel, uint64_t nowMs, TimerExpired expired, void* context) {
+    uint64_t target = nowMs / TIMER_TICK_MS;
+    if (wheel.count == 0 && wheel.tick < target) {
+        wheel.tick = target;
+        return;
+    }
+    while (wheel.tick < target) {
+        wheel.tick++;
+        // A level wrapped, spread the next slot of the level above over the ones below
+        for (uint32_t level = 1; level < TIMER_LEVELS; level++) {
+            if ((wheel.tick & (((uint64_t)1 << (TIMER_LEVEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            TimerNode& head = wheel.slots[level][(wheel.tick >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+            while (head.next != &head) {
+                TimerNode& node = *head.next;
+                TimerUnlink(node);
+                TimerLink(wheel, node);
+            }
+        }
+        TimerNode& head = wheel.slots[0][wheel.tick & (TIMER_SLOTS - 1)];
+        while (head.next != &head) {
+            TimerNode& node = *head.next;
+            TimerUnlink(node);
+            wheel.count--;
+            expired(context, &node);
+        }
+    }
+}
+
+// Milliseconds from nowMs until the wheel has something to do, -1 when it
+// is empty. This is the next busy level 0 slot, or the next time a level
+// wraps and may bring timers down.
+int TimerWheelNextMs(const TimerWheel& wheel, uint64_t nowMs) {
+    if (wheel.count == 0) {
+        return -1;
+    }
+    uint64_t next = (wheel.tick | (TIMER_SLOTS - 1)) + 1;
+    for (uint64_t tick = wheel.tick + 1; tick < next; tick++) {
+        const TimerNode& head = wheel.slots[0][tick & (TIMER_SLOTS - 1)];
+        if (head.next != &head) {
+            next = tick;
+            break;
+        }
+    }
+    uint64_t dueMs = next * TIMER_TICK_MS;
+    return dueMs > nowMs ? (int)std::min<uint64_t>(dueMs - nowMs, INT32_MAX) : 0;
+}
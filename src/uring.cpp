@@ -0,0 +1,543 @@
+#pragma once
+#include "reactor.cpp"
+#ifdef ORZCHAT_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+// io_uring reactors
+// The same shards, connections, mailboxes and outbound queues as the epoll
+// reactors, driven by completions instead of readiness:
+//
+// - one multishot accept per reactor on its SO_REUSEPORT listener
+// - one multishot recv per connection, the kernel picks a buffer from a ring
+//   of provided buffers and it goes back to the ring once the decoder is done
+// - accepted sockets are put in the ring's registered file table, so the
+//   requests on them skip the descriptor lookup
+// - at most one SENDMSG in flight per connection, gathering its queued frames
+//   like OutboundFlush, the next one goes out when it completes
+// - mailbox wakeups are IORING_OP_MSG_RING requests from the posting ring
+//
+// Requests are only prepared while a pass of completions is handled, the
+// whole pass is submitted by the io_uring_enter that waits for the next one.
+// A broadcast to a thousand local members is a thousand SENDMSG requests and
+// one system call.
+
+const uint32_t URING_ENTRIES = 4096;
+const uint32_t URING_BUFFERS = 512;  // provided receive buffers per reactor, a power of two
+const uint32_t URING_BUFFER_SIZE = 16 * 1024;
+const uint32_t URING_MAX_FILES = 1 << 20;  // kernel limit of the registered file table
+const uint16_t URING_BUFFER_GROUP = 0;
+
+// user_data is a Connection pointer with the request kind in the low bits,
+// or one of the reactor-wide kinds on its own
+enum UringKind : uint64_t {
+    URING_ACCEPT = 1,
+    URING_WAKE = 2,
+    URING_IGNORE = 3,  // nothing to do on completion
+    URING_WAKE_FD = 4,  // the eventfd threads outside the rings wake us with
+    URING_RECV = 1,
+    URING_SEND = 2,
+    URING_FILES = 3,
+    URING_SHUTDOWN = 4,
+    URING_KIND_MASK = 7
+};
+
+typedef struct UringSend {
+    struct iovec iov[OUTBOUND_IOV_BATCH];
+    struct msghdr message;
+    size_t requested;
+} UringSend;
+
+typedef struct UringState {
+    int fd;
+    int enterFd;  // registered index of fd once the owner registered it
+    uint32_t enterFlags;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t sqEntries;
+    io_uring_sqe* sqes;
+    uint32_t sqLocalTail;  // prepared, not yet published
+    uint32_t sqSubmitted;  // published to the kernel
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    io_uring_cqe* cqes;
+    void* sqRing;  // and the completion queue, one mapping for both
+    size_t sqRingSize;
+    size_t sqesSize;
+    io_uring_buf_ring* buffers;
+    char* bufferMemory;
+    uint16_t bufferTail;
+    uint32_t fileSlots;  // sockets numbered below this go in the file table
+    int retired;  // -1, written to a file table slot to empty it
+    std::vector<UringSend*> freeSends;
+} UringState;
+
+int UringSetupCall(uint32_t entries, io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int UringEnterCall(int fd, uint32_t submit, uint32_t wait, uint32_t flags, const io_uring_getevents_arg* arg) {
+    MetricsAdd(METRIC_SYSCALLS);
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg != nullptr ? sizeof(*arg) : 0);
+}
+
+int UringRegisterCall(int fd, uint32_t opcode, const void* arg, uint32_t count) {
+    MetricsAdd(METRIC_SYSCALLS);
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Hand everything prepared so far to the kernel and wait for wait
+// completions, for at most timeoutMs unless that is -1. Fails with ETIME
+// when the time ran out first.
+int UringSubmit(UringState* ring, uint32_t wait, int timeoutMs) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    uint32_t pending = ring->sqLocalTail - ring->sqSubmitted;
+    if (pending == 0 && wait == 0) {
+        return 0;
+    }
+    uint32_t flags = ring->enterFlags | (wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    __kernel_timespec timeout;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait > 0 && timeoutMs >= 0) {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int result = UringEnterCall(ring->enterFd, pending, wait, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr);
+    if (result > 0) {
+        ring->sqSubmitted += result;
+    }
+    return result;
+}
+
+// A zeroed request, submitting what is prepared when the queue is full
+io_uring_sqe* UringRequest(UringState* ring) {
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        if (UringSubmit(ring, 0, -1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            break;
+        }
+    }
+    io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Target the socket through the file table when it is registered
+void UringTarget(io_uring_sqe* sqe, const Connection* conn) {
+    sqe->fd = (int)conn->sock;  // the slot number is the descriptor
+    if (conn->fixed) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+void UringArmAccept(Reactor* reactor) {
+    io_uring_sqe* sqe = UringRequest(reactor->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = (int)reactor->listenSock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = 0;  // sockets are only used through the ring, they may block
+    sqe->user_data = URING_ACCEPT;
+}
+
+void UringArmWakePoll(Reactor* reactor) {
+    io_uring_sqe* sqe = UringRequest(reactor->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor->wakeFd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_WAKE_FD;
+}
+
+void UringArmRecv(Reactor* reactor, Connection* conn, uint8_t flags) {
+    io_uring_sqe* sqe = UringRequest(reactor->ring);
+    sqe->opcode = IORING_OP_RECV;
+    UringTarget(sqe, conn);
+    sqe->flags |= IOSQE_BUFFER_SELECT | flags;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_RECV;
+    conn->inflight++;
+}
+
+// Put the socket in slot sock of the file table, or empty the slot
+io_uring_sqe* UringUpdateFile(Reactor* reactor, Connection* conn, int* fd) {
+    io_uring_sqe* sqe = UringRequest(reactor->ring);
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)fd;
+    sqe->len = 1;
+    sqe->off = (uint64_t)conn->sock;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_FILES;
+    conn->inflight++;
+    return sqe;
+}
+
+// Give a receive buffer back to the kernel
+void UringRecycle(UringState* ring, uint16_t bid) {
+    // Not ring->buffers->bufs, the empty struct in front of it takes 8 bytes in C++
+    io_uring_buf& buffer = ((io_uring_buf*)ring->buffers)[ring->bufferTail & (URING_BUFFERS - 1)];
+    buffer.addr = (uint64_t)(uintptr_t)(ring->bufferMemory + (size_t)bid * URING_BUFFER_SIZE);
+    buffer.len = URING_BUFFER_SIZE;
+    buffer.bid = bid;
+    ring->bufferTail++;
+}
+
+void UringPublishBuffers(UringState* ring) {
+    __atomic_store_n(&ring->buffers->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+void UringWake(Reactor* target) {
+    io_uring_sqe* sqe = UringRequest(localReactor->ring);
+    sqe->opcode = IORING_OP_MSG_RING;
+    sqe->fd = target->ring->fd;
+    sqe->addr = IORING_MSG_DATA;
+    sqe->off = URING_WAKE;  // user_data of the completion on the target ring
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_IGNORE;
+}
+
+// Send what is queued unless a send is already in flight
+void UringFlush(Reactor* reactor, Connection* conn) {
+    if (conn->closing || conn->sending != nullptr || OutboundEmpty(conn->out)) {
+        return;
+    }
+    UringState* ring = reactor->ring;
+    OutboundPrepare(conn->out);
+    UringSend* send;
+    if (ring->freeSends.empty()) {
+        send = new UringSend();
+    } else {
+        send = ring->freeSends.back();
+        ring->freeSends.pop_back();
+    }
+    size_t count = OutboundGather(conn->out, send->iov, send->requested);
+    // The kernel reads these frames until the send completes, the slow
+    // consumer policy must not drop them meanwhile
+    for (size_t i = 0; i < count; i++) {
+        conn->out.frames[conn->out.head + i].droppable = FALSE;
+    }
+    memset(&send->message, 0, sizeof(send->message));
+    send->message.msg_iov = send->iov;
+    send->message.msg_iovlen = count;
+
+    io_uring_sqe* sqe = UringRequest(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    UringTarget(sqe, conn);
+    sqe->addr = (uint64_t)(uintptr_t)&send->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_SEND;
+    conn->sending = send;
+    conn->inflight++;
+}
+
+// Start closing a connection: empty its file table slot and shut the socket
+// down, which ends its receive and any blocked send. The socket is closed
+// and the connection freed once the last of its requests has completed.
+void UringRetire(Reactor* reactor, Connection* conn) {
+    UringState* ring = reactor->ring;
+    if (conn->fixed) {
+        UringUpdateFile(reactor, conn, &ring->retired);
+        conn->fixed = FALSE;
+    }
+    io_uring_sqe* sqe = UringRequest(ring);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = (int)conn->sock;
+    sqe->len = SHUT_RDWR;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_SHUTDOWN;
+    conn->inflight++;
+    conn->closing = TRUE;
+}
+
+void UringReleaseConnection(Reactor* reactor, Connection* conn) {
+    UringState* ring = reactor->ring;
+    if (conn->sending != nullptr) {
+        ring->freeSends.push_back(conn->sending);
+        conn->sending = nullptr;
+    }
+    OutboundClear(conn->out);
+    OutboundReport(conn->out);
+    DecoderFree(conn->in);
+    io_uring_sqe* sqe = UringRequest(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = (int)conn->sock;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_IGNORE;
+    delete conn;
+    MetricsAdd(METRIC_CLOSED);
+}
+
+void UringAccepted(Reactor* reactor, int fd) {
+    Connection* conn = AdoptConnection(reactor, fd);
+    conn->fixed = (uint32_t)fd < reactor->ring->fileSlots;
+    if (conn->fixed) {
+        // The receive waits for the slot to be filled
+        UringUpdateFile(reactor, conn, &conn->sock)->flags |= IOSQE_IO_LINK;
+    }
+    UringArmRecv(reactor, conn, 0);
+}
+
+void UringReceived(Reactor* reactor, Connection* conn, const io_uring_cqe* cqe) {
+    UringState* ring = reactor->ring;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->inflight--;
+    }
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!conn->closing) {
+            MetricsAdd(METRIC_BYTES_IN, cqe->res);
+            LivenessHeard(conn->liveness, reactor->now);
+            // Frames are dispatched straight out of the provided buffer,
+            // only a trailing partial frame is copied into the connection
+            DecoderFeed(conn->in, ring->bufferMemory + (size_t)bid * URING_BUFFER_SIZE, cqe->res);
+            BOOL ok = ProcessFrames(reactor, conn);
+            DecoderSettle(conn->in);
+            if (!ok) {
+                ScheduleClose(reactor, conn);
+            }
+        }
+        UringRecycle(ring, bid);
+    } else if (cqe->res == 0) {
+        if (!conn->closing) {
+            LogPrintf(LOG_INFO, L"Client disconnected");
+            ScheduleClose(reactor, conn);
+        }
+        return;
+    } else if (cqe->res == -ECANCELED && !conn->closing) {
+        // the file table update in front of it failed, use the descriptor
+        conn->fixed = FALSE;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        ScheduleClose(reactor, conn);
+        return;
+    }
+    // Out of buffers or stopped for another reason, the recycled ones are
+    // back in the ring by the time this is submitted
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !conn->closing) {
+        UringArmRecv(reactor, conn, 0);
+    }
+}
+
+void UringSent(Reactor* reactor, Connection* conn, const io_uring_cqe* cqe) {
+    UringState* ring = reactor->ring;
+    conn->inflight--;
+    UringSend* send = conn->sending;
+    conn->sending = nullptr;
+    ring->freeSends.push_back(send);
+    if (conn->closing) {
+        return;  // the queue goes with the connection
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            ScheduleClose(reactor, conn);
+        } else {
+            ScheduleFlush(reactor, conn);
+        }
+        return;
+    }
+    OutboundAdvance(conn->out, cqe->res, send->requested);
+    if (OutboundEmpty(conn->out)) {
+        OutboundClear(conn->out);
+    } else {
+        ScheduleFlush(reactor, conn);
+    }
+    OutboundReport(conn->out);
+}
+
+void UringComplete(Reactor* reactor, const io_uring_cqe* cqe) {
+    uint64_t kind = cqe->user_data & URING_KIND_MASK;
+    Connection* conn = (Connection*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_KIND_MASK);
+    if (conn == nullptr) {
+        if (kind == URING_ACCEPT) {
+            if (cqe->res >= 0) {
+                UringAccepted(reactor, cqe->res);
+            } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+                LogPrintf(LOG_WARNING, L"accept failed with error code: %d", -cqe->res);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                UringArmAccept(reactor);
+            }
+        } else if (kind == URING_WAKE) {
+            DrainMailbox(reactor, FALSE);
+        } else if (kind == URING_WAKE_FD) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                UringArmWakePoll(reactor);
+            }
+            DrainMailbox(reactor, TRUE);
+        }
+        return;
+    }
+
+    if (kind == URING_RECV) {
+        UringReceived(reactor, conn, cqe);
+    } else if (kind == URING_SEND) {
+        UringSent(reactor, conn, cqe);
+    } else if (kind == URING_FILES) {
+        conn->inflight--;
+        if (cqe->res < 0 && conn->fixed) {
+            LogPrintf(LOG_WARNING, L"Unable to register socket %d with the ring, error code: %d", (int)conn->sock, -cqe->res);
+            conn->fixed = FALSE;
+        }
+    } else if (kind == URING_SHUTDOWN) {
+        conn->inflight--;
+    }
+    // A retired connection is out of the table, its socket is still open so
+    // the slot cannot belong to anyone else yet. It goes with its last request.
+    if (conn->closing && conn->inflight == 0 && reactor->connections[conn->sock] != conn) {
+        UringReleaseConnection(reactor, conn);
+    }
+}
+
+void UringLoop(Reactor* reactor, BOOL* running) {
+    localReactor = reactor;
+    currentShard = reactor->id;
+    PinToCore(reactor->id);
+    UringState* ring = reactor->ring;
+
+    // Registered ring descriptors belong to the thread that registers them
+    io_uring_rsrc_update registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.offset = (uint32_t)-1;
+    registration.data = (uint64_t)ring->fd;
+    if (UringRegisterCall(ring->fd, IORING_REGISTER_RING_FDS, &registration, 1) == 1) {
+        ring->enterFd = (int)registration.offset;
+        ring->enterFlags = IORING_ENTER_REGISTERED_RING;
+    }
+
+    UringArmAccept(reactor);
+    UringArmWakePoll(reactor);
+    while (*running) {
+        UringPublishBuffers(ring);
+        int timeout = TimerWheelNextMs(reactor->timers, GetTickCount64());
+        if (UringSubmit(ring, 1, timeout) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN && errno != ETIME) {
+            LogPrintf(LOG_ERROR, L"io_uring_enter failed with error code: %d", errno);
+            break;
+        }
+        reactor->now = GetTickCount64();
+
+        uint32_t head = *ring->cqHead;
+        uint32_t tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            UringComplete(reactor, &ring->cqes[head & ring->cqMask]);
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+        TimerWheelAdvance(reactor->timers, reactor->now, ConnectionTimerExpired, reactor);
+
+        for (Connection* conn : reactor->pendingFlush) {
+            conn->flushScheduled = FALSE;
+            UringFlush(reactor, conn);
+        }
+        reactor->pendingFlush.clear();
+
+        for (Connection* conn : reactor->pendingClose) {
+            CloseConnection(reactor, conn);
+        }
+        reactor->pendingClose.clear();
+    }
+}
+
+// Map the rings, register the provided buffers and an empty file table
+Reactor* CreateUringReactor(uint32_t id, SOCKET listenSock, uint32_t shardCount) {
+    UringState* ring = new UringState();
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = UringSetupCall(URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        params.flags = IORING_SETUP_CQSIZE;  // before 5.19
+        ring->fd = UringSetupCall(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        LogPrintf(LOG_ERROR, L"Unable to create io_uring for reactor %u, error code: %d", id, errno);
+        delete ring;
+        return nullptr;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        LogPrintf(LOG_ERROR, L"io_uring of this kernel is too old, use --mode epoll");
+        close(ring->fd);
+        delete ring;
+        return nullptr;
+    }
+    ring->enterFd = ring->fd;
+    ring->sqRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe*)mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring->fd, IORING_OFF_SQES);
+    size_t bufferRingSize = URING_BUFFERS * sizeof(io_uring_buf);
+    ring->buffers = (io_uring_buf_ring*)mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufferMemory = (char*)mmap(nullptr, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sqRing == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED ||
+        ring->bufferMemory == MAP_FAILED) {
+        LogPrintf(LOG_ERROR, L"Unable to map io_uring for reactor %u, error code: %d", id, errno);
+        return nullptr;
+    }
+    char* sq = (char*)ring->sqRing;
+    ring->sqHead = (uint32_t*)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    uint32_t* sqArray = (uint32_t*)(sq + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++) {
+        sqArray[i] = i;  // requests are always taken in order
+    }
+    ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+    ring->cqHead = (uint32_t*)(sq + params.cq_off.head);
+    ring->cqTail = (uint32_t*)(sq + params.cq_off.tail);
+    ring->cqMask = *(uint32_t*)(sq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(sq + params.cq_off.cqes);
+
+    io_uring_buf_reg bufferRegistration;
+    memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+    bufferRegistration.ring_addr = (uint64_t)(uintptr_t)ring->buffers;
+    bufferRegistration.ring_entries = URING_BUFFERS;
+    bufferRegistration.bgid = URING_BUFFER_GROUP;
+    if (UringRegisterCall(ring->fd, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) < 0) {
+        LogPrintf(LOG_ERROR, L"Unable to register receive buffers for reactor %u, error code: %d", id, errno);
+        return nullptr;
+    }
+    ring->bufferTail = 0;
+    for (uint32_t bid = 0; bid < URING_BUFFERS; bid++) {
+        UringRecycle(ring, (uint16_t)bid);
+    }
+    UringPublishBuffers(ring);
+
+    // A sparse table as large as the descriptor limit allows
+    struct rlimit limit;
+    ring->fileSlots = getrlimit(RLIMIT_NOFILE, &limit) == 0 ? (uint32_t)std::min<rlim_t>(limit.rlim_cur, URING_MAX_FILES) : 0;
+    io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = ring->fileSlots;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (ring->fileSlots > 0 && UringRegisterCall(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        LogPrintf(LOG_WARNING, L"Unable to register a file table for reactor %u, error code: %d", id, errno);
+        ring->fileSlots = 0;
+    }
+    ring->retired = -1;
+
+    Reactor* reactor = new Reactor();
+    reactor->id = id;
+    reactor->listenSock = listenSock;
+    reactor->mailbox.store(nullptr);
+    reactor->outbox.assign(shardCount, nullptr);
+    reactor->epollFd = -1;
+    reactor->wakeFd = eventfd(0, EFD_NONBLOCK);
+    reactor->ring = ring;
+    if (reactor->wakeFd == -1) {
+        LogPrintf(LOG_ERROR, L"Unable to create reactor %u, error code: %d", id, errno);
+        return nullptr;
+    }
+    return reactor;
+}
+
+#endif
@@ -0,0 +1,222 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <wchar.h>
+#include "platform.cpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF8_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// UTF-8 transcoding
+// wchar_t is UTF-16 on Windows and UTF-32 everywhere else, UTF-8 is what goes
+// over the wire. Chat text is mostly ASCII, so both directions work on whole
+// blocks (16 bytes with SSE2, 32 with AVX2) as long as no character in the
+// block is above 0x7F, widening or narrowing it with a few unpack/pack
+// instructions. A block holding anything else is walked by the scalar loop up
+// to and including its first non-ASCII character, then the block loop resumes.
+// Invalid input never fails, bad sequences and lone surrogates become U+FFFD.
+
+const uint32_t UTF8_REPLACEMENT = 0xFFFD;
+
+// Buffer sizes that always fit the converted text (without a terminator)
+size_t Utf8MaxBytes(size_t wideLength) {
+    return wideLength * (sizeof(wchar_t) == 2 ? 3 : 4);
+}
+
+size_t WideMaxChars(size_t utf8Length) {
+    return utf8Length;
+}
+
+// Decode one code point starting at src[i], advances i past it
+uint32_t DecodeUtf8CodePoint(const unsigned char* src, size_t len, size_t& i) {
+    unsigned char lead = src[i];
+    uint32_t cp;
+    size_t extra;
+    uint32_t min;
+    if (lead < 0x80) {
+        i++;
+        return lead;
+    } else if ((lead & 0xE0) == 0xC0) {
+        cp = lead & 0x1F;
+        extra = 1;
+        min = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+        cp = lead & 0x0F;
+        extra = 2;
+        min = 0x800;
+    } else if ((lead & 0xF8) == 0xF0) {
+        cp = lead & 0x07;
+        extra = 3;
+        min = 0x10000;
+    } else {
+        i++;
+        return UTF8_REPLACEMENT;
+    }
+    for (size_t k = 1; k <= extra; k++) {
+        if (i + k >= len || (src[i + k] & 0xC0) != 0x80) {
+            i += k;  // resume at the byte that broke the sequence
+            return UTF8_REPLACEMENT;
+        }
+        cp = (cp << 6) | (src[i + k] & 0x3F);
+    }
+    i += extra + 1;
+    // Overlong forms, surrogates and values past Unicode are not characters
+    if (cp < min || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        return UTF8_REPLACEMENT;
+    }
+    return cp;
+}
+
+size_t PutWide(uint32_t cp, wchar_t* dst) {
+    if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+        cp -= 0x10000;
+        dst[0] = (wchar_t)(0xD800 | (cp >> 10));
+        dst[1] = (wchar_t)(0xDC00 | (cp & 0x3FF));
+        return 2;
+    }
+    dst[0] = (wchar_t)cp;
+    return 1;
+}
+
+size_t PutUtf8(uint32_t c, char* dst) {
+    if (c < 0x80) {
+        dst[0] = (char)c;
+        return 1;
+    } else if (c < 0x800) {
+        dst[0] = (char)(0xC0 | (c >> 6));
+        dst[1] = (char)(0x80 | (c & 0x3F));
+        return 2;
+    } else if (c < 0x10000) {
+        dst[0] = (char)(0xE0 | (c >> 12));
+        dst[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (c & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | (c >> 18));
+    dst[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+    dst[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+    dst[3] = (char)(0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Widen a block of 16 ASCII bytes
+#ifdef UTF8_SSE2
+void WidenAscii16(__m128i bytes, wchar_t* dst) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    if (sizeof(wchar_t) == 2) {
+        _mm_storeu_si128((__m128i*)dst, lo);
+        _mm_storeu_si128((__m128i*)(dst + 8), hi);
+    } else {
+        _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(dst + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(dst + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(dst + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+}
+#endif
+
+// Decode len bytes of UTF-8, dst needs room for WideMaxChars(len).
+// Returns the number of wchar_t written, no terminator is added.
+size_t Utf8ToWide(const char* src, size_t len, wchar_t* dst) {
+    const unsigned char* in = (const unsigned char*)src;
+    size_t i = 0;
+    size_t out = 0;
+    while (i < len) {
+#ifdef __AVX2__
+        while (len - i >= 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(in + i));
+            if (_mm256_movemask_epi8(block) != 0) {
+                break;
+            }
+            WidenAscii16(_mm256_castsi256_si128(block), dst + out);
+            WidenAscii16(_mm256_extracti128_si256(block, 1), dst + out + 16);
+            i += 32;
+            out += 32;
+        }
+#endif
+#ifdef UTF8_SSE2
+        while (len - i >= 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(in + i));
+            if (_mm_movemask_epi8(block) != 0) {
+                break;
+            }
+            WidenAscii16(block, dst + out);
+            i += 16;
+            out += 16;
+        }
+#endif
+        // Scalar until the next character that is not ASCII has been handled
+        while (i < len) {
+            BOOL ascii = in[i] < 0x80;
+            out += PutWide(DecodeUtf8CodePoint(in, len, i), dst + out);
+            if (!ascii) {
+                break;
+            }
+        }
+    }
+    return out;
+}
+
+// Encode len wchar_t as UTF-8, dst needs room for Utf8MaxBytes(len).
+// Returns the number of bytes written, no terminator is added.
+size_t WideToUtf8(const wchar_t* src, size_t len, char* dst) {
+    size_t i = 0;
+    size_t out = 0;
+    while (i < len) {
+#ifdef UTF8_SSE2
+        // 16 characters per round, all of them below 0x80
+        while (len - i >= 16) {
+            __m128i packed;
+            if (sizeof(wchar_t) == 2) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 8));
+                __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xFF80));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, _mm_setzero_si128())) != 0xFFFF) {
+                    break;
+                }
+                packed = _mm_packus_epi16(a, b);
+            } else {
+                __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+                __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 8));
+                __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 12));
+                __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+                __m128i high = _mm_and_si128(any, _mm_set1_epi32((int)0xFFFFFF80));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, _mm_setzero_si128())) != 0xFFFF) {
+                    break;
+                }
+                packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+            }
+            _mm_storeu_si128((__m128i*)(dst + out), packed);
+            i += 16;
+            out += 16;
+        }
+#endif
+        while (i < len) {
+            uint32_t c = (uint32_t)src[i++];
+            BOOL ascii = c < 0x80;
+            if (sizeof(wchar_t) == 2 && c >= 0xD800 && c <= 0xDFFF) {
+                // Join a surrogate pair, anything unpaired is replaced
+                if (c <= 0xDBFF && i < len && (uint32_t)src[i] >= 0xDC00 && (uint32_t)src[i] <= 0xDFFF) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)src[i++] - 0xDC00);
+                } else {
+                    c = UTF8_REPLACEMENT;
+                }
+            } else if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+                c = UTF8_REPLACEMENT;
+            }
+            out += PutUtf8(c, dst + out);
+            if (!ascii) {
+                break;
+            }
+        }
+    }
+    return out;
+}